@@ -36,6 +36,7 @@ public class TRPX_Reader implements PlugIn {
         int dim0 = 0;
         int dim1 = 0;
         int nFrames = 1;
+        long alignment = 1;
 
 		// Get these parameters from the filename
     	try (BufferedReader br = new BufferedReader(new FileReader(filePath))) {
@@ -73,6 +74,10 @@ public class TRPX_Reader implements PlugIn {
                				if (scanner.findWithinHorizon("<.*?number_of_frames=\"(\\d+)\".*?/>", 0) != null) 
                 				nFrames = Integer.parseInt(scanner.match().group(1));
                			}	
+               			try (Scanner scanner = new Scanner(line.substring(indexTerse, indexEndTag))) {
+               				if (scanner.findWithinHorizon("<.*?alignment=\"(\\d+)\".*?/>", 0) != null) 
+                				alignment = Long.parseLong(scanner.match().group(1));
+               			}	
                			try (Scanner scanner = new Scanner(line.substring(indexTerse, indexEndTag))) {
               				if (scanner.findWithinHorizon("<.*?dimensions=\"(\\d+)(?:\\s+(\\d+))?(?:\\s+(\\d+))?\".*?/>", 0) != null) {
                				    dim0 = Integer.parseInt(scanner.match().group(1));
@@ -127,7 +132,10 @@ public class TRPX_Reader implements PlugIn {
         		    for (int j = from; j < to; ++j) 
                    		pixels[j] = ToShort(significant_bits);
        		}
-        	dBitStart = (1 + (dBitStart >> 3)) << 3;
+        	// The next frame starts at the next byte, rounded up to a multiple of the alignment (the header, which is
+        	// padded with spaces inside the tag, ends at a multiple of the alignment too)
+        	long frameEnd = 1 + (dBitStart >> 3) - dataStartIndex;
+        	dBitStart = (dataStartIndex + (frameEnd + alignment - 1) / alignment * alignment) << 3;
     	}
 
 		// Display the image stack
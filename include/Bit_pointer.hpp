@@ -702,10 +702,13 @@ public:
         using T = typename std::iterator_traits<T_iter>::value_type;
         if (this->size()) {
             Type buffer = *d_bit_pointer.d_offset;
-            std::conditional_t<(sizeof(Type) > sizeof(T)), Type, T> value;
+            // Signed values are sign extended to 64 bits and masked, as they may take one bit more than T
+            using Value = std::conditional_t<std::is_signed_v<T>, std::uint64_t,
+                                             std::conditional_t<(sizeof(Type) > sizeof(T)), Type, T>>;
+            Value value;
             for (auto p = from; p != to; ++p) {
                 if constexpr (std::is_signed_v<T>)
-                    value = static_cast<T>(*p) & ((T(1) << d_size) - 1);
+                    value = static_cast<Value>(static_cast<std::int64_t>(*p)) & (~Value(0) >> (64 - d_size));
                 else
                     value = static_cast<T>(*p);
                 buffer |= value << d_bit_pointer.d_bit;
@@ -714,7 +717,7 @@ public:
                     *(d_bit_pointer.d_offset++) = buffer;
                     d_bit_pointer.d_bit -= sizeof(Type) * 8;
                     buffer = value >>= (this->size() - d_bit_pointer.d_bit);
-                    if constexpr (sizeof(T) > sizeof(Type)) {
+                    if constexpr (sizeof(Value) > sizeof(Type)) {
                         while (d_bit_pointer.d_bit >= (sizeof(Type) * 8)) {
                             *(d_bit_pointer.d_offset++) = buffer;
                             d_bit_pointer.d_bit -= sizeof(Type) * 8;
@@ -762,18 +765,20 @@ public:
             }
         }
         else {
-            T const mask = ((T(1) << d_size) - 1);
+            T const mask = T(std::make_unsigned_t<T>(~std::make_unsigned_t<T>(0)) >> (sizeof(T) * 8 - d_size));
             std::remove_cv_t<Type> buffer = *d_bit_pointer.d_offset >> d_bit_pointer.d_bit;
             for (auto p = from; p != to; ++p) {
                 T result = T(buffer);
-                buffer >>= this->size();
+                buffer = this->size() < sizeof(int) * 8 ? buffer >> this->size() : 0; // avoids shifting an int by 32 bits
                 d_bit_pointer.d_bit += this->size();
                 if constexpr (sizeof(T) > sizeof(Type))
                     while (d_bit_pointer.d_bit >= (sizeof(Type) * 8)) {
                         buffer = *++d_bit_pointer.d_offset;
                         d_bit_pointer.d_bit -= sizeof(Type) * 8;
-                        result |= buffer << (this->size() - d_bit_pointer.d_bit);
-                        buffer >>= d_bit_pointer.d_bit;
+                        // Bits that are shifted beyond T belong to the next value, and shifting by the width of T is undefined
+                        if (this->size() - d_bit_pointer.d_bit < sizeof(T) * 8)
+                            result |= T(buffer) << (this->size() - d_bit_pointer.d_bit);
+                        buffer = d_bit_pointer.d_bit < sizeof(Type) * 8 ? buffer >> d_bit_pointer.d_bit : 0;
                     }
                 else if (d_bit_pointer.d_bit >= sizeof(Type) * 8) {
                     buffer = *++d_bit_pointer.d_offset;
@@ -0,0 +1,159 @@
+//
+//  Bounded_queue.hpp
+//  Bounded_queue
+//
+
+#ifndef Bounded_queue_h
+#define Bounded_queue_h
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <optional>
+#include <algorithm>
+
+// Bounded_queue<T> is a first-in-first-out queue with a maximum depth that can be shared by producer and
+// consumer threads. Producers block while the queue is full, consumers block while it is empty. Once the queue
+// has been closed, producers can no longer push, and consumers drain the remaining elements.
+//
+//  Bounded_queue(std::size_t depth)
+//      Constructs an empty queue that holds at most 'depth' elements (at least 1).
+//  bool push(T value)
+//      Appends 'value', waiting while the queue is full. Returns false if the queue was closed.
+//  bool try_push(T&& value)
+//      Appends 'value' if the queue is neither full nor closed, and returns whether it did. If it did not, 'value' is
+//      left unchanged, so that the caller can still dispose of it.
+//  std::optional<T> pop()
+//      Removes and returns the oldest element, waiting while the queue is empty. Returns std::nullopt once the
+//      queue has been closed and is empty.
+//  std::optional<T> try_pop()
+//      Removes and returns the oldest element if the queue is not empty, otherwise returns std::nullopt.
+//  void close()
+//      Closes the queue and wakes up all waiting threads.
+//  std::size_t size()
+//      Returns the number of elements currently in the queue.
+//
+// Example:
+//    Bounded_queue<int> queue(4);
+//    std::thread consumer([&] { while (auto i = queue.pop()) std::cout << *i << std::endl; });
+//    for (int i = 0; i != 100; ++i)
+//        queue.push(i);
+//    queue.close();
+//    consumer.join();
+
+namespace jpa {
+
+/**
+ * @class Bounded_queue
+ * @brief A thread-safe first-in-first-out queue with a maximum depth.
+ *
+ * Producers block while the queue is full and consumers block while it is empty, so a chain of Bounded_queue
+ * objects between processing stages limits the amount of work in flight.
+ *
+ * @tparam T The type of the queued elements.
+ */
+template <typename T>
+class Bounded_queue {
+public:
+
+    /**
+     * @brief Constructs an empty queue.
+     *
+     * @param depth The maximum number of elements in the queue (at least 1).
+     */
+    explicit Bounded_queue(std::size_t const depth) : d_depth(std::max(depth, std::size_t(1))) {}
+
+    /**
+     * @brief Appends an element, waiting while the queue is full.
+     *
+     * @param value The element to append.
+     * @return False if the queue was closed and the element was not appended.
+     */
+    bool push(T value) {
+        std::unique_lock lock(d_mutex);
+        d_not_full.wait(lock, [this] { return d_closed || d_queue.size() < d_depth; });
+        if (d_closed)
+            return false;
+        d_queue.push_back(std::move(value));
+        d_not_empty.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief Appends an element, if the queue is neither full nor closed.
+     *
+     * @param value The element to append. It is only moved from if it was appended.
+     * @return True if the element was appended.
+     */
+    bool try_push(T&& value) {
+        std::lock_guard lock(d_mutex);
+        if (d_closed || d_queue.size() >= d_depth)
+            return false;
+        d_queue.push_back(std::move(value));
+        d_not_empty.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief Removes and returns the oldest element, waiting while the queue is empty.
+     *
+     * @return The oldest element, or std::nullopt if the queue has been closed and is empty.
+     */
+    std::optional<T> pop() {
+        std::unique_lock lock(d_mutex);
+        d_not_empty.wait(lock, [this] { return d_closed || !d_queue.empty(); });
+        if (d_queue.empty())
+            return std::nullopt;
+        std::optional<T> r(std::move(d_queue.front()));
+        d_queue.pop_front();
+        d_not_full.notify_one();
+        return r;
+    }
+
+    /**
+     * @brief Removes and returns the oldest element, if there is one.
+     *
+     * @return The oldest element, or std::nullopt if the queue is empty.
+     */
+    std::optional<T> try_pop() {
+        std::lock_guard lock(d_mutex);
+        if (d_queue.empty())
+            return std::nullopt;
+        std::optional<T> r(std::move(d_queue.front()));
+        d_queue.pop_front();
+        d_not_full.notify_one();
+        return r;
+    }
+
+    /**
+     * @brief Closes the queue. Pushing is no longer possible, remaining elements can still be popped.
+     */
+    void close() {
+        std::lock_guard lock(d_mutex);
+        d_closed = true;
+        d_not_full.notify_all();
+        d_not_empty.notify_all();
+    }
+
+    /**
+     * @brief Returns the number of elements in the queue.
+     *
+     * @return The number of elements in the queue.
+     */
+    std::size_t size() const {
+        std::lock_guard lock(d_mutex);
+        return d_queue.size();
+    }
+
+private:
+    std::size_t const d_depth;
+    std::deque<T> d_queue;
+    bool d_closed = false;
+    mutable std::mutex d_mutex;
+    std::condition_variable d_not_full;
+    std::condition_variable d_not_empty;
+};
+
+} // end namespace jpa
+
+#endif /* Bounded_queue_h */
@@ -0,0 +1,323 @@
+//
+//  Compression_queue.hpp
+//  Compression_queue
+//
+
+#ifndef Compression_queue_h
+#define Compression_queue_h
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <optional>
+#include <functional>
+#include <filesystem>
+#include <unordered_map>
+#include <stdexcept>
+#include "Terse.hpp"
+#include "Terse_reorder.hpp"
+#include "Bounded_queue.hpp"
+#include "Latency_histogram.hpp"
+
+// Compression_queue<T> compresses a stream of frames with a fixed number of worker threads and writes them in order,
+// while tracking the latency of every frame. It is meant for real-time acquisition, where the tail latency of frames
+// matters more than the average throughput.
+//
+// A frame passes three points: it is enqueued by submit(), compressed by a worker, and written (emitted in frame order
+// to a stream or a callback). The queue records three latency histograms: enqueue→compression start (waiting),
+// enqueue→compressed, and enqueue→written. A frame that is written later than its deadline (enqueue time plus
+// Options::deadline) is counted as a missed deadline.
+//
+// At most Options::queue_depth frames wait for a worker. When the queue is full, submit() applies the policy:
+//  Policy::block   waits until a worker takes a frame, so that the producer is slowed down (backpressure).
+//  Policy::spill   writes the uncompressed frame to Options::spill_path instead, and its index to spill_path + ".frames",
+//                  so that it can be compressed later (for instance with terse -raw). The frame is missing from the output.
+//  Policy::drop    discards the frame. With this policy, workers also discard frames whose deadline has already passed
+//                  when they get to them, so that a backlog does not delay all subsequent frames.
+// Spilled and dropped frames are counted, and skipped in the output by the workers, so that submit() never writes
+// frames that were waiting for them.
+//
+//  Compression_queue(std::ostream& out, Options const& options)
+//  Compression_queue(std::function<void(std::size_t, Terse&&)> sink, Options const& options)
+//      Starts the workers. Frames are written to 'out' as single-frame Terse objects, or passed to 'sink' in order.
+//  bool submit(std::vector<T>&& frame, std::vector<std::size_t> const& dim = {})
+//      Enqueues a frame; its index is the number of frames submitted before it. Returns false if the frame was spilled
+//      or dropped. Thread-safe.
+//  void close()
+//      Waits until all enqueued frames have been written, and stops the workers. Called by the destructor.
+//  Statistics statistics()
+//      Returns the frame counters: submitted, written, spilled, dropped, missed deadlines and the current queue depth.
+//  Latency_histogram const& waiting(), compressed(), written()
+//      The latency histograms.
+//  std::string report()
+//      Returns the counters and the p50/p99/p99.9/max latencies as one line of text.
+//
+// Example:
+//    Compression_queue<std::uint16_t> queue(outfile, {.workers = 8, .queue_depth = 256,
+//        .policy = Compression_queue<std::uint16_t>::Policy::drop, .deadline = std::chrono::milliseconds(50)});
+//    while (acquiring())
+//        queue.submit(read_frame(), {4096, 4096});
+//    queue.close();
+//    std::cerr << queue.report() << std::endl;
+
+namespace jpa {
+
+/**
+ * @class Compression_queue
+ * @brief Compresses frames with a pool of workers and writes them in order, with latency histograms and a policy for
+ * falling behind.
+ *
+ * @tparam T The integral pixel type of the frames.
+ */
+template <typename T>
+class Compression_queue {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    enum class Policy { block, spill, drop };
+
+    struct Options {
+        std::size_t workers = 0;                      ///< Number of compression threads (0: one per core).
+        std::size_t queue_depth = 64;                 ///< Maximum number of frames waiting for a worker.
+        Policy policy = Policy::block;                ///< What submit() does when the queue is full.
+        std::chrono::nanoseconds deadline{0};         ///< Maximum enqueue→written latency (0: no deadline).
+        std::filesystem::path spill_path = {};        ///< The file that Policy::spill writes uncompressed frames to.
+    };
+
+    struct Statistics {
+        std::size_t submitted;
+        std::size_t written;
+        std::size_t spilled;
+        std::size_t dropped;
+        std::size_t missed_deadlines;
+        std::size_t queued;
+    };
+
+    /**
+     * @brief Starts a queue that writes the frames to a stream, as single-frame Terse objects.
+     *
+     * @param out The stream. It must outlive the queue.
+     * @param options The worker count, queue depth, policy and deadline.
+     */
+    Compression_queue(std::ostream& out, Options const& options) :
+    Compression_queue([&out](std::size_t, Terse&& frame) { frame.write(out); }, options) {}
+
+    /**
+     * @brief Starts a queue that passes the frames to a callback, in frame order.
+     *
+     * @param sink Called with the index and the compressed frame, by one thread at a time.
+     * @param options The worker count, queue depth, policy and deadline.
+     */
+    Compression_queue(std::function<void(std::size_t, Terse&&)> sink, Options const& options) :
+    d_options(options),
+    d_queue(options.queue_depth),
+    d_reorder([this, sink = std::move(sink)](std::size_t const index, Terse&& frame) {
+        sink(index, std::move(frame));
+        f_written(index);
+    }) {
+        if (d_options.policy == Policy::spill) {
+            d_spill.open(d_options.spill_path, std::ios::binary | std::ios::trunc);
+            d_spill_index.open(d_options.spill_path.string() + ".frames", std::ios::trunc);
+            if (!d_spill.is_open() || !d_spill_index.is_open())
+                throw std::runtime_error("cannot open spill file \"" + d_options.spill_path.string() + "\"");
+        }
+        std::size_t const workers = d_options.workers == 0 ? std::max(1u, std::thread::hardware_concurrency()) : d_options.workers;
+        for (std::size_t i = 0; i != workers; ++i)
+            d_workers.emplace_back([this] { f_work(); });
+    }
+
+    Compression_queue(Compression_queue const&) = delete;
+    Compression_queue& operator=(Compression_queue const&) = delete;
+
+    ~Compression_queue() {
+        close();
+    }
+
+    /**
+     * @brief Enqueues a frame for compression.
+     *
+     * @param frame The pixels of the frame.
+     * @param dim The dimensions of the frame (optional).
+     * @return True if the frame was enqueued, false if it was spilled or dropped because the queue was full.
+     */
+    bool submit(std::vector<T>&& frame, std::vector<std::size_t> const& dim = {}) {
+        Job job{0, Clock::now(), std::move(frame), dim};
+        std::lock_guard lock(d_submit_mutex); // frame indices follow the order of the queue
+        job.index = d_submitted++;
+        if (d_options.policy == Policy::block) {
+            if (!d_queue.push(std::move(job)))
+                throw std::logic_error("frame submitted to a closed Compression_queue");
+            return true;
+        }
+        if (d_queue.try_push(std::move(job)))
+            return true;
+        if (d_options.policy == Policy::spill) {
+            d_spill.write(reinterpret_cast<char const*>(job.pixels.data()), static_cast<std::streamsize>(job.pixels.size() * sizeof(T)));
+            d_spill_index << job.index << '\n';
+            ++d_spilled;
+        }
+        else
+            ++d_dropped;
+        {
+            std::lock_guard skipped_lock(d_skipped_mutex); // the workers skip it, as skipping can write waiting frames
+            d_skipped.push_back(job.index);
+        }
+        // If the workers have emptied the queue meanwhile, one of them is woken up to skip the frame
+        d_queue.try_push(Job{.index = 0, .enqueued = {}, .pixels = {}, .dim = {}, .skips = true});
+        return false;
+    }
+
+    /**
+     * @brief Waits until all enqueued frames have been written, and stops the workers.
+     */
+    void close() {
+        d_queue.close();
+        for (auto& worker : d_workers)
+            if (worker.joinable())
+                worker.join();
+        f_skip();
+        if (d_spill.is_open()) {
+            d_spill.flush();
+            d_spill_index.flush();
+        }
+    }
+
+    /**
+     * @brief Returns the frame counters.
+     *
+     * @return The counters.
+     */
+    Statistics statistics() const {
+        return {d_submitted, d_written, d_spilled, d_dropped, d_missed_deadlines, d_queue.size()};
+    }
+
+    /**
+     * @brief Returns the histogram of the time between enqueueing a frame and the start of its compression.
+     */
+    Latency_histogram const& waiting() const noexcept { return d_waiting; }
+
+    /**
+     * @brief Returns the histogram of the time between enqueueing and compressing a frame.
+     */
+    Latency_histogram const& compressed() const noexcept { return d_compressed; }
+
+    /**
+     * @brief Returns the histogram of the time between enqueueing and writing a frame.
+     */
+    Latency_histogram const& written() const noexcept { return d_written_latency; }
+
+    /**
+     * @brief Returns the counters and latency percentiles as text.
+     *
+     * @return One line of text.
+     */
+    std::string report() const {
+        Statistics const s = statistics();
+        std::ostringstream report;
+        report << s.submitted << " frames submitted, " << s.written << " written, " << s.spilled << " spilled, " << s.dropped
+               << " dropped, " << s.missed_deadlines << " missed deadlines, queue " << s.queued;
+        auto const latencies = [&](char const* name, Latency_histogram const& histogram) {
+            auto const ms = [](std::chrono::nanoseconds const t) { return std::chrono::duration<double, std::milli>(t).count(); };
+            report << "; " << name << " p50 " << ms(histogram.percentile(0.5)) << " p99 " << ms(histogram.percentile(0.99))
+                   << " p99.9 " << ms(histogram.percentile(0.999)) << " max " << ms(histogram.max()) << " ms";
+        };
+        report << std::setprecision(3);
+        latencies("enqueue->compressed", d_compressed);
+        latencies("enqueue->written", d_written_latency);
+        return report.str();
+    }
+
+private:
+    struct Job {
+        std::size_t index;
+        Clock::time_point enqueued;
+        std::vector<T> pixels;
+        std::vector<std::size_t> dim;
+        bool skips = false; // the job only skips the frames that submit() spilled or dropped
+    };
+
+    Options const d_options;
+    Bounded_queue<Job> d_queue;
+    Terse_reorder d_reorder;
+    std::vector<std::thread> d_workers;
+    std::mutex d_submit_mutex;
+    std::ofstream d_spill;
+    std::ofstream d_spill_index;
+    std::mutex d_skipped_mutex;
+    std::vector<std::size_t> d_skipped; // frames that submit() spilled or dropped, and that are still to be skipped
+    std::mutex d_enqueued_mutex;
+    std::unordered_map<std::size_t, Clock::time_point> d_enqueued; // of frames that have been compressed, but not written
+    std::atomic<std::size_t> d_submitted = 0;
+    std::atomic<std::size_t> d_written = 0;
+    std::atomic<std::size_t> d_spilled = 0;
+    std::atomic<std::size_t> d_dropped = 0;
+    std::atomic<std::size_t> d_missed_deadlines = 0;
+    Latency_histogram d_waiting;
+    Latency_histogram d_compressed;
+    Latency_histogram d_written_latency;
+
+    void f_work() {
+        while (auto job = d_queue.pop()) {
+            if (job->skips) {
+                f_skip();
+                continue;
+            }
+            auto const start = Clock::now();
+            d_waiting.record(start - job->enqueued);
+            if (d_options.policy == Policy::drop && d_options.deadline.count() > 0 && start > job->enqueued + d_options.deadline) {
+                ++d_dropped;
+                ++d_missed_deadlines;
+                d_reorder.skip(job->index);
+                f_skip();
+                continue;
+            }
+            Terse frame(job->pixels.data(), job->pixels.size());
+            if (!job->dim.empty())
+                frame.dim(job->dim);
+            d_compressed.record(Clock::now() - job->enqueued);
+            {
+                std::lock_guard lock(d_enqueued_mutex);
+                d_enqueued.emplace(job->index, job->enqueued);
+            }
+            d_reorder.insert(job->index, std::move(frame));
+            f_skip();
+        }
+    }
+
+    // Skips the frames that submit() spilled or dropped. Workers get here after every job, and submit() queues a job
+    // that only skips if the queue has been emptied, so that the producer never writes frames that were waiting for them.
+    void f_skip() {
+        std::vector<std::size_t> skipped;
+        {
+            std::lock_guard lock(d_skipped_mutex);
+            skipped.swap(d_skipped);
+        }
+        for (std::size_t const index : skipped)
+            d_reorder.skip(index);
+    }
+
+    void f_written(std::size_t const index) {
+        Clock::time_point enqueued;
+        {
+            std::lock_guard lock(d_enqueued_mutex);
+            auto const i = d_enqueued.find(index);
+            enqueued = i->second;
+            d_enqueued.erase(i);
+        }
+        auto const latency = Clock::now() - enqueued;
+        d_written_latency.record(latency);
+        ++d_written;
+        if (d_options.deadline.count() > 0 && latency > d_options.deadline)
+            ++d_missed_deadlines;
+    }
+};
+
+} // end namespace jpa
+
+#endif /* Compression_queue_h */
@@ -0,0 +1,161 @@
+//
+//  Directory_watcher.hpp
+//  Directory_watcher
+//
+
+#ifndef Directory_watcher_h
+#define Directory_watcher_h
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <set>
+#include <utility>
+#include <filesystem>
+#include <system_error>
+#include <cerrno>
+#include <climits>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+// Directory_watcher reports files in a directory as soon as they are complete, using Linux inotify. A file is complete
+// when it has been closed after writing, or when it has been moved into the directory (so writers that create a
+// temporary file and rename it are handled as well). Files are reported once per event; a file that is written and
+// closed twice is reported twice.
+//
+// The kernel queues a limited number of events. If events have been lost because the queue overflowed, wait() rescans
+// the directory and returns the regular files in it, so that no file is ever missed. A scan cannot tell whether a file
+// is still being written, so files that have been modified within the settle interval are held back: they are
+// reported by the event when they are closed, or by a later wait() once they have not been modified for the settle
+// interval, whichever comes first.
+//
+//  Directory_watcher(std::filesystem::path const& directory, std::chrono::milliseconds settle = std::chrono::seconds(1))
+//      Starts watching 'directory'. Throws std::system_error if the directory cannot be watched.
+//  std::vector<std::filesystem::path> wait(std::chrono::milliseconds timeout)
+//      Waits at most 'timeout' for files to be completed, and returns the paths of the completed files (possibly none).
+//  std::vector<std::filesystem::path> scan()
+//      Returns the paths of the regular files in the directory that have not been modified for the settle interval, and
+//      holds back the others until they have settled.
+//
+// Example:
+//    Directory_watcher spool("/data/spool");
+//    for (;;)
+//        for (auto const& path : spool.wait(std::chrono::seconds(1)))
+//            std::cout << path << " is complete" << std::endl;
+
+namespace jpa {
+
+/**
+ * @class Directory_watcher
+ * @brief Reports files that have been written into a directory, as soon as they have been closed.
+ */
+class Directory_watcher {
+public:
+
+    /**
+     * @brief Starts watching a directory.
+     *
+     * @param directory The directory to watch.
+     * @param settle The time that a file found by scan() must have been left unmodified to be reported as complete.
+     */
+    explicit Directory_watcher(std::filesystem::path const& directory, std::chrono::milliseconds const settle = std::chrono::seconds(1))
+        : d_directory(directory), d_settle(settle) {
+        d_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (d_fd < 0)
+            throw std::system_error(errno, std::generic_category(), "inotify_init1");
+        if (inotify_add_watch(d_fd, d_directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+            int const error = errno;
+            close(d_fd);
+            throw std::system_error(error, std::generic_category(), "watching \"" + d_directory.string() + "\"");
+        }
+    }
+
+    Directory_watcher(Directory_watcher const&) = delete;
+    Directory_watcher& operator=(Directory_watcher const&) = delete;
+
+    ~Directory_watcher() {
+        close(d_fd);
+    }
+
+    /**
+     * @brief Waits for files to be completed.
+     *
+     * @param timeout The maximum time to wait.
+     * @return The paths of the files that have been completed since the previous call, or the settled files in the
+     *         directory if events have been lost.
+     */
+    std::vector<std::filesystem::path> wait(std::chrono::milliseconds const timeout) {
+        std::vector<std::filesystem::path> files;
+        pollfd pfd{d_fd, POLLIN, 0};
+        int const r = poll(&pfd, 1, static_cast<int>(timeout.count()));
+        if (r < 0 && errno != EINTR)
+            throw std::system_error(errno, std::generic_category(), "poll");
+        if (r <= 0)
+            return f_settled(std::move(files));
+        bool overflow = false;
+        alignas(inotify_event) char buffer[64 * (sizeof(inotify_event) + NAME_MAX + 1)];
+        for (;;) {
+            ssize_t const size = read(d_fd, buffer, sizeof(buffer));
+            if (size < 0 && errno == EINTR)
+                continue;
+            if (size < 0 && errno == EAGAIN)
+                break;
+            if (size < 0)
+                throw std::system_error(errno, std::generic_category(), "reading inotify events");
+            for (char* p = buffer; p < buffer + size; p += sizeof(inotify_event) + reinterpret_cast<inotify_event*>(p)->len) {
+                inotify_event const* event = reinterpret_cast<inotify_event*>(p);
+                if (event->mask & IN_Q_OVERFLOW)
+                    overflow = true;
+                else if (event->len != 0 && !(event->mask & IN_ISDIR)) {
+                    files.push_back(d_directory / event->name);
+                    d_unsettled.erase(files.back()); // reported now, so no longer held back
+                }
+            }
+        }
+        return overflow ? scan() : f_settled(std::move(files));
+    }
+
+    /**
+     * @brief Lists the directory.
+     *
+     * @return The paths of the regular files in the directory that have not been modified for the settle interval. The
+     *         other regular files are reported by wait() later.
+     */
+    std::vector<std::filesystem::path> scan() {
+        std::vector<std::filesystem::path> files;
+        for (auto const& entry : std::filesystem::directory_iterator(d_directory))
+            if (entry.is_regular_file())
+                files.push_back(entry.path());
+        d_unsettled.insert(files.begin(), files.end());
+        return f_settled({});
+    }
+
+private:
+    // Moves the files that are held back and have not been modified for the settle interval to 'files'. Files that have
+    // been removed are forgotten.
+    std::vector<std::filesystem::path> f_settled(std::vector<std::filesystem::path> files) {
+        auto const now = std::filesystem::file_time_type::clock::now();
+        for (auto i = d_unsettled.begin(); i != d_unsettled.end(); ) {
+            std::error_code error;
+            auto const modified = std::filesystem::last_write_time(*i, error);
+            if (!error && now - modified < d_settle)
+                ++i;
+            else {
+                if (!error)
+                    files.push_back(*i);
+                i = d_unsettled.erase(i);
+            }
+        }
+        return files;
+    }
+
+    std::filesystem::path const d_directory;
+    std::chrono::milliseconds const d_settle;
+    std::set<std::filesystem::path> d_unsettled; // files found by scan() that may still be written
+    int d_fd = -1;
+};
+
+} // end namespace jpa
+
+#endif /* Directory_watcher_h */
@@ -0,0 +1,600 @@
+//
+//  File_io.hpp
+//  File_io
+//
+
+#ifndef File_io_h
+#define File_io_h
+
+#include <vector>
+#include <span>
+#include <string>
+#include <fstream>
+#include <filesystem>
+#include <system_error>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include <cstdlib>
+#include <cstdint>
+
+#if defined(__linux__)
+#define FILE_IO_DIRECT 1
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if __has_include(<linux/io_uring.h>)
+#define FILE_IO_URING 1
+#include <atomic>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// File_io reads, writes and removes batches of complete files. It has two backends:
+//  - sync:     every file is opened, read or written, and closed with blocking calls, one file at a time.
+//  - io_uring: (Linux only) the opens, reads, writes, closes and unlinks of a whole batch of files are submitted to
+//              the kernel together, so that a batch costs a handful of system calls instead of several per file.
+// The on-disk results of both backends are identical. If io_uring is requested but not supported by the kernel (or
+// not available on the platform), File_io falls back to the sync backend.
+//
+// Both backends can bypass the page cache with direct I/O (O_DIRECT, Linux only), so that reading and writing large
+// amounts of data does not evict the working set of other processes from the page cache. Direct I/O transfers data
+// between 4096 byte aligned buffers and 4096 byte aligned file offsets in multiples of 4096 bytes. Data that are not
+// aligned in memory are copied through an aligned buffer, and files whose size is not a multiple of 4096 bytes are
+// truncated after writing. File systems that do not support O_DIRECT are accessed through the page cache.
+//
+// A File_io object is not thread-safe: every thread should use its own File_io object.
+//
+//  File_io(Backend backend = Backend::automatic, unsigned entries = 64, bool direct = false)
+//      Constructs a File_io object with the requested backend. Backend::automatic selects io_uring if supported.
+//      'entries' is the number of operations that are submitted to io_uring in one go. If 'direct' is true, files
+//      are read and written with direct I/O where supported.
+//  Backend backend()
+//      Returns the backend that is used: Backend::sync or Backend::io_uring.
+//  bool direct()
+//      Returns whether direct I/O is used.
+//  std::vector<int> read(std::span<std::filesystem::path const> paths, std::span<Buffer> buffers)
+//      Reads the complete contents of each of the files into the corresponding buffer, which can be a std::string,
+//      std::vector<char>, std::vector<std::byte>, etc. Returns an errno value for each file, which is 0 on success.
+//  std::vector<int> write(std::span<std::filesystem::path const> paths, std::span<std::span<std::byte const> const> data)
+//      Creates or truncates each of the files and writes the corresponding data. Returns an errno value per file.
+//  std::vector<int> remove(std::span<std::filesystem::path const> paths)
+//      Removes each of the files. Returns an errno value per file.
+//
+// Example:
+//    File_io io;
+//    std::vector<std::filesystem::path> paths = {"a.tif", "b.tif"};
+//    std::vector<std::vector<std::byte>> data(2);
+//    for (int error : io.read(paths, std::span(data)))
+//        if (error != 0) std::cerr << std::strerror(error) << std::endl;
+
+namespace jpa {
+
+/**
+ * @class File_io
+ * @brief Reads, writes and removes batches of complete files, using io_uring where available.
+ *
+ * The io_uring backend submits the system calls for a whole batch of files at once, which removes the per-file
+ * system call overhead that dominates when many small files are processed. The sync backend uses standard C++
+ * streams. Both backends produce identical files. A File_io object must not be shared between threads.
+ */
+class File_io {
+public:
+
+    /**
+     * @brief The I/O backends.
+     */
+    enum class Backend { automatic, sync, io_uring };
+
+    /**
+     * @brief Constructs a File_io object.
+     *
+     * @param backend The requested backend. If io_uring is not supported, the sync backend is used.
+     * @param entries The maximum number of operations submitted to io_uring in one go.
+     * @param direct Read and write with direct I/O, bypassing the page cache, where supported.
+     */
+    explicit File_io(Backend const backend = Backend::automatic, unsigned const entries = 64, bool const direct = false) {
+#ifdef FILE_IO_URING
+        if (backend != Backend::sync)
+            f_setup(std::max(entries, 2u));
+#endif
+#ifdef FILE_IO_DIRECT
+        d_direct = direct;
+#endif
+    }
+
+    File_io(File_io const&) = delete;
+    File_io& operator=(File_io const&) = delete;
+
+    ~File_io() {
+#ifdef FILE_IO_URING
+        f_teardown();
+#endif
+    }
+
+    /**
+     * @brief Returns the backend in use.
+     *
+     * @return Backend::io_uring or Backend::sync.
+     */
+    Backend backend() const noexcept {
+#ifdef FILE_IO_URING
+        if (d_ring_fd >= 0)
+            return Backend::io_uring;
+#endif
+        return Backend::sync;
+    }
+
+    /**
+     * @brief Returns whether files are read and written with direct I/O.
+     *
+     * @return True if direct I/O is used.
+     */
+    bool direct() const noexcept { return d_direct; }
+
+    /**
+     * @brief Reads complete files.
+     *
+     * @tparam Buffer A contiguous container of bytes with resize() and data(), like std::string or std::vector<std::byte>.
+     * @param paths The files to read.
+     * @param buffers One buffer per file, which is resized to the size of the file.
+     * @return An errno value per file; 0 if the file was read successfully.
+     */
+    template <typename Buffer> requires (sizeof(typename Buffer::value_type) == 1)
+    std::vector<int> read(std::span<std::filesystem::path const> const paths, std::span<Buffer> const buffers) {
+#ifdef FILE_IO_URING
+        if (d_ring_fd >= 0) {
+            return f_uring_read(paths, [&](std::size_t i, std::size_t size) {
+                buffers[i].resize(size);
+                return std::span<char>(reinterpret_cast<char*>(buffers[i].data()), size);
+            }, [&](std::size_t i, std::size_t size) { buffers[i].resize(size); });
+        }
+#endif
+        std::vector<int> errors(paths.size(), 0);
+#ifdef FILE_IO_DIRECT
+        if (d_direct) {
+            for (std::size_t i = 0; i != paths.size(); ++i)
+                errors[i] = f_direct_read(paths[i], buffers[i]);
+            return errors;
+        }
+#endif
+        for (std::size_t i = 0; i != paths.size(); ++i) {
+            errno = 0;
+            std::ifstream file(paths[i], std::ios::binary | std::ios::ate);
+            if (!file.is_open()) {
+                errors[i] = f_errno();
+                continue;
+            }
+            buffers[i].resize(static_cast<std::size_t>(file.tellg()));
+            file.seekg(0);
+            if (!file.read(reinterpret_cast<char*>(buffers[i].data()), buffers[i].size()))
+                errors[i] = f_errno();
+        }
+        return errors;
+    }
+
+    /**
+     * @brief Creates or truncates files and writes data into them.
+     *
+     * @param paths The files to write.
+     * @param data The data for each of the files.
+     * @return An errno value per file; 0 if the file was written successfully.
+     */
+    std::vector<int> write(std::span<std::filesystem::path const> const paths, std::span<std::span<std::byte const> const> const data) {
+#ifdef FILE_IO_URING
+        if (d_ring_fd >= 0)
+            return f_uring_write(paths, data);
+#endif
+        std::vector<int> errors(paths.size(), 0);
+#ifdef FILE_IO_DIRECT
+        if (d_direct) {
+            for (std::size_t i = 0; i != paths.size(); ++i)
+                errors[i] = f_direct_write(paths[i], data[i]);
+            return errors;
+        }
+#endif
+        for (std::size_t i = 0; i != paths.size(); ++i) {
+            errno = 0;
+            std::ofstream file(paths[i], std::ios::binary);
+            if (!file.is_open() || !file.write(reinterpret_cast<char const*>(data[i].data()), data[i].size()) || !file.flush())
+                errors[i] = f_errno();
+        }
+        return errors;
+    }
+
+    /**
+     * @brief Removes files.
+     *
+     * @param paths The files to remove.
+     * @return An errno value per file; 0 if the file was removed successfully.
+     */
+    std::vector<int> remove(std::span<std::filesystem::path const> const paths) {
+#ifdef FILE_IO_URING
+        if (d_ring_fd >= 0) {
+            std::vector<io_uring_sqe> ops(paths.size());
+            for (std::size_t i = 0; i != paths.size(); ++i) {
+                ops[i].opcode = IORING_OP_UNLINKAT;
+                ops[i].fd = AT_FDCWD;
+                ops[i].addr = reinterpret_cast<std::uint64_t>(paths[i].c_str());
+            }
+            std::vector<int> errors = f_submit(ops);
+            for (auto& e : errors)
+                e = e < 0 ? -e : 0;
+            return errors;
+        }
+#endif
+        std::vector<int> errors(paths.size(), 0);
+        for (std::size_t i = 0; i != paths.size(); ++i) {
+            std::error_code ec;
+            if (!std::filesystem::remove(paths[i], ec))
+                errors[i] = ec ? ec.value() : ENOENT;
+        }
+        return errors;
+    }
+
+private:
+    bool d_direct = false;
+
+    static int f_errno() noexcept { return errno != 0 ? errno : EIO; }
+
+#ifdef FILE_IO_DIRECT
+    static constexpr std::size_t s_direct_alignment = 4096; // alignment of buffers, file offsets and sizes for O_DIRECT
+
+    struct Free {
+        void operator()(char* p) const noexcept { std::free(p); }
+    };
+    using Aligned_buffer = std::unique_ptr<char[], Free>;
+
+    static std::size_t f_direct_size(std::size_t const size) noexcept {
+        return (size + s_direct_alignment - 1) / s_direct_alignment * s_direct_alignment;
+    }
+
+    // Allocates an aligned buffer of at least 'size' bytes, rounded up to a multiple of the alignment.
+    static Aligned_buffer f_aligned_buffer(std::size_t const size) {
+        Aligned_buffer buffer(static_cast<char*>(std::aligned_alloc(s_direct_alignment, std::max(f_direct_size(size), s_direct_alignment))));
+        if (!buffer)
+            throw std::bad_alloc();
+        return buffer;
+    }
+
+    // Returns an aligned copy of 'data' that is padded with zeros to a multiple of the alignment, or an empty buffer
+    // if 'data' can be written with O_DIRECT as it is.
+    static Aligned_buffer f_aligned_copy(std::span<std::byte const> const data) {
+        if (reinterpret_cast<std::uintptr_t>(data.data()) % s_direct_alignment == 0 && data.size() % s_direct_alignment == 0)
+            return Aligned_buffer();
+        Aligned_buffer buffer = f_aligned_buffer(data.size());
+        std::memcpy(buffer.get(), data.data(), data.size());
+        std::memset(buffer.get() + data.size(), 0, f_direct_size(data.size()) - data.size());
+        return buffer;
+    }
+
+    // Opens a file with O_DIRECT, or without it if the file system does not support it.
+    static int f_open_direct(std::filesystem::path const& path, int const flags) noexcept {
+        int const fd = ::open(path.c_str(), flags | O_DIRECT, 0666);
+        if (fd < 0 && errno == EINVAL)
+            return ::open(path.c_str(), flags, 0666);
+        return fd;
+    }
+
+    template <typename Buffer>
+    static int f_direct_read(std::filesystem::path const& path, Buffer& buffer) {
+        int const fd = f_open_direct(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return f_errno();
+        int error = 0;
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+            error = f_errno();
+        else {
+            std::size_t const size = f_direct_size(static_cast<std::size_t>(st.st_size));
+            Aligned_buffer aligned = f_aligned_buffer(size);
+            std::size_t done = 0;
+            while (done < size) {
+                ssize_t const r = ::pread(fd, aligned.get() + done, size - done, static_cast<off_t>(done));
+                if (r < 0 && errno == EINTR)
+                    continue;
+                if (r < 0)
+                    error = f_errno();
+                if (r <= 0)
+                    break;
+                done += static_cast<std::size_t>(r);
+            }
+            buffer.resize(done);
+            std::memcpy(buffer.data(), aligned.get(), done);
+        }
+        if (::close(fd) != 0 && error == 0)
+            error = f_errno();
+        return error;
+    }
+
+    static int f_direct_write(std::filesystem::path const& path, std::span<std::byte const> const data) {
+        int const fd = f_open_direct(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC);
+        if (fd < 0)
+            return f_errno();
+        Aligned_buffer const aligned = f_aligned_copy(data);
+        char const* const source = aligned ? aligned.get() : reinterpret_cast<char const*>(data.data());
+        std::size_t const size = f_direct_size(data.size());
+        int error = 0;
+        for (std::size_t done = 0; done < size && error == 0; ) {
+            ssize_t const r = ::pwrite(fd, source + done, size - done, static_cast<off_t>(done));
+            if (r < 0 && errno != EINTR)
+                error = f_errno();
+            else if (r > 0)
+                done += static_cast<std::size_t>(r);
+        }
+        if (error == 0 && size != data.size() && ::ftruncate(fd, static_cast<off_t>(data.size())) != 0)
+            error = f_errno();
+        if (::close(fd) != 0 && error == 0)
+            error = f_errno();
+        return error;
+    }
+#endif
+
+#ifdef FILE_IO_URING
+    static constexpr std::size_t s_max_transfer = 1ul << 30; // maximum number of bytes per read or write operation
+
+    int d_ring_fd = -1;
+    unsigned d_entries = 0;
+    void* d_sq_ring = MAP_FAILED;
+    void* d_cq_ring = MAP_FAILED;
+    std::size_t d_sq_ring_size = 0;
+    std::size_t d_cq_ring_size = 0;
+    io_uring_sqe* d_sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    std::size_t d_sqes_size = 0;
+    unsigned* d_sq_tail = nullptr;
+    unsigned* d_sq_mask = nullptr;
+    unsigned* d_sq_array = nullptr;
+    unsigned* d_cq_head = nullptr;
+    unsigned* d_cq_tail = nullptr;
+    unsigned* d_cq_mask = nullptr;
+    io_uring_cqe* d_cqes = nullptr;
+
+    // Set up the submission and completion rings, and check that all required operations are supported.
+    void f_setup(unsigned const entries) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        d_ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (d_ring_fd < 0)
+            return;
+        d_entries = params.sq_entries;
+        d_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        d_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            d_sq_ring_size = d_cq_ring_size = std::max(d_sq_ring_size, d_cq_ring_size);
+        d_sq_ring = mmap(nullptr, d_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, d_ring_fd, IORING_OFF_SQ_RING);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            d_cq_ring = d_sq_ring;
+        else
+            d_cq_ring = mmap(nullptr, d_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, d_ring_fd, IORING_OFF_CQ_RING);
+        d_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        d_sqes = static_cast<io_uring_sqe*>(mmap(nullptr, d_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, d_ring_fd, IORING_OFF_SQES));
+        if (d_sq_ring == MAP_FAILED || d_cq_ring == MAP_FAILED || d_sqes == MAP_FAILED || !f_supported()) {
+            f_teardown();
+            return;
+        }
+        char* sq = static_cast<char*>(d_sq_ring);
+        char* cq = static_cast<char*>(d_cq_ring);
+        d_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        d_sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        d_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        d_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        d_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        d_cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        d_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    }
+
+    bool f_supported() const {
+        std::vector<std::byte> buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), std::byte(0));
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+        if (syscall(__NR_io_uring_register, d_ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+            return false;
+        for (int op : {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_UNLINKAT})
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+                return false;
+        return true;
+    }
+
+    void f_teardown() noexcept {
+        if (d_sqes != MAP_FAILED)
+            munmap(d_sqes, d_sqes_size);
+        if (d_cq_ring != MAP_FAILED && d_cq_ring != d_sq_ring)
+            munmap(d_cq_ring, d_cq_ring_size);
+        if (d_sq_ring != MAP_FAILED)
+            munmap(d_sq_ring, d_sq_ring_size);
+        if (d_ring_fd >= 0)
+            close(d_ring_fd);
+        d_sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+        d_sq_ring = d_cq_ring = MAP_FAILED;
+        d_ring_fd = -1;
+    }
+
+    // Submit all operations, in chunks of at most d_entries, and wait for their completion. Returns the result of
+    // each operation (a negative errno value on failure).
+    std::vector<int> f_submit(std::vector<io_uring_sqe>& ops) {
+        std::vector<int> results(ops.size(), -EIO);
+        for (std::size_t first = 0; first < ops.size(); first += d_entries) {
+            unsigned const count = static_cast<unsigned>(std::min<std::size_t>(d_entries, ops.size() - first));
+            unsigned tail = *d_sq_tail;
+            for (unsigned i = 0; i != count; ++i, ++tail) {
+                unsigned const index = tail & *d_sq_mask;
+                d_sqes[index] = ops[first + i];
+                d_sqes[index].user_data = first + i;
+                d_sq_array[index] = index;
+            }
+            std::atomic_ref<unsigned>(*d_sq_tail).store(tail, std::memory_order_release);
+            unsigned completed = 0;
+            unsigned submitted = 0;
+            while (completed != count) {
+                int const r = static_cast<int>(syscall(__NR_io_uring_enter, d_ring_fd, count - submitted, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+                if (r < 0 && errno != EINTR)
+                    throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+                if (r > 0)
+                    submitted += r;
+                unsigned head = *d_cq_head;
+                unsigned const cq_tail = std::atomic_ref<unsigned>(*d_cq_tail).load(std::memory_order_acquire);
+                for (; head != cq_tail; ++head, ++completed) {
+                    io_uring_cqe const& cqe = d_cqes[head & *d_cq_mask];
+                    results[cqe.user_data] = cqe.res;
+                }
+                std::atomic_ref<unsigned>(*d_cq_head).store(head, std::memory_order_release);
+            }
+        }
+        return results;
+    }
+
+    // Transfer (read or write) all data through the file descriptors. Short transfers are resubmitted until all
+    // data have been transferred, or until a read reaches the end of the file. Returns the number of bytes
+    // transferred per file, and sets errors for failed transfers.
+    std::vector<std::size_t> f_transfer(std::uint8_t const opcode, std::vector<int> const& fds, std::vector<std::span<char>> const& data, std::vector<int>& errors) {
+        std::vector<std::size_t> done(fds.size(), 0);
+        std::vector<bool> finished(fds.size(), false);
+        for (;;) {
+            std::vector<io_uring_sqe> ops;
+            std::vector<std::size_t> files;
+            for (std::size_t i = 0; i != fds.size(); ++i)
+                if (errors[i] == 0 && !finished[i] && done[i] < data[i].size()) {
+                    io_uring_sqe op;
+                    std::memset(&op, 0, sizeof(op));
+                    op.opcode = opcode;
+                    op.fd = fds[i];
+                    op.addr = reinterpret_cast<std::uint64_t>(data[i].data() + done[i]);
+                    op.len = static_cast<std::uint32_t>(std::min(data[i].size() - done[i], s_max_transfer));
+                    op.off = done[i];
+                    ops.push_back(op);
+                    files.push_back(i);
+                }
+            if (ops.empty())
+                return done;
+            std::vector<int> results = f_submit(ops);
+            for (std::size_t k = 0; k != files.size(); ++k) {
+                if (results[k] < 0)
+                    errors[files[k]] = -results[k];
+                else if (results[k] == 0)
+                    finished[files[k]] = true;
+                else
+                    done[files[k]] += results[k];
+            }
+        }
+    }
+
+    void f_close(std::vector<int> const& fds, std::vector<int>& errors) {
+        std::vector<io_uring_sqe> ops;
+        std::vector<std::size_t> files;
+        for (std::size_t i = 0; i != fds.size(); ++i)
+            if (fds[i] >= 0) {
+                io_uring_sqe op;
+                std::memset(&op, 0, sizeof(op));
+                op.opcode = IORING_OP_CLOSE;
+                op.fd = fds[i];
+                ops.push_back(op);
+                files.push_back(i);
+            }
+        std::vector<int> results = f_submit(ops);
+        for (std::size_t k = 0; k != files.size(); ++k)
+            if (results[k] < 0 && errors[files[k]] == 0)
+                errors[files[k]] = -results[k];
+    }
+
+    // Opens and stats all files in one submission, reads them in one or more submissions, and closes them in one submission.
+    template <typename Allocate, typename Truncate>
+    std::vector<int> f_uring_read(std::span<std::filesystem::path const> const paths, Allocate&& allocate, Truncate&& truncate) {
+        std::size_t const n = paths.size();
+        std::vector<int> errors(n, 0);
+        std::vector<int> fds(n, -1);
+        std::vector<struct statx> stats(n);
+        std::vector<io_uring_sqe> ops(2 * n);
+        for (std::size_t i = 0; i != n; ++i) {
+            std::memset(&ops[2 * i], 0, 2 * sizeof(io_uring_sqe));
+            ops[2 * i].opcode = IORING_OP_OPENAT;
+            ops[2 * i].fd = AT_FDCWD;
+            ops[2 * i].addr = reinterpret_cast<std::uint64_t>(paths[i].c_str());
+            ops[2 * i].open_flags = O_RDONLY | O_CLOEXEC | (d_direct ? O_DIRECT : 0);
+            ops[2 * i + 1].opcode = IORING_OP_STATX;
+            ops[2 * i + 1].fd = AT_FDCWD;
+            ops[2 * i + 1].addr = reinterpret_cast<std::uint64_t>(paths[i].c_str());
+            ops[2 * i + 1].len = STATX_SIZE;
+            ops[2 * i + 1].off = reinterpret_cast<std::uint64_t>(&stats[i]);
+        }
+        std::vector<int> results = f_submit(ops);
+        std::vector<std::span<char>> data(n);
+        std::vector<Aligned_buffer> aligned(n);
+        for (std::size_t i = 0; i != n; ++i) {
+            if (d_direct && results[2 * i] == -EINVAL) { // the file system does not support O_DIRECT
+                int const fd = ::open(paths[i].c_str(), O_RDONLY | O_CLOEXEC);
+                results[2 * i] = fd < 0 ? -f_errno() : fd;
+            }
+            if (results[2 * i] >= 0)
+                fds[i] = results[2 * i];
+            if (results[2 * i] < 0)
+                errors[i] = -results[2 * i];
+            else if (results[2 * i + 1] < 0)
+                errors[i] = -results[2 * i + 1];
+            else if (d_direct) {
+                aligned[i] = f_aligned_buffer(static_cast<std::size_t>(stats[i].stx_size));
+                data[i] = std::span<char>(aligned[i].get(), f_direct_size(static_cast<std::size_t>(stats[i].stx_size)));
+            }
+            else
+                data[i] = allocate(i, static_cast<std::size_t>(stats[i].stx_size));
+        }
+        std::vector<std::size_t> const done = f_transfer(IORING_OP_READ, fds, data, errors);
+        for (std::size_t i = 0; i != n; ++i)
+            if (errors[i] == 0 && d_direct)
+                std::memcpy(allocate(i, done[i]).data(), aligned[i].get(), done[i]);
+            else if (errors[i] == 0 && done[i] != data[i].size())
+                truncate(i, done[i]);
+        f_close(fds, errors);
+        return errors;
+    }
+
+    // Opens all files in one submission, writes them in one or more submissions, and closes them in one submission.
+    std::vector<int> f_uring_write(std::span<std::filesystem::path const> const paths, std::span<std::span<std::byte const> const> const data) {
+        std::size_t const n = paths.size();
+        std::vector<int> errors(n, 0);
+        std::vector<int> fds(n, -1);
+        std::vector<io_uring_sqe> ops(n);
+        for (std::size_t i = 0; i != n; ++i) {
+            std::memset(&ops[i], 0, sizeof(io_uring_sqe));
+            ops[i].opcode = IORING_OP_OPENAT;
+            ops[i].fd = AT_FDCWD;
+            ops[i].addr = reinterpret_cast<std::uint64_t>(paths[i].c_str());
+            ops[i].open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | (d_direct ? O_DIRECT : 0);
+            ops[i].len = 0666;
+        }
+        std::vector<int> results = f_submit(ops);
+        std::vector<std::span<char>> spans(n);
+        std::vector<Aligned_buffer> aligned(n);
+        for (std::size_t i = 0; i != n; ++i) {
+            if (d_direct && results[i] == -EINVAL) { // the file system does not support O_DIRECT
+                int const fd = ::open(paths[i].c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+                results[i] = fd < 0 ? -f_errno() : fd;
+            }
+            if (results[i] < 0)
+                errors[i] = -results[i];
+            else {
+                fds[i] = results[i];
+                if (d_direct)
+                    aligned[i] = f_aligned_copy(data[i]);
+                if (aligned[i])
+                    spans[i] = std::span<char>(aligned[i].get(), f_direct_size(data[i].size()));
+                else
+                    spans[i] = std::span<char>(reinterpret_cast<char*>(const_cast<std::byte*>(data[i].data())), data[i].size());
+            }
+        }
+        std::vector<std::size_t> const done = f_transfer(IORING_OP_WRITE, fds, spans, errors);
+        for (std::size_t i = 0; i != n; ++i)
+            if (errors[i] == 0 && done[i] != spans[i].size())
+                errors[i] = EIO;
+            else if (errors[i] == 0 && spans[i].size() != data[i].size() && ::ftruncate(fds[i], static_cast<off_t>(data[i].size())) != 0)
+                errors[i] = f_errno();
+        f_close(fds, errors);
+        return errors;
+    }
+#endif
+};
+
+} // end namespace jpa
+
+#endif /* File_io_h */
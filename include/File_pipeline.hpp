@@ -0,0 +1,334 @@
+//
+//  File_pipeline.hpp
+//  File_pipeline
+//
+
+#ifndef File_pipeline_h
+#define File_pipeline_h
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <semaphore>
+#include <atomic>
+#include <concepts>
+#include <chrono>
+#include <span>
+#include <cstring>
+#include <filesystem>
+#include "Thread_pool.hpp"
+#include "Bounded_queue.hpp"
+#include "File_io.hpp"
+
+// File_pipeline<Job> processes a batch of jobs, typically one per file, in three overlapping stages: reading,
+// processing and writing. While one job is processed, the next jobs are being read and previous jobs are being
+// written, so the throughput approaches the maximum of the disk and CPU throughput rather than their sum.
+//
+// All file I/O is done by the pipeline itself, through File_io, in batches of files. With the io_uring backend, the
+// opens, reads, writes, closes and unlinks of a batch of files are each submitted to the kernel in one go. A job only
+// describes its files and transforms the input data into output data:
+//  using Input
+//      The buffer type that receives the contents of the input file, for instance std::vector<std::byte>.
+//  std::filesystem::path input_path()
+//  std::filesystem::path output_path()
+//      The file to read, and the file to write.
+//  std::size_t memory_size()
+//      Estimate of the number of bytes that the job requires from reading until writing has finished.
+//  void process(Input&& input)
+//      Processes the input and prepares the output. Called by one of the workers of a work-stealing Thread_pool.
+//  std::span<std::byte const> output()
+//      The data to be written to output_path().
+//  void written()
+//      Called after the output has been written (and the input has been removed); the job should release its buffers.
+//  void fail(std::string const& message)
+//  bool failed()
+//      Marks the job as failed / returns whether it failed. Stages of failed jobs are skipped. Exceptions thrown by
+//      the job are caught and passed to fail().
+//
+// Readers prefetch jobs in their input order. The number of read jobs waiting to be processed, and of processed
+// jobs waiting to be written, are each limited by the queue depth. The sum of memory_size() of all jobs in flight is
+// limited by the memory budget (a single batch that exceeds the budget is processed on its own).
+//
+//  File_pipeline(Options const& options)
+//      Constructs a pipeline with the specified number of reader threads, workers, writer threads, queue depth,
+//      memory budget, I/O backend, batch size and whether direct I/O is used.
+//  void run(std::vector<Job>& jobs, Report&& report)
+//      Runs all jobs through the pipeline. 'report(i)' is called for every job after it has been written (or has
+//      failed), strictly in the order of the jobs, so that the output does not depend on the number of threads.
+//  Stage_times const& times()
+//      The times spent in each of the stages, summed over all threads.
+
+namespace jpa {
+
+/**
+ * @brief Concept for the jobs that are handled by a File_pipeline.
+ */
+template <typename Job>
+concept File_pipeline_job = requires (Job& job, Job const& cjob, typename Job::Input&& input, std::string const& message) {
+    { cjob.input_path() } -> std::convertible_to<std::filesystem::path>;
+    { cjob.output_path() } -> std::convertible_to<std::filesystem::path>;
+    { job.memory_size() } -> std::convertible_to<std::size_t>;
+    job.process(std::move(input));
+    { cjob.output() } -> std::convertible_to<std::span<std::byte const>>;
+    job.written();
+    job.fail(message);
+    { cjob.failed() } -> std::convertible_to<bool>;
+};
+
+/**
+ * @class Memory_budget
+ * @brief Limits the number of bytes that are in use by concurrent jobs.
+ *
+ * acquire() blocks until the requested bytes fit in the budget. A request that is larger than the total budget is
+ * granted when no other bytes are in use, so that it cannot block forever.
+ */
+class Memory_budget {
+public:
+
+    /**
+     * @brief Constructs a memory budget.
+     *
+     * @param bytes The total number of bytes that can be in use at any time.
+     */
+    explicit Memory_budget(std::size_t const bytes) : d_budget(bytes) {}
+
+    /**
+     * @brief Waits until 'bytes' fit in the budget, and reserves them.
+     *
+     * @param bytes The number of bytes to reserve.
+     */
+    void acquire(std::size_t const bytes) {
+        std::unique_lock lock(d_mutex);
+        d_released.wait(lock, [&] { return d_in_use == 0 || d_in_use + bytes <= d_budget; });
+        d_in_use += bytes;
+    }
+
+    /**
+     * @brief Returns previously reserved bytes to the budget.
+     *
+     * @param bytes The number of bytes to return.
+     */
+    void release(std::size_t const bytes) {
+        std::lock_guard lock(d_mutex);
+        d_in_use -= bytes;
+        d_released.notify_all();
+    }
+
+private:
+    std::size_t const d_budget;
+    std::size_t d_in_use = 0;
+    std::mutex d_mutex;
+    std::condition_variable d_released;
+};
+
+/**
+ * @class File_pipeline
+ * @brief Overlaps reading, processing and writing of a batch of jobs.
+ *
+ * Reader threads prefetch jobs in input order, a work-stealing Thread_pool processes them, and writer threads write
+ * the results. All file I/O is batched through File_io. Bounded queues between the stages and a memory budget limit
+ * the amount of work in flight. Reports are delivered strictly in job order.
+ *
+ * @tparam Job The job type, see File_pipeline_job.
+ */
+template <File_pipeline_job Job>
+class File_pipeline {
+public:
+
+    /**
+     * @brief Parameters of the pipeline.
+     */
+    struct Options {
+        std::size_t readers = 1;              ///< Number of reader threads.
+        std::size_t workers = 1;              ///< Number of processing threads (0: one per core).
+        std::size_t writers = 1;              ///< Number of writer threads.
+        std::size_t queue_depth = 4;          ///< Maximum number of jobs waiting between two stages.
+        std::size_t memory_budget = 1ul << 30; ///< Maximum number of bytes of all jobs in flight.
+        File_io::Backend io = File_io::Backend::automatic; ///< The I/O backend of the readers and writers.
+        std::size_t batch = 16;               ///< Maximum number of files that are read or written in one batch.
+        bool direct = false;                  ///< Read and write with direct I/O (O_DIRECT), bypassing the page cache.
+        bool remove_input = true;             ///< Remove the input file after the output has been written.
+    };
+
+    /**
+     * @brief Times spent in each of the stages, summed over all threads.
+     */
+    struct Stage_times {
+        std::chrono::duration<double> read{0};
+        std::chrono::duration<double> process{0};
+        std::chrono::duration<double> write{0};
+    };
+
+    /**
+     * @brief Constructs a pipeline.
+     *
+     * @param options The numbers of threads per stage, the queue depth, the memory budget, the I/O backend and the batch size.
+     */
+    explicit File_pipeline(Options const& options) : d_options(options) {}
+
+    /**
+     * @brief Runs all jobs through the pipeline.
+     *
+     * @tparam Report A callable taking the index of a job.
+     * @param jobs The jobs to be run.
+     * @param report Called once per job, after it has been written or has failed, strictly in job order.
+     */
+    template <typename Report>
+    void run(std::vector<Job>& jobs, Report&& report) {
+        using Clock = std::chrono::steady_clock;
+        std::size_t const batch = std::max(d_options.batch, std::size_t(1));
+        Memory_budget memory(d_options.memory_budget);
+        std::counting_semaphore<> process_slots(std::max(d_options.queue_depth, std::size_t(1)));
+        Bounded_queue<std::size_t> to_write(d_options.queue_depth);
+        std::vector<std::size_t> reserved(jobs.size(), 0);
+        std::atomic<std::size_t> next_job = 0;
+
+        std::vector<bool> done(jobs.size(), false);
+        std::size_t next_report = 0;
+        std::mutex report_mutex;
+
+        Thread_pool workers(d_options.workers);
+        auto read = [&] {
+            File_io io(d_options.io, 64, d_options.direct);
+            for (std::size_t first = next_job.fetch_add(batch); first < jobs.size(); first = next_job.fetch_add(batch)) {
+                std::size_t const last = std::min(first + batch, jobs.size());
+                std::size_t bytes = 0;
+                for (std::size_t i = first; i != last; ++i) {
+                    f_stage(jobs[i], [&] { reserved[i] = jobs[i].memory_size(); });
+                    bytes += reserved[i];
+                }
+                memory.acquire(bytes);
+                
+                auto const start_time = Clock::now();
+                std::vector<std::filesystem::path> paths;
+                for (std::size_t i = first; i != last; ++i)
+                    paths.push_back(jobs[i].failed() ? std::filesystem::path() : std::filesystem::path(jobs[i].input_path()));
+                std::vector<typename Job::Input> inputs(paths.size());
+                std::vector<int> const errors = io.read(std::span<std::filesystem::path const>(paths), std::span(inputs));
+                f_add_time(d_times.read, Clock::now() - start_time);
+                
+                for (std::size_t i = first; i != last; ++i) {
+                    if (!jobs[i].failed() && errors[i - first] != 0)
+                        jobs[i].fail("Failed to read input file: " + std::string(std::strerror(errors[i - first])));
+                    if (jobs[i].failed())
+                        to_write.push(i);
+                    else {
+                        process_slots.acquire();
+                        workers.submit([&, i, input = std::move(inputs[i - first])] () mutable {
+                            auto const start_time = Clock::now();
+                            f_stage(jobs[i], [&] { jobs[i].process(std::move(input)); });
+                            f_add_time(d_times.process, Clock::now() - start_time);
+                            process_slots.release();
+                            to_write.push(i);
+                        });
+                    }
+                }
+            }
+        };
+        auto write = [&] {
+            File_io io(d_options.io, 64, d_options.direct);
+            while (auto first = to_write.pop()) {
+                std::vector<std::size_t> indices = {*first};
+                while (indices.size() < batch)
+                    if (auto i = to_write.try_pop())
+                        indices.push_back(*i);
+                    else
+                        break;
+                
+                auto const start_time = Clock::now();
+                f_write(io, jobs, indices);
+                f_add_time(d_times.write, Clock::now() - start_time);
+                
+                std::lock_guard lock(report_mutex);
+                for (std::size_t i : indices) {
+                    memory.release(reserved[i]);
+                    done[i] = true;
+                }
+                for (; next_report != done.size() && done[next_report]; ++next_report)
+                    report(next_report);
+            }
+        };
+
+        std::vector<std::thread> readers;
+        std::vector<std::thread> writers;
+        for (std::size_t i = 0; i != std::max(d_options.readers, std::size_t(1)); ++i)
+            readers.emplace_back(read);
+        for (std::size_t i = 0; i != std::max(d_options.writers, std::size_t(1)); ++i)
+            writers.emplace_back(write);
+        for (auto& reader : readers)
+            reader.join();
+        workers.wait();
+        to_write.close();
+        for (auto& writer : writers)
+            writer.join();
+    }
+
+    /**
+     * @brief Returns the times spent in each of the stages, summed over all threads.
+     *
+     * @return The stage times.
+     */
+    Stage_times const& times() const noexcept { return d_times; }
+
+private:
+    Options const d_options;
+    Stage_times d_times;
+    std::mutex d_times_mutex;
+
+    // Run a stage of a job, unless the job already failed. Exceptions mark the job as failed.
+    template <typename Stage>
+    static void f_stage(Job& job, Stage&& stage) {
+        if (!job.failed())
+            try {
+                stage();
+            }
+            catch (std::exception const& e) {
+                job.fail(e.what());
+            }
+    }
+
+    void f_add_time(std::chrono::duration<double>& total, std::chrono::duration<double> const time) {
+        std::lock_guard lock(d_times_mutex);
+        total += time;
+    }
+
+    // Write the outputs of a batch of jobs, then remove the inputs of the jobs that were written successfully.
+    void f_write(File_io& io, std::vector<Job>& jobs, std::vector<std::size_t> const& indices) {
+        std::vector<std::size_t> writing;
+        std::vector<std::filesystem::path> paths;
+        std::vector<std::span<std::byte const>> data;
+        for (std::size_t i : indices)
+            f_stage(jobs[i], [&] {
+                std::span<std::byte const> const output = jobs[i].output();
+                paths.push_back(jobs[i].output_path());
+                data.push_back(output);
+                writing.push_back(i);
+            });
+        std::vector<int> errors = io.write(std::span<std::filesystem::path const>(paths), std::span<std::span<std::byte const> const>(data));
+        for (std::size_t k = 0; k != writing.size(); ++k)
+            if (errors[k] != 0)
+                jobs[writing[k]].fail("Failed to write \"" + paths[k].string() + "\": " + std::strerror(errors[k]));
+        
+        if (d_options.remove_input) {
+            std::vector<std::size_t> removing;
+            paths.clear();
+            for (std::size_t i : writing)
+                if (!jobs[i].failed()) {
+                    paths.push_back(jobs[i].input_path());
+                    removing.push_back(i);
+                }
+            errors = io.remove(std::span<std::filesystem::path const>(paths));
+            for (std::size_t k = 0; k != removing.size(); ++k)
+                if (errors[k] != 0)
+                    jobs[removing[k]].fail("Failed to remove input file: " + std::string(std::strerror(errors[k])));
+        }
+        for (std::size_t i : writing)
+            f_stage(jobs[i], [&] { jobs[i].written(); });
+    }
+};
+
+} // end namespace jpa
+
+#endif /* File_pipeline_h */
@@ -0,0 +1,308 @@
+//
+//  Frame_cache.hpp
+//  Frame_cache
+//
+
+#ifndef Frame_cache_h
+#define Frame_cache_h
+
+#include <list>
+#include <span>
+#include <mutex>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <optional>
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <condition_variable>
+
+// Frame_cache holds expanded frames of trpx stacks for tools that read the same frames again and again, so that a frame
+// is expanded once instead of at every request. It is shared by many threads: a frame that is in the cache is found
+// under a shared lock, and only a frame that has to be expanded takes the lock exclusively. A frame that is being
+// expanded is cached as a future, so that threads that ask for it at the same time expand it only once.
+//
+// The cache has a budget in bytes. When it is exceeded, frames are evicted by the CLOCK algorithm, an approximation of
+// LRU eviction that needs no exclusive lock when a frame is found: a frame that has been used since the clock hand last
+// passed it gets a second chance. Optionally, the frames that follow a requested frame are expanded in advance by an
+// executor, for tools that step through a stack.
+//
+// Frames are identified by a source (for instance the index of a file) and their index in the source. The function
+// that expands a frame is passed with every request, and is called by other threads when frames are prefetched, so it
+// must be safe to call concurrently. The frames are held by shared pointers, so a frame that is evicted stays valid for
+// the threads that use it.
+//
+//  Frame_cache(std::size_t budget)
+//      Constructs a cache of at most 'budget' bytes of frames, apart from the frames that are in use or being expanded.
+//  Frame_cache(std::size_t budget, Executor& executor, std::size_t prefetch)
+//      Constructs a cache that expands the 'prefetch' frames that follow a requested frame in advance, with tasks
+//      submitted to 'executor' (any object with submit(callable), for instance a Thread_pool). The executor must outlive
+//      the cache; the destructor waits for the prefetches that are in progress.
+//  Frame get(std::uint64_t source, std::size_t frame, std::size_t frames, Expand const& expand)
+//      Returns a frame of a source of 'frames' frames. If the frame is not cached, it is expanded by expand(frame).
+//      Exceptions of 'expand' are passed on, and the frame is not cached.
+//  void clear()
+//      Evicts all frames that are not being expanded.
+//  Statistics statistics()
+//      Returns the number of hits, misses, prefetched frames and evictions, and the number of frames and bytes cached.
+//
+// Example:
+//    Frame_cache cache(1 << 30, pool, 4);
+//    auto const expand = [&trpx](std::size_t const frame) {
+//        auto pixels = std::make_shared<std::vector<std::byte>>(trpx.size() * sizeof(std::uint16_t));
+//        trpx.prolix(reinterpret_cast<std::uint16_t*>(pixels->data()), frame);
+//        return Frame_cache::Frame(std::move(pixels));
+//    };
+//    std::span<std::uint16_t const> const image = Frame_cache::pixels<std::uint16_t>(cache.get(0, 7, trpx.number_of_frames(), expand));
+
+namespace jpa {
+
+/**
+ * @class Frame_cache
+ * @brief A thread-safe cache of expanded frames, with a budget in bytes and optional prefetching.
+ */
+class Frame_cache {
+public:
+    using Frame = std::shared_ptr<std::vector<std::byte> const>;
+    using Expand = std::function<Frame(std::size_t)>;
+
+    /**
+     * @brief The use of the cache since it was constructed, and its content.
+     */
+    struct Statistics {
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t prefetches = 0;
+        std::uint64_t evictions = 0;
+        std::size_t frames = 0;
+        std::size_t bytes = 0;
+    };
+
+    /**
+     * @brief Constructs a cache without prefetching.
+     *
+     * @param budget The maximum number of bytes of cached frames.
+     */
+    explicit Frame_cache(std::size_t const budget) :
+    d_budget(budget) {}
+
+    /**
+     * @brief Constructs a cache that expands the frames that follow a requested frame in advance.
+     *
+     * @tparam Executor Any type with a member function submit(callable).
+     * @param budget The maximum number of bytes of cached frames.
+     * @param executor The executor that expands the frames in advance. It must outlive the cache.
+     * @param prefetch The number of frames that are expanded in advance.
+     */
+    template <typename Executor>
+    Frame_cache(std::size_t const budget, Executor& executor, std::size_t const prefetch) :
+    d_budget(budget),
+    d_submit([&executor](std::function<void()> task) { executor.submit(std::move(task)); }),
+    d_prefetch(prefetch) {}
+
+    Frame_cache(Frame_cache const&) = delete;
+    Frame_cache& operator=(Frame_cache const&) = delete;
+
+    ~Frame_cache() {
+        std::unique_lock lock(d_prefetch_mutex);
+        d_prefetch_done.wait(lock, [this] { return d_prefetching == 0; });
+    }
+
+    /**
+     * @brief Returns a frame, which is expanded if it is not in the cache.
+     *
+     * @param source The source of the frame.
+     * @param frame The index of the frame in its source.
+     * @param frames The number of frames of the source, which limits prefetching.
+     * @param expand The function that expands a frame of the source, given its index.
+     * @return The frame.
+     */
+    Frame get(std::uint64_t const source, std::size_t const frame, std::size_t const frames, Expand const& expand) {
+        Key const key{source, frame};
+        std::shared_future<Frame> cached;
+        {
+            std::shared_lock lock(d_mutex);
+            if (auto const entry = d_entries.find(key); entry != d_entries.end()) {
+                entry->second->referenced.store(true, std::memory_order_relaxed);
+                cached = entry->second->frame;
+            }
+        }
+        if (cached.valid()) {
+            d_hits.fetch_add(1, std::memory_order_relaxed);
+            f_prefetch(source, frame, frames, expand);
+            return cached.get();
+        }
+        std::optional<std::promise<Frame>> promise = f_reserve(key, cached);
+        if (!promise) { // another thread put it in the cache in the meantime
+            d_hits.fetch_add(1, std::memory_order_relaxed);
+            return cached.get();
+        }
+        d_misses.fetch_add(1, std::memory_order_relaxed);
+        f_prefetch(source, frame, frames, expand);
+        return f_expand(key, *promise, expand);
+    }
+
+    /**
+     * @brief Evicts all frames that are not being expanded.
+     */
+    void clear() {
+        std::unique_lock lock(d_mutex);
+        for (auto i = d_clock.begin(); i != d_clock.end(); )
+            i = f_evict(i);
+        d_hand = d_clock.begin();
+    }
+
+    /**
+     * @brief Returns the use of the cache since it was constructed, and its content.
+     */
+    Statistics statistics() const {
+        std::shared_lock lock(d_mutex);
+        return {d_hits.load(), d_misses.load(), d_prefetches.load(), d_evictions.load(), d_entries.size(), d_bytes};
+    }
+
+    /**
+     * @brief Returns the pixels of a frame.
+     *
+     * @tparam T The type of the pixels that the frame was expanded to.
+     */
+    template <typename T>
+    static std::span<T const> pixels(Frame const& frame) noexcept {
+        return {reinterpret_cast<T const*>(frame->data()), frame->size() / sizeof(T)};
+    }
+
+private:
+    struct Key {
+        std::uint64_t source;
+        std::size_t frame;
+        bool operator==(Key const&) const = default;
+    };
+
+    struct Key_hash {
+        std::size_t operator()(Key const& key) const noexcept {
+            return std::hash<std::uint64_t>()(key.source * 0x9e3779b97f4a7c15ull ^ key.frame);
+        }
+    };
+
+    struct Entry {
+        std::shared_future<Frame> frame;
+        std::size_t bytes = 0; // 0 while the frame is being expanded
+        std::atomic<bool> referenced = false;
+        std::list<Key>::iterator clock;
+    };
+
+    std::size_t const d_budget;
+    std::function<void(std::function<void()>)> const d_submit;
+    std::size_t const d_prefetch = 0;
+    mutable std::shared_mutex d_mutex;
+    std::unordered_map<Key, std::unique_ptr<Entry>, Key_hash> d_entries;
+    std::list<Key> d_clock;                       // the cached frames, in the order of the clock
+    std::list<Key>::iterator d_hand = d_clock.end();
+    std::size_t d_bytes = 0;
+    std::atomic<std::uint64_t> d_hits = 0;
+    std::atomic<std::uint64_t> d_misses = 0;
+    std::atomic<std::uint64_t> d_prefetches = 0;
+    std::atomic<std::uint64_t> d_evictions = 0;
+    std::mutex d_prefetch_mutex;
+    std::condition_variable d_prefetch_done;
+    std::size_t d_prefetching = 0;
+
+    // Puts a frame that is to be expanded in the cache, and returns the promise of the frame. If the frame is already
+    // in the cache, returns no promise and sets 'cached' to the frame.
+    std::optional<std::promise<Frame>> f_reserve(Key const& key, std::shared_future<Frame>& cached) {
+        std::unique_lock lock(d_mutex);
+        if (auto const entry = d_entries.find(key); entry != d_entries.end()) {
+            entry->second->referenced.store(true, std::memory_order_relaxed);
+            cached = entry->second->frame;
+            return std::nullopt;
+        }
+        std::promise<Frame> promise;
+        auto entry = std::make_unique<Entry>();
+        entry->frame = promise.get_future().share();
+        entry->clock = d_clock.insert(d_hand, key); // the last frame that the hand reaches
+        d_entries.emplace(key, std::move(entry));
+        return promise;
+    }
+
+    // Expands a frame that has been reserved, and evicts frames if the budget is exceeded.
+    Frame f_expand(Key const& key, std::promise<Frame>& promise, Expand const& expand) {
+        try {
+            Frame const frame = expand(key.frame);
+            promise.set_value(frame);
+            std::unique_lock lock(d_mutex);
+            d_entries.at(key)->bytes = frame->size();
+            d_bytes += frame->size();
+            for (std::size_t steps = 2 * d_clock.size(); d_bytes > d_budget && steps != 0; --steps) {
+                if (d_hand == d_clock.end())
+                    d_hand = d_clock.begin();
+                Entry& entry = *d_entries.at(*d_hand);
+                if (*d_hand == key || entry.bytes == 0 || entry.referenced.exchange(false, std::memory_order_relaxed))
+                    ++d_hand;
+                else
+                    d_hand = f_evict(d_hand);
+            }
+            return frame;
+        }
+        catch (...) {
+            promise.set_exception(std::current_exception());
+            std::unique_lock lock(d_mutex);
+            auto const entry = d_entries.find(key);
+            if (d_hand == entry->second->clock)
+                ++d_hand;
+            d_clock.erase(entry->second->clock);
+            d_entries.erase(entry);
+            throw;
+        }
+    }
+
+    // Evicts the frame at 'i' of the clock, unless it is being expanded, and returns the next position of the clock.
+    std::list<Key>::iterator f_evict(std::list<Key>::iterator const i) {
+        auto const entry = d_entries.find(*i);
+        if (entry->second->bytes == 0)
+            return std::next(i);
+        d_bytes -= entry->second->bytes;
+        d_entries.erase(entry);
+        d_evictions.fetch_add(1, std::memory_order_relaxed);
+        return d_clock.erase(i);
+    }
+
+    // Submits the expansion of the frames that follow 'frame' and are not in the cache.
+    void f_prefetch(std::uint64_t const source, std::size_t const frame, std::size_t const frames, Expand const& expand) {
+        for (std::size_t next = frame + 1; next < std::min(frames, frame + 1 + d_prefetch); ++next) {
+            Key const key{source, next};
+            {
+                std::shared_lock lock(d_mutex);
+                if (d_entries.contains(key))
+                    continue;
+            }
+            std::shared_future<Frame> cached;
+            auto promise = f_reserve(key, cached);
+            if (!promise)
+                continue;
+            {
+                std::lock_guard lock(d_prefetch_mutex);
+                ++d_prefetching;
+            }
+            d_prefetches.fetch_add(1, std::memory_order_relaxed);
+            d_submit([this, key, expand, promise = std::make_shared<std::promise<Frame>>(std::move(*promise))] {
+                try {
+                    f_expand(key, *promise, expand);
+                }
+                catch (...) {
+                    // the frame is not cached, so a request for it expands it again and reports the error
+                }
+                std::lock_guard lock(d_prefetch_mutex);
+                if (--d_prefetching == 0)
+                    d_prefetch_done.notify_all();
+            });
+        }
+    }
+};
+
+} // end namespace jpa
+
+#endif /* Frame_cache_h */
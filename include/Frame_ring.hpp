@@ -0,0 +1,404 @@
+//
+//  Frame_ring.hpp
+//  Frame_ring
+//
+
+#ifndef Frame_ring_h
+#define Frame_ring_h
+
+#include <span>
+#include <array>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <stop_token>
+#include <system_error>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Frame_ring is a lock-free single-producer/multi-consumer ring buffer of frames in POSIX shared memory. It hands
+// frames from a detector readout process to compressing processes without writing them to disk first.
+//
+// The producer creates the ring with a fixed number of slots, each large enough for one frame, and writes frames into
+// consecutive slots. Consumers, in the same or in other processes, claim frames in the order in which they were
+// written; every frame is claimed by exactly one consumer. A consumer keeps the slot of its frame until it releases
+// the frame, so that it can compress it in place, and consumers may release frames in any order.
+//
+// If all slots are in use, the producer either waits until a consumer releases a slot (Policy::block, backpressure on
+// the detector), or drops the frame (Policy::drop). The ring counts written, consumed and dropped frames, and the
+// maximum lag: the largest number of frames that were written but not yet consumed.
+//
+// Waiting, both of the producer for a free slot and of consumers for a new frame, spins briefly and then sleeps for
+// short intervals. Consumers stop waiting once the producer has closed the ring, or has died.
+//
+//  static Frame_ring create(std::string const& name, std::size_t slots, std::size_t slot_size, unsigned pixel_size, bool is_signed)
+//      Creates (or replaces) the ring 'name' with 'slots' slots of 'slot_size' bytes, for pixels of 'pixel_size' bytes.
+//  static Frame_ring open(std::string const& name)
+//      Opens an existing ring. Throws std::system_error if it does not exist.
+//  static void remove(std::string const& name)
+//      Removes the name of the ring; processes that have it open can continue to use it.
+//
+// Producer:
+//  std::span<std::byte> reserve(Policy policy)
+//      Returns the memory of the next free slot, or an empty span if the frame is dropped.
+//  void commit(std::uint64_t number, std::array<std::uint64_t,2> const& dim, std::size_t size)
+//      Publishes the frame in the reserved slot: its acquisition number, dimensions and size in bytes.
+//  bool push(std::span<T const> frame, std::array<std::uint64_t,2> const& dim, std::uint64_t number, Policy policy)
+//      Copies a frame into the ring. Returns false if it was dropped.
+//  void close()
+//      Signals the end of the stream to the consumers.
+//
+// Consumers:
+//  std::optional<Frame_ring::Frame> pop()
+//      Claims the next frame, waiting until it is available. Returns std::nullopt once the ring has been closed (or its
+//      producer has died) and all frames have been claimed. The frame is released when the Frame is destroyed.
+//  std::optional<Frame_ring::Frame> pop(std::stop_token stop)
+//      As pop(), but also returns std::nullopt when a stop has been requested, so that the consumers of a process can
+//      give up, for instance after one of them failed, without waiting for the producer.
+//
+// Common:
+//  Frame_ring::Counters counters()
+//      Returns the written, consumed and dropped frame counts, and the maximum lag.
+//  unsigned pixel_size(), bool is_signed(), std::size_t slots(), std::size_t slot_size()
+//      The properties of the ring.
+//
+// Example:
+//    // The detector readout process
+//    auto ring = Frame_ring::create("/detector", 64, 4096 * 4096 * 2, 2, false);
+//    for (std::uint64_t number = 0; acquiring(); ++number) {
+//        read_out(ring.reserve(Frame_ring::Policy::block));
+//        ring.commit(number, {4096, 4096}, 4096 * 4096 * 2);
+//    }
+//    ring.close();
+//
+//    // A compressing process
+//    auto ring = Frame_ring::open("/detector");
+//    while (auto frame = ring.pop())
+//        compress(frame->data());
+
+namespace jpa {
+
+/**
+ * @class Frame_ring
+ * @brief A lock-free single-producer/multi-consumer ring buffer of frames in POSIX shared memory.
+ */
+class Frame_ring {
+    static constexpr std::uint64_t s_magic = 0x474E495258505254; // "TRPXRING"
+    static constexpr std::size_t s_page = 4096;
+    static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "Frame_ring requires lock-free 64-bit atomics");
+
+    // The layout of the shared memory: a header, the slot headers, and the page-aligned slots.
+    struct Header {
+        std::uint64_t magic;
+        std::uint64_t slots;
+        std::uint64_t slot_size;
+        std::uint32_t pixel_size;
+        std::uint32_t is_signed;
+        pid_t producer;
+        alignas(64) std::atomic<std::uint64_t> written;   // frames published by the producer
+        std::atomic<std::uint64_t> dropped;
+        std::atomic<std::uint64_t> max_lag;
+        std::atomic<std::uint32_t> closed;
+        alignas(64) std::atomic<std::uint64_t> claimed;   // frames claimed by consumers
+        alignas(64) std::atomic<std::uint64_t> consumed;  // frames released by consumers
+    };
+    struct alignas(64) Slot {
+        std::atomic<std::uint64_t> free;   // the index of the next frame that may be written into the slot
+        std::uint64_t number;
+        std::uint64_t dim[2];
+        std::uint64_t size;
+    };
+
+public:
+    enum class Policy { block, drop };
+
+    struct Counters {
+        std::uint64_t written;
+        std::uint64_t consumed;
+        std::uint64_t dropped;
+        std::uint64_t max_lag;
+    };
+
+    /**
+     * @class Frame
+     * @brief A frame claimed by a consumer. Its slot is released when the Frame is destroyed.
+     */
+    class Frame {
+    public:
+        Frame(Frame&& other) noexcept : d_ring(other.d_ring), d_index(other.d_index) { other.d_ring = nullptr; }
+        Frame& operator=(Frame&&) = delete;
+        ~Frame() {
+            if (d_ring != nullptr)
+                d_ring->f_release(d_index);
+        }
+
+        /**
+         * @brief Returns the position of the frame in the stream of written frames, starting at 0.
+         */
+        std::uint64_t index() const noexcept { return d_index; }
+
+        /**
+         * @brief Returns the acquisition number that the producer gave the frame.
+         */
+        std::uint64_t number() const noexcept { return f_slot().number; }
+
+        /**
+         * @brief Returns the dimensions of the frame.
+         */
+        std::array<std::uint64_t,2> dim() const noexcept { return {f_slot().dim[0], f_slot().dim[1]}; }
+
+        /**
+         * @brief Returns the pixels of the frame.
+         */
+        std::span<std::byte const> data() const noexcept { return {d_ring->f_data(d_index), f_slot().size}; }
+
+    private:
+        friend class Frame_ring;
+        Frame(Frame_ring* const ring, std::uint64_t const index) noexcept : d_ring(ring), d_index(index) {}
+        Slot const& f_slot() const noexcept { return d_ring->f_slot(d_index); }
+        Frame_ring* d_ring;
+        std::uint64_t d_index;
+    };
+
+    /**
+     * @brief Creates a ring, replacing an existing ring with the same name.
+     *
+     * @param name The name of the shared memory object, for instance "/detector".
+     * @param slots The number of slots.
+     * @param slot_size The maximum size of a frame in bytes.
+     * @param pixel_size The number of bytes per pixel.
+     * @param is_signed Whether pixels are signed.
+     * @return The ring, opened as its producer.
+     */
+    static Frame_ring create(std::string const& name, std::size_t const slots, std::size_t const slot_size, unsigned const pixel_size, bool const is_signed) {
+        if (slots == 0 || pixel_size == 0)
+            throw std::invalid_argument("a Frame_ring requires at least one slot and a pixel size");
+        shm_unlink(name.c_str());
+        int const fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), "creating ring \"" + name + "\"");
+        std::size_t const size = f_data_offset(slots) + slots * f_stride(slot_size);
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            int const error = errno;
+            ::close(fd);
+            shm_unlink(name.c_str());
+            throw std::system_error(error, std::generic_category(), "sizing ring \"" + name + "\"");
+        }
+        Frame_ring ring(fd, size, name);
+        ring.d_header = new (ring.d_memory) Header{s_magic, slots, slot_size, pixel_size, is_signed, getpid(), {}, {}, {}, {}, {}, {}};
+        for (std::size_t i = 0; i != slots; ++i)
+            new (&ring.f_slot(i)) Slot{{i}, 0, {0, 0}, 0};
+        return ring;
+    }
+
+    /**
+     * @brief Opens an existing ring.
+     *
+     * @param name The name of the shared memory object.
+     * @return The ring.
+     */
+    static Frame_ring open(std::string const& name) {
+        int const fd = shm_open(name.c_str(), O_RDWR, 0);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0)
+            throw std::system_error(errno, std::generic_category(), "opening ring \"" + name + "\"");
+        Frame_ring ring(fd, static_cast<std::size_t>(st.st_size), name);
+        ring.d_header = static_cast<Header*>(ring.d_memory);
+        if (ring.d_size < sizeof(Header) || ring.d_header->magic != s_magic ||
+            ring.d_size < f_data_offset(ring.d_header->slots) + ring.d_header->slots * f_stride(ring.d_header->slot_size))
+            throw std::runtime_error("\"" + name + "\" is not a frame ring");
+        return ring;
+    }
+
+    /**
+     * @brief Removes the name of a ring.
+     *
+     * @param name The name of the shared memory object.
+     */
+    static void remove(std::string const& name) noexcept { shm_unlink(name.c_str()); }
+
+    Frame_ring(Frame_ring&& other) noexcept : d_memory(other.d_memory), d_size(other.d_size), d_header(other.d_header), d_name(std::move(other.d_name)) {
+        other.d_memory = nullptr;
+    }
+    Frame_ring& operator=(Frame_ring&&) = delete;
+    ~Frame_ring() {
+        if (d_memory != nullptr)
+            munmap(d_memory, d_size);
+    }
+
+    /**
+     * @brief Reserves the next slot for the producer.
+     *
+     * @param policy Whether to wait for a free slot, or to drop the frame if all slots are in use.
+     * @return The memory of the slot, or an empty span if the frame has been dropped.
+     */
+    std::span<std::byte> reserve(Policy const policy) {
+        std::uint64_t const index = d_header->written.load(std::memory_order_relaxed);
+        Slot& slot = f_slot(index);
+        for (unsigned spins = 0; slot.free.load(std::memory_order_acquire) != index; ++spins) {
+            if (policy == Policy::drop) {
+                d_header->dropped.fetch_add(1, std::memory_order_relaxed);
+                return {};
+            }
+            f_backoff(spins);
+        }
+        return {f_data(index), d_header->slot_size};
+    }
+
+    /**
+     * @brief Publishes the frame in the reserved slot to the consumers.
+     *
+     * @param number The acquisition number of the frame.
+     * @param dim The dimensions of the frame.
+     * @param size The size of the frame in bytes; at most slot_size().
+     */
+    void commit(std::uint64_t const number, std::array<std::uint64_t,2> const& dim, std::size_t const size) {
+        if (size > d_header->slot_size)
+            throw std::length_error("frame larger than the slots of the ring");
+        std::uint64_t const index = d_header->written.load(std::memory_order_relaxed);
+        Slot& slot = f_slot(index);
+        slot.number = number;
+        slot.dim[0] = dim[0];
+        slot.dim[1] = dim[1];
+        slot.size = size;
+        d_header->written.store(index + 1, std::memory_order_release);
+        std::uint64_t const lag = index + 1 - d_header->consumed.load(std::memory_order_relaxed);
+        if (lag > d_header->max_lag.load(std::memory_order_relaxed))
+            d_header->max_lag.store(lag, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Copies a frame into the ring.
+     *
+     * @tparam T The pixel type; its size must be pixel_size().
+     * @param frame The pixels of the frame.
+     * @param dim The dimensions of the frame.
+     * @param number The acquisition number of the frame.
+     * @param policy Whether to wait for a free slot, or to drop the frame if all slots are in use.
+     * @return True if the frame was written, false if it was dropped.
+     */
+    template <typename T>
+    bool push(std::span<T const> const frame, std::array<std::uint64_t,2> const& dim, std::uint64_t const number, Policy const policy = Policy::block) {
+        if (sizeof(T) != d_header->pixel_size)
+            throw std::invalid_argument("pixel type does not match the ring");
+        std::span<std::byte> const slot = reserve(policy);
+        if (slot.empty())
+            return false;
+        if (frame.size_bytes() > slot.size())
+            throw std::length_error("frame larger than the slots of the ring");
+        std::memcpy(slot.data(), frame.data(), frame.size_bytes());
+        commit(number, dim, frame.size_bytes());
+        return true;
+    }
+
+    /**
+     * @brief Signals the end of the stream. Consumers finish the frames that have been written.
+     */
+    void close() noexcept { d_header->closed.store(1, std::memory_order_release); }
+
+    /**
+     * @brief Claims the next frame.
+     *
+     * @return The frame, or std::nullopt at the end of the stream.
+     */
+    std::optional<Frame> pop() { return pop(std::stop_token()); }
+
+    /**
+     * @brief Claims the next frame, unless a stop is requested.
+     *
+     * @param stop Returns without a frame once a stop has been requested, also while waiting for a frame.
+     * @return The frame, or std::nullopt at the end of the stream or when a stop has been requested.
+     */
+    std::optional<Frame> pop(std::stop_token const stop) {
+        std::uint64_t index = d_header->claimed.load(std::memory_order_relaxed);
+        for (unsigned spins = 0; ; ++spins) {
+            if (stop.stop_requested())
+                return std::nullopt;
+            if (index < d_header->written.load(std::memory_order_acquire)) {
+                if (d_header->claimed.compare_exchange_weak(index, index + 1, std::memory_order_acquire, std::memory_order_relaxed))
+                    return Frame(this, index);
+                continue;
+            }
+            bool const closed = d_header->closed.load(std::memory_order_acquire) != 0 ||
+                                (spins % 1024 == 1023 && kill(d_header->producer, 0) != 0 && errno == ESRCH);
+            if (closed && index >= d_header->written.load(std::memory_order_acquire))
+                return std::nullopt;
+            f_backoff(spins);
+            index = d_header->claimed.load(std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief Returns the frame counters of the ring.
+     *
+     * @return The counters.
+     */
+    Counters counters() const noexcept {
+        return {d_header->written.load(std::memory_order_relaxed), d_header->consumed.load(std::memory_order_relaxed),
+                d_header->dropped.load(std::memory_order_relaxed), d_header->max_lag.load(std::memory_order_relaxed)};
+    }
+
+    unsigned pixel_size() const noexcept { return d_header->pixel_size; }
+    bool is_signed() const noexcept { return d_header->is_signed != 0; }
+    std::size_t slots() const noexcept { return d_header->slots; }
+    std::size_t slot_size() const noexcept { return d_header->slot_size; }
+    std::string const& name() const noexcept { return d_name; }
+
+private:
+    void* d_memory;
+    std::size_t d_size;
+    Header* d_header = nullptr;
+    std::string d_name;
+
+    Frame_ring(int const fd, std::size_t const size, std::string const& name) : d_size(size), d_name(name) {
+        d_memory = mmap(nullptr, d_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        int const error = errno;
+        ::close(fd);
+        if (d_memory == MAP_FAILED) {
+            d_memory = nullptr;
+            throw std::system_error(error, std::generic_category(), "mapping ring \"" + name + "\"");
+        }
+    }
+
+    static std::size_t f_data_offset(std::size_t const slots) noexcept {
+        return (sizeof(Header) + slots * sizeof(Slot) + s_page - 1) / s_page * s_page;
+    }
+
+    static std::size_t f_stride(std::size_t const slot_size) noexcept {
+        return (slot_size + s_page - 1) / s_page * s_page;
+    }
+
+    Slot& f_slot(std::uint64_t const index) const noexcept {
+        static_assert(sizeof(Header) % alignof(Slot) == 0);
+        return reinterpret_cast<Slot*>(static_cast<std::byte*>(d_memory) + sizeof(Header))[index % d_header->slots];
+    }
+
+    std::byte* f_data(std::uint64_t const index) const noexcept {
+        return static_cast<std::byte*>(d_memory) + f_data_offset(d_header->slots) + (index % d_header->slots) * f_stride(d_header->slot_size);
+    }
+
+    void f_release(std::uint64_t const index) noexcept {
+        f_slot(index).free.store(index + d_header->slots, std::memory_order_release);
+        d_header->consumed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static void f_backoff(unsigned const spins) {
+        if (spins < 64)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(spins < 1024 ? 20 : 200));
+    }
+};
+
+} // end namespace jpa
+
+#endif /* Frame_ring_h */
@@ -16,6 +16,11 @@
 #include <cassert>
 #include <type_traits>
 #include <algorithm>
+#include <bit>
+#include <limits>
+#include <thread>
+#include <cstring>
+#include "Pixel_kernels.hpp"
 
 // DISCLAIMER: This is not a general-purpose TIFF library!
 
@@ -34,12 +39,13 @@ namespace jpa {
  * - Accommodating images with varying types and sizes.
  * - Support for signed and unsigned integral values, and float and double values.
  * - Flexible bit depths: 8, 16, 32, or (for double precision values) 64 bits.
+ * - Reads classic TIFF and BigTIFF files; stacks that grow beyond 4 GB are converted to BigTIFF automatically.
+ * - Reads images that are stored in several strips in any order, or in tiles; their pixels are assembled on reading.
  * - Accomodates raw TIFF data with runtinme pixel type identification.
  * - Allows regularizing pixel types to a compile-time determined type.
  * - The first (or only) image managed by a Grey_tif object is directly available as a readonly std::span
  *
  * Limitations: Grey_tif does not support:
- * - TIFF files with fragmented images.
  * - TIFF files with single-bit (black & white) or color images.
  * - TIFF files that contain compressed images.
  *
@@ -49,7 +55,9 @@ namespace jpa {
  * - clear(): remove all images.
  * - swap(): swap image contants with another Grey_tif object, reacsting the pixel types of both Grey_tif containers if required.
  * - image_stack_size(): get the number of images managed by the Grey_tif object.
- * - push_back(): append one or more images from an STL container or other Grey_tif object.
+ * - push_back(): append one or more images from an STL container or other Grey_tif object, in amortized constant time per image.
+ * - reserve(): reserve memory for images that will be appended; raw_data_size() returns the size of a stack before it is built.
+ * - is_big(): returns true if the TIFF data are in BigTIFF format (64-bit offsets).
  * - const_image(): returns a const Grey_tif_image from the tif stack for readonly access to images form a TIFF stack.
  * - image(): returns a Grey_tif_image object for read/write access to images form a TIFF stack.
  *
@@ -119,6 +127,7 @@ namespace jpa {
  * @tparam T The default / assumed pixel data type (default: std::uint16_t).
  */
 template <typename T = std::uint16_t> class Grey_tif;
+class Grey_tif_map;
 
 /**
  * @brief POD_type_traits represents traits information about Plain Old Data (POD) types.
@@ -164,6 +173,113 @@ struct POD_type_traits {
     }
 };
 
+/**
+ * @brief The location of the pixels of an image in a TIFF file: in strips of rows, or in tiles.
+ *
+ * An image may be stored in one strip, in several strips in any order, or in tiles of which the rows are padded to
+ * the tile width. gather() copies the pixels into a contiguous image, using several threads for large images.
+ */
+struct Grey_tif_layout {
+    POD_type_traits type;
+    std::array<long,2> dim = {0, 0};        ///< The width and height of the image.
+    std::vector<std::uint64_t> offsets;     ///< The offsets of the strips or tiles in the file.
+    std::uint64_t rows_per_strip = 0;       ///< The number of rows per strip; 0 for one strip.
+    std::array<long,2> tile = {0, 0};       ///< The width and length of the tiles; zero for strips.
+    
+    /**
+     * @brief Returns true if the pixels are stored in tiles.
+     */
+    bool tiled() const noexcept { return tile[0] != 0; }
+    
+    /**
+     * @brief Returns the number of bytes of the pixels of the image.
+     */
+    std::size_t bytes() const noexcept { return static_cast<std::size_t>(dim[0]) * static_cast<std::size_t>(dim[1]) * type.size; }
+    
+    /**
+     * @brief Returns the number of strips or tiles of the image.
+     */
+    std::size_t pieces() const noexcept {
+        if (tiled())
+            return ((dim[0] + tile[0] - 1) / tile[0]) * ((dim[1] + tile[1] - 1) / tile[1]);
+        return (dim[1] + f_rows() - 1) / f_rows();
+    }
+    
+    /**
+     * @brief Returns true if the pixels form one block, starting at offsets[0], so that they need not be gathered.
+     */
+    bool contiguous() const noexcept {
+        if (tiled())
+            return false;
+        for (std::size_t i = 0; i + 1 < pieces(); ++i)
+            if (offsets[i + 1] != offsets[i] + f_piece_bytes(i))
+                return false;
+        return true;
+    }
+    
+    /**
+     * @brief Returns true if all strips or tiles lie within a file of 'size' bytes.
+     */
+    bool fits(std::uint64_t const size) const noexcept {
+        if (type.size == 0 || dim[0] <= 0 || dim[1] <= 0 || (tiled() && tile[1] <= 0) || offsets.size() < pieces())
+            return false;
+        for (std::size_t i = 0; i != pieces(); ++i)
+            if (offsets[i] + f_piece_bytes(i) > size)
+                return false;
+        return true;
+    }
+    
+    /**
+     * @brief Copies the pixels from the strips or tiles into a contiguous image.
+     *
+     * @param file The TIFF file, at offset 0.
+     * @param pixels The destination, of bytes() bytes.
+     * @param threads The maximum number of threads; 0 for a number that depends on the size of the image.
+     */
+    void gather(std::byte const* const file, std::byte* const pixels, std::size_t threads = 0) const {
+        if (threads == 0)
+            threads = std::min<std::size_t>(std::max(1u, std::thread::hardware_concurrency()), bytes() / pixel_kernels::s_bytes_per_thread + 1);
+        threads = std::min(threads, pieces());
+        std::vector<std::thread> workers;
+        for (std::size_t t = 1; t < threads; ++t)
+            workers.emplace_back([=, this] { f_gather(file, pixels, t * pieces() / threads, (t + 1) * pieces() / threads); });
+        f_gather(file, pixels, 0, pieces() / std::max<std::size_t>(threads, 1));
+        for (auto& worker : workers)
+            worker.join();
+    }
+    
+private:
+    std::size_t f_rows() const noexcept {
+        return rows_per_strip == 0 || rows_per_strip > static_cast<std::uint64_t>(dim[1]) ? dim[1] : rows_per_strip;
+    }
+    
+    // The number of bytes of a strip (the last may have fewer rows) or a (padded) tile.
+    std::size_t f_piece_bytes(std::size_t const i) const noexcept {
+        if (tiled())
+            return static_cast<std::size_t>(tile[0]) * static_cast<std::size_t>(tile[1]) * type.size;
+        std::size_t const rows = std::min<std::size_t>(f_rows(), dim[1] - i * f_rows());
+        return rows * dim[0] * type.size;
+    }
+    
+    void f_gather(std::byte const* const file, std::byte* const pixels, std::size_t const first, std::size_t const last) const {
+        std::size_t const row_bytes = dim[0] * type.size;
+        if (!tiled()) {
+            for (std::size_t i = first; i != last; ++i)
+                std::memcpy(pixels + i * f_rows() * row_bytes, file + offsets[i], f_piece_bytes(i));
+            return;
+        }
+        std::size_t const across = (dim[0] + tile[0] - 1) / tile[0];
+        for (std::size_t i = first; i != last; ++i) {
+            std::size_t const x = i % across * tile[0];
+            std::size_t const y = i / across * tile[1];
+            std::size_t const width = std::min<std::size_t>(tile[0], dim[0] - x) * type.size;
+            std::size_t const rows = std::min<std::size_t>(tile[1], dim[1] - y);
+            for (std::size_t row = 0; row != rows; ++row)
+                std::memcpy(pixels + (y + row) * row_bytes + x * type.size, file + offsets[i] + row * tile[0] * type.size, width);
+        }
+    }
+};
+
 /**
  * @brief API to an image managed by a regularized Grey_tif object with a compile time defined pixel type.
  *
@@ -179,6 +295,7 @@ class Grey_tif_image : public std::span<T> {
     
     template <typename TG> friend class Grey_tif;
     template <typename TG> friend class Grey_tif_image;
+    friend class Grey_tif_map;
     
 public:
     
@@ -264,6 +381,9 @@ template<typename T> requires std::is_same_v<std::remove_const_t<T>, std::byte>
 class Grey_tif_image<T> {
     
     template <typename TG> friend class Grey_tif;
+    friend class Grey_tif_map;
+    friend class Mrc_map;
+    friend class Npy_map;
     
 public:
     /**
@@ -368,12 +488,27 @@ public:
         d_tif.resize(fileSize);
         if (!is.read(reinterpret_cast<char*>(d_tif.data()), fileSize) ||
             (d_tif[0] != std::byte('I') && d_tif[0] != std::byte('M')) ||
-            d_tif[0] != d_tif[1] || std::byte(42) != (d_tif[0] == std::byte('I') ? d_tif[2] : d_tif[3]) )
+            d_tif[0] != d_tif[1] || !f_is_tiff_version(d_tif[0] == std::byte('I') ? d_tif[2] : d_tif[3]) )
             is.setstate(std::ios::failbit);
         else
             f_scan_images();
     }
     
+    /**
+     * @brief Constructor for Grey_tif that takes ownership of the contents of a TIFF file.
+     *
+     * Avoids copying when the TIFF file has already been read into memory.
+     *
+     * @param tif The complete contents of a TIFF file.
+     */
+    Grey_tif(std::vector<std::byte>&& tif) : Grey_tif() {
+        if (tif.size() < 8 || (tif[0] != std::byte('I') && tif[0] != std::byte('M')) ||
+            tif[0] != tif[1] || !f_is_tiff_version(tif[0] == std::byte('I') ? tif[2] : tif[3]))
+            throw std::runtime_error("Not a TIFF file\n");
+        d_tif = std::move(tif);
+        f_scan_images();
+    }
+    
     /**
      * @brief swapping the contents of two TIFF stacks
      *
@@ -382,7 +517,6 @@ public:
      */
     template <typename Tother>
     void swap(Grey_tif<Tother>&& other) {
-        d_last_ifd_offset = other.d_last_ifd_offset = 4;
          std::swap(d_tif, other.d_tif);
         f_scan_images();
         other.f_scan_images();
@@ -457,6 +591,58 @@ public:
      */
     std::size_t raw_data_size() const noexcept {return d_tif.size();}
     
+    /**
+     * @brief Get the number of bytes of the TIFF data of a stack, before it is built.
+     *
+     * @param images The number of images in the stack.
+     * @param dim The dimensions of the images.
+     * @param pixel_size The number of bytes per pixel.
+     * @return The number of bytes of the TIFF data of a Grey_tif object to which the images are appended with push_back();
+     * BigTIFF data if classic TIFF data would exceed 4 GB.
+     */
+    static std::size_t raw_data_size(std::size_t const images, std::array<long,2> const& dim, std::size_t const pixel_size = sizeof(T)) noexcept {
+        std::size_t const data_size = dim[0] * dim[1] * pixel_size;
+        std::size_t const size = 8 + images * (data_size + (data_size & 1) + s_ifd_size[0]);
+        if (size <= std::numeric_limits<std::uint32_t>::max())
+            return size;
+        return 16 + images * (data_size + (data_size & 1) + s_ifd_size[1]);
+    }
+    
+    /**
+     * @brief Returns true if the TIFF data are in BigTIFF format, with 64-bit offsets.
+     *
+     * @return True for BigTIFF data, false for classic TIFF data.
+     */
+    bool is_big() const noexcept {return d_big;}
+    
+    /**
+     * @brief Reserves memory for images that will be appended, so that appending them does not move the TIFF data.
+     *
+     * If the TIFF data would exceed 4 GB, they are converted to BigTIFF now, rather than when they grow past 4 GB.
+     *
+     * @param images The number of images that will be appended.
+     * @param dim The dimensions of the images.
+     * @param pixel_size The number of bytes per pixel (for a raw Grey_tif<std::byte> object, the size of the pixel type).
+     * @return A reference to this Grey_tif object.
+     */
+    Grey_tif& reserve(std::size_t const images, std::array<long,2> const& dim, std::size_t const pixel_size = sizeof(T)) {
+        std::size_t const bytes = raw_data_size(images, dim, pixel_size) + 1;
+        if (!d_big && d_tif.size() + bytes > std::numeric_limits<std::uint32_t>::max())
+            f_make_big(bytes);
+        else
+            f_reserve(d_tif.size() + bytes - 8);
+        d_img.reserve(d_img.size() + images);
+        d_img_const.reserve(d_img_const.size() + images);
+        return *this;
+    }
+    
+    /**
+     * @brief Get the TIFF data, as they would be written by write().
+     *
+     * @return A view of the bytes of the TIFF data.
+     */
+    std::span<std::byte const> raw_data() const noexcept {return d_tif;}
+    
     /**
      * @brief Write the TIFF data to an output stream.
      *
@@ -504,36 +690,26 @@ public:
             static_assert ((std::is_arithmetic_v<CT> && sizeof(CT) <= 8 && !std::is_same_v<CT, bool> && !(sizeof(CT) == 8 && std::is_integral_v<CT>)) ||
                            std::is_same_v<float, CT> || std::is_same_v<double, CT>);
             assert(container.size() == dim[0] * dim[1]);
-            assert((d_tif.size() + dim[0] * dim[1] + 6 * 12 + 4) < std::numeric_limits<uint32_t>::max());
-            std::uint32_t index = static_cast<uint32_t>(d_tif.size());
-            std::uint32_t data_start = index;
-            if constexpr (std::is_same_v<T, std::byte>) {
-                d_tif.resize(d_tif.size() + dim[0] * dim[1] * sizeof(CT) + 7 * 12 + 6);
-                for (auto const val : container) {
-                    reinterpret_cast<CT&>(d_tif[index]) = static_cast<CT>(val);
-                    index += sizeof(CT);
-                }
-            }
-            else {
-                d_tif.resize(d_tif.size() + dim[0] * dim[1] * sizeof(T) + 7 * 12 + 6);
-                for (auto const val : container) {
-                    reinterpret_cast<T&>(d_tif[index]) = static_cast<T>(val);
-                    index += sizeof(T);
-                }
-            }
-            if ((d_tif.size() & 1) == 1) {
-                d_tif.push_back(std::byte(0));
-                ++index;
+            using PT = std::conditional_t<std::is_same_v<T, std::byte>, CT, T>; // the pixel type in the TIFF data
+            std::size_t const data_size = dim[0] * dim[1] * sizeof(PT);
+            f_fit(data_size);
+            std::size_t index = d_tif.size();
+            std::size_t const data_start = index;
+            f_grow(f_image_bytes(data_size));
+            for (auto const val : container) {
+                reinterpret_cast<PT&>(d_tif[index]) = static_cast<PT>(val);
+                index += sizeof(PT);
             }
-            reinterpret_cast<std::uint32_t&>(d_tif[d_last_ifd_offset]) = index;
-            reinterpret_cast<std::uint16_t&>(d_tif[index]) = 7;
-            index += 2;
+            index += index & 1; // the IFD starts on a word boundary
+            f_set_offset(d_last_ifd_offset, index);
+            std::size_t const ifd = index;
+            f_set_tag_count(index, 7);
             f_set_ifd(index, 0x0100, 3, static_cast<uint32_t>(dim[1]));
             f_set_ifd(index, 0x0101, 3, static_cast<uint32_t>(dim[0]));
             f_set_ifd(index, 0x0102, 3, 8 * (std::is_same_v<std::byte, T> ? sizeof(CT) : sizeof(T)));
             f_set_ifd(index, 0x0103, 3, 1);
             f_set_ifd(index, 0x0106, 3, 1);
-            f_set_ifd(index, 0x0111, 4, data_start);
+            f_set_ifd(index, 0x0111, d_big ? 16 : 4, data_start);
             if constexpr (std::is_same_v<std::byte, T>) {
                 if (std::is_unsigned_v<CT> )
                     f_set_ifd(index, 0x0153, 3, 1);
@@ -550,9 +726,8 @@ public:
                 else if (std::is_floating_point_v<T>)
                     f_set_ifd(index, 0x0153, 3, 3);
             }
-            d_tif[index] = d_tif[index + 1] = d_tif[index + 2] = d_tif[index + 3] = std::byte(0);
-            d_last_ifd_offset = static_cast<uint32_t>(index);
-            f_scan_images();
+            f_set_offset(index, 0);
+            f_append_image(ifd);
         }
     }
     
@@ -582,7 +757,9 @@ public:
     }
     
 private:
-    std::uint32_t d_last_ifd_offset = 0; // location of the last tif tag
+    std::uint64_t d_last_ifd_offset = 0; // location of the offset of the next IFD in the last IFD
+    bool d_big = false; // BigTIFF: 64-bit offsets and counts
+    static constexpr std::size_t s_ifd_size[2] = {2 + 7 * 12 + 4, 8 + 7 * 20 + 8}; // IFDs with 7 tags, classic and BigTIFF
     std::vector<std::byte> d_tif; // raw tiff data as std::byte
     std::vector<Grey_tif_image<T>> d_img; // vector of images that retrieve their pixel values from d_tif
     std::vector<Grey_tif_image<T const>> d_img_const; // vector of images that retrieve their pixel values from d_tif
@@ -599,29 +776,115 @@ private:
     
     // Push_back an all-zero image of the specified type
     void f_push_back(std::array<long,2> const& dim, POD_type_traits const& new_type) {
-        assert((d_tif.size() + dim[0] * dim[1] + 6 * 12 + 4) < std::numeric_limits<uint32_t>::max());
+        std::size_t const data_size = dim[0] * dim[1] * new_type.size;
         assert((this->type().template is<T>() || std::is_same_v<T, std::byte>));
-        std::uint32_t index = static_cast<uint32_t>(d_tif.size());
-        std::uint32_t data_start = index;
-        d_tif.resize(d_tif.size() + dim[0] * dim[1] * new_type.size + 7 * 12 + 6);
-        index += dim[0] * dim[1] * new_type.size;
-        if ((d_tif.size() & 1) == 1) {
-            d_tif.push_back(std::byte(0));
-            ++index;
-        }
-        reinterpret_cast<std::uint32_t&>(d_tif[d_last_ifd_offset]) = index;
-        reinterpret_cast<std::uint16_t&>(d_tif[index]) = 7;
-        index += 2;
+        f_fit(data_size);
+        std::size_t index = d_tif.size();
+        std::size_t const data_start = index;
+        f_grow(f_image_bytes(data_size));
+        index += data_size;
+        index += index & 1; // the IFD starts on a word boundary
+        f_set_offset(d_last_ifd_offset, index);
+        std::size_t const ifd = index;
+        f_set_tag_count(index, 7);
         f_set_ifd(index, 0x0100, 3, static_cast<uint32_t>(dim[0]));
         f_set_ifd(index, 0x0101, 3, static_cast<uint32_t>(dim[1]));
         f_set_ifd(index, 0x0102, 3, 8 * static_cast<uint32_t>(new_type.size));
         f_set_ifd(index, 0x0103, 3, 1);
         f_set_ifd(index, 0x0106, 3, 1);
-        f_set_ifd(index, 0x0111, 4, data_start);
+        f_set_ifd(index, 0x0111, d_big ? 16 : 4, data_start);
         f_set_ifd(index, 0x0153, 3, new_type.is_integral ? (!new_type.is_signed ? 1 : 2) : 3);
-        d_tif[index] = d_tif[index + 1] = d_tif[index + 2] = d_tif[index + 3] = std::byte(0);
-        d_last_ifd_offset = static_cast<uint32_t>(index);
-        f_scan_images();
+        f_set_offset(index, 0);
+        f_append_image(ifd);
+    }
+    
+    // Converts the TIFF data to BigTIFF if appending an image with 'data_size' bytes of pixels would make them exceed 4 GB.
+    void f_fit(std::size_t const data_size) {
+        if (!d_big && d_tif.size() + f_image_bytes(data_size) > std::numeric_limits<std::uint32_t>::max())
+            f_make_big(f_image_bytes(data_size) + s_ifd_size[1]);
+    }
+    
+    // Rewrites the TIFF data as BigTIFF data, with room for 'extra_bytes' more.
+    void f_make_big(std::size_t const extra_bytes) {
+        Grey_tif big;
+        big.d_tif.resize(16);
+        big.d_tif[0] = big.d_tif[1] = d_tif[0];
+        reinterpret_cast<std::uint16_t&>(big.d_tif[2]) = 43;
+        reinterpret_cast<std::uint16_t&>(big.d_tif[4]) = 8;
+        big.d_last_ifd_offset = 8;
+        big.d_big = true;
+        std::size_t bytes = 16;
+        for (auto const& img : d_img_const)
+            bytes += f_image_bytes(img.dim()[0] * img.dim()[1] * img.type().size) - s_ifd_size[0] + s_ifd_size[1] + 1;
+        big.f_reserve(bytes + extra_bytes);
+        for (std::size_t i = 0; i != d_img_const.size(); ++i) {
+            big.f_push_back(d_img_const[i].dim(), d_img_const[i].type());
+            std::size_t const size = d_img_const[i].dim()[0] * d_img_const[i].dim()[1] * d_img_const[i].type().size;
+            if constexpr (std::is_same_v<T, std::byte>)
+                std::copy_n(d_img_const[i].d_data, size, big.d_img[i].d_data);
+            else
+                std::copy_n(reinterpret_cast<std::byte const*>(d_img_const[i].data()), size, reinterpret_cast<std::byte*>(big.d_img[i].data()));
+        }
+        d_tif = std::move(big.d_tif); // moving the vectors keeps the pixels of the images in place
+        d_img = std::move(big.d_img);
+        d_img_const = std::move(big.d_img_const);
+        d_last_ifd_offset = big.d_last_ifd_offset;
+        d_big = true;
+    }
+    
+    // The number of bytes that appending an image with 'data_size' bytes of pixels adds: the pixels, a padding byte
+    // if the IFD would not start on a word boundary, and the IFD with 7 tags (classic TIFF or BigTIFF).
+    std::size_t f_image_bytes(std::size_t const data_size) const noexcept {
+        return data_size + ((d_tif.size() + data_size) & 1) + s_ifd_size[d_big];
+    }
+    
+    // Appends 'bytes' zero bytes to the TIFF data. If the data do not fit in the capacity, the capacity is at least
+    // doubled, so that appending N images takes O(N) time.
+    void f_grow(std::size_t const bytes) {
+        std::size_t const size = d_tif.size() + bytes;
+        if (size > d_tif.capacity())
+            f_reserve(std::max(size, 2 * d_tif.capacity()));
+        d_tif.resize(size);
+    }
+    
+    // Reserves memory for the TIFF data. If that moves the data, the image spans are moved along.
+    void f_reserve(std::size_t const capacity) {
+        if (capacity <= d_tif.capacity())
+            return;
+        std::byte const* const old_data = d_tif.data();
+        std::vector<std::size_t> offsets;
+        offsets.reserve(d_img_const.size());
+        for (auto const& img : d_img_const) {
+            if constexpr (std::is_same_v<T, std::byte>)
+                offsets.push_back(img.d_data - old_data);
+            else
+                offsets.push_back(reinterpret_cast<std::byte const*>(img.data()) - old_data);
+        }
+        d_tif.reserve(capacity);
+        for (std::size_t i = 0; i != offsets.size(); ++i) {
+            std::size_t const size = d_img[i].dim()[0] * d_img[i].dim()[1];
+            d_img[i] = Grey_tif_image<T>(d_img[i].type(), d_img[i].dim(), std::span<T>(reinterpret_cast<T*>(&d_tif[offsets[i]]), size));
+            d_img_const[i] = Grey_tif_image<T const>(d_img_const[i].type(), d_img_const[i].dim(), std::span<T const>(reinterpret_cast<T const*>(&d_tif[offsets[i]]), size));
+        }
+        if (!d_img.empty())
+            f_set_first_image();
+    }
+    
+    // Adds the image of the IFD at 'ifd', that has just been appended, without scanning the other IFDs again.
+    void f_append_image(std::uint64_t ifd) {
+        f_add_image(f_make_Image<true>(ifd));
+        if (d_img.size() == 1)
+            f_set_first_image();
+    }
+    
+    // The Grey_tif object itself is a view of its first image.
+    void f_set_first_image() {
+        if constexpr(!std::is_same_v<T, std::byte>)
+            std::span<T const>::operator=(d_img_const[0]);
+        else
+            this->d_data = d_img_const[0].d_data;
+        this->d_dim = d_img[0].dim();
+        this->d_image_type = d_img[0].type();
     }
     
     Grey_tif& f_regularize() noexcept {
@@ -634,37 +897,24 @@ private:
             for (auto it = d_img.begin() + 1; it != d_img.end() && same_size == true; ++it)
                 same_size = it->type().size == new_type.size;
             if (same_size) {
+                // Converted in place by the pixel kernels
                 for (auto& img : d_img) {
-                    if (!new_type.is_integral && img.type().is_integral && img.type().is_signed)
-                        for (auto& pixel : img)
-                            reinterpret_cast<float&>(pixel) = static_cast<float>(reinterpret_cast<int&>(pixel));
-                    else if (!new_type.is_integral && img.type().is_integral && !img.type().is_signed)
-                        for (auto& pixel : img)
-                            reinterpret_cast<float&>(pixel) = static_cast<float>(reinterpret_cast<unsigned int&>(pixel));
-                    else if (new_type.is_integral && new_type.is_signed && !img.type().is_integral)
-                        for (auto& pixel : img)
-                            reinterpret_cast<std::int32_t&>(pixel) = static_cast<int>(reinterpret_cast<float&>(pixel));
-                    else if (new_type.is_integral && !new_type.is_signed && !img.type().is_integral)
-                        for (auto& pixel : img)
-                            reinterpret_cast<std::uint32_t&>(pixel) = static_cast<int>(reinterpret_cast<float&>(pixel));
+                    std::byte* const pixels = reinterpret_cast<std::byte*>(img.data());
+                    f_convert(pixels, img.type(), pixels, img.dim()[0] * img.dim()[1]);
                     img = Grey_tif_image(new_type, img.dim(), img);
                 }
             }
             else {
                 Grey_tif new_tif;
-                for (int i=0; i != image_stack_size(); ++i) {
+                std::size_t bytes = 16;
+                for (auto const& img : d_img)
+                    bytes += img.dim()[0] * img.dim()[1] * new_type.size + 1 + s_ifd_size[1];
+                new_tif.f_reserve(bytes); // appending the images does not move the data
+                for (std::size_t i=0; i != image_stack_size(); ++i) {
                     new_tif.f_push_back(image(i).dim(), new_type);
-                    POD_type_traits const& old_type = image(i).type();
                     std::size_t size = image(i).dim()[0] * image(i).dim()[1];
-                    auto new_begin = new_tif.image(i).begin();
-                    if      (old_type.is<std::int8_t>())   std::copy_n(reinterpret_cast<std::int8_t*>(&d_img[i][0])  , size, new_begin);
-                    else if (old_type.is<std::uint8_t>())  std::copy_n(reinterpret_cast<std::uint8_t*>(&d_img[i][0])  , size, new_begin);
-                    else if (old_type.is<std::int16_t>())  std::copy_n(reinterpret_cast<std::int16_t*>(&d_img[i][0])  , size, new_begin);
-                    else if (old_type.is<std::uint16_t>())  std::copy_n(reinterpret_cast<std::uint16_t*>(&d_img[i][0])  , size, new_begin);
-                    else if (old_type.is<std::int32_t>())  std::copy_n(reinterpret_cast<std::int32_t*>(&d_img[i][0])  , size, new_begin);
-                    else if (old_type.is<std::uint32_t>())  std::copy_n(reinterpret_cast<std::uint32_t*>(&d_img[i][0])  , size, new_begin);
-                    else if (old_type.is<float>())  std::copy_n(reinterpret_cast<float*>(&d_img[i][0])  , size, new_begin);
-                    else if (old_type.is<double>())  std::copy_n(reinterpret_cast<double*>(&d_img[i][0])  , size, new_begin);
+                    f_convert(reinterpret_cast<std::byte const*>(d_img[i].data()), image(i).type(),
+                              reinterpret_cast<std::byte*>(new_tif.d_img[i].data()), size);
                 }
                 std::swap(new_tif, *this);
             }
@@ -672,84 +922,128 @@ private:
         }
     }
     
+    // Converts 'size' pixels of type 'from_type' to pixels of type T, with the pixel kernels.
+    static void f_convert(std::byte const* from, POD_type_traits const& from_type, std::byte* to, std::size_t const size) {
+        if      (from_type.is<std::int8_t>())   pixel_kernels::convert<std::int8_t, T>  (from, to, size);
+        else if (from_type.is<std::uint8_t>())  pixel_kernels::convert<std::uint8_t, T> (from, to, size);
+        else if (from_type.is<std::int16_t>())  pixel_kernels::convert<std::int16_t, T> (from, to, size);
+        else if (from_type.is<std::uint16_t>()) pixel_kernels::convert<std::uint16_t, T>(from, to, size);
+        else if (from_type.is<std::int32_t>())  pixel_kernels::convert<std::int32_t, T> (from, to, size);
+        else if (from_type.is<std::uint32_t>()) pixel_kernels::convert<std::uint32_t, T>(from, to, size);
+        else if (from_type.is<float>())         pixel_kernels::convert<float, T>        (from, to, size);
+        else if (from_type.is<double>())        pixel_kernels::convert<double, T>       (from, to, size);
+    }
+    
     void f_scan_images() {
         d_img.clear();
         d_img_const.clear();
         this->d_dim = {0,0};
-        bool native = d_tif[0] == std::byte('I') && std::endian::native == std::endian::little;
+        bool native = (d_tif[0] == std::byte('I')) == (std::endian::native == std::endian::little);
         if (!native)
             d_tif[0] = d_tif[1] = (d_tif[0] == std::byte('M')) ? std::byte('I'): std::byte('M');
-        reinterpret_cast<std::uint16_t&>(d_tif[2]) = 42;
-        std::uint32_t index = reinterpret_cast<std::uint32_t&>(d_tif[4]);
-        if (!native) {
-            index = (index << 24) | ((index & 0xff00) << 8) | ((index >> 8) & 0xff00) | (index >> 24);
-            reinterpret_cast<std::uint32_t&>(d_tif[4]) = index;
-        }
-        if (native)
-            while (index != 0) {
-                f_make_Image<true>(index);
-                index = reinterpret_cast<std::uint32_t&>(d_tif[d_last_ifd_offset]);
+        std::byte* cursor = d_tif.data() + 2;
+        d_big = (native ? f_int16<true>(cursor) : f_int16<false>(cursor)) == 43;
+        if (d_big) {
+            if (d_tif.size() < 16)
+                throw std::runtime_error("Not a TIFF file\n");
+            if (native)
+                cursor += 4;
+            else {
+                f_int16<false>(cursor);
+                f_int16<false>(cursor);
             }
+            d_last_ifd_offset = 8;
+        }
         else
-            while (index != 0) {
-                f_make_Image<false>(index);
-                index = reinterpret_cast<std::uint32_t&>(d_tif[d_last_ifd_offset]);
+            d_last_ifd_offset = 4;
+        std::uint64_t index = d_big ? (native ? f_int64<true>(cursor) : f_int64<false>(cursor)) :
+                                      (native ? f_int32<true>(cursor) : f_int32<false>(cursor));
+        std::vector<Grey_tif_layout> layouts;
+        while (index != 0) {
+            layouts.push_back(native ? f_make_Image<true>(index) : f_make_Image<false>(index));
+            index = f_offset(d_last_ifd_offset);
+        }
+        if (!std::all_of(layouts.begin(), layouts.end(), [](auto const& layout) { return layout.contiguous(); })) {
+            f_assemble(layouts, native);
+            return;
+        }
+        for (auto const& layout : layouts) {
+            if (!native) {
+                std::byte* const pixels = d_tif.data() + layout.offsets[0];
+                pixel_kernels::byte_swap(pixels, pixels, layout.dim[0] * layout.dim[1], layout.type.size);
             }
-        if (image_stack_size() != 0) {
-            if constexpr(!std::is_same_v<T, std::byte>)
-                std::span<T const>::operator=(d_img_const[0]);
-            else
-                this->d_data = d_img_const[0].d_data;
-            this->d_dim = d_img[0].dim();
-            this->d_image_type = d_img[0].type();
+            f_add_image(layout);
         }
+        if (image_stack_size() != 0)
+            f_set_first_image();
         if constexpr (!std::is_same_v<T, std::byte>)
             f_regularize();
     }
     
+    // Adds an image of which the pixels are contiguous.
+    void f_add_image(Grey_tif_layout const& layout) {
+        std::byte* const pixels = d_tif.data() + layout.offsets[0];
+        std::size_t const size = layout.dim[0] * layout.dim[1];
+        d_img.push_back(Grey_tif_image<T>(layout.type, layout.dim, std::span<T>(reinterpret_cast<T*>(pixels), size)));
+        d_img_const.push_back(Grey_tif_image<T const>(layout.type, layout.dim, std::span<T const>(reinterpret_cast<T const*>(pixels), size)));
+    }
+    
+    // Replaces TIFF data with images in strips in any order, or in tiles, by TIFF data in which the pixels of every
+    // image are contiguous, in the native byte order.
+    void f_assemble(std::vector<Grey_tif_layout> const& layouts, bool const native) {
+        Grey_tif<std::byte> assembled;
+        std::size_t bytes = 16;
+        for (auto const& layout : layouts)
+            bytes += layout.bytes() + 1 + s_ifd_size[1];
+        assembled.f_reserve(bytes);
+        for (auto const& layout : layouts) {
+            assembled.f_push_back(layout.dim, layout.type);
+            std::byte* const pixels = assembled.d_img.back().d_data;
+            layout.gather(d_tif.data(), pixels);
+            if (!native)
+                pixel_kernels::byte_swap(pixels, pixels, layout.dim[0] * layout.dim[1], layout.type.size);
+        }
+        d_tif = std::move(assembled.d_tif);
+        f_scan_images();
+    }
+    
+    // Parses the IFD at 'index', and sets 'index' to the next IFD.
     template <bool NATIVE = true>
-    void f_make_Image(std::uint32_t& index) {
+    Grey_tif_layout f_make_Image(std::uint64_t& index) {
         bool compatible_tif = true;
         std::array<long,2> dim = {0,0};
         std::size_t bits_per_pixel = 0;
         std::byte* cursor = d_tif.data() + index;
-        int const tag_count = f_int16<NATIVE>(cursor);
-        std::int32_t rows_per_strip;
-        std::vector<std::int32_t> strip_offsets(1);
-        std::vector<std::int32_t> strip_byte_counts(1);
+        std::uint64_t const tag_count = d_big ? f_int64<NATIVE>(cursor) : f_int16<NATIVE>(cursor);
+        std::size_t const field_size = d_big ? 8 : 4;
+        Grey_tif_layout layout;
         bool signed_pixels = false;
         bool int_pixels = true;
-        for (int i = 0; i != tag_count; ++i) {
+        for (std::uint64_t i = 0; i != tag_count; ++i) {
             uint16_t tag = f_int16<NATIVE>(cursor);
             uint16_t type = f_int16<NATIVE>(cursor);
-            uint32_t count = f_int32<NATIVE>(cursor);
-            uint32_t val(0);
-            double double_val(0);
-            if ((type == 1) || (type == 2) || (type == 6) || (type == 7)) {
-                val = f_int8(cursor);
-                cursor += 3;
-            }
-            else if ((type == 3) || (type == 8)) {
-                val = f_int16<NATIVE>(cursor);
-                cursor += 2;
-            }
-            else if ((type == 4) || (type == 9))
-                val = f_int32<NATIVE>(cursor);
-            else if (type == 5 || type == 10) {
-                std::byte* p = d_tif.data() + f_int32<NATIVE>(cursor);
-                double_val = f_int32<NATIVE>(p);
-                double_val /= f_int32<NATIVE>(p);
-            }
-            else if (type == 11) {
-                val = f_int32<NATIVE>(cursor);
-                double_val = reinterpret_cast<float&>(val);
-                val = 0;
-            }
-            else if (type == 12) {
-                std::byte* p = d_tif.data() + f_int32<NATIVE>(cursor);
-                std::uint64_t tmp = f_int64<NATIVE>(p);
-                double_val = reinterpret_cast<double&>(tmp);
+            std::uint64_t count = d_big ? f_int64<NATIVE>(cursor) : f_int32<NATIVE>(cursor);
+            std::byte* field = cursor;
+            cursor += field_size;
+            // The values are read as words, which are byte-swapped in place if the file is not in native byte order.
+            // Rationals consist of two 4-byte words. Values that fit in the field are stored in the field itself.
+            std::size_t const word_size = (type == 5 || type == 10) ? 4 : f_type_size(type);
+            std::uint64_t const words = (type == 5 || type == 10) ? 2 * count : count;
+            if (word_size == 0 || words == 0)
+                continue;
+            std::byte* p = field;
+            if (words * word_size > field_size) {
+                std::uint64_t const offset = d_big ? f_int64<NATIVE>(p) : f_int32<NATIVE>(p);
+                if (offset + words * word_size > d_tif.size())
+                    throw std::runtime_error("Incompatible TIFF file\n");
+                p = d_tif.data() + offset;
             }
+            std::vector<std::uint64_t> values(words);
+            for (auto& value : values)
+                value = word_size == 1 ? f_int8(p) : word_size == 2 ? f_int16<NATIVE>(p) : word_size == 4 ? f_int32<NATIVE>(p) : f_int64<NATIVE>(p);
+            uint64_t val = values[0];
+            if (type == 11 || type == 12)
+                val = 0; // none of the tags that are read holds a float or double value
             if (tag == 0x0100) dim[0] = val;
             else if (tag == 0x0101) dim[1] = val;
             else if (tag == 0x0102 ) {
@@ -772,73 +1066,90 @@ private:
                 std::cerr << "Warning: Grey_tif cannot read black & white tiff files"<< std::endl;
                 compatible_tif = false;
             }
-            else if (tag == 0x0111) {
-                if (count == 1) strip_offsets[0] = val;
-                else {
-                    strip_offsets.resize(count);
-                    std::byte* p = d_tif.data() + val;
-                    for (int i=0; i != count; ++i)
-                        strip_offsets[i] = f_int32<NATIVE>(p);
-                }
-            }
+            else if (tag == 0x0111 || tag == 0x0144) layout.offsets = values;
             else if (tag == 0x0115 && val != 1) {
                 std::cerr << "Warning: Grey_tif cannot read RGB colour tiff files"<< std::endl;
                 compatible_tif = false;
             }
-            else if (tag == 0x0116) rows_per_strip = val;
-            else if (tag == 0x0117) {
-                if (count == 1) strip_byte_counts[0] = val;
-                else {
-                    strip_byte_counts.resize(count);
-                    std::byte* p = d_tif.data() + val;
-                    for (int i=0; i != count; ++i)
-                        strip_byte_counts[i] = f_int32<NATIVE>(p);
-                }
-            }
+            else if (tag == 0x0116) layout.rows_per_strip = val;
+            else if (tag == 0x0142) layout.tile[0] = val;
+            else if (tag == 0x0143) layout.tile[1] = val;
             else if (tag == 0x0153) {
                 if (val != 1) signed_pixels = true;
                 if (val == 3) int_pixels = false;
             }
         }
-        for (int i=0; i != strip_offsets.size() - 1; ++i)
-            if (strip_byte_counts[i] != strip_offsets[i + 1] - strip_offsets[i]) {
-                std::cerr << "Warning: Grey_tif cannot read tiff files with non-consecutive strips" << std::endl;
-                std::cerr << "         most likely the tiff file is corrupted" << std::endl;
-                compatible_tif = false;
-                break;
-            }
-        if (!compatible_tif) 
+        layout.type = { .size = bits_per_pixel / 8, .is_signed = signed_pixels, .is_integral = int_pixels };
+        layout.dim = dim;
+        if (!compatible_tif || !layout.fits(d_tif.size())) {
+            if (compatible_tif)
+                std::cerr << "Warning: the strips or tiles of an image lie outside the tiff file; most likely it is corrupted" << std::endl;
             throw std::runtime_error("Incompatible TIFF file\n");
-        d_last_ifd_offset = static_cast<std::uint32_t>(cursor - d_tif.data());
-        index = f_int32<NATIVE>(cursor);
-        if constexpr (!NATIVE) {
-            std::byte* begin = d_tif.data() + strip_offsets[0];
-            std::byte* end = begin + dim[0] * dim[1] * bits_per_pixel / 8;
-            if (bits_per_pixel == 16)
-                while (begin != end) f_int16<false>(begin);
-            else if (bits_per_pixel == 32)
-                while (begin != end) f_int32<false>(begin);
-            else if (bits_per_pixel == 64)
-                while (begin != end) f_int64<false>(begin);
         }
-        POD_type_traits image_type = { .size = bits_per_pixel / 8, .is_signed = signed_pixels, .is_integral = int_pixels };
-        d_img.push_back(Grey_tif_image<T>(image_type, dim, std::span<T>(reinterpret_cast<T*>(&d_tif[strip_offsets[0]]), dim[0] * dim[1])));
-        d_img_const.push_back(Grey_tif_image<T const>(image_type, dim, std::span<T const>(reinterpret_cast<T const*>(&d_tif[strip_offsets[0]]), dim[0] * dim[1])));
+        d_last_ifd_offset = static_cast<std::uint64_t>(cursor - d_tif.data());
+        index = d_big ? f_int64<NATIVE>(cursor) : f_int32<NATIVE>(cursor);
+        return layout;
     };
     
-    void f_set_ifd(std::uint32_t& index, uint16_t tag, uint16_t type, uint32_t val) {
+    void f_set_ifd(std::size_t& index, uint16_t tag, uint16_t type, uint64_t val) {
         reinterpret_cast<uint16_t&>(d_tif[index]) = tag;
         reinterpret_cast<uint16_t&>(d_tif[index + 2]) = type;
-        reinterpret_cast<uint32_t&>(d_tif[index + 4]) = 1;
+        std::size_t const field = d_big ? index + 12 : index + 8;
+        if (d_big)
+            reinterpret_cast<uint64_t&>(d_tif[index + 4]) = 1;
+        else
+            reinterpret_cast<uint32_t&>(d_tif[index + 4]) = 1;
         if (type == 1)
-            reinterpret_cast<uint8_t&>(d_tif[index + 8]) = val;
+            reinterpret_cast<uint8_t&>(d_tif[field]) = static_cast<uint8_t>(val);
         else if (type == 3)
-            reinterpret_cast<uint16_t&>(d_tif[index + 8]) = val;
+            reinterpret_cast<uint16_t&>(d_tif[field]) = static_cast<uint16_t>(val);
         else if (type == 4)
-            reinterpret_cast<uint32_t&>(d_tif[index + 8]) = val;
-        index += 12;
+            reinterpret_cast<uint32_t&>(d_tif[field]) = static_cast<uint32_t>(val);
+        else if (type == 16)
+            reinterpret_cast<uint64_t&>(d_tif[field]) = val;
+        index += d_big ? 20 : 12;
     };
     
+    // Writes the number of tags of an IFD.
+    void f_set_tag_count(std::size_t& index, std::uint16_t const count) {
+        if (d_big) {
+            reinterpret_cast<uint64_t&>(d_tif[index]) = count;
+            index += 8;
+        }
+        else {
+            reinterpret_cast<uint16_t&>(d_tif[index]) = count;
+            index += 2;
+        }
+    }
+    
+    // Writes and reads an IFD offset in the TIFF data.
+    void f_set_offset(std::uint64_t const index, std::uint64_t const offset) {
+        if (d_big)
+            reinterpret_cast<uint64_t&>(d_tif[index]) = offset;
+        else
+            reinterpret_cast<uint32_t&>(d_tif[index]) = static_cast<uint32_t>(offset);
+    }
+    
+    std::uint64_t f_offset(std::uint64_t const index) const {
+        return d_big ? reinterpret_cast<uint64_t const&>(d_tif[index]) : reinterpret_cast<uint32_t const&>(d_tif[index]);
+    }
+    
+    // The number of bytes of a value of a TIFF field type, 0 for unknown types.
+    static constexpr std::size_t f_type_size(std::uint16_t const type) noexcept {
+        switch (type) {
+            case 1: case 2: case 6: case 7: return 1;
+            case 3: case 8: return 2;
+            case 4: case 9: case 11: return 4;
+            case 5: case 10: case 12: case 16: case 17: case 18: return 8;
+            default: return 0;
+        }
+    }
+    
+    // 42 identifies classic TIFF files, 43 BigTIFF files.
+    static bool f_is_tiff_version(std::byte const version) noexcept {
+        return version == std::byte(42) || version == std::byte(43);
+    }
+    
     std::uint8_t f_int8(std::byte* &cursor)  {
         return reinterpret_cast<std::uint8_t&>(*cursor++);
     }
@@ -0,0 +1,394 @@
+//
+//  Grey_tif_map.hpp
+//  Grey_tif_map
+//
+
+#ifndef Grey_tif_map_h
+#define Grey_tif_map_h
+
+#include <array>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <span>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <stdexcept>
+#include <filesystem>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Grey_tif.hpp"
+
+// Grey_tif_map gives read-only access to the images of a TIFF file by mapping the file into memory, instead of reading
+// it. Opening a file only checks its header: the image file directories (IFDs) are parsed when an image is first
+// requested, and only up to that image. So the first frame of a 10 GB stack is available immediately, and pages of the
+// file are only read when their pixels are used; the memory of the pixels is the page cache, not the heap.
+//
+// Images are returned as Grey_tif_image<std::byte const>, the raw image type of Grey_tif<std::byte>, whose pixel type
+// is determined at runtime. For files in the native byte order, the images are spans over the mapped pages. Images of
+// files in the other byte order, images that are stored in strips in any order or in tiles, and images that are not
+// aligned to their pixel size are byte-swapped, gathered or copied when they are requested, into a small cache of the
+// most recently requested images. Strips and tiles are gathered from the mapped file by several threads at once.
+//
+// Grey_tif_map reads the same TIFF files as Grey_tif, classic TIFF and BigTIFF, and throws std::runtime_error for files
+// that Grey_tif cannot read.
+//
+//  Grey_tif_map(std::filesystem::path const& path, std::size_t cache_images = 2)
+//      Maps a TIFF file. Throws std::system_error if it cannot be mapped, and std::runtime_error if it is not a TIFF file.
+//      'cache_images' is the number of byte-swapped images that are kept.
+//  std::size_t image_stack_size()
+//      Returns the number of images; parses all IFDs.
+//  Grey_tif_image<std::byte const> image(std::size_t i)
+//  Grey_tif_image<T const> image<T>(std::size_t i)
+//      Returns image 'i', parsing the IFDs up to it, as a raw image or with pixel type T (which must be its type).
+//      Throws std::out_of_range if there is no image 'i'. A byte-swapped image stays valid until 'cache_images' other
+//      byte-swapped images have been requested; images over mapped pages stay valid as long as the Grey_tif_map.
+//  Grey_tif_image<std::byte const> image(std::size_t i, std::vector<std::byte>& buffer)
+//      Returns image 'i' as image(i) does, but an image that must be byte-swapped, gathered or copied is made in
+//      'buffer' instead of in the cache, by the calling thread. So several threads can convert images at once, and
+//      the image stays valid until 'buffer' is changed.
+//  void prefetch(std::size_t i)
+//      Asks the kernel to start reading the pixels of image 'i' (if it exists), so that they are in memory when used.
+//  void release(std::size_t i)
+//      Tells the kernel that the pixels of image 'i' are no longer needed, so that reading a stack does not keep
+//      its pages mapped. Images over mapped pages remain valid: their pages are read again if they are used.
+//  bool native()
+//      Returns true if the file is in the native byte order, so that images are not copied.
+//  std::size_t raw_data_size()
+//      Returns the size of the file in bytes.
+//
+// All member functions are thread-safe.
+//
+// Example:
+//    Grey_tif_map const tif("movie.tif");
+//    Terse compressed(tif.image<std::uint16_t>(0));    // only the first IFD and image are read
+//    for (std::size_t i = 1; i < tif.image_stack_size(); ++i) {
+//        tif.prefetch(i + 1);
+//        compressed.push_back(tif.image<std::uint16_t>(i));
+//    }
+
+namespace jpa {
+
+/**
+ * @class Grey_tif_map
+ * @brief A read-only TIFF file mapped into memory, of which the IFDs are parsed lazily.
+ */
+class Grey_tif_map {
+public:
+
+    /**
+     * @brief Maps a TIFF file into memory, and checks its header.
+     *
+     * @param path The TIFF file.
+     * @param cache_images The number of byte-swapped images that are kept (at least 1).
+     */
+    explicit Grey_tif_map(std::filesystem::path const& path, std::size_t const cache_images = 2) :
+    d_cache_images(std::max<std::size_t>(cache_images, 1)) {
+        int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            throw std::system_error(errno, std::generic_category(), "cannot open \"" + path.string() + "\"");
+        struct stat status;
+        if (fstat(fd, &status) == -1) {
+            int const error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "cannot stat \"" + path.string() + "\"");
+        }
+        d_size = static_cast<std::size_t>(status.st_size);
+        if (d_size >= 8) {
+            void* const p = mmap(nullptr, d_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                int const error = errno;
+                ::close(fd);
+                throw std::system_error(error, std::generic_category(), "cannot map \"" + path.string() + "\"");
+            }
+            d_data = static_cast<std::byte const*>(p);
+        }
+        ::close(fd);
+        if (d_size < 8 || (d_data[0] != std::byte('I') && d_data[0] != std::byte('M')) || d_data[0] != d_data[1] ||
+            (f_uint(2, 2) != 42 && f_uint(2, 2) != 43) || (f_uint(2, 2) == 43 && (d_size < 16 || f_uint(4, 2) != 8))) {
+            f_unmap();
+            throw std::runtime_error("Not a TIFF file\n");
+        }
+        d_native = (d_data[0] == std::byte('I')) == (std::endian::native == std::endian::little);
+        d_big = f_uint(2, 2) == 43;
+        d_next_ifd = d_big ? f_uint(8, 8) : f_uint(4, 4);
+    }
+
+    Grey_tif_map(Grey_tif_map const&) = delete;
+    Grey_tif_map& operator=(Grey_tif_map const&) = delete;
+
+    ~Grey_tif_map() {
+        f_unmap();
+    }
+
+    /**
+     * @brief Returns the number of images, parsing all IFDs.
+     *
+     * @return The number of images.
+     */
+    std::size_t image_stack_size() const {
+        std::lock_guard lock(d_mutex);
+        while (d_next_ifd != 0)
+            f_parse_ifd();
+        return d_ifds.size();
+    }
+
+    /**
+     * @brief Returns an image as a raw image, of which the pixel type is determined at runtime.
+     *
+     * @param i The index of the image in the stack.
+     * @return The image.
+     */
+    Grey_tif_image<std::byte const> image(std::size_t const i) const {
+        std::lock_guard lock(d_mutex);
+        Ifd const& ifd = f_ifd(i);
+        if (f_mapped(ifd))
+            return Grey_tif_image<std::byte const>(ifd.type, ifd.dim, std::span<std::byte const>(d_data + ifd.offsets[0], ifd.bytes()));
+        return Grey_tif_image<std::byte const>(ifd.type, ifd.dim, f_cached(i, ifd));
+    }
+
+    /**
+     * @brief Returns an image as a raw image, converting it in a buffer of the caller if it cannot be mapped.
+     *
+     * Images that must be byte-swapped, gathered or copied are made by the calling thread, outside the lock, so that
+     * several threads can convert images at the same time.
+     *
+     * @param i The index of the image in the stack.
+     * @param buffer The buffer that receives the pixels of an image that cannot be mapped.
+     * @return The image, which stays valid until 'buffer' is changed.
+     */
+    Grey_tif_image<std::byte const> image(std::size_t const i, std::vector<std::byte>& buffer) const {
+        Ifd ifd;
+        {
+            std::lock_guard lock(d_mutex);
+            ifd = f_ifd(i);
+        }
+        if (f_mapped(ifd))
+            return Grey_tif_image<std::byte const>(ifd.type, ifd.dim, std::span<std::byte const>(d_data + ifd.offsets[0], ifd.bytes()));
+        buffer.resize(ifd.bytes());
+        f_copy(ifd, buffer.data());
+        return Grey_tif_image<std::byte const>(ifd.type, ifd.dim, std::span<std::byte const>(buffer));
+    }
+
+    /**
+     * @brief Returns an image with a compile-time pixel type.
+     *
+     * @tparam T The pixel type; image(i).type().is<T>() must be true.
+     * @param i The index of the image in the stack.
+     * @return The image.
+     */
+    template <typename T>
+    Grey_tif_image<T const> image(std::size_t const i) const {
+        return static_cast<Grey_tif_image<T const>>(image(i));
+    }
+
+    /**
+     * @brief Asks the kernel to read the pixels of an image ahead of their use.
+     *
+     * @param i The index of the image in the stack; nothing happens if there is no such image.
+     */
+    void prefetch(std::size_t const i) const {
+        std::lock_guard lock(d_mutex);
+        while (i >= d_ifds.size() && d_next_ifd != 0)
+            f_parse_ifd();
+        if (i >= d_ifds.size())
+            return;
+        auto const [begin, end] = f_extent(d_ifds[i]);
+        std::size_t const page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        std::size_t const first = begin / page * page;
+        madvise(const_cast<std::byte*>(d_data) + first, end - first, MADV_WILLNEED);
+    }
+
+    /**
+     * @brief Tells the kernel that the pixels of an image are no longer needed.
+     *
+     * Only the pages that lie entirely within the image are released, so that neighbouring images are not affected.
+     *
+     * @param i The index of the image in the stack; nothing happens if it has not been parsed.
+     */
+    void release(std::size_t const i) const {
+        std::lock_guard lock(d_mutex);
+        if (i >= d_ifds.size())
+            return;
+        auto const [begin, end] = f_extent(d_ifds[i]);
+        std::size_t const page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        std::size_t const first = (begin + page - 1) / page * page;
+        std::size_t const last = end / page * page;
+        if (first < last)
+            madvise(const_cast<std::byte*>(d_data) + first, last - first, MADV_DONTNEED);
+    }
+
+    /**
+     * @brief Returns true if the file is in the native byte order, so that images are spans over the mapped file.
+     */
+    bool native() const noexcept { return d_native; }
+
+    /**
+     * @brief Returns the size of the TIFF file.
+     *
+     * @return The number of bytes of the file.
+     */
+    std::size_t raw_data_size() const noexcept { return d_size; }
+
+private:
+    using Ifd = Grey_tif_layout;
+
+    std::byte const* d_data = nullptr;
+    std::size_t d_size = 0;
+    bool d_native = true;
+    bool d_big = false; // BigTIFF: 64-bit offsets and counts
+    std::size_t const d_cache_images;
+    mutable std::mutex d_mutex;
+    mutable std::vector<Ifd> d_ifds;
+    mutable std::size_t d_next_ifd = 0; // offset of the first IFD that has not been parsed, 0 after the last one
+    mutable std::deque<std::pair<std::size_t, std::vector<std::byte>>> d_cache; // most recently requested first
+
+    void f_unmap() noexcept {
+        if (d_data != nullptr)
+            munmap(const_cast<std::byte*>(d_data), d_size);
+        d_data = nullptr;
+    }
+
+    // Reads an unsigned integer of 'size' bytes in the byte order of the file.
+    std::uint64_t f_uint(std::size_t const offset, unsigned const size) const {
+        if (offset + size > d_size)
+            throw std::runtime_error("Incompatible TIFF file\n");
+        std::uint64_t value = 0;
+        bool const little = d_data[0] == std::byte('I');
+        for (unsigned i = 0; i != size; ++i)
+            value |= std::uint64_t(d_data[offset + (little ? i : size - 1 - i)]) << (8 * i);
+        return value;
+    }
+
+    Ifd const& f_ifd(std::size_t const i) const {
+        while (i >= d_ifds.size() && d_next_ifd != 0)
+            f_parse_ifd();
+        if (i >= d_ifds.size())
+            throw std::out_of_range("TIFF file has no image " + std::to_string(i));
+        return d_ifds[i];
+    }
+
+    // Parses the IFD at d_next_ifd, with the same checks as Grey_tif. BigTIFF IFDs have 8-byte counts and offsets,
+    // and 20-byte entries.
+    void f_parse_ifd() const {
+        unsigned const field_size = d_big ? 8 : 4;
+        std::size_t cursor = d_next_ifd;
+        std::size_t const tag_count = f_uint(cursor, d_big ? 8 : 2);
+        cursor += d_big ? 8 : 2;
+        std::array<long,2> dim = {0, 0};
+        std::size_t bits_per_pixel = 0;
+        Ifd ifd;
+        bool signed_pixels = false;
+        bool int_pixels = true;
+        bool compatible_tif = true;
+        auto const values = [&](std::size_t const entry, unsigned const type, std::size_t const count) {
+            unsigned const size = (type == 3 || type == 8) ? 2 : (type == 4 || type == 9) ? 4 : (type >= 16) ? 8 : 1;
+            std::size_t const field = entry + 4 + field_size;
+            std::size_t const at = count * size <= field_size ? field : f_uint(field, field_size);
+            std::vector<std::uint64_t> result(count);
+            for (std::size_t i = 0; i != count; ++i)
+                result[i] = f_uint(at + i * size, size);
+            return result;
+        };
+        for (std::size_t i = 0; i != tag_count; ++i, cursor += 4 + 2 * field_size) {
+            unsigned const tag = static_cast<unsigned>(f_uint(cursor, 2));
+            unsigned const type = static_cast<unsigned>(f_uint(cursor + 2, 2));
+            std::size_t const count = f_uint(cursor + 4, field_size);
+            if (type != 1 && type != 3 && type != 4 && type != 6 && type != 7 && type != 8 && type != 9 &&
+                type != 16 && type != 17 && type != 18)
+                continue; // rationals, floats and strings are not needed
+            std::uint64_t const val = count == 0 ? 0 : values(cursor, type, 1)[0];
+            if (tag == 0x0100) dim[0] = static_cast<long>(val);
+            else if (tag == 0x0101) dim[1] = static_cast<long>(val);
+            else if (tag == 0x0102) {
+                if (val == 8 || val == 16 || val == 32 || val == 64)
+                    bits_per_pixel = val;
+                else {
+                    std::cerr << "Warning: Grey_tif can only read greyscale tiff files with 8-, 16-, 32-, or 64-bit pixels" << std::endl;
+                    compatible_tif = false;
+                }
+            }
+            else if (tag == 0x0103 && val != 1) {
+                std::cerr << "Warning: Grey_tif cannot read compressed tiff files" << std::endl;
+                compatible_tif = false;
+            }
+            else if (tag == 0x0106 && val > 1) {
+                std::cerr << "Warning: Grey_tif cannot read colour tiff files" << std::endl;
+                compatible_tif = false;
+            }
+            else if (tag == 0x0111 || tag == 0x0144) ifd.offsets = values(cursor, type, count);
+            else if (tag == 0x0115 && val != 1) {
+                std::cerr << "Warning: Grey_tif cannot read RGB colour tiff files" << std::endl;
+                compatible_tif = false;
+            }
+            else if (tag == 0x0116) ifd.rows_per_strip = val;
+            else if (tag == 0x0142) ifd.tile[0] = static_cast<long>(val);
+            else if (tag == 0x0143) ifd.tile[1] = static_cast<long>(val);
+            else if (tag == 0x0153) {
+                if (val != 1) signed_pixels = true;
+                if (val == 3) int_pixels = false;
+            }
+        }
+        ifd.type = {.size = bits_per_pixel / 8, .is_signed = signed_pixels, .is_integral = int_pixels};
+        ifd.dim = dim;
+        if (!compatible_tif || !ifd.fits(d_size))
+            throw std::runtime_error("Incompatible TIFF file\n");
+        d_next_ifd = f_uint(cursor, field_size);
+        d_ifds.push_back(std::move(ifd));
+    }
+
+    // The range of bytes of the file that holds the pixels of an image.
+    std::pair<std::size_t, std::size_t> f_extent(Ifd const& ifd) const noexcept {
+        std::size_t begin = d_size;
+        std::size_t end = 0;
+        for (std::size_t piece = 0; piece != ifd.pieces(); ++piece) {
+            begin = std::min<std::size_t>(begin, ifd.offsets[piece]);
+            end = std::max<std::size_t>(end, ifd.offsets[piece]);
+        }
+        end = std::min(d_size, end + (ifd.tiled() ? ifd.tile[0] * ifd.tile[1] * ifd.type.size : ifd.bytes()));
+        return {std::min(begin, end), end};
+    }
+
+    // Returns true if an image can be used straight from the mapped file.
+    bool f_mapped(Ifd const& ifd) const noexcept {
+        return d_native && ifd.contiguous() && reinterpret_cast<std::uintptr_t>(d_data + ifd.offsets[0]) % ifd.type.size == 0;
+    }
+
+    // Copies the pixels of an image to 'pixels', in native byte order.
+    void f_copy(Ifd const& ifd, std::byte* const pixels) const {
+        if (!ifd.contiguous()) {
+            ifd.gather(d_data, pixels);
+            if (!d_native)
+                pixel_kernels::byte_swap(pixels, pixels, ifd.bytes() / ifd.type.size, ifd.type.size);
+        }
+        else if (d_native)
+            std::memcpy(pixels, d_data + ifd.offsets[0], ifd.bytes());
+        else
+            pixel_kernels::byte_swap(d_data + ifd.offsets[0], pixels, ifd.bytes() / ifd.type.size, ifd.type.size);
+    }
+
+    // Returns the cached copy of image 'i', in native byte order, making it if it is not cached.
+    std::span<std::byte const> f_cached(std::size_t const i, Ifd const& ifd) const {
+        for (auto it = d_cache.begin(); it != d_cache.end(); ++it)
+            if (it->first == i) {
+                std::rotate(d_cache.begin(), it, std::next(it)); // moving a vector keeps its pixels in place
+                return d_cache.front().second;
+            }
+        std::vector<std::byte> pixels(ifd.bytes());
+        f_copy(ifd, pixels.data());
+        if (d_cache.size() == d_cache_images)
+            d_cache.pop_back();
+        d_cache.emplace_front(i, std::move(pixels));
+        return d_cache.front().second;
+    }
+};
+
+} // end namespace jpa
+
+#endif /* Grey_tif_map_h */
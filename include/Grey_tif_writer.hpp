@@ -0,0 +1,347 @@
+//
+//  Grey_tif_writer.hpp
+//  Grey_tif_writer
+//
+
+#ifndef Grey_tif_writer_h
+#define Grey_tif_writer_h
+
+#include <array>
+#include <bit>
+#include <span>
+#include <limits>
+#include <memory>
+#include <cassert>
+#include <vector>
+#include <ostream>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <functional>
+#include <type_traits>
+#include "Grey_tif.hpp"
+
+// Grey_tif_writer writes a stack of images as a TIFF file, one image at a time, so that a stack never has to be held in
+// memory. The file has the same layout as the TIFF data of a Grey_tif object: every image is followed by its image file
+// directory (IFD). The IFD of an image is written when the next image (or close()) comes in, because only then is the
+// offset of the next IFD known. So the writer never seeks back, and can write to pipes.
+//
+// The output is a stream, a function that is called with consecutive pieces of the file, or memory of the size of the
+// file, such as a mapped file (see Mapped_file). The pixels of an image can be left to the caller: the writer then only
+// writes the header and the IFDs, and returns the offsets at which the pixels belong, so that the images of a stack can
+// be laid out first, and their pixels filled in afterwards, in any order. A sink is then called with the pieces of the
+// file around the pixels, and size() returns the offset of the piece it is called with.
+//
+//  Grey_tif_writer(std::ostream& out, std::uint64_t expected_size = 0)
+//  Grey_tif_writer(std::function<void(std::span<std::byte const>)> sink, std::uint64_t expected_size = 0)
+//      Constructs a writer for a new TIFF file. If 'expected_size' (for instance Grey_tif::raw_data_size()) exceeds
+//      4 GB, the file is written as BigTIFF, with 64-bit offsets.
+//  Grey_tif_writer(std::span<std::byte> file)
+//      Constructs a writer that writes a TIFF file into 'file', which must have the size of the TIFF file (see
+//      file_size()). The file is written as BigTIFF if it exceeds 4 GB.
+//  void write(Container const& image, std::array<long,2> dim = {-1,-1})
+//      Writes an image of 8-, 16- or 32-bit integers, floats or doubles. If the container has a member function dim(),
+//      'dim' may be omitted. 'dim' is {width, height}, as Grey_tif_image::dim().
+//  void write(std::span<std::byte const> pixels, POD_type_traits const& type, std::array<long,2> dim)
+//      Writes an image of which the pixel type is determined at runtime.
+//  std::uint64_t place(POD_type_traits const& type, std::array<long,2> dim)
+//      Writes an image without its pixels, and returns the offset in the file at which the caller is to write its
+//      pixels, in native byte order. A stream skips the pixels with seekp().
+//  void close()
+//      Writes the last IFD. Called by the destructor; no images can be written afterwards.
+//  std::size_t image_stack_size()
+//      Returns the number of images written so far.
+//  std::uint64_t size()
+//      Returns the number of bytes written so far.
+//  bool is_big()
+//      Returns true if the file is written as BigTIFF.
+//  static std::uint64_t file_size(std::uint64_t pixel_bytes, std::size_t odd_images, std::size_t images, bool big)
+//      Returns the size of a TIFF file of 'images' images with 'pixel_bytes' bytes of pixels in total, of which
+//      'odd_images' have an odd number of bytes.
+//
+// Since the header is written before the size of the stack is known, the format cannot change once the first image
+// has been written: a classic TIFF file is limited to 4 GB, and write() throws std::length_error for an image that
+// would not fit. Pass the expected size to write larger stacks.
+//
+// Example:
+//    std::ofstream file("movie.tif", std::ios::binary);
+//    Grey_tif_writer tif(file);
+//    std::vector<std::uint16_t> frame(4096 * 4096);
+//    for (std::size_t i = 0; i != trpx.number_of_frames(); ++i) {
+//        trpx.prolix(frame, i);
+//        tif.write(frame, {4096, 4096});
+//    }
+//    tif.close();
+
+namespace jpa {
+
+/**
+ * @class Grey_tif_writer
+ * @brief Writes a TIFF stack image by image, without holding the stack in memory.
+ */
+class Grey_tif_writer {
+public:
+
+    /**
+     * @brief Constructs a writer that writes a TIFF file to a stream.
+     *
+     * @param out The stream. It must outlive the writer.
+     * @param expected_size The expected size of the file in bytes; the file is written as BigTIFF if it exceeds 4 GB.
+     */
+    explicit Grey_tif_writer(std::ostream& out, std::uint64_t const expected_size = 0) :
+    Grey_tif_writer([&out](std::span<std::byte const> const data) {
+        if (!out.write(reinterpret_cast<char const*>(data.data()), static_cast<std::streamsize>(data.size())))
+            throw std::runtime_error("writing TIFF file failed");
+    }, expected_size) {
+        d_skip = [&out](std::uint64_t const bytes) {
+            if (!out.seekp(static_cast<std::streamoff>(bytes), std::ios::cur))
+                throw std::runtime_error("writing TIFF file failed");
+        };
+    }
+
+    /**
+     * @brief Constructs a writer that passes the TIFF file to a function, in consecutive pieces.
+     *
+     * @param sink The function.
+     * @param expected_size The expected size of the file in bytes; the file is written as BigTIFF if it exceeds 4 GB.
+     */
+    explicit Grey_tif_writer(std::function<void(std::span<std::byte const>)> sink, std::uint64_t const expected_size = 0) :
+    d_sink(std::move(sink)),
+    d_big(expected_size > std::numeric_limits<std::uint32_t>::max()) {}
+
+    /**
+     * @brief Constructs a writer that writes a TIFF file into memory of the size of the file.
+     *
+     * @param file The memory, such as a mapped file. Its size must be that of the TIFF file; the file is written as
+     * BigTIFF if it exceeds 4 GB.
+     */
+    explicit Grey_tif_writer(std::span<std::byte> const file) :
+    d_memory(file),
+    d_big(file.size() > std::numeric_limits<std::uint32_t>::max()) {}
+
+    Grey_tif_writer(Grey_tif_writer const&) = delete;
+    Grey_tif_writer& operator=(Grey_tif_writer const&) = delete;
+
+    ~Grey_tif_writer() {
+        try {
+            close();
+        }
+        catch (...) {
+        }
+    }
+
+    /**
+     * @brief Writes an image from a container of pixels.
+     *
+     * @tparam C The type of the container.
+     * @param image The pixels.
+     * @param dim The width and height of the image; may be omitted if the container has a member function dim().
+     */
+    template <typename C> requires requires (C const& c) {std::begin(c), std::end(c), std::size(c);}
+    void write(C const& image, std::array<long,2> dim = {-1,-1}) {
+        using CT = std::remove_cv_t<typename C::value_type>;
+        static_assert ((std::is_integral_v<CT> && sizeof(CT) <= 4 && !std::is_same_v<CT, bool>) ||
+                       std::is_same_v<float, CT> || std::is_same_v<double, CT>,
+                       "Only signed & unsigned 8-, 16 and 32-bit integers, floats and doubles allowed in TIFF image data");
+        if constexpr (requires(C const& c) { c.dim().size();})
+            if (dim[0] == -1 && dim[1] == -1) {
+                assert(image.dim().size() == 2); // Grey_tif_writer.write(container) only accepts 2D containers
+                dim[0] = image.dim()[0];
+                dim[1] = image.dim()[1];
+            }
+        POD_type_traits const type{.size = sizeof(CT), .is_signed = std::is_signed_v<CT>, .is_integral = std::is_integral_v<CT>};
+        if constexpr (std::contiguous_iterator<decltype(std::begin(image))>)
+            write(std::as_bytes(std::span(std::to_address(std::begin(image)), std::size(image))), type, dim);
+        else {
+            std::vector<CT> pixels(std::begin(image), std::end(image));
+            write(std::as_bytes(std::span(pixels)), type, dim);
+        }
+    }
+
+    /**
+     * @brief Writes an image of which the pixel type is determined at runtime.
+     *
+     * @param pixels The pixels, in native byte order.
+     * @param type The pixel type.
+     * @param dim The width and height of the image.
+     */
+    void write(std::span<std::byte const> const pixels, POD_type_traits const& type, std::array<long,2> const& dim) {
+        assert(pixels.size() == dim[0] * dim[1] * type.size);
+        f_image(pixels, type, dim);
+    }
+
+    /**
+     * @brief Writes an image without its pixels. The caller writes the pixels.
+     *
+     * @param type The pixel type.
+     * @param dim The width and height of the image.
+     * @return The offset in the file at which the pixels of the image are to be written, in native byte order.
+     */
+    std::uint64_t place(POD_type_traits const& type, std::array<long,2> const& dim) {
+        return f_image(std::span<std::byte const>(static_cast<std::byte const*>(nullptr), dim[0] * dim[1] * type.size), type, dim);
+    }
+
+    /**
+     * @brief Writes the last IFD. No images can be written afterwards.
+     */
+    void close() {
+        if (d_closed)
+            return;
+        d_closed = true;
+        if (d_images == 0)
+            f_header(0);
+        else
+            f_ifd(0);
+    }
+
+    /**
+     * @brief Returns the number of images written so far.
+     */
+    std::size_t image_stack_size() const noexcept { return d_images; }
+
+    /**
+     * @brief Returns the number of bytes written so far.
+     */
+    std::uint64_t size() const noexcept { return d_size; }
+
+    /**
+     * @brief Returns true if the file is written as BigTIFF, with 64-bit offsets.
+     */
+    bool is_big() const noexcept { return d_big; }
+
+    /**
+     * @brief Returns the size of a TIFF file, as written by Grey_tif_writer.
+     *
+     * @param pixel_bytes The number of bytes of the pixels of all images.
+     * @param odd_images The number of images of an odd number of bytes, which are padded to an even number.
+     * @param images The number of images.
+     * @param big True for BigTIFF.
+     * @return The number of bytes of the file.
+     */
+    static std::uint64_t file_size(std::uint64_t const pixel_bytes, std::size_t const odd_images, std::size_t const images,
+                                   bool const big) noexcept {
+        return s_header_size[big] + pixel_bytes + odd_images + images * s_ifd_size[big];
+    }
+
+private:
+    static constexpr std::size_t s_header_size[2] = {8, 16}; // classic TIFF and BigTIFF
+    static constexpr std::size_t s_ifd_size[2] = {2 + 7 * 12 + 4, 8 + 7 * 20 + 8};
+
+    std::function<void(std::span<std::byte const>)> const d_sink;
+    std::function<void(std::uint64_t)> d_skip; // skips the pixels that the caller writes, on a stream
+    std::span<std::byte> const d_memory; // if the file is written into memory
+    bool const d_big;
+    std::array<std::byte, s_ifd_size[1]> d_ifd{}; // the IFD of the last image, without the offset of the next IFD
+    std::uint64_t d_size = 0;
+    std::size_t d_images = 0;
+    bool d_closed = false;
+
+    // Writes an image, or, if 'pixels' has no data, skips its pixels. Returns the offset of the pixels.
+    std::uint64_t f_image(std::span<std::byte const> const pixels, POD_type_traits const& type, std::array<long,2> const& dim) {
+        if (d_closed)
+            throw std::logic_error("image written to a closed Grey_tif_writer");
+        std::uint64_t const before = d_images == 0 ? s_header_size[d_big] : s_ifd_size[d_big];
+        std::uint64_t const padding = (d_size + before + pixels.size()) & 1;
+        std::uint64_t const ifd = d_size + before + pixels.size() + padding;
+        if (!d_big && ifd + s_ifd_size[0] > std::numeric_limits<std::uint32_t>::max())
+            throw std::length_error("TIFF files are limited to 4 GB; pass the expected size to Grey_tif_writer for BigTIFF");
+        if (d_images == 0)
+            f_header(ifd);
+        else
+            f_ifd(ifd);
+        std::uint64_t const data_start = d_size;
+        f_write(pixels);
+        if (padding != 0)
+            f_write(std::array<std::byte,1>{std::byte(0)});
+        f_make_ifd(data_start, type, dim);
+        ++d_images;
+        return data_start;
+    }
+
+    // Writes 'data', or skips its size if it has no data.
+    void f_write(std::span<std::byte const> const data) {
+        if (d_memory.data() == nullptr) {
+            if (data.data() != nullptr)
+                d_sink(data);
+            else if (d_skip)
+                d_skip(data.size());
+        }
+        else if (d_size + data.size() > d_memory.size())
+            throw std::length_error("the TIFF file is larger than the memory it is written into");
+        else if (data.data() != nullptr)
+            std::memcpy(d_memory.data() + d_size, data.data(), data.size());
+        d_size += data.size();
+    }
+
+    template <typename I>
+    static void f_put(std::byte* const at, I const value) noexcept { std::memcpy(at, &value, sizeof(I)); }
+
+    // Writes an offset: 32 bits in classic TIFF files, 64 bits in BigTIFF files.
+    void f_put_offset(std::byte* const at, std::uint64_t const offset) const noexcept {
+        if (d_big)
+            f_put(at, offset);
+        else
+            f_put(at, static_cast<std::uint32_t>(offset));
+    }
+
+    void f_header(std::uint64_t const first_ifd) {
+        std::array<std::byte,16> header{};
+        header[0] = header[1] = std::byte((std::endian::native == std::endian::little) ? 'I' : 'M');
+        if (d_big) {
+            f_put(&header[2], std::uint16_t(43));
+            f_put(&header[4], std::uint16_t(8));
+            f_put(&header[8], first_ifd);
+        }
+        else {
+            f_put(&header[2], std::uint16_t(42));
+            f_put(&header[4], static_cast<std::uint32_t>(first_ifd));
+        }
+        f_write(std::span(header).first(s_header_size[d_big]));
+    }
+
+    // Writes the IFD of the last image, pointing to the next IFD.
+    void f_ifd(std::uint64_t const next_ifd) {
+        std::size_t const size = s_ifd_size[d_big];
+        f_put_offset(&d_ifd[size - (d_big ? 8 : 4)], next_ifd);
+        f_write(std::span(d_ifd).first(size));
+    }
+
+    // Makes the IFD of an image with the same tags as Grey_tif.
+    void f_make_ifd(std::uint64_t const data_start, POD_type_traits const& type, std::array<long,2> const& dim) {
+        d_ifd.fill(std::byte(0));
+        std::size_t index = 0;
+        if (d_big) {
+            f_put(&d_ifd[0], std::uint64_t(7));
+            index = 8;
+        }
+        else {
+            f_put(&d_ifd[0], std::uint16_t(7));
+            index = 2;
+        }
+        auto const tag = [&](std::uint16_t const tag, std::uint16_t const type, std::uint64_t const value) {
+            f_put(&d_ifd[index], tag);
+            f_put(&d_ifd[index + 2], type);
+            f_put_offset(&d_ifd[index + 4], 1);
+            std::byte* const field = &d_ifd[index + (d_big ? 12 : 8)];
+            if (type == 3)
+                f_put(field, static_cast<std::uint16_t>(value));
+            else if (type == 4)
+                f_put(field, static_cast<std::uint32_t>(value));
+            else
+                f_put(field, value);
+            index += d_big ? 20 : 12;
+        };
+        tag(0x0100, 3, static_cast<std::uint32_t>(dim[0]));
+        tag(0x0101, 3, static_cast<std::uint32_t>(dim[1]));
+        tag(0x0102, 3, 8 * static_cast<std::uint32_t>(type.size));
+        tag(0x0103, 3, 1);
+        tag(0x0106, 3, 1);
+        tag(0x0111, d_big ? 16 : 4, data_start);
+        tag(0x0153, 3, type.is_integral ? (!type.is_signed ? 1 : 2) : 3);
+    }
+};
+
+} // end namespace jpa
+
+#endif /* Grey_tif_writer_h */
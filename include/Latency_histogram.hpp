@@ -0,0 +1,149 @@
+//
+//  Latency_histogram.hpp
+//  Latency_histogram
+//
+
+#ifndef Latency_histogram_h
+#define Latency_histogram_h
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+// Latency_histogram records durations with a bounded relative error, in the style of HdrHistogram: durations are
+// counted in buckets whose width grows with the duration, so that every recorded duration is known to within 1/128
+// (0.8%) from 1 ns to hours, in a fixed amount of memory. Recording is lock-free and can be done concurrently by many
+// threads, which makes it suitable for tail latencies (p99, p99.9) of real-time pipelines.
+//
+//  void record(std::chrono::nanoseconds duration)
+//      Records a duration. Thread-safe.
+//  std::uint64_t count()
+//      Returns the number of recorded durations.
+//  std::chrono::nanoseconds percentile(double p)
+//      Returns the duration below which a fraction 'p' (0 to 1) of the recorded durations lie, rounded up to the upper
+//      bound of its bucket. percentile(0.99) is the p99 latency.
+//  std::chrono::nanoseconds mean(), max()
+//      The mean and the maximum of the recorded durations.
+//  void reset()
+//      Discards all recorded durations.
+//
+// Example:
+//    Latency_histogram latency;
+//    auto const start = std::chrono::steady_clock::now();
+//    compress(frame);
+//    latency.record(std::chrono::steady_clock::now() - start);
+//    std::cout << "p99 " << latency.percentile(0.99).count() << " ns" << std::endl;
+
+namespace jpa {
+
+/**
+ * @class Latency_histogram
+ * @brief A lock-free log-linear histogram of durations with a relative error of at most 1/128.
+ */
+class Latency_histogram {
+    static constexpr unsigned s_sub_bits = 8;                       // 256 linear sub-buckets per power of 2
+    static constexpr std::uint64_t s_sub_count = 1 << s_sub_bits;
+    static constexpr std::uint64_t s_half = s_sub_count / 2;
+    static constexpr std::size_t s_buckets = s_sub_count + (64 - s_sub_bits) * s_half;
+
+public:
+
+    /**
+     * @brief Records a duration.
+     *
+     * @param duration The duration; negative durations are recorded as 0.
+     */
+    void record(std::chrono::nanoseconds const duration) noexcept {
+        std::uint64_t const ns = static_cast<std::uint64_t>(std::max<std::chrono::nanoseconds::rep>(duration.count(), 0));
+        d_counts[f_index(ns)].fetch_add(1, std::memory_order_relaxed);
+        d_count.fetch_add(1, std::memory_order_relaxed);
+        d_sum.fetch_add(ns, std::memory_order_relaxed);
+        for (std::uint64_t max = d_max.load(std::memory_order_relaxed); ns > max && !d_max.compare_exchange_weak(max, ns, std::memory_order_relaxed); );
+    }
+
+    /**
+     * @brief Returns the number of recorded durations.
+     *
+     * @return The number of durations.
+     */
+    std::uint64_t count() const noexcept { return d_count.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Returns a percentile of the recorded durations.
+     *
+     * @param p The fraction of durations, from 0 to 1; for instance 0.99 for the p99 latency.
+     * @return The upper bound of the bucket that holds the percentile, or 0 if nothing has been recorded.
+     */
+    std::chrono::nanoseconds percentile(double const p) const noexcept {
+        std::uint64_t const total = count();
+        if (total == 0)
+            return std::chrono::nanoseconds(0);
+        std::uint64_t const rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(std::ceil(std::clamp(p, 0.0, 1.0) * total)));
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i != s_buckets; ++i) {
+            seen += d_counts[i].load(std::memory_order_relaxed);
+            if (seen >= rank)
+                return std::chrono::nanoseconds(std::min(f_upper_bound(i), d_max.load(std::memory_order_relaxed)));
+        }
+        return max();
+    }
+
+    /**
+     * @brief Returns the mean of the recorded durations.
+     *
+     * @return The mean duration, or 0 if nothing has been recorded.
+     */
+    std::chrono::nanoseconds mean() const noexcept {
+        std::uint64_t const total = count();
+        return std::chrono::nanoseconds(total == 0 ? 0 : d_sum.load(std::memory_order_relaxed) / total);
+    }
+
+    /**
+     * @brief Returns the longest recorded duration.
+     *
+     * @return The maximum duration.
+     */
+    std::chrono::nanoseconds max() const noexcept { return std::chrono::nanoseconds(d_max.load(std::memory_order_relaxed)); }
+
+    /**
+     * @brief Discards all recorded durations. Durations recorded concurrently may or may not be discarded.
+     */
+    void reset() noexcept {
+        for (auto& counter : d_counts)
+            counter.store(0, std::memory_order_relaxed);
+        d_count.store(0, std::memory_order_relaxed);
+        d_sum.store(0, std::memory_order_relaxed);
+        d_max.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    std::array<std::atomic<std::uint64_t>, s_buckets> d_counts{};
+    std::atomic<std::uint64_t> d_count = 0;
+    std::atomic<std::uint64_t> d_sum = 0;
+    std::atomic<std::uint64_t> d_max = 0;
+
+    // Values below s_sub_count have their own bucket. Larger values are shifted right until they fit in the upper half
+    // of the sub-buckets, and the shift selects the group of s_half buckets.
+    static std::size_t f_index(std::uint64_t const value) noexcept {
+        if (value < s_sub_count)
+            return static_cast<std::size_t>(value);
+        unsigned const shift = static_cast<unsigned>(std::bit_width(value)) - s_sub_bits;
+        return static_cast<std::size_t>(s_sub_count + (shift - 1) * s_half + ((value >> shift) - s_half));
+    }
+
+    static std::uint64_t f_upper_bound(std::size_t const index) noexcept {
+        if (index < s_sub_count)
+            return index;
+        unsigned const shift = static_cast<unsigned>((index - s_sub_count) / s_half + 1);
+        std::uint64_t const sub = (index - s_sub_count) % s_half + s_half;
+        return ((sub + 1) << shift) - 1;
+    }
+};
+
+} // end namespace jpa
+
+#endif /* Latency_histogram_h */
@@ -0,0 +1,119 @@
+//
+//  Mapped_file.hpp
+//  Mapped_file
+//
+
+#ifndef Mapped_file_h
+#define Mapped_file_h
+
+#include <span>
+#include <string>
+#include <cstddef>
+#include <filesystem>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Mapped_file creates a file of a known size and maps it into memory for writing, so that data are written straight
+// into the page cache, without an intermediate buffer and a final copy, and so that several threads can fill different
+// parts of the file at the same time. The file is sized with ftruncate() before it is mapped, and on Linux its blocks are
+// allocated with fallocate(), so that a full disk is reported by the constructor rather than by a SIGBUS when a page of
+// the mapping is written.
+//
+//  Mapped_file(std::filesystem::path const& path, std::size_t size)
+//      Creates the file, or truncates an existing file, sizes it to 'size' bytes and maps it. Throws std::system_error
+//      if the file cannot be created, sized or mapped.
+//  std::span<std::byte> data()
+//      Returns the mapped file.
+//  void close()
+//      Unmaps and closes the file. Throws std::system_error if the file cannot be closed. Called by the destructor,
+//      which ignores errors.
+//
+// Example:
+//    Mapped_file npy("frames.npy", header.size() + frames * frame_size);
+//    std::memcpy(npy.data().data(), header.data(), header.size());
+//    trpx.prolix(reinterpret_cast<std::uint16_t*>(npy.data().data() + header.size()), 0);
+//    npy.close();
+
+namespace jpa {
+
+/**
+ * @class Mapped_file
+ * @brief A new file of a known size, mapped into memory for writing.
+ */
+class Mapped_file {
+public:
+
+    /**
+     * @brief Creates a file of 'size' bytes and maps it into memory.
+     *
+     * @param path The file, which is truncated if it exists.
+     * @param size The size of the file in bytes.
+     */
+    Mapped_file(std::filesystem::path const& path, std::size_t const size) :
+    d_size(size) {
+        d_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (d_fd == -1)
+            throw std::system_error(errno, std::generic_category(), "cannot create \"" + path.string() + "\"");
+        if (ftruncate(d_fd, static_cast<off_t>(size)) == -1)
+            f_fail("cannot size \"" + path.string() + "\"");
+#ifdef __linux__
+        // File systems that cannot allocate in advance are left to allocate the blocks as the pages are written
+        if (size != 0 && fallocate(d_fd, 0, 0, static_cast<off_t>(size)) == -1 && errno != EOPNOTSUPP && errno != ENOSYS)
+            f_fail("cannot allocate \"" + path.string() + "\"");
+#endif
+        if (size != 0) {
+            void* const p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, d_fd, 0);
+            if (p == MAP_FAILED)
+                f_fail("cannot map \"" + path.string() + "\"");
+            d_data = static_cast<std::byte*>(p);
+        }
+    }
+
+    Mapped_file(Mapped_file const&) = delete;
+    Mapped_file& operator=(Mapped_file const&) = delete;
+
+    ~Mapped_file() {
+        try {
+            close();
+        }
+        catch (...) {
+        }
+    }
+
+    /**
+     * @brief Returns the mapped file.
+     */
+    std::span<std::byte> data() const noexcept { return {d_data, d_data == nullptr ? 0 : d_size}; }
+
+    /**
+     * @brief Unmaps and closes the file. The data that have been written are left to the page cache to write out.
+     */
+    void close() {
+        if (d_data != nullptr)
+            munmap(d_data, d_size);
+        d_data = nullptr;
+        if (d_fd != -1 && ::close(d_fd) == -1) {
+            d_fd = -1;
+            throw std::system_error(errno, std::generic_category(), "cannot close mapped file");
+        }
+        d_fd = -1;
+    }
+
+private:
+    int d_fd = -1;
+    std::byte* d_data = nullptr;
+    std::size_t const d_size;
+
+    [[noreturn]] void f_fail(std::string const& message) {
+        int const error = errno;
+        ::close(d_fd);
+        d_fd = -1;
+        throw std::system_error(error, std::generic_category(), message);
+    }
+};
+
+} // end namespace jpa
+
+#endif /* Mapped_file_h */
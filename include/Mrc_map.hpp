@@ -0,0 +1,361 @@
+//
+//  Mrc_map.hpp
+//  Mrc_map
+//
+
+#ifndef Mrc_map_h
+#define Mrc_map_h
+
+#include <array>
+#include <bit>
+#include <deque>
+#include <mutex>
+#include <span>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <filesystem>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Grey_tif.hpp"
+#include "Pixel_kernels.hpp"
+
+// Mrc_map gives read-only access to the images of an MRC file (MRC2014, as used for cryo-EM movies, particle stacks
+// (.mrcs) and volumes) by mapping the file into memory. Every section of the file (every z-slice) is an image. The
+// images are returned as Grey_tif_image<std::byte const>, the same raw image type as that of Grey_tif_map, so that
+// the images of MRC and TIFF files are handled by the same code.
+//
+// The file consists of a header of 1024 bytes, an extended header of NSYMBT bytes, and the sections. The pixel type is
+// set by the mode of the file:
+//  mode 0:  8-bit signed integers (unsigned if the file has an IMOD stamp without the signed-bytes flag)
+//  mode 1:  16-bit signed integers
+//  mode 2:  32-bit floats
+//  mode 6:  16-bit unsigned integers
+//  mode 12: 16-bit (half precision) floats, which are converted to 32-bit floats
+// Other modes (complex values and 4-bit pixels) throw std::runtime_error. The byte order of the file is taken from
+// its machine stamp, or, if that is not set, from the mode.
+//
+//  Mrc_map(std::filesystem::path const& path, std::size_t cache_images = 2)
+//      Maps an MRC file. Throws std::system_error if it cannot be mapped, and std::runtime_error if it is not an MRC
+//      file of a supported mode. 'cache_images' is the number of converted images that are kept.
+//  std::size_t image_stack_size()
+//      Returns the number of images (sections).
+//  Grey_tif_image<std::byte const> image(std::size_t i)
+//  Grey_tif_image<T const> image<T>(std::size_t i)
+//  Grey_tif_image<std::byte const> image(std::size_t i, std::vector<std::byte>& buffer)
+//      Returns image 'i', as Grey_tif_map does: images of files in the native byte order are spans over the mapped
+//      pages; other images are byte-swapped or converted into a small cache of the most recently requested images,
+//      or into 'buffer'. Throws std::out_of_range if there is no image 'i'.
+//  void prefetch(std::size_t i)
+//  void release(std::size_t i)
+//      Asks the kernel to start reading the pixels of image 'i', or tells it that they are no longer needed.
+//  int mode()
+//      Returns the mode of the file.
+//  std::span<std::byte const> header()
+//  std::span<std::byte const> extended_header()
+//      Return the header of 1024 bytes and the extended header, in the byte order of the file.
+//  bool native()
+//      Returns true if the file is in the native byte order and of a mode other than 12, so that images are not copied.
+//  std::size_t raw_data_size()
+//      Returns the size of the file in bytes.
+//
+// All member functions are thread-safe.
+//
+// Example:
+//    Mrc_map const movie("movie.mrc");
+//    Terse compressed;
+//    for (std::size_t i = 0; i != movie.image_stack_size(); ++i) {
+//        movie.prefetch(i + 1);
+//        compressed.push_back(movie.image<std::int16_t>(i));
+//    }
+
+namespace jpa {
+
+/**
+ * @class Mrc_map
+ * @brief A read-only MRC file mapped into memory, of which every section is an image.
+ */
+class Mrc_map {
+public:
+
+    /**
+     * @brief Maps an MRC file into memory, and checks its header.
+     *
+     * @param path The MRC file.
+     * @param cache_images The number of converted images that are kept (at least 1).
+     */
+    explicit Mrc_map(std::filesystem::path const& path, std::size_t const cache_images = 2) :
+    d_cache_images(std::max<std::size_t>(cache_images, 1)) {
+        int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            throw std::system_error(errno, std::generic_category(), "cannot open \"" + path.string() + "\"");
+        struct stat status;
+        if (fstat(fd, &status) == -1) {
+            int const error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "cannot stat \"" + path.string() + "\"");
+        }
+        d_size = static_cast<std::size_t>(status.st_size);
+        if (d_size >= s_header_size) {
+            void* const p = mmap(nullptr, d_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                int const error = errno;
+                ::close(fd);
+                throw std::system_error(error, std::generic_category(), "cannot map \"" + path.string() + "\"");
+            }
+            d_data = static_cast<std::byte const*>(p);
+        }
+        ::close(fd);
+        try {
+            f_parse_header();
+        }
+        catch (...) {
+            f_unmap();
+            throw;
+        }
+    }
+
+    Mrc_map(Mrc_map const&) = delete;
+    Mrc_map& operator=(Mrc_map const&) = delete;
+
+    ~Mrc_map() {
+        f_unmap();
+    }
+
+    /**
+     * @brief Returns the number of images, which is the number of sections of the file.
+     *
+     * @return The number of images.
+     */
+    std::size_t image_stack_size() const noexcept { return d_images; }
+
+    /**
+     * @brief Returns an image as a raw image, of which the pixel type is determined at runtime.
+     *
+     * @param i The index of the image in the stack.
+     * @return The image.
+     */
+    Grey_tif_image<std::byte const> image(std::size_t const i) const {
+        f_check(i);
+        if (f_mapped(i))
+            return Grey_tif_image<std::byte const>(d_type, d_dim, std::span<std::byte const>(f_pixels(i), f_image_bytes()));
+        std::lock_guard lock(d_mutex);
+        return Grey_tif_image<std::byte const>(d_type, d_dim, f_cached(i));
+    }
+
+    /**
+     * @brief Returns an image with a compile-time pixel type.
+     *
+     * @tparam T The pixel type; image(i).type().is<T>() must be true.
+     * @param i The index of the image in the stack.
+     * @return The image.
+     */
+    template <typename T>
+    Grey_tif_image<T const> image(std::size_t const i) const {
+        return static_cast<Grey_tif_image<T const>>(image(i));
+    }
+
+    /**
+     * @brief Returns an image as a raw image, converting it in a buffer of the caller if it cannot be mapped.
+     *
+     * @param i The index of the image in the stack.
+     * @param buffer The buffer that receives the pixels of an image that cannot be mapped.
+     * @return The image, which stays valid until 'buffer' is changed.
+     */
+    Grey_tif_image<std::byte const> image(std::size_t const i, std::vector<std::byte>& buffer) const {
+        f_check(i);
+        if (f_mapped(i))
+            return Grey_tif_image<std::byte const>(d_type, d_dim, std::span<std::byte const>(f_pixels(i), f_image_bytes()));
+        buffer.resize(f_image_bytes());
+        f_convert(i, buffer.data());
+        return Grey_tif_image<std::byte const>(d_type, d_dim, std::span<std::byte const>(buffer));
+    }
+
+    /**
+     * @brief Asks the kernel to read the pixels of an image ahead of their use.
+     *
+     * @param i The index of the image in the stack; nothing happens if there is no such image.
+     */
+    void prefetch(std::size_t const i) const {
+        if (i >= d_images)
+            return;
+        std::size_t const page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        std::size_t const begin = f_offset(i) / page * page;
+        madvise(const_cast<std::byte*>(d_data) + begin, f_offset(i) + f_file_bytes() - begin, MADV_WILLNEED);
+    }
+
+    /**
+     * @brief Tells the kernel that the pixels of an image are no longer needed.
+     *
+     * Only the pages that lie entirely within the image are released, so that neighbouring images are not affected.
+     *
+     * @param i The index of the image in the stack; nothing happens if there is no such image.
+     */
+    void release(std::size_t const i) const {
+        if (i >= d_images)
+            return;
+        std::size_t const page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        std::size_t const first = (f_offset(i) + page - 1) / page * page;
+        std::size_t const last = (f_offset(i) + f_file_bytes()) / page * page;
+        if (first < last)
+            madvise(const_cast<std::byte*>(d_data) + first, last - first, MADV_DONTNEED);
+    }
+
+    /**
+     * @brief Returns the mode of the file, which defines the pixel type.
+     */
+    int mode() const noexcept { return d_mode; }
+
+    /**
+     * @brief Returns the header of 1024 bytes, in the byte order of the file.
+     */
+    std::span<std::byte const> header() const noexcept { return {d_data, s_header_size}; }
+
+    /**
+     * @brief Returns the extended header, in the byte order of the file.
+     */
+    std::span<std::byte const> extended_header() const noexcept { return {d_data + s_header_size, d_offset - s_header_size}; }
+
+    /**
+     * @brief Returns true if the images are spans over the mapped file, without being copied.
+     */
+    bool native() const noexcept { return d_native && d_mode != 12; }
+
+    /**
+     * @brief Returns the size of the MRC file.
+     *
+     * @return The number of bytes of the file.
+     */
+    std::size_t raw_data_size() const noexcept { return d_size; }
+
+private:
+    static constexpr std::size_t s_header_size = 1024;
+    static constexpr std::uint32_t s_imod_stamp = 1146047817;
+
+    std::byte const* d_data = nullptr;
+    std::size_t d_size = 0;
+    bool d_little = true;  // the byte order of the file
+    bool d_native = true;
+    int d_mode = 0;
+    POD_type_traits d_type;
+    std::array<long,2> d_dim = {0, 0};
+    std::size_t d_images = 0;
+    std::size_t d_offset = 0;   // of the first section
+    std::size_t const d_cache_images;
+    mutable std::mutex d_mutex;
+    mutable std::deque<std::pair<std::size_t, std::vector<std::byte>>> d_cache; // most recently requested first
+
+    void f_unmap() noexcept {
+        if (d_data != nullptr)
+            munmap(const_cast<std::byte*>(d_data), d_size);
+        d_data = nullptr;
+    }
+
+    // Reads a 32-bit word of the header in the byte order of the file.
+    std::uint32_t f_word(std::size_t const offset) const noexcept {
+        std::uint32_t value = 0;
+        for (unsigned i = 0; i != 4; ++i)
+            value |= std::uint32_t(d_data[offset + (d_little ? i : 3 - i)]) << (8 * i);
+        return value;
+    }
+
+    static bool f_supported(std::uint32_t const mode) noexcept {
+        return mode == 0 || mode == 1 || mode == 2 || mode == 6 || mode == 12;
+    }
+
+    // The MRC2014 machine stamp is 0x44 0x44 for little-endian files and 0x11 0x11 for big-endian files. Older files
+    // may not set it, but their mode is a small number in the right byte order.
+    void f_parse_header() {
+        if (d_size < s_header_size)
+            throw std::runtime_error("Not an MRC file\n");
+        if (d_data[212] == std::byte(0x44) || d_data[212] == std::byte(0x11))
+            d_little = d_data[212] == std::byte(0x44);
+        else {
+            d_little = true;
+            if (f_word(12) > 0xffff)
+                d_little = false;
+        }
+        d_native = d_little == (std::endian::native == std::endian::little);
+        std::int32_t const nx = static_cast<std::int32_t>(f_word(0));
+        std::int32_t const ny = static_cast<std::int32_t>(f_word(4));
+        std::int32_t const nz = static_cast<std::int32_t>(f_word(8));
+        std::int32_t const nsymbt = static_cast<std::int32_t>(f_word(92));
+        if (nx <= 0 || ny <= 0 || nz < 0 || nsymbt < 0)
+            throw std::runtime_error("Not an MRC file\n");
+        d_mode = static_cast<int>(f_word(12));
+        if (!f_supported(f_word(12)))
+            throw std::runtime_error("MRC files of mode " + std::to_string(f_word(12)) + " are not supported\n");
+        bool const unsigned_bytes = f_word(152) == s_imod_stamp && (f_word(156) & 1) == 0;
+        switch (d_mode) {
+            case 0:  d_type = {.size = 1, .is_signed = !unsigned_bytes, .is_integral = true}; break;
+            case 1:  d_type = {.size = 2, .is_signed = true, .is_integral = true}; break;
+            case 6:  d_type = {.size = 2, .is_signed = false, .is_integral = true}; break;
+            default: d_type = {.size = 4, .is_signed = true, .is_integral = false}; break;
+        }
+        d_dim = {nx, ny};
+        d_images = static_cast<std::size_t>(nz);
+        d_offset = s_header_size + static_cast<std::size_t>(nsymbt);
+        if (d_offset + d_images * f_file_bytes() > d_size)
+            throw std::runtime_error("Incompatible MRC file: the file is smaller than its header specifies\n");
+    }
+
+    void f_check(std::size_t const i) const {
+        if (i >= d_images)
+            throw std::out_of_range("MRC file has no image " + std::to_string(i));
+    }
+
+    // The number of bytes of an image in the file, and in memory.
+    std::size_t f_file_bytes() const noexcept { return d_dim[0] * d_dim[1] * (d_mode == 12 ? 2 : d_type.size); }
+    std::size_t f_image_bytes() const noexcept { return d_dim[0] * d_dim[1] * d_type.size; }
+    std::size_t f_offset(std::size_t const i) const noexcept { return d_offset + i * f_file_bytes(); }
+    std::byte const* f_pixels(std::size_t const i) const noexcept { return d_data + f_offset(i); }
+
+    // Returns true if an image can be used straight from the mapped file.
+    bool f_mapped(std::size_t const i) const noexcept {
+        return native() && reinterpret_cast<std::uintptr_t>(f_pixels(i)) % d_type.size == 0;
+    }
+
+    // Copies the pixels of an image to 'pixels', in native byte order, converting half precision floats to floats.
+    void f_convert(std::size_t const i, std::byte* const pixels) const {
+        std::size_t const values = d_dim[0] * d_dim[1];
+        if (d_mode == 12) {
+            if (d_native)
+                pixel_kernels::half_to_float(f_pixels(i), pixels, values);
+            else {
+                std::vector<std::byte> swapped(2 * values);
+                pixel_kernels::byte_swap(f_pixels(i), swapped.data(), values, 2);
+                pixel_kernels::half_to_float(swapped.data(), pixels, values);
+            }
+        }
+        else if (d_native)
+            std::memcpy(pixels, f_pixels(i), f_image_bytes());
+        else
+            pixel_kernels::byte_swap(f_pixels(i), pixels, values, d_type.size);
+    }
+
+    // Returns the cached copy of image 'i', in native byte order, making it if it is not cached.
+    std::span<std::byte const> f_cached(std::size_t const i) const {
+        for (auto it = d_cache.begin(); it != d_cache.end(); ++it)
+            if (it->first == i) {
+                std::rotate(d_cache.begin(), it, std::next(it)); // moving a vector keeps its pixels in place
+                return d_cache.front().second;
+            }
+        std::vector<std::byte> pixels(f_image_bytes());
+        f_convert(i, pixels.data());
+        if (d_cache.size() == d_cache_images)
+            d_cache.pop_back();
+        d_cache.emplace_front(i, std::move(pixels));
+        return d_cache.front().second;
+    }
+};
+
+} // end namespace jpa
+
+#endif /* Mrc_map_h */
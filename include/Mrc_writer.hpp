@@ -0,0 +1,344 @@
+//
+//  Mrc_writer.hpp
+//  Mrc_writer
+//
+
+#ifndef Mrc_writer_h
+#define Mrc_writer_h
+
+#include <array>
+#include <bit>
+#include <span>
+#include <limits>
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include <ostream>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <iterator>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+#include "Grey_tif.hpp"
+#include "Pixel_kernels.hpp"
+
+// Mrc_writer writes a stack of images as an MRC2014 file, one image at a time, so that a stack never has to be held in
+// memory. Every image is a section of the file, so the images must all have the same size and pixel type. The header
+// holds the number of sections and the minimum, maximum, mean and RMS deviation of the pixels, which are only known
+// when the last image has been written: on a stream that can seek, the header is rewritten by close(). On a stream that
+// cannot seek, like a pipe, the header is written with the expected number of images, and the statistics are marked as
+// not determined, as MRC2014 allows.
+//
+// The pixel type of the images defines the mode of the file:
+//  std::int8_t:   mode 0
+//  std::uint8_t:  mode 0, with an IMOD stamp that marks the bytes as unsigned
+//  std::int16_t:  mode 1
+//  float:         mode 2
+//  std::uint16_t: mode 6
+// Half precision floats (mode 12) can be written as raw pixels, with write(pixels, 12, dim).
+//
+//  Mrc_writer(std::ostream& out, std::size_t expected_images = 0)
+//      Constructs a writer for a new MRC file. 'expected_images' is the number of images in the header if 'out' cannot
+//      seek; it is ignored otherwise.
+//  void write(Container const& image, std::array<long,2> dim = {-1,-1})
+//      Writes an image of one of the pixel types above. If the container has a member function dim(), 'dim' may be
+//      omitted. 'dim' is {width, height}, as Grey_tif_image::dim().
+//  void write(std::span<std::byte const> pixels, POD_type_traits const& type, std::array<long,2> dim)
+//      Writes an image of which the pixel type is determined at runtime. Throws std::invalid_argument for pixel types
+//      that MRC files cannot hold.
+//  void write(std::span<std::byte const> pixels, int mode, std::array<long,2> dim)
+//      Writes an image in native byte order of mode 0 (signed bytes), 1, 2, 6 or 12.
+//  void close()
+//      Writes the header, if the stream can seek. Called by the destructor; no images can be written afterwards. Throws
+//      std::length_error if the stream cannot seek and the number of images is not the expected number.
+//  std::size_t image_stack_size()
+//      Returns the number of images written so far.
+//  static std::array<std::byte, 1024> header(POD_type_traits const& type, std::array<long,2> dim, std::size_t images)
+//      Returns the header of an MRC stack of 'images' images, with its statistics marked as not determined, for stacks
+//      of which the images are written or served by other means.
+//
+// Images of a different size or mode than the first image throw std::invalid_argument.
+//
+// Example:
+//    std::ofstream file("movie.mrc", std::ios::binary);
+//    Mrc_writer mrc(file);
+//    std::vector<std::uint16_t> frame(4096 * 4096);
+//    for (std::size_t i = 0; i != trpx.number_of_frames(); ++i) {
+//        trpx.prolix(frame, i);
+//        mrc.write(frame, {4096, 4096});
+//    }
+//    mrc.close();
+
+namespace jpa {
+
+/**
+ * @class Mrc_writer
+ * @brief Writes an MRC stack image by image, without holding the stack in memory.
+ */
+class Mrc_writer {
+public:
+
+    /**
+     * @brief Constructs a writer that writes an MRC file to a stream.
+     *
+     * @param out The stream. It must outlive the writer.
+     * @param expected_images The number of images that is written in the header if the stream cannot seek.
+     */
+    explicit Mrc_writer(std::ostream& out, std::size_t const expected_images = 0) :
+    d_out(out),
+    d_start(out.tellp()),
+    d_expected_images(expected_images) {}
+
+    Mrc_writer(Mrc_writer const&) = delete;
+    Mrc_writer& operator=(Mrc_writer const&) = delete;
+
+    ~Mrc_writer() {
+        try {
+            close();
+        }
+        catch (...) {
+        }
+    }
+
+    /**
+     * @brief Writes an image from a container of pixels.
+     *
+     * @tparam C The type of the container.
+     * @param image The pixels.
+     * @param dim The width and height of the image; may be omitted if the container has a member function dim().
+     */
+    template <typename C> requires requires (C const& c) {std::begin(c), std::end(c), std::size(c);}
+    void write(C const& image, std::array<long,2> dim = {-1,-1}) {
+        using CT = std::remove_cv_t<typename C::value_type>;
+        static_assert (std::is_same_v<CT, std::int8_t> || std::is_same_v<CT, std::uint8_t> || std::is_same_v<CT, std::int16_t> ||
+                       std::is_same_v<CT, std::uint16_t> || std::is_same_v<CT, float>,
+                       "Only signed & unsigned 8- and 16-bit integers and floats allowed in MRC image data");
+        if constexpr (requires(C const& c) { c.dim().size();})
+            if (dim[0] == -1 && dim[1] == -1) {
+                assert(image.dim().size() == 2); // Mrc_writer.write(container) only accepts 2D containers
+                dim[0] = image.dim()[0];
+                dim[1] = image.dim()[1];
+            }
+        POD_type_traits const type{.size = sizeof(CT), .is_signed = std::is_signed_v<CT>, .is_integral = std::is_integral_v<CT>};
+        if constexpr (std::contiguous_iterator<decltype(std::begin(image))>)
+            write(std::as_bytes(std::span(std::to_address(std::begin(image)), std::size(image))), type, dim);
+        else {
+            std::vector<CT> pixels(std::begin(image), std::end(image));
+            write(std::as_bytes(std::span(pixels)), type, dim);
+        }
+    }
+
+    /**
+     * @brief Writes an image of which the pixel type is determined at runtime.
+     *
+     * @param pixels The pixels, in native byte order.
+     * @param type The pixel type: signed or unsigned 8- or 16-bit integers, or floats.
+     * @param dim The width and height of the image.
+     */
+    void write(std::span<std::byte const> const pixels, POD_type_traits const& type, std::array<long,2> const& dim) {
+        f_write(pixels, f_mode(type), type.is<std::uint8_t>(), dim);
+    }
+
+    /**
+     * @brief Writes an image of an MRC mode.
+     *
+     * @param pixels The pixels, in native byte order.
+     * @param mode The mode: 0 (signed bytes), 1, 2, 6 or 12.
+     * @param dim The width and height of the image.
+     */
+    void write(std::span<std::byte const> const pixels, int const mode, std::array<long,2> const& dim) {
+        if (mode != 0 && mode != 1 && mode != 2 && mode != 6 && mode != 12)
+            throw std::invalid_argument("MRC mode " + std::to_string(mode) + " cannot be written");
+        f_write(pixels, mode, false, dim);
+    }
+
+    /**
+     * @brief Writes the header, if the stream can seek. No images can be written afterwards.
+     */
+    void close() {
+        if (d_closed)
+            return;
+        d_closed = true;
+        if (d_images == 0)
+            return;
+        if (d_start == std::streampos(-1)) {
+            if (d_images != d_expected_images)
+                throw std::length_error("the header of the MRC file holds " + std::to_string(d_expected_images) + " images, but " +
+                                        std::to_string(d_images) + " have been written");
+            return;
+        }
+        std::streampos const end = d_out.tellp();
+        d_out.seekp(d_start);
+        f_header(d_images, true);
+        d_out.seekp(end);
+        d_out.flush();
+        if (!d_out)
+            throw std::runtime_error("writing MRC header failed");
+    }
+
+    /**
+     * @brief Returns the number of images written so far.
+     */
+    std::size_t image_stack_size() const noexcept { return d_images; }
+
+    /**
+     * @brief Returns the header of an MRC stack, with its statistics marked as not determined.
+     *
+     * @param type The pixel type: signed or unsigned 8- or 16-bit integers, or floats.
+     * @param dim The width and height of the images.
+     * @param images The number of images.
+     * @return The header, in native byte order.
+     */
+    static std::array<std::byte, 1024> header(POD_type_traits const& type, std::array<long,2> const& dim, std::size_t const images) {
+        return f_make_header(f_mode(type), type.is<std::uint8_t>(), dim, images, {});
+    }
+
+private:
+    static constexpr std::size_t s_header_size = 1024;
+    static constexpr std::uint32_t s_imod_stamp = 1146047817;
+
+    std::ostream& d_out;
+    std::streampos const d_start;
+    std::size_t const d_expected_images;
+    std::size_t d_images = 0;
+    bool d_closed = false;
+    int d_mode = 0;
+    bool d_unsigned_bytes = false;
+    std::array<long,2> d_dim = {0, 0};
+    double d_min = std::numeric_limits<double>::infinity();
+    double d_max = -std::numeric_limits<double>::infinity();
+    double d_sum = 0;
+    double d_sum_of_squares = 0;
+
+    void f_write(std::span<std::byte const> const pixels, int const mode, bool const unsigned_bytes, std::array<long,2> const& dim) {
+        if (d_closed)
+            throw std::logic_error("image written to a closed Mrc_writer");
+        std::size_t const values = dim[0] * dim[1];
+        assert(pixels.size() == values * (mode == 0 ? 1 : mode == 2 ? 4 : 2));
+        if (d_images == 0) {
+            d_mode = mode;
+            d_unsigned_bytes = unsigned_bytes;
+            d_dim = dim;
+            f_header(d_start == std::streampos(-1) ? d_expected_images : 0, false);
+        }
+        else if (mode != d_mode || unsigned_bytes != d_unsigned_bytes || dim != d_dim)
+            throw std::invalid_argument("all images of an MRC file must have the same size and pixel type");
+        if (d_start != std::streampos(-1))
+            f_statistics(pixels, values);
+        if (!d_out.write(reinterpret_cast<char const*>(pixels.data()), static_cast<std::streamsize>(pixels.size())))
+            throw std::runtime_error("writing MRC file failed");
+        ++d_images;
+    }
+
+    static int f_mode(POD_type_traits const& type) {
+        if (type.is<std::int8_t>() || type.is<std::uint8_t>()) return 0;
+        if (type.is<std::int16_t>())  return 1;
+        if (type.is<float>())         return 2;
+        if (type.is<std::uint16_t>()) return 6;
+        throw std::invalid_argument("MRC files cannot hold pixels of " + std::to_string(8 * type.size) + "-bit " +
+                                    (type.is_integral ? "integers" : "floating point values"));
+    }
+
+    template <typename T>
+    void f_accumulate(std::span<std::byte const> const pixels, std::size_t const values) {
+        double min = d_min, max = d_max, sum = 0, sum_of_squares = 0;
+        for (std::size_t i = 0; i != values; ++i) {
+            T value;
+            std::memcpy(&value, pixels.data() + i * sizeof(T), sizeof(T));
+            double const v = [&] {
+                if constexpr (std::is_same_v<T, std::uint16_t>)
+                    if (d_mode == 12)
+                        return static_cast<double>(pixel_kernels::f_half_to_float(value));
+                return static_cast<double>(value);
+            }();
+            min = std::min(min, v);
+            max = std::max(max, v);
+            sum += v;
+            sum_of_squares += v * v;
+        }
+        d_min = min;
+        d_max = max;
+        d_sum += sum;
+        d_sum_of_squares += sum_of_squares;
+    }
+
+    void f_statistics(std::span<std::byte const> const pixels, std::size_t const values) {
+        switch (d_mode) {
+            case 0:  d_unsigned_bytes ? f_accumulate<std::uint8_t>(pixels, values) : f_accumulate<std::int8_t>(pixels, values); break;
+            case 1:  f_accumulate<std::int16_t>(pixels, values); break;
+            case 2:  f_accumulate<float>(pixels, values); break;
+            default: f_accumulate<std::uint16_t>(pixels, values); break; // mode 6, and mode 12 (converted)
+        }
+    }
+
+    template <typename I>
+    static void f_put(std::byte* const at, I const value) noexcept { std::memcpy(at, &value, sizeof(I)); }
+
+    // Writes the header.
+    void f_header(std::size_t const images, bool const statistics) {
+        double const count = static_cast<double>(images) * d_dim[0] * d_dim[1];
+        std::optional<std::array<float,4>> summary;
+        if (statistics && count > 0) {
+            double const mean = d_sum / count;
+            summary = {static_cast<float>(d_min), static_cast<float>(d_max), static_cast<float>(mean),
+                       static_cast<float>(std::sqrt(std::max(0.0, d_sum_of_squares / count - mean * mean)))};
+        }
+        std::array<std::byte, s_header_size> const header = f_make_header(d_mode, d_unsigned_bytes, d_dim, images, summary);
+        if (!d_out.write(reinterpret_cast<char const*>(header.data()), static_cast<std::streamsize>(header.size())))
+            throw std::runtime_error("writing MRC header failed");
+    }
+
+    // Makes a header in native byte order, with the minimum, maximum, mean and RMS deviation of the pixels if they are
+    // known. Otherwise, DMAX < DMIN, DMEAN < DMIN and RMS < 0 mark them as not determined.
+    static std::array<std::byte, s_header_size> f_make_header(int const mode, bool const unsigned_bytes, std::array<long,2> const& dim,
+                                                              std::size_t const images, std::optional<std::array<float,4>> const& statistics) {
+        std::array<std::byte, s_header_size> header{};
+        auto const word = [&](std::size_t const number) { return &header[4 * (number - 1)]; };
+        std::int32_t const nx = static_cast<std::int32_t>(dim[0]);
+        std::int32_t const ny = static_cast<std::int32_t>(dim[1]);
+        std::int32_t const nz = static_cast<std::int32_t>(images);
+        f_put(word(1), nx);
+        f_put(word(2), ny);
+        f_put(word(3), nz);
+        f_put(word(4), std::int32_t(mode));
+        f_put(word(8), nx);     // MX, MY, MZ: the sampling of the cell
+        f_put(word(9), ny);
+        f_put(word(10), nz);
+        f_put(word(11), float(nx)); // the cell dimensions, for a pixel size of 1 Angstrom
+        f_put(word(12), float(ny));
+        f_put(word(13), float(nz));
+        f_put(word(14), 90.0f);
+        f_put(word(15), 90.0f);
+        f_put(word(16), 90.0f);
+        f_put(word(17), std::int32_t(1)); // MAPC, MAPR, MAPS
+        f_put(word(18), std::int32_t(2));
+        f_put(word(19), std::int32_t(3));
+        if (statistics) {
+            f_put(word(20), (*statistics)[0]);
+            f_put(word(21), (*statistics)[1]);
+            f_put(word(22), (*statistics)[2]);
+            f_put(word(55), (*statistics)[3]);
+        }
+        else {
+            f_put(word(20), 0.0f);
+            f_put(word(21), -1.0f);
+            f_put(word(22), -2.0f);
+            f_put(word(55), -1.0f);
+        }
+        f_put(word(23), std::int32_t(0));     // ISPG: a stack of images
+        f_put(word(28), std::int32_t(20141)); // NVERSION
+        if (mode == 0) {
+            f_put(word(39), s_imod_stamp);
+            f_put(word(40), std::int32_t(unsigned_bytes ? 0 : 1)); // bit 0: the bytes are signed
+        }
+        std::memcpy(word(53), "MAP ", 4);
+        header[212] = header[213] = std::byte(std::endian::native == std::endian::little ? 0x44 : 0x11);
+        return header;
+    }
+};
+
+} // end namespace jpa
+
+#endif /* Mrc_writer_h */
@@ -0,0 +1,419 @@
+//
+//  Npy_map.hpp
+//  Npy_map
+//
+
+#ifndef Npy_map_h
+#define Npy_map_h
+
+#include <array>
+#include <bit>
+#include <deque>
+#include <mutex>
+#include <span>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <filesystem>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Grey_tif.hpp"
+#include "Pixel_kernels.hpp"
+
+// Npy_map gives read-only access to the frames of a NumPy .npy file, or of a headerless raw file of which the frame size
+// and pixel type are known, by mapping the file into memory. The last two axes of an array are the rows and columns of
+// a frame, and all other axes count frames: an array of shape (ny, nx) is a single frame, and an array of shape
+// (n, ny, nx) is a stack of n frames. The frames are returned as Grey_tif_image<std::byte const>, the same raw image
+// type as that of Grey_tif_map and Mrc_map, so that they are handled by the same code.
+//
+// The .npy dtypes i1, u1, b1, i2, u2, i4, u4, f4 and f8 are supported in either byte order, and f2 (half precision
+// floats), which is converted to f4. Fortran-ordered arrays and 64-bit integers throw std::runtime_error. Raw files
+// are in the native byte order.
+//
+//  Npy_map(std::filesystem::path const& path, std::size_t cache_images = 2)
+//      Maps a .npy file. Throws std::system_error if it cannot be mapped, and std::runtime_error if it is not a .npy
+//      file of a supported dtype. 'cache_images' is the number of converted images that are kept.
+//  Npy_map(std::filesystem::path const& path, POD_type_traits const& type, std::array<long,2> const& dim,
+//          std::size_t cache_images = 2)
+//      Maps a raw file of frames of dim[0] x dim[1] pixels of 'type'. Throws std::runtime_error if the file does not
+//      hold a whole number of frames.
+//  std::size_t image_stack_size()
+//      Returns the number of frames.
+//  Grey_tif_image<std::byte const> image(std::size_t i)
+//  Grey_tif_image<T const> image<T>(std::size_t i)
+//  Grey_tif_image<std::byte const> image(std::size_t i, std::vector<std::byte>& buffer)
+//  void prefetch(std::size_t i)
+//  void release(std::size_t i)
+//      As for Mrc_map.
+//  std::vector<std::size_t> const& shape()
+//      Returns the shape of the array (for raw files: the number of frames, dim[1] and dim[0]).
+//  bool native()
+//      Returns true if the images are spans over the mapped file, without being copied.
+//  std::size_t raw_data_size()
+//      Returns the size of the file in bytes.
+//  static std::string header(POD_type_traits const& type, std::vector<std::size_t> const& shape)
+//      Returns the header of a .npy file (version 1.0) of a C-ordered array of 'shape', with pixels of 'type' in
+//      native byte order. Its size is a multiple of 64 bytes, so that the pixels that follow it are aligned.
+//
+// All member functions are thread-safe.
+//
+// Example:
+//    Npy_map const movie("movie.npy");
+//    Terse compressed;
+//    for (std::size_t i = 0; i != movie.image_stack_size(); ++i)
+//        compressed.push_back(movie.image<std::uint16_t>(i));
+
+namespace jpa {
+
+/**
+ * @class Npy_map
+ * @brief A read-only NumPy .npy file or raw file mapped into memory, of which the frames are images.
+ */
+class Npy_map {
+public:
+
+    /**
+     * @brief Maps a .npy file into memory, and checks its header.
+     *
+     * @param path The .npy file.
+     * @param cache_images The number of converted images that are kept (at least 1).
+     */
+    explicit Npy_map(std::filesystem::path const& path, std::size_t const cache_images = 2) :
+    d_cache_images(std::max<std::size_t>(cache_images, 1)) {
+        f_map(path);
+        try {
+            f_parse_header();
+        }
+        catch (...) {
+            f_unmap();
+            throw;
+        }
+    }
+
+    /**
+     * @brief Maps a raw file of frames of a known size and pixel type, in native byte order.
+     *
+     * @param path The raw file.
+     * @param type The pixel type.
+     * @param dim The width and height of the frames.
+     * @param cache_images The number of converted images that are kept (at least 1).
+     */
+    Npy_map(std::filesystem::path const& path, POD_type_traits const& type, std::array<long,2> const& dim,
+            std::size_t const cache_images = 2) :
+    d_type(type),
+    d_dim(dim),
+    d_cache_images(std::max<std::size_t>(cache_images, 1)) {
+        if (dim[0] <= 0 || dim[1] <= 0)
+            throw std::runtime_error("raw files require the width and height of the frames\n");
+        f_map(path);
+        d_images = d_size / f_file_bytes();
+        if (d_size % f_file_bytes() != 0) {
+            f_unmap();
+            throw std::runtime_error("the file ends with an incomplete frame\n");
+        }
+        d_shape = {d_images, std::size_t(dim[1]), std::size_t(dim[0])};
+    }
+
+    Npy_map(Npy_map const&) = delete;
+    Npy_map& operator=(Npy_map const&) = delete;
+
+    ~Npy_map() {
+        f_unmap();
+    }
+
+    /**
+     * @brief Returns the number of images, which is the product of all but the last two axes of the array.
+     *
+     * @return The number of images.
+     */
+    std::size_t image_stack_size() const noexcept { return d_images; }
+
+    /**
+     * @brief Returns an image as a raw image, of which the pixel type is determined at runtime.
+     *
+     * @param i The index of the image in the stack.
+     * @return The image.
+     */
+    Grey_tif_image<std::byte const> image(std::size_t const i) const {
+        f_check(i);
+        if (f_mapped(i))
+            return Grey_tif_image<std::byte const>(d_type, d_dim, std::span<std::byte const>(f_pixels(i), f_image_bytes()));
+        std::lock_guard lock(d_mutex);
+        return Grey_tif_image<std::byte const>(d_type, d_dim, f_cached(i));
+    }
+
+    /**
+     * @brief Returns an image with a compile-time pixel type.
+     *
+     * @tparam T The pixel type; image(i).type().is<T>() must be true.
+     * @param i The index of the image in the stack.
+     * @return The image.
+     */
+    template <typename T>
+    Grey_tif_image<T const> image(std::size_t const i) const {
+        return static_cast<Grey_tif_image<T const>>(image(i));
+    }
+
+    /**
+     * @brief Returns an image as a raw image, converting it in a buffer of the caller if it cannot be mapped.
+     *
+     * @param i The index of the image in the stack.
+     * @param buffer The buffer that receives the pixels of an image that cannot be mapped.
+     * @return The image, which stays valid until 'buffer' is changed.
+     */
+    Grey_tif_image<std::byte const> image(std::size_t const i, std::vector<std::byte>& buffer) const {
+        f_check(i);
+        if (f_mapped(i))
+            return Grey_tif_image<std::byte const>(d_type, d_dim, std::span<std::byte const>(f_pixels(i), f_image_bytes()));
+        buffer.resize(f_image_bytes());
+        f_convert(i, buffer.data());
+        return Grey_tif_image<std::byte const>(d_type, d_dim, std::span<std::byte const>(buffer));
+    }
+
+    /**
+     * @brief Asks the kernel to read the pixels of an image ahead of their use.
+     *
+     * @param i The index of the image in the stack; nothing happens if there is no such image.
+     */
+    void prefetch(std::size_t const i) const {
+        if (i >= d_images)
+            return;
+        std::size_t const page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        std::size_t const begin = f_offset(i) / page * page;
+        madvise(const_cast<std::byte*>(d_data) + begin, f_offset(i) + f_file_bytes() - begin, MADV_WILLNEED);
+    }
+
+    /**
+     * @brief Tells the kernel that the pixels of an image are no longer needed.
+     *
+     * Only the pages that lie entirely within the image are released, so that neighbouring images are not affected.
+     *
+     * @param i The index of the image in the stack; nothing happens if there is no such image.
+     */
+    void release(std::size_t const i) const {
+        if (i >= d_images)
+            return;
+        std::size_t const page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        std::size_t const first = (f_offset(i) + page - 1) / page * page;
+        std::size_t const last = (f_offset(i) + f_file_bytes()) / page * page;
+        if (first < last)
+            madvise(const_cast<std::byte*>(d_data) + first, last - first, MADV_DONTNEED);
+    }
+
+    /**
+     * @brief Returns the shape of the array, slowest varying axis first.
+     */
+    std::vector<std::size_t> const& shape() const noexcept { return d_shape; }
+
+    /**
+     * @brief Returns true if the images are spans over the mapped file, without being copied.
+     */
+    bool native() const noexcept { return d_native && !d_half; }
+
+    /**
+     * @brief Returns the size of the file.
+     *
+     * @return The number of bytes of the file.
+     */
+    std::size_t raw_data_size() const noexcept { return d_size; }
+
+    /**
+     * @brief Returns the header of a .npy file of a C-ordered array, with pixels in native byte order.
+     *
+     * @param type The pixel type: an 8, 16, 32 or 64-bit integer, or a 32 or 64-bit float.
+     * @param shape The shape of the array, slowest varying axis first.
+     * @return The header, of which the size is a multiple of 64 bytes.
+     */
+    static std::string header(POD_type_traits const& type, std::vector<std::size_t> const& shape) {
+        std::string dict = "{'descr': '";
+        dict += type.size == 1 ? '|' : std::endian::native == std::endian::little ? '<' : '>';
+        dict += !type.is_integral ? 'f' : type.is_signed ? 'i' : 'u';
+        dict += std::to_string(type.size) + "', 'fortran_order': False, 'shape': (";
+        for (std::size_t i = 0; i != shape.size(); ++i)
+            dict += std::to_string(shape[i]) + (i + 1 != shape.size() ? ", " : shape.size() == 1 ? "," : "");
+        dict += "), }";
+        std::size_t const size = (s_prefix_size + dict.size() + 1 + 63) / 64 * 64;
+        dict.append(size - s_prefix_size - dict.size() - 1, ' ');
+        dict += '\n';
+        std::string header("\x93NUMPY\x01\x00", s_prefix_size - 2);
+        header += char(dict.size() & 0xff);
+        header += char(dict.size() >> 8);
+        return header + dict;
+    }
+
+private:
+    static constexpr std::size_t s_prefix_size = 10; // magic string, version and header length of version 1.0
+
+    std::byte const* d_data = nullptr;
+    std::size_t d_size = 0;
+    bool d_native = true;
+    bool d_half = false;   // half precision floats, converted to floats
+    POD_type_traits d_type;
+    std::array<long,2> d_dim = {0, 0};
+    std::vector<std::size_t> d_shape;
+    std::size_t d_images = 0;
+    std::size_t d_offset = 0;   // of the first frame
+    std::size_t const d_cache_images;
+    mutable std::mutex d_mutex;
+    mutable std::deque<std::pair<std::size_t, std::vector<std::byte>>> d_cache; // most recently requested first
+
+    void f_map(std::filesystem::path const& path) {
+        int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            throw std::system_error(errno, std::generic_category(), "cannot open \"" + path.string() + "\"");
+        struct stat status;
+        if (fstat(fd, &status) == -1) {
+            int const error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "cannot stat \"" + path.string() + "\"");
+        }
+        d_size = static_cast<std::size_t>(status.st_size);
+        if (d_size != 0) {
+            void* const p = mmap(nullptr, d_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                int const error = errno;
+                ::close(fd);
+                throw std::system_error(error, std::generic_category(), "cannot map \"" + path.string() + "\"");
+            }
+            d_data = static_cast<std::byte const*>(p);
+        }
+        ::close(fd);
+    }
+
+    void f_unmap() noexcept {
+        if (d_data != nullptr)
+            munmap(const_cast<std::byte*>(d_data), d_size);
+        d_data = nullptr;
+    }
+
+    // Returns the value of 'key' in the header dictionary, up to the next ',' that is not within parentheses or quotes.
+    static std::string f_value(std::string const& dict, std::string const& key) {
+        std::size_t from = dict.find("'" + key + "'");
+        if (from == std::string::npos || (from = dict.find(':', from)) == std::string::npos)
+            throw std::runtime_error("Incompatible .npy file: the header has no " + key + "\n");
+        std::size_t to = ++from;
+        for (char closing = 0; to != dict.size() && (closing != 0 || (dict[to] != ',' && dict[to] != '}')); ++to)
+            if (closing != 0 && dict[to] == closing)
+                closing = 0;
+            else if (closing == 0 && (dict[to] == '(' || dict[to] == '\'' || dict[to] == '"'))
+                closing = dict[to] == '(' ? ')' : dict[to];
+        std::string value = dict.substr(from, to - from);
+        value.erase(0, value.find_first_not_of(" "));
+        value.erase(value.find_last_not_of(" ") + 1);
+        return value;
+    }
+
+    void f_parse_header() {
+        if (d_size < s_prefix_size || std::memcmp(d_data, "\x93NUMPY", 6) != 0)
+            throw std::runtime_error("Not a .npy file\n");
+        auto const byte = [this](std::size_t const i) { return static_cast<std::size_t>(d_data[i]); };
+        std::size_t const major = byte(6);
+        std::size_t const length_size = major == 1 ? 2 : 4;
+        std::size_t const length = major == 1 ? byte(8) | byte(9) << 8 : byte(8) | byte(9) << 8 | byte(10) << 16 | byte(11) << 24;
+        d_offset = 8 + length_size + length;
+        if (d_offset > d_size)
+            throw std::runtime_error("Not a .npy file\n");
+        std::string const dict(reinterpret_cast<char const*>(d_data) + 8 + length_size, length);
+        if (f_value(dict, "fortran_order") != "False")
+            throw std::runtime_error("Fortran-ordered .npy arrays are not supported\n");
+
+        // The dtype, such as '<u2': the byte order ('<', '>', '|' or '='), the kind and the size in bytes
+        std::string const descr = f_value(dict, "descr");
+        if (descr.size() < 4 || (descr[0] != '\'' && descr[0] != '"'))
+            throw std::runtime_error(".npy arrays of dtype " + descr + " are not supported\n");
+        char const order = descr[1];
+        char const kind = descr[2];
+        std::size_t const size = std::stoul(descr.substr(3));
+        bool const little = order == '<' || (order != '>' && std::endian::native == std::endian::little);
+        d_native = size == 1 || little == (std::endian::native == std::endian::little);
+        if ((kind == 'i' || kind == 'u') && (size == 1 || size == 2 || size == 4))
+            d_type = {.size = size, .is_signed = kind == 'i', .is_integral = true};
+        else if (kind == 'b' && size == 1)
+            d_type = {.size = 1, .is_signed = false, .is_integral = true};
+        else if (kind == 'f' && (size == 4 || size == 8))
+            d_type = {.size = size, .is_signed = true, .is_integral = false};
+        else if (kind == 'f' && size == 2) {
+            d_type = {.size = 4, .is_signed = true, .is_integral = false};
+            d_half = true;
+        }
+        else
+            throw std::runtime_error(".npy arrays of dtype " + descr + " are not supported\n");
+
+        // The shape, such as (3, 512, 512) or (512,)
+        std::string const shape = f_value(dict, "shape");
+        for (std::size_t i = shape.find_first_of("0123456789"); i != std::string::npos; i = shape.find_first_of("0123456789", i)) {
+            std::size_t digits = 0;
+            d_shape.push_back(std::stoull(shape.substr(i), &digits));
+            i += digits;
+        }
+        std::size_t const axes = d_shape.size();
+        d_dim = {axes == 0 ? 1 : long(d_shape[axes - 1]), axes < 2 ? 1 : long(d_shape[axes - 2])};
+        d_images = 1;
+        for (std::size_t i = 0; i + 2 < axes; ++i)
+            d_images *= d_shape[i];
+        if (d_dim[0] == 0 || d_dim[1] == 0)
+            d_images = 0;
+        if (d_offset + d_images * f_file_bytes() > d_size)
+            throw std::runtime_error("Incompatible .npy file: the file is smaller than its header specifies\n");
+    }
+
+    void f_check(std::size_t const i) const {
+        if (i >= d_images)
+            throw std::out_of_range(".npy file has no image " + std::to_string(i));
+    }
+
+    // The number of bytes of an image in the file, and in memory.
+    std::size_t f_file_bytes() const noexcept { return d_dim[0] * d_dim[1] * (d_half ? 2 : d_type.size); }
+    std::size_t f_image_bytes() const noexcept { return d_dim[0] * d_dim[1] * d_type.size; }
+    std::size_t f_offset(std::size_t const i) const noexcept { return d_offset + i * f_file_bytes(); }
+    std::byte const* f_pixels(std::size_t const i) const noexcept { return d_data + f_offset(i); }
+
+    // Returns true if an image can be used straight from the mapped file.
+    bool f_mapped(std::size_t const i) const noexcept {
+        return native() && reinterpret_cast<std::uintptr_t>(f_pixels(i)) % d_type.size == 0;
+    }
+
+    // Copies the pixels of an image to 'pixels', in native byte order, converting half precision floats to floats.
+    void f_convert(std::size_t const i, std::byte* const pixels) const {
+        std::size_t const values = d_dim[0] * d_dim[1];
+        if (d_half) {
+            if (d_native)
+                pixel_kernels::half_to_float(f_pixels(i), pixels, values);
+            else {
+                std::vector<std::byte> swapped(2 * values);
+                pixel_kernels::byte_swap(f_pixels(i), swapped.data(), values, 2);
+                pixel_kernels::half_to_float(swapped.data(), pixels, values);
+            }
+        }
+        else if (d_native)
+            std::memcpy(pixels, f_pixels(i), f_image_bytes());
+        else
+            pixel_kernels::byte_swap(f_pixels(i), pixels, values, d_type.size);
+    }
+
+    // Returns the cached copy of image 'i', in native byte order, making it if it is not cached.
+    std::span<std::byte const> f_cached(std::size_t const i) const {
+        for (auto it = d_cache.begin(); it != d_cache.end(); ++it)
+            if (it->first == i) {
+                std::rotate(d_cache.begin(), it, std::next(it)); // moving a vector keeps its pixels in place
+                return d_cache.front().second;
+            }
+        std::vector<std::byte> pixels(f_image_bytes());
+        f_convert(i, pixels.data());
+        if (d_cache.size() == d_cache_images)
+            d_cache.pop_back();
+        d_cache.emplace_front(i, std::move(pixels));
+        return d_cache.front().second;
+    }
+};
+
+} // end namespace jpa
+
+#endif /* Npy_map_h */
@@ -0,0 +1,184 @@
+//
+//  Pipe_writer.hpp
+//  Pipe_writer
+//
+
+#ifndef Pipe_writer_h
+#define Pipe_writer_h
+
+#include <span>
+#include <cstddef>
+#include <cerrno>
+#include <new>
+#include <utility>
+#include <system_error>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/uio.h>
+#endif
+
+// Pipe_writer writes data to a file descriptor, typically standard output. If the file descriptor is a pipe (Linux
+// only), the pages of a Page_buffer are handed to the pipe with vmsplice() instead of being copied into it, so that
+// large frames can be passed on to the next process of a shell pipeline without copying them through the kernel.
+//
+// A Page_buffer is a buffer of anonymous memory pages. Once it has been written by write(Page_buffer&&), its pages
+// are unmapped, but the pipe keeps a reference to them until they have been read. Since the pages are never written
+// to again, the data in the pipe are stable, which is what makes zero-copy vmsplice() safe.
+//
+// Page_buffer:
+//  Page_buffer(std::size_t size)
+//      Maps 'size' bytes of zero-initialised anonymous memory.
+//  std::byte* data()
+//  std::size_t size()
+//      The memory of the buffer and its size in bytes.
+//
+// Pipe_writer:
+//  Pipe_writer(int fd = STDOUT_FILENO)
+//      Constructs a writer for file descriptor 'fd'.
+//  bool is_pipe()
+//      Returns true if data are written into a pipe with vmsplice().
+//  void write(std::span<std::byte const> data)
+//      Writes (copies) 'data'. Throws std::system_error if writing fails.
+//  void write(Page_buffer&& buffer)
+//      Writes the buffer, moving its pages into the pipe if possible. Throws std::system_error if writing fails.
+//
+// Example:
+//    Pipe_writer out;
+//    Page_buffer frame(width * height * sizeof(std::uint16_t));
+//    decompress(reinterpret_cast<std::uint16_t*>(frame.data()));
+//    out.write(std::move(frame));
+
+namespace jpa {
+
+/**
+ * @class Page_buffer
+ * @brief A move-only buffer of anonymous memory pages, that can be moved into a pipe by Pipe_writer.
+ */
+class Page_buffer {
+public:
+
+    /**
+     * @brief Maps a zero-initialised buffer.
+     *
+     * @param size The size of the buffer in bytes.
+     */
+    explicit Page_buffer(std::size_t const size) : d_size(size) {
+        if (d_size != 0) {
+            void* const p = mmap(nullptr, d_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED)
+                throw std::bad_alloc();
+            d_data = static_cast<std::byte*>(p);
+        }
+    }
+
+    Page_buffer(Page_buffer&& other) noexcept : d_data(other.d_data), d_size(other.d_size) {
+        other.d_data = nullptr;
+        other.d_size = 0;
+    }
+
+    Page_buffer& operator=(Page_buffer&& other) noexcept {
+        std::swap(d_data, other.d_data);
+        std::swap(d_size, other.d_size);
+        return *this;
+    }
+
+    ~Page_buffer() {
+        if (d_data != nullptr)
+            munmap(d_data, d_size);
+    }
+
+    /**
+     * @brief Returns the memory of the buffer.
+     *
+     * @return A pointer to the first byte of the buffer.
+     */
+    std::byte* data() const noexcept { return d_data; }
+
+    /**
+     * @brief Returns the size of the buffer.
+     *
+     * @return The size of the buffer in bytes.
+     */
+    std::size_t size() const noexcept { return d_size; }
+
+private:
+    std::byte* d_data = nullptr;
+    std::size_t d_size;
+};
+
+/**
+ * @class Pipe_writer
+ * @brief Writes data to a file descriptor, moving the pages of Page_buffers into pipes with vmsplice() where possible.
+ */
+class Pipe_writer {
+public:
+
+    /**
+     * @brief Constructs a writer.
+     *
+     * @param fd The file descriptor to write to, by default standard output.
+     */
+    explicit Pipe_writer(int const fd = STDOUT_FILENO) : d_fd(fd) {
+#if defined(__linux__)
+        struct stat st;
+        d_pipe = fstat(d_fd, &st) == 0 && S_ISFIFO(st.st_mode);
+#endif
+    }
+
+    /**
+     * @brief Returns whether data are moved into a pipe with vmsplice().
+     *
+     * @return True if the file descriptor is a pipe and vmsplice() is available.
+     */
+    bool is_pipe() const noexcept { return d_pipe; }
+
+    /**
+     * @brief Writes data.
+     *
+     * @param data The data to be written.
+     */
+    void write(std::span<std::byte const> data) {
+        while (!data.empty()) {
+            ssize_t const r = ::write(d_fd, data.data(), data.size());
+            if (r < 0 && errno != EINTR)
+                throw std::system_error(errno, std::generic_category(), "write");
+            if (r > 0)
+                data = data.subspan(static_cast<std::size_t>(r));
+        }
+    }
+
+    /**
+     * @brief Writes the contents of a Page_buffer, moving its pages into the pipe if possible.
+     *
+     * @param buffer The buffer to be written. It is released after writing.
+     */
+    void write(Page_buffer&& buffer) {
+        Page_buffer const pages(std::move(buffer));
+        std::span<std::byte const> data(pages.data(), pages.size());
+#if defined(__linux__)
+        while (d_pipe && !data.empty()) {
+            iovec iov{const_cast<std::byte*>(data.data()), data.size()};
+            ssize_t const r = vmsplice(d_fd, &iov, 1, 0);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0) {
+                d_pipe = false; // for instance EINVAL or ENOSYS: copy the remaining data
+                break;
+            }
+            data = data.subspan(static_cast<std::size_t>(r));
+        }
+#endif
+        write(data);
+    }
+
+private:
+    int const d_fd;
+    bool d_pipe = false;
+};
+
+} // end namespace jpa
+
+#endif /* Pipe_writer_h */
@@ -0,0 +1,292 @@
+//
+//  Pixel_kernels.hpp
+//  Pixel_kernels
+//
+
+#ifndef Pixel_kernels_h
+#define Pixel_kernels_h
+
+#include <bit>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <type_traits>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define PIXEL_KERNELS_AVX2 1
+#endif
+
+// Pixel_kernels are the loops that touch every pixel of an image when it is read: byte-swapping pixels of files in the
+// other byte order, and converting pixels from one type to another. They work on raw bytes, so that pixels need not be
+// aligned, and the source and destination may be the same (for swapping, and for converting between types of the same
+// size). The loops are written so that the compiler vectorises them.
+//
+// All kernels share one dispatch: on x86-64, each kernel is compiled twice, for the baseline instruction set and for
+// AVX2, and the AVX2 version is used if the processor supports it. Large images are split over several threads.
+//
+//  void byte_swap(std::byte const* from, std::byte* to, std::size_t values, std::size_t value_size, std::size_t threads = 0)
+//      Reverses the bytes of 'values' values of 'value_size' (1, 2, 4 or 8) bytes each.
+//  void convert<From, To>(std::byte const* from, std::byte* to, std::size_t values, std::size_t threads = 0)
+//      Converts 'values' values of type From to type To. Floating point values are converted to unsigned integers
+//      through the signed integer type of the same size, so that negative values wrap around.
+//  void half_to_float(std::byte const* from, std::byte* to, std::size_t values, std::size_t threads = 0)
+//      Converts 'values' IEEE 754 half precision (16-bit) floating point values to floats, as in MRC files of mode 12.
+//
+// 'threads' is the maximum number of threads; 0 uses up to std::thread::hardware_concurrency() threads, one per
+// s_bytes_per_thread bytes. 'from' and 'to' must either be equal or not overlap.
+//
+// Example:
+//    std::vector<std::byte> image = read_big_endian_image();
+//    pixel_kernels::byte_swap(image.data(), image.data(), image.size() / 2, 2);
+//    std::vector<float> pixels(image.size() / 2);
+//    pixel_kernels::convert<std::uint16_t, float>(image.data(), reinterpret_cast<std::byte*>(pixels.data()), pixels.size());
+
+namespace jpa::pixel_kernels {
+
+// Images smaller than this are processed by the calling thread only.
+inline constexpr std::size_t s_bytes_per_thread = std::size_t(8) << 20;
+
+// Threads process whole blocks of this number of values.
+inline constexpr std::size_t s_block = 1024;
+
+template <std::size_t N> using Uint = std::conditional_t<N == 1, std::uint8_t, std::conditional_t<N == 2, std::uint16_t,
+                                      std::conditional_t<N == 4, std::uint32_t, std::uint64_t>>>;
+
+template <typename U>
+[[gnu::always_inline]] inline U f_reverse(U const value) noexcept {
+    if constexpr (sizeof(U) == 1) return value;
+    else if constexpr (sizeof(U) == 2) return __builtin_bswap16(value);
+    else if constexpr (sizeof(U) == 4) return __builtin_bswap32(value);
+    else return __builtin_bswap64(value);
+}
+
+template <typename From, typename To>
+[[gnu::always_inline]] inline To f_cast(From const value) noexcept {
+    if constexpr (std::is_floating_point_v<From> && std::is_integral_v<To> && std::is_unsigned_v<To>)
+        return static_cast<To>(static_cast<std::make_signed_t<To>>(value));
+    else
+        return static_cast<To>(value);
+}
+
+// The loops that are compiled for each instruction set. Values are loaded and stored with memcpy, which compiles to
+// (unaligned) vector loads and stores. In-place and out-of-place loops are separate, because the compiler only
+// vectorises a loop over two pointers if it knows that they do not overlap.
+template <typename From, typename To, typename F>
+[[gnu::always_inline]] inline void f_loop_in_place(std::byte* data, std::size_t const values, F const f) noexcept {
+    static_assert(sizeof(From) == sizeof(To));
+    for (std::size_t i = 0; i != values; ++i) {
+        From value;
+        std::memcpy(&value, data + i * sizeof(From), sizeof(From));
+        To const result = f(value);
+        std::memcpy(data + i * sizeof(To), &result, sizeof(To));
+    }
+}
+
+template <typename From, typename To, typename F>
+[[gnu::always_inline]] inline void f_loop(std::byte const* __restrict from, std::byte* __restrict to, std::size_t const values,
+                                          F const f) noexcept {
+    for (std::size_t i = 0; i != values; ++i) {
+        From value;
+        std::memcpy(&value, from + i * sizeof(From), sizeof(From));
+        To const result = f(value);
+        std::memcpy(to + i * sizeof(To), &result, sizeof(To));
+    }
+}
+
+template <std::size_t N>
+[[gnu::always_inline]] inline void f_swap_loop(std::byte const* from, std::byte* to, std::size_t values) noexcept {
+    auto const reverse = [](Uint<N> const value) { return f_reverse(value); };
+    if (from == to)
+        f_loop_in_place<Uint<N>, Uint<N>>(to, values, reverse);
+    else
+        f_loop<Uint<N>, Uint<N>>(from, to, values, reverse);
+}
+
+template <typename From, typename To>
+[[gnu::always_inline]] inline void f_convert_loop(std::byte const* from, std::byte* to, std::size_t values) noexcept {
+    auto const cast = [](From const value) { return f_cast<From, To>(value); };
+    if constexpr (sizeof(From) == sizeof(To))
+        if (from == to) {
+            f_loop_in_place<From, To>(to, values, cast);
+            return;
+        }
+    f_loop<From, To>(from, to, values, cast);
+}
+
+// Half precision values have 5 exponent bits (with a bias of 15) and 10 mantissa bits. Subnormal values are the
+// mantissa times 2^-24, which is exact in a float.
+[[gnu::always_inline]] inline float f_half_to_float(std::uint16_t const half) noexcept {
+    std::uint32_t const sign = std::uint32_t(half & 0x8000) << 16;
+    std::uint32_t const exponent = (half >> 10) & 0x1f;
+    std::uint32_t const mantissa = half & 0x3ff;
+    if (exponent == 0)
+        return std::bit_cast<float>(sign | std::bit_cast<std::uint32_t>(static_cast<float>(mantissa) * 0x1p-24f));
+    if (exponent == 0x1f)
+        return std::bit_cast<float>(sign | 0x7f800000 | (mantissa << 13)); // infinities and NaNs
+    return std::bit_cast<float>(sign | ((exponent + 127 - 15) << 23) | (mantissa << 13));
+}
+
+[[gnu::always_inline]] inline void f_half_loop(std::byte const* from, std::byte* to, std::size_t values) noexcept {
+    f_loop<std::uint16_t, float>(from, to, values, f_half_to_float);
+}
+
+using Kernel = void (*)(std::byte const*, std::byte*, std::size_t) noexcept;
+
+template <std::size_t N>
+void f_swap(std::byte const* from, std::byte* to, std::size_t values) noexcept { f_swap_loop<N>(from, to, values); }
+
+template <typename From, typename To>
+void f_convert(std::byte const* from, std::byte* to, std::size_t values) noexcept { f_convert_loop<From, To>(from, to, values); }
+
+inline void f_half(std::byte const* from, std::byte* to, std::size_t values) noexcept { f_half_loop(from, to, values); }
+
+#ifdef PIXEL_KERNELS_AVX2
+// Byte swapping does not depend on the compiler: it reverses the bytes of the values in 32-byte vectors with a shuffle.
+template <std::size_t N> [[gnu::target("avx2")]]
+void f_swap_avx2(std::byte const* from, std::byte* to, std::size_t values) noexcept {
+    alignas(32) std::uint8_t order[32];
+    for (std::size_t i = 0; i != 32; ++i)
+        order[i] = static_cast<std::uint8_t>(i % 16 / N * N + N - 1 - i % N); // the shuffle works within 16-byte lanes
+    __m256i const reverse = _mm256_load_si256(reinterpret_cast<__m256i const*>(order));
+    std::size_t const vectors = values * N / 32;
+    for (std::size_t i = 0; i != vectors; ++i) {
+        __m256i const v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(from + 32 * i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(to + 32 * i), _mm256_shuffle_epi8(v, reverse));
+    }
+    std::size_t const done = vectors * 32 / N;
+    f_swap_loop<N>(from + done * N, to + done * N, values - done);
+}
+
+template <typename From, typename To> [[gnu::target("avx2")]]
+void f_convert_avx2(std::byte const* from, std::byte* to, std::size_t values) noexcept { f_convert_loop<From, To>(from, to, values); }
+
+// The processors that support AVX2 (almost) all convert half precision values in hardware (F16C).
+[[gnu::target("avx2,f16c")]]
+inline void f_half_avx2(std::byte const* from, std::byte* to, std::size_t values) noexcept {
+    std::size_t const vectors = values / 8;
+    for (std::size_t i = 0; i != vectors; ++i) {
+        __m128i const v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(from + 16 * i));
+        _mm256_storeu_ps(reinterpret_cast<float*>(to + 32 * i), _mm256_cvtph_ps(v));
+    }
+    f_half_loop(from + 16 * vectors, to + 32 * vectors, values - 8 * vectors);
+}
+#endif
+
+/**
+ * @brief Returns true if the AVX2 versions of the kernels are used.
+ */
+inline bool has_avx2() noexcept {
+#ifdef PIXEL_KERNELS_AVX2
+    static bool const avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+#else
+    return false;
+#endif
+}
+
+inline bool f_has_f16c() noexcept {
+#ifdef PIXEL_KERNELS_AVX2
+    static bool const f16c = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c");
+    return f16c;
+#else
+    return false;
+#endif
+}
+
+// The dispatch that is shared by all kernels: the version for the best instruction set that the processor supports.
+template <std::size_t N>
+Kernel f_swap_kernel() noexcept {
+#ifdef PIXEL_KERNELS_AVX2
+    if (has_avx2())
+        return f_swap_avx2<N>;
+#endif
+    return f_swap<N>;
+}
+
+template <typename From, typename To>
+Kernel f_convert_kernel() noexcept {
+#ifdef PIXEL_KERNELS_AVX2
+    if (has_avx2())
+        return f_convert_avx2<From, To>;
+#endif
+    return f_convert<From, To>;
+}
+
+inline Kernel f_half_kernel() noexcept {
+#ifdef PIXEL_KERNELS_AVX2
+    if (f_has_f16c())
+        return f_half_avx2;
+#endif
+    return f_half;
+}
+
+// Runs a kernel over 'values' values, split over threads in whole blocks.
+inline void f_run(Kernel const kernel, std::byte const* from, std::byte* to, std::size_t const values,
+                  std::size_t const from_size, std::size_t const to_size, std::size_t threads) {
+    std::size_t const bytes = values * std::max(from_size, to_size);
+    if (threads == 0)
+        threads = std::min<std::size_t>(std::max(1u, std::thread::hardware_concurrency()), bytes / s_bytes_per_thread + 1);
+    threads = std::min(threads, (values + s_block - 1) / s_block);
+    if (threads <= 1) {
+        kernel(from, to, values);
+        return;
+    }
+    std::size_t const chunk = (values / threads + s_block - 1) / s_block * s_block;
+    std::vector<std::thread> workers;
+    for (std::size_t begin = chunk; begin < values; begin += chunk)
+        workers.emplace_back(kernel, from + begin * from_size, to + begin * to_size, std::min(chunk, values - begin));
+    kernel(from, to, std::min(chunk, values));
+    for (auto& worker : workers)
+        worker.join();
+}
+
+/**
+ * @brief Reverses the byte order of values.
+ *
+ * @param from The values.
+ * @param to The destination, which may be 'from'.
+ * @param values The number of values.
+ * @param value_size The number of bytes per value: 1, 2, 4 or 8.
+ * @param threads The maximum number of threads; 0 for a number that depends on the size of the data.
+ */
+inline void byte_swap(std::byte const* from, std::byte* to, std::size_t const values, std::size_t const value_size,
+                      std::size_t const threads = 0) {
+    if      (value_size == 2) f_run(f_swap_kernel<2>(), from, to, values, 2, 2, threads);
+    else if (value_size == 4) f_run(f_swap_kernel<4>(), from, to, values, 4, 4, threads);
+    else if (value_size == 8) f_run(f_swap_kernel<8>(), from, to, values, 8, 8, threads);
+    else if (from != to)
+        std::memcpy(to, from, values * value_size);
+}
+
+/**
+ * @brief Converts values from one type to another.
+ *
+ * @tparam From The type of the values.
+ * @tparam To The type to convert to.
+ * @param from The values.
+ * @param to The destination, which may be 'from' if the types have the same size.
+ * @param values The number of values.
+ * @param threads The maximum number of threads; 0 for a number that depends on the size of the data.
+ */
+template <typename From, typename To>
+void convert(std::byte const* from, std::byte* to, std::size_t const values, std::size_t const threads = 0) {
+    f_run(f_convert_kernel<From, To>(), from, to, values, sizeof(From), sizeof(To), threads);
+}
+
+/**
+ * @brief Converts IEEE 754 half precision floating point values to floats.
+ *
+ * @param from The half precision values, in native byte order.
+ * @param to The destination, which must not overlap 'from'.
+ * @param values The number of values.
+ * @param threads The maximum number of threads; 0 for a number that depends on the size of the data.
+ */
+inline void half_to_float(std::byte const* from, std::byte* to, std::size_t const values, std::size_t const threads = 0) {
+    f_run(f_half_kernel(), from, to, values, 2, 4, threads);
+}
+
+} // end namespace jpa::pixel_kernels
+
+#endif /* Pixel_kernels_h */
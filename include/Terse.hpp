@@ -10,8 +10,12 @@
 #define Terse_h
 
 #include <fstream>
+#include <sstream>
+#include <cmath>
 #include <vector>
 #include <charconv>
+#include <atomic>
+#include <memory_resource>
 #include <cassert>
 #include "Bit_pointer.hpp"
 #include "XML_element.hpp"
@@ -36,7 +40,7 @@
 // transparent.
 //
 // Terse data in a file are immediately preceded by a small header, which is encoded in standard XML as follows:
-// <Terse prolix_bits="n" signed="s" block="b" memory_size="m" number_of_values="v" [dimensions="d [...]"] [number_of_frams="f"]/>
+// <Terse prolix_bits="n" signed="s" block="b" memory_size="m" number_of_values="v" [dimensions="d [...]"] [number_of_frams="f"] [alignment="a"]/>
 //   - "n" is the number of bits required for the most extreme value in the Terse data
 //   - "s" is "0" for unsigned data, "1" for signed data
 //   - "b" is the block size of the stretches of data values that are encoded (by default 12 values)
@@ -44,6 +48,7 @@
 //   - "v" is the number of values of a single frame of a stack
 //   - "d [...]" is optional. It encodes the dimensions of a single frame. Frames can have any number of dimensions.
 //   - "f" is optional. if it is absent, a single frame is encoded, if it is present, f indicates the number of frames.
+//   - "a" is optional. If it is present, the header and every frame start at a multiple of "a" bytes (see alignment()).
 // Here is an example:
 // <Terse prolix_bits="12" signed="0" block="12" memory_size="91388" number_of_values="262144" dimensions="512 512" number_of_frames="2"/>
 //
@@ -73,8 +78,8 @@
 //           number of bits per value in the data block is 10 + 54 = 64.
 //
 // Constructors:
-//  Terse(std::ifstream& istream)
-//      Reads in a Terse object that has been written to a file by the overloaded Terse output operator '<<'.
+//  Terse(std::istream& istream)
+//      Reads in a Terse object that has been written to a file or stream by write().
 //  Terse(container_type const& data)
 //      Creates a Terse object from data (which can be a std::vector, Field, etc.). Only containers of
 //      integral types are allowed. If the container has a member function dim(), that will set the dimensions
@@ -82,6 +87,11 @@
 //  Terse(iterator begin, std::size_t size)
 //      Creates a Terse object given a starting iterator or pointer and the number of elements that need to be
 //      encoded.
+//  Terse(std::pmr::memory_resource* resource)
+//      Creates an empty Terse object that allocates its compressed data from 'resource'. The resource must outlive the
+//      Terse object, and any Terse object that is move-constructed from it. Copies allocate from the default resource.
+//      Assignment does not change the resource of a Terse object: an object that is assigned to keeps allocating from
+//      its own resource.
 //
 // Member functions:
 //  std::size_t size()
@@ -100,20 +110,33 @@
 //      Adds another frame to the Terse object. The new frame is defined by its begin iterator and size, or by a
 //      reference to a container. The size must be the same as that of the frame used to create the Terse object.
 //      If the container has a member function dim(), that must return the same dimension as provided for the first frame.
+//  void clear()
+//      Removes all frames and their dimensions, keeping the memory, so that a Terse object that is reused for every
+//      frame of an acquisition does not allocate memory once it has compressed a few frames.
+//  void append(Terse const& frames)
+//      Appends the frames of another Terse object, without decompressing them. The frames must have the same size,
+//      signedness and dimensions as the frames of this object. This allows frames to be compressed separately, for
+//      instance concurrently by several threads, and collected into one Terse object afterwards (see Terse_reorder).
 //  std::size_t const number_of_frames() const
 //      Returns the number of frames stored in the Terse object
 //  std::vector<std::size_t> const& dim() const
 //      Returns the dimensions of each of the Terse frames (all frames must have the same dimensions).
 //  std::vector<std::size_t> const& dim(std::vector<std::size_t> const& dim) {
 //      Sets the dimensions of the Terse frames. Since all frames must have the same dimensions, they can be set only once.
-//  void prolix(iterator begin)
+//  std::size_t alignment() const
+//      Returns the alignment in bytes of the header and of the frames in written Terse data (1 if not aligned).
+//  std::size_t alignment(std::size_t alignment)
+//      Sets the alignment. The header is padded with spaces, and every frame is padded with zeros, to a multiple of
+//      'alignment' bytes, so that frames can be read with unbuffered I/O (for instance O_DIRECT, which requires 4096
+//      byte alignment). It can only be set before a second frame is pushed in.
+//  void prolix(iterator begin) const
 //      Unpacks the Terse data, storing it from the location defined by 'begin'. Terse integral signed data cannot be
 //      unpacked into integral unsigned data. Terse data cannot be decompressed into elements that are smaller
 //      in bits than bits_per_val(), but can be decompressed into larger values. Terse data can always be unpacked
 //      into signed intergral, double and float data and will have the correct sign (with one exception: an
 //      unsigned overflowed - all 1's - value will be unpacked as -1 signed value. As all other values are positive
 //      in this case, such a situation is easy to recognise).
-//  void prolix(container_type& container)
+//  void prolix(container_type& container) const
 //      Unpacks the Terse data and stores it in the provided container. Also checks the container is large enough.
 //  void write(Streamtype &ostream)
 //      Writes Terse data to 'ostream'. The Terse data are preceded by an XML element containing the parameters
@@ -121,6 +144,9 @@
 //      and are therefore independent of endian-ness. A small-endian memory lay-out produces the a Terse file
 //      that is identical to a big-endian machine.
 //
+// Unpacking is thread-safe: many threads can unpack frames of the same Terse object at the same time, as long as no
+// frames are added to it meanwhile. The offsets of the frames of Terse data that have been read from a stream are found
+// as frames are unpacked and are published atomically, so a frame is seldom scanned twice.
 //
 // Example:
 //
@@ -177,7 +203,7 @@ namespace jpa {
  *
  * Terse data in a file are immediately preceded by a small header, which is encoded in standard XML as follows:
  * <pre>
- * <Terse prolix_bits="n" signed="s" block="b" memory_size="m" number_of_values="v" [dimensions="d [...]"] [number_of_frames="f"]/>
+ * <Terse prolix_bits="n" signed="s" block="b" memory_size="m" number_of_values="v" [dimensions="d [...]"] [number_of_frames="f"] [alignment="a"]/>
  * </pre>
  *   - "n" is the number of bits required for the most extreme value in the Terse data.
  *   - "s" is "0" for unsigned data, "1" for signed data.
@@ -186,6 +212,7 @@ namespace jpa {
  *   - "v" is the number of values of a single frame of a stack.
  *   - "d [...]" is optional. It encodes the dimensions of a single frame. Frames can have any number of dimensions.
  *   - "f" is optional. If it is absent, a single frame is encoded; if it is present, "f" indicates the number of frames.
+ *   - "a" is optional. If it is present, the header and every frame start at a multiple of "a" bytes.
  *
  * Here is an example of a Terse file with two frames of 512x512 pixels:
  * <pre>
@@ -235,6 +262,22 @@ public:
      * determines size and signedness of the remaining datasets that can be pushed in.
      */
     Terse(){};
+
+    /**
+     * @brief Initializes an empty Terse object that allocates its compressed data from a memory resource.
+     *
+     * Copies of the Terse object allocate from the default memory resource; a Terse object that is move-constructed
+     * from it keeps allocating from 'resource'. As with other pmr containers, assignment keeps the resource of the
+     * object that is assigned to, so that 'resource' stays in use when other Terse objects are assigned to this one.
+     * Together with clear(), this allows frames to be compressed without heap allocations, for instance from a
+     * std::pmr::unsynchronized_pool_resource on a buffer.
+     *
+     * @param resource The memory resource, which must outlive the Terse object and the Terse objects that are
+     * move-constructed from it.
+     */
+    explicit Terse(std::pmr::memory_resource* const resource) :
+    d_terse_data(resource),
+    d_terse_frames(resource) {}
     
     /**
      * @brief Creates a Terse object from data (which can be a std::vector, Field, etc.).
@@ -270,13 +313,13 @@ public:
     }
     
     /**
-     * @brief Reads in a Terse object that has been written to a file .
+     * @brief Reads in a Terse object that has been written to a file or other stream.
      *
      * Scans the stream for the Terse XML header, then reads the binary Terse data, leaving the stream position exactly on byte beyond the binary Terse data.
      *
      * @param istream The input stream containing Terse data.
      */
-    Terse(std::ifstream& istream) : Terse(istream, XML_element(istream, "Terse")) {};
+    Terse(std::istream& istream) : Terse(istream, XML_element(istream, "Terse")) {};
  
     /**
      * @brief Adds another frame to the Terse object. The new frame is defined by its begin iterator and size.
@@ -321,6 +364,56 @@ public:
         push_back(data.begin(), data.size());
     }
 
+    /**
+     * @brief Removes all frames, keeping the memory that they took for the frames that are pushed in next.
+     *
+     * The next frame that is pushed in sets the size, signedness and dimensions anew. The block size and the alignment
+     * are kept.
+     */
+    void clear() noexcept {
+        d_size = 0;
+        d_prolix_bits = 0;
+        d_dim.clear();
+        d_terse_data.clear();
+        d_terse_frames.clear();
+    }
+
+    /**
+     * @brief Appends the frames of another Terse object, without decompressing them.
+     *
+     * Frames are compressed independently of each other, so their compressed data can simply be copied. The frames must
+     * have the same size, signedness and dimensions (if set) as the frames of this object.
+     *
+     * @param frames The Terse object with the frames to be appended.
+     */
+    void append(Terse const& frames) {
+        if (frames.number_of_frames() == 0)
+            return;
+        assert(d_block == frames.d_block);
+        assert(frames.number_of_frames() == 1 || frames.d_alignment == d_alignment); // frame offsets are kept
+        if (number_of_frames() == 0) {
+            d_size = frames.d_size;
+            d_signed = frames.d_signed;
+        }
+        else {
+            assert(size() == frames.size()); // each frame of a multi-Terse object must have the same size
+            assert(d_signed == frames.d_signed);
+        }
+        if (d_dim.empty())
+            d_dim = frames.d_dim;
+        else
+            assert(frames.d_dim.empty() || frames.d_dim == d_dim);
+        std::size_t const base = f_aligned(d_terse_data.size());
+        d_terse_data.resize(base);
+        d_terse_data.insert(d_terse_data.end(), frames.d_terse_data.begin(), frames.d_terse_data.end());
+        d_terse_frames.push_back(base);
+        for (std::size_t i = 1; i != frames.number_of_frames(); ++i) { // unknown offsets (0) stay unknown
+            std::size_t const offset = frames.f_offset(i);
+            d_terse_frames.push_back(offset == 0 ? 0 : base + offset);
+        }
+        d_prolix_bits = std::max(d_prolix_bits, frames.d_prolix_bits);
+    }
+    
     /**
      * @brief Unpacks the Terse data and stores it in the provided container.
      *
@@ -331,7 +424,7 @@ public:
      * @param frame The index of the frame to unpack (default is 0).
      */
     template <typename Container> requires requires (Container& c) {c.begin(), c.end(), c.size();}
-    void prolix(Container& data, std::size_t frame = 0) {
+    void prolix(Container& data, std::size_t frame = 0) const {
         assert(this->size() == data.size());
         if constexpr(requires (Container &c) {c.dim();})
             for (int i = 0; i != d_dim.size(); ++i)
@@ -343,14 +436,14 @@ public:
     /**
      * @brief Unpacks the Terse data, storing it from the location defined by 'begin'.
      *
-     * Unpacks with bounds checking.
+     * Unpacks with bounds checking. Several threads can unpack frames of the same Terse object concurrently.
      *
      * @tparam Iterator The type of the iterator.
      * @param begin The starting iterator or pointer where the data will be stored.
      * @param frame The index of the frame to unpack (default is 0).
      */
     template <typename Iterator> requires requires (Iterator& i) {*i;}
-    void prolix(Iterator begin, std::size_t frame = 0) {
+    void prolix(Iterator begin, std::size_t frame = 0) const {
         assert(frame < number_of_frames());
         std::uint8_t const* terse_begin = f_find_terse_frame(frame);
         if (d_signed)
@@ -384,8 +477,8 @@ public:
                 bitp = bitr.begin();
             }
         }
-        if (d_terse_frames.size() > ++frame)
-            d_terse_frames[frame] = 1 + (bitp - Bit_pointer<const std::uint8_t*>(terse_begin)) / 8;
+        if (++frame < d_terse_frames.size())
+            f_publish(frame, bitp);
     }
     
     /**
@@ -427,6 +520,29 @@ public:
      */
     bool const is_signed() const {return d_signed;}
     
+    /**
+     * @brief Returns the alignment in bytes of the header and of each of the frames of written Terse data.
+     *
+     * @return The alignment in bytes, 1 if the Terse data are not aligned.
+     */
+    std::size_t const alignment() const {return d_alignment;}
+    
+    /**
+     * @brief Sets the alignment in bytes of the header and of each of the frames of written Terse data.
+     *
+     * The header is padded with spaces and each frame is padded with zeros to a multiple of 'alignment' bytes, so that
+     * frames can be read and written with unbuffered I/O (O_DIRECT requires 4096 byte alignment). The padding is
+     * included in terse_size(). The alignment can only be set before a second frame is pushed in.
+     *
+     * @param alignment The alignment in bytes.
+     * @return The alignment in bytes.
+     */
+    std::size_t const alignment(std::size_t const alignment) {
+        assert(number_of_frames() <= 1); // the layout of the frames that have already been compressed cannot be changed
+        assert(alignment != 0);
+        return d_alignment = alignment;
+    }
+    
     /**
      * @brief Returns the number of bits per required for unpacking without overflows.
      *
@@ -453,36 +569,59 @@ public:
      */
     void write(std::ostream& ostream) const {
         // Write Terse object attributes to the output stream
-        ostream << "<Terse prolix_bits=\"" << d_prolix_bits << "\"";
-        ostream << " signed=\"" << d_signed << "\"";
-        ostream << " block=\"" << d_block << "\"";
-        ostream << " memory_size=\"" << d_terse_data.size() * sizeof(std::uint8_t) << "\"";
-        ostream << " number_of_values=\"" << size() << "\"";
+        std::size_t const memory_size = f_aligned(d_terse_data.size());
+        ostream << f_header(d_terse_frames.size(), memory_size);
         
-        // Write Terse object dimensions if available
-        if (!d_dim.empty()) {
-            ostream << " dimensions=\"";
-            for (size_t i = 0; i + 1 != d_dim.size(); ++i)
-                ostream << d_dim[i] << " ";
-            ostream << d_dim.back() << "\"";
-        }
-        ostream << " number_of_frames=\"" << d_terse_frames.size() << "\"/>";
-        
-        // Write Terse object data to the output stream
+        // Write Terse object data to the output stream, padded with zeros to a multiple of the alignment
         ostream.write(reinterpret_cast<const char*>(d_terse_data.data()), d_terse_data.size());
+        for (std::size_t i = d_terse_data.size(); i != memory_size; ++i)
+            ostream.put(0);
         ostream.flush();
     }
     
 private:
-    bool d_signed;
-    unsigned const d_block = 12;
-    std::size_t d_size;
+    friend class Terse_writer;
+    
+    bool d_signed = false;
+    unsigned d_block = 12;
+    std::size_t d_size = 0;
     unsigned d_prolix_bits = 0;
     std::vector<std::size_t> d_dim;
-    std::vector<std::uint8_t> d_terse_data;
-    std::vector<std::size_t> d_terse_frames;
+    std::pmr::vector<std::uint8_t> d_terse_data;
+    // The byte offsets of the frames in d_terse_data; 0 for frames after the first of which the offset is not known yet.
+    // Unknown offsets are filled in by const member functions, through std::atomic_ref (see f_offset and f_publish).
+    mutable std::pmr::vector<std::size_t> d_terse_frames;
+    std::size_t d_alignment = 1;
+    
+    // The XML header of Terse data of 'frames' frames and 'memory_size' bytes. The header is padded with spaces to at
+    // least 'min_size' bytes, and to a multiple of the alignment, so that it can be rewritten in place (see Terse_writer).
+    std::string f_header(std::size_t const frames, std::size_t const memory_size, std::size_t const min_size = 0) const {
+        std::ostringstream header;
+        header << "<Terse prolix_bits=\"" << d_prolix_bits << "\"";
+        header << " signed=\"" << d_signed << "\"";
+        header << " block=\"" << d_block << "\"";
+        header << " memory_size=\"" << memory_size * sizeof(std::uint8_t) << "\"";
+        header << " number_of_values=\"" << size() << "\"";
+        
+        // Write Terse object dimensions if available
+        if (!d_dim.empty()) {
+            header << " dimensions=\"";
+            for (size_t i = 0; i + 1 != d_dim.size(); ++i)
+                header << d_dim[i] << " ";
+            header << d_dim.back() << "\"";
+        }
+        header << " number_of_frames=\"" << frames << "\"";
+        
+        // Pad the header with spaces, so that the Terse data start at a multiple of the alignment
+        if (d_alignment > 1)
+            header << " alignment=\"" << d_alignment << "\"";
+        std::size_t const header_size = std::size_t(header.tellp()) + 2; // including the closing "/>"
+        header << std::string(f_aligned(std::max(header_size, min_size)) - header_size, ' ');
+        header << "/>";
+        return std::move(header).str();
+    }
     
-    Terse(std::ifstream& istream, XML_element const& xmle) :
+    Terse(std::istream& istream, XML_element const& xmle) :
     d_prolix_bits(unsigned(std::stoul(xmle.attribute("prolix_bits")))),
     d_signed(std::stoul(xmle.attribute("signed"))),
     d_block(int(std::stoul(xmle.attribute("block")))),
@@ -495,24 +634,40 @@ private:
         d_terse_data.resize(std::stold(xmle.attribute("memory_size")));
         istream.read((char*)&d_terse_data[0], d_terse_data.size());
         d_terse_frames.resize(std::stoull(xmle.attribute("number_of_frames")), 0);
+        if (!xmle.attribute("alignment").empty())
+            d_alignment = std::stoull(xmle.attribute("alignment"));
     }
     
+    // Compresses a frame after the frames that have been compressed. Room for the largest possible frame is made first,
+    // and the unused room is kept as capacity for the next frame, so that stacks grow geometrically and a cleared Terse
+    // object reuses its memory. Only the first frame of a new Terse object is shrunk to fit, as single-frame objects
+    // are often kept in large numbers (for instance by Terse_reorder).
     template <typename Iterator>
     void const f_compress(Iterator data) {
-        std::size_t prev_data_size = d_terse_data.size();
-        d_terse_data.resize(prev_data_size + std::ceil(d_size * (sizeof(decltype(*data)) + (long double)(12.0) / (d_block * 8)) / sizeof(std::uint8_t)), 0);
+        bool const is_new = d_terse_data.capacity() == 0;
+        std::size_t prev_data_size = f_aligned(d_terse_data.size());
+        d_terse_frames.back() = prev_data_size;
+        // A block takes at most 12 bits for its header plus the bits of its values. Signed values take at most one bit
+        // more than their size, e.g. -128 takes 9 bits
+        using T = typename std::iterator_traits<Iterator>::value_type;
+        std::size_t const blocks = (d_size + d_block - 1) / d_block;
+        std::size_t const max_bits = blocks * (12 + d_block * (8 * sizeof(T) + std::is_signed_v<T>));
+        d_terse_data.resize(prev_data_size + max_bits / 8 + 1, 0);
         Bit_pointer bitp (d_terse_data.data() + prev_data_size);
         int prevbits = 0;
         for (size_t from = 0; from < d_size; from += d_block) {
             auto const to = std::min(d_size, from + d_block);
-            typename std::iterator_traits<Iterator>::value_type setbits(0);
+            // The magnitudes of signed values are or-ed as unsigned values, as the magnitude of the lowest value does
+            // not fit in the signed type
+            std::make_unsigned_t<T> setbits(0);
             auto p = data;
             for (auto i = from; i != to; ++i, ++p)
-                if constexpr (std::is_unsigned_v<decltype(setbits)>)
+                if constexpr (std::is_unsigned_v<T>)
                     setbits |= *p;
-                else if constexpr (std::is_signed_v<decltype(setbits)>)
-                    setbits |= std::abs(*p);
-            unsigned significant_bits = f_highest_set_bit(setbits);
+                else
+                    setbits |= *p < 0 ? std::make_unsigned_t<T>(0) - std::make_unsigned_t<T>(*p) : std::make_unsigned_t<T>(*p);
+            // The sign bit does not fit beyond 64 bits, but 64 bits hold any int64_t value in two's complement
+            unsigned significant_bits = std::min(f_highest_set_bit(setbits) + (std::is_signed_v<T> && setbits != 0), 64);
             d_prolix_bits = std::max(d_prolix_bits, significant_bits);
             if (prevbits == significant_bits) {
                 (*bitp).set();
@@ -545,7 +700,8 @@ private:
                 for (int i = 0; i != d_block; ++i, ++data);
         }
         d_terse_data.resize(1 + (bitp - d_terse_data.data()) / (sizeof(std::uint8_t) * 8));
-        d_terse_data.shrink_to_fit();
+        if (is_new)
+            d_terse_data.shrink_to_fit();
     }
     
     template <typename T0>
@@ -559,10 +715,33 @@ private:
         }
     }
     
-    std::uint8_t const* f_find_terse_frame(std::size_t frame) {
-        if (frame > 0 && d_terse_frames[frame] == 0) {
-            std::uint8_t const* terse_begin = f_find_terse_frame(frame - 1);
-            Bit_pointer<const std::uint8_t*> bitp(terse_begin);
+    // Rounds 'size' up to a multiple of the alignment.
+    std::size_t f_aligned(std::size_t const size) const noexcept {
+        return (size + d_alignment - 1) / d_alignment * d_alignment;
+    }
+    
+    // Frame offsets are stored as byte offsets from the start of the Terse data. Offsets of frames that have been read
+    // from a stream are unknown (0) until the preceding frame has been scanned or unpacked. An offset only ever changes
+    // from 0 to its final value, and threads that find the same offset store the same value, so offsets are loaded and
+    // stored atomically, without further synchronisation.
+    std::size_t f_offset(std::size_t const frame) const noexcept {
+        return std::atomic_ref<std::size_t>(d_terse_frames[frame]).load(std::memory_order_acquire);
+    }
+
+    // Records the offset of 'frame', which starts after the frame that ends at 'end'.
+    void f_publish(std::size_t const frame, Bit_pointer<const std::uint8_t*> const& end) const noexcept {
+        std::size_t const offset = f_aligned(1 + (end - Bit_pointer<const std::uint8_t*>(d_terse_data.data())) / 8);
+        std::atomic_ref<std::size_t>(d_terse_frames[frame]).store(offset, std::memory_order_release);
+    }
+
+    // Returns the start of a frame. If its offset is unknown, the frames from the last frame before it with a known
+    // offset are scanned, and their offsets are recorded.
+    std::uint8_t const* f_find_terse_frame(std::size_t const frame) const {
+        std::size_t known = frame;
+        while (known > 0 && f_offset(known) == 0)
+            --known;
+        for (; known != frame; ++known) {
+            Bit_pointer<const std::uint8_t*> bitp(d_terse_data.data() + f_offset(known));
             uint8_t significant_bits = 0;
             for (size_t from = 0; from < size(); from += d_block) {
                 if (*bitp++ == 0) {
@@ -577,11 +756,11 @@ private:
                         }
                     }
                 }
-                bitp += significant_bits * d_block;
+                bitp += significant_bits * (std::min(size(), from + d_block) - from);
             }
-            d_terse_frames[frame] = 1 + (bitp - Bit_pointer<const std::uint8_t*>(terse_begin)) / 8;
+            f_publish(known + 1, bitp);
         }
-        return d_terse_data.data() + d_terse_frames[frame];
+        return d_terse_data.data() + f_offset(frame);
     }
 };
 
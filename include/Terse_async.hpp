@@ -0,0 +1,443 @@
+//
+//  Terse_async.hpp
+//  Terse_async
+//
+
+#ifndef Terse_async_h
+#define Terse_async_h
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <fstream>
+#include <optional>
+#include <exception>
+#include <coroutine>
+#include <semaphore>
+#include <functional>
+#include <filesystem>
+#include <stdexcept>
+#include <type_traits>
+#include "Terse.hpp"
+
+// Terse_async provides C++20 coroutines for compressing, decompressing, reading and writing Terse data without blocking
+// the calling thread. Each operation runs on an Executor, and the coroutine that awaits it is suspended meanwhile and
+// resumed on the executor's thread when the operation has finished. So an event loop can co_await a decode without
+// stalling, and file I/O and codec work can be interleaved without callbacks.
+//
+// An Executor wraps anything with a member function submit(callable), such as a Thread_pool, or a function that posts
+// a callable to an event loop. Operations can use different executors, for instance one for I/O and one for codec work;
+// terse_async::schedule(executor) moves the awaiting coroutine onto an executor, for instance back to the event loop.
+//
+// Task<T>
+//      The return type of coroutines that co_return a T. A Task starts when it is awaited; sync_wait() runs a Task to
+//      completion from ordinary code. Exceptions thrown in a Task are rethrown where it is awaited.
+// Executor
+//  Executor(E& executor)
+//      Wraps an object with a member function submit(callable), for instance a Thread_pool. It must outlive the Executor.
+//  Executor(std::function<void(std::function<void()>)> submit)
+//      Wraps a function that runs or schedules a callable.
+//  static Executor inline_executor()
+//      Runs callables immediately, on the calling thread.
+// terse_async:
+//  co_await schedule(Executor executor)
+//      Resumes the awaiting coroutine on 'executor'.
+//  co_await run(Executor executor, F function)
+//      Calls 'function' on 'executor' and returns its result.
+//  co_await compress(Executor executor, Container const& frame)
+//      Compresses a frame (a container of integral values) and returns the Terse object.
+//  co_await prolix<T>(Executor executor, Terse const& terse, std::size_t frame = 0)
+//      Decompresses a frame of a Terse object into a std::vector<T>.
+//  T sync_wait(Task<T> task)
+//      Runs a task and blocks until it has finished.
+// Async_trpx_reader
+//  Async_trpx_reader(std::filesystem::path const& path, Executor io)
+//      Opens a trpx file. Throws std::runtime_error if it cannot be opened.
+//  co_await next_frame()
+//      Reads the next Terse object on the 'io' executor, and returns it, or std::nullopt at the end of the file. Files
+//      written frame by frame (by terse -stdout, terse -ring or trpxd) hold one frame per Terse object.
+// Async_trpx_writer
+//  Async_trpx_writer(std::filesystem::path const& path, Executor io)
+//      Creates a trpx file. Throws std::runtime_error if it cannot be created.
+//  co_await write(Terse const& frame)
+//      Appends a Terse object to the file on the 'io' executor.
+//
+// Operations that take references require the referenced objects to stay alive until the operation has been awaited,
+// which is automatic when they are locals of the awaiting coroutine.
+//
+// Example:
+//    Thread_pool pool;
+//    Executor const codec(pool), io(pool);
+//    Task<std::size_t> recompress(std::filesystem::path in, std::filesystem::path out) {
+//        Async_trpx_reader reader(in, io);
+//        Async_trpx_writer writer(out, io);
+//        std::size_t frames = 0;
+//        while (auto terse = co_await reader.next_frame()) {
+//            std::vector<std::int32_t> frame = co_await terse_async::prolix<std::int32_t>(codec, *terse);
+//            correct(frame);
+//            co_await writer.write(co_await terse_async::compress(codec, frame));
+//            ++frames;
+//        }
+//        co_return frames;
+//    }
+//    std::size_t frames = terse_async::sync_wait(recompress("a.trpx", "b.trpx"));
+
+namespace jpa {
+
+/**
+ * @class Executor
+ * @brief A type-erased executor: something that runs callables, now or later, on some thread.
+ */
+class Executor {
+public:
+
+    /**
+     * @brief Wraps an object with a member function submit(callable).
+     *
+     * @tparam E The type of the executor, for instance Thread_pool.
+     * @param executor The executor. It must outlive the Executor.
+     */
+    template <typename E> requires requires (E& e, std::function<void()> f) { e.submit(std::move(f)); }
+    Executor(E& executor) : d_submit([&executor](std::function<void()> f) { executor.submit(std::move(f)); }) {}
+
+    /**
+     * @brief Wraps a function that runs or schedules a callable.
+     *
+     * @param submit The function.
+     */
+    explicit Executor(std::function<void(std::function<void()>)> submit) : d_submit(std::move(submit)) {}
+
+    /**
+     * @brief Returns an executor that runs callables immediately, on the calling thread.
+     *
+     * @return The executor.
+     */
+    static Executor inline_executor() {
+        return Executor(std::function<void(std::function<void()>)>([](std::function<void()> f) { f(); }));
+    }
+
+    /**
+     * @brief Runs or schedules a callable.
+     *
+     * @param f The callable.
+     */
+    void submit(std::function<void()> f) const { d_submit(std::move(f)); }
+
+private:
+    std::function<void(std::function<void()>)> d_submit;
+};
+
+template <typename T = void> class Task;
+
+namespace terse_async {
+
+// Resumes the awaiting coroutine when a task has finished, by symmetric transfer, so that long chains of tasks do not
+// grow the stack.
+struct Final_awaiter {
+    bool await_ready() const noexcept { return false; }
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> const h) const noexcept {
+        std::coroutine_handle<> const continuation = h.promise().continuation;
+        return continuation ? continuation : std::noop_coroutine();
+    }
+    void await_resume() const noexcept {}
+};
+
+// The parts of a promise that do not depend on the result type: the continuation, and the exception.
+struct Promise_base {
+    std::coroutine_handle<> continuation = nullptr;
+    std::exception_ptr exception = nullptr;
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    Final_awaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() noexcept { exception = std::current_exception(); }
+};
+
+template <typename T>
+struct Promise : Promise_base {
+    std::optional<T> value;
+    Task<T> get_return_object() noexcept;
+    template <typename U> requires std::is_convertible_v<U&&, T>
+    void return_value(U&& v) { value.emplace(std::forward<U>(v)); }
+    T result() {
+        if (exception)
+            std::rethrow_exception(exception);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct Promise<void> : Promise_base {
+    Task<void> get_return_object() noexcept;
+    void return_void() const noexcept {}
+    void result() const {
+        if (exception)
+            std::rethrow_exception(exception);
+    }
+};
+
+} // end namespace terse_async
+
+/**
+ * @class Task
+ * @brief A lazily started coroutine that produces a T, and that can be co_awaited once.
+ *
+ * @tparam T The type of the result.
+ */
+template <typename T>
+class Task {
+public:
+    using promise_type = terse_async::Promise<T>;
+
+    Task(Task&& other) noexcept : d_handle(std::exchange(other.d_handle, nullptr)) {}
+    Task& operator=(Task&& other) noexcept {
+        std::swap(d_handle, other.d_handle);
+        return *this;
+    }
+    ~Task() {
+        if (d_handle)
+            d_handle.destroy();
+    }
+
+    /**
+     * @brief Starts the task and suspends the awaiting coroutine until it has finished.
+     */
+    auto operator co_await() && noexcept {
+        struct Awaiter {
+            std::coroutine_handle<promise_type> handle;
+            bool await_ready() const noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> const awaiting) const noexcept {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+            T await_resume() const { return handle.promise().result(); }
+        };
+        return Awaiter{d_handle};
+    }
+
+private:
+    friend promise_type;
+    explicit Task(std::coroutine_handle<promise_type> const handle) noexcept : d_handle(handle) {}
+    std::coroutine_handle<promise_type> d_handle;
+};
+
+namespace terse_async {
+
+template <typename T>
+Task<T> Promise<T>::get_return_object() noexcept { return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this)); }
+
+inline Task<void> Promise<void>::get_return_object() noexcept { return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this)); }
+
+/**
+ * @brief Returns an awaitable that resumes the awaiting coroutine on an executor.
+ *
+ * @param executor The executor.
+ * @return The awaitable.
+ */
+inline auto schedule(Executor executor) {
+    struct Awaiter {
+        Executor executor;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> const awaiting) const { executor.submit([awaiting] { awaiting.resume(); }); }
+        void await_resume() const noexcept {}
+    };
+    return Awaiter{std::move(executor)};
+}
+
+/**
+ * @brief Returns an awaitable that calls a function on an executor, and resumes the awaiting coroutine with its result
+ * on the executor's thread.
+ *
+ * @tparam F A callable without parameters.
+ * @param executor The executor.
+ * @param function The function.
+ * @return The awaitable.
+ */
+template <typename F>
+auto run(Executor executor, F function) {
+    using R = std::invoke_result_t<F&>;
+    struct Awaiter {
+        Executor executor;
+        F function;
+        std::conditional_t<std::is_void_v<R>, bool, std::optional<R>> result{};
+        std::exception_ptr exception = nullptr;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> const awaiting) {
+            executor.submit([this, awaiting] {
+                try {
+                    if constexpr (std::is_void_v<R>)
+                        function();
+                    else
+                        result.emplace(function());
+                }
+                catch (...) {
+                    exception = std::current_exception();
+                }
+                awaiting.resume();
+            });
+        }
+        R await_resume() {
+            if (exception)
+                std::rethrow_exception(exception);
+            if constexpr (!std::is_void_v<R>)
+                return std::move(*result);
+        }
+    };
+    return Awaiter{std::move(executor), std::move(function)};
+}
+
+/**
+ * @brief Returns an awaitable that compresses a frame on an executor.
+ *
+ * @tparam Container A container of integral values. If it has a member function dim(), that sets the dimensions.
+ * @param executor The executor.
+ * @param frame The frame. It must stay alive until the result has been awaited.
+ * @return The awaitable, which produces the Terse object.
+ */
+template <typename Container> requires requires (Container& c) {c.begin(), c.end(), c.size();}
+auto compress(Executor executor, Container const& frame) {
+    return run(std::move(executor), [&frame] { return Terse(frame); });
+}
+
+/**
+ * @brief Returns an awaitable that decompresses a frame on an executor.
+ *
+ * @tparam T The type of the decompressed values.
+ * @param executor The executor.
+ * @param terse The Terse object. It must stay alive until the result has been awaited; other frames of it may be
+ *              decompressed at the same time.
+ * @param frame The index of the frame.
+ * @return The awaitable, which produces the values of the frame.
+ */
+template <typename T>
+auto prolix(Executor executor, Terse const& terse, std::size_t const frame = 0) {
+    return run(std::move(executor), [&terse, frame] {
+        std::vector<T> values(terse.size());
+        terse.prolix(values, frame);
+        return values;
+    });
+}
+
+// A coroutine that starts immediately and destroys itself when it finishes; used by sync_wait().
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() const noexcept { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+};
+
+template <typename T, typename Result>
+Detached f_sync_wait(Task<T>& task, Result& result, std::exception_ptr& exception, std::binary_semaphore& done) {
+    try {
+        if constexpr (std::is_void_v<T>)
+            co_await std::move(task);
+        else
+            result.emplace(co_await std::move(task));
+    }
+    catch (...) {
+        exception = std::current_exception();
+    }
+    done.release();
+}
+
+/**
+ * @brief Runs a task, and blocks the calling thread until it has finished.
+ *
+ * @tparam T The type of the result.
+ * @param task The task.
+ * @return The result of the task. Exceptions thrown by the task are rethrown.
+ */
+template <typename T>
+T sync_wait(Task<T> task) {
+    std::conditional_t<std::is_void_v<T>, std::optional<bool>, std::optional<T>> result;
+    std::exception_ptr exception = nullptr;
+    std::binary_semaphore done(0);
+    f_sync_wait(task, result, exception, done);
+    done.acquire();
+    if (exception)
+        std::rethrow_exception(exception);
+    if constexpr (!std::is_void_v<T>)
+        return std::move(*result);
+}
+
+} // end namespace terse_async
+
+/**
+ * @class Async_trpx_reader
+ * @brief Reads the Terse objects of a trpx file one at a time, on an I/O executor.
+ */
+class Async_trpx_reader {
+public:
+
+    /**
+     * @brief Opens a trpx file.
+     *
+     * @param path The trpx file.
+     * @param io The executor on which the file is read.
+     */
+    Async_trpx_reader(std::filesystem::path const& path, Executor io) : d_file(path, std::ios::binary), d_io(std::move(io)) {
+        if (!d_file.is_open())
+            throw std::runtime_error("cannot open \"" + path.string() + "\"");
+    }
+
+    /**
+     * @brief Returns an awaitable that reads the next Terse object.
+     *
+     * @return The awaitable, which produces the Terse object, or std::nullopt at the end of the file.
+     */
+    auto next_frame() {
+        return terse_async::run(d_io, [this]() -> std::optional<Terse> {
+            if ((d_file >> std::ws).peek() == std::ifstream::traits_type::eof())
+                return std::nullopt;
+            return std::optional<Terse>(std::in_place, d_file);
+        });
+    }
+
+private:
+    std::ifstream d_file;
+    Executor d_io;
+};
+
+/**
+ * @class Async_trpx_writer
+ * @brief Appends Terse objects to a trpx file, on an I/O executor.
+ */
+class Async_trpx_writer {
+public:
+
+    /**
+     * @brief Creates a trpx file.
+     *
+     * @param path The trpx file.
+     * @param io The executor on which the file is written.
+     */
+    Async_trpx_writer(std::filesystem::path const& path, Executor io) : d_file(path, std::ios::binary | std::ios::trunc), d_io(std::move(io)) {
+        if (!d_file.is_open())
+            throw std::runtime_error("cannot create \"" + path.string() + "\"");
+    }
+
+    /**
+     * @brief Returns an awaitable that appends a Terse object to the file.
+     *
+     * @param frame The Terse object. It must stay alive until the write has been awaited.
+     * @return The awaitable.
+     */
+    auto write(Terse const& frame) {
+        return terse_async::run(d_io, [this, &frame] {
+            frame.write(d_file);
+            if (!d_file)
+                throw std::runtime_error("writing trpx file failed");
+        });
+    }
+
+private:
+    std::ofstream d_file;
+    Executor d_io;
+};
+
+} // end namespace jpa
+
+#endif /* Terse_async_h */
@@ -0,0 +1,238 @@
+//
+//  Terse_reorder.hpp
+//  Terse_reorder
+//
+
+#ifndef Terse_reorder_h
+#define Terse_reorder_h
+
+#include <map>
+#include <mutex>
+#include <vector>
+#include <ostream>
+#include <optional>
+#include <stdexcept>
+#include <functional>
+#include <condition_variable>
+#include "Terse.hpp"
+
+// Terse_reorder collects frames that are produced out of order, for instance by several readout threads, and emits
+// them in index order. Each thread inserts (frame_index, data) pairs; the frame is compressed immediately on the
+// calling thread, without any locking, so that producers compress in parallel. Only the compressed frame is handed to
+// the reorder buffer, which emits every frame as soon as all frames with lower indices have been emitted.
+//
+// Frames are emitted by the inserting threads themselves: the thread that inserts the next frame in order emits it,
+// together with the frames after it that were already waiting. Emitting is serialised; inserting is not.
+//
+// If a window is given, a thread that inserts a frame more than 'window' frames ahead of the next frame to be emitted
+// waits until the gap has been closed, which bounds the memory of the reorder buffer.
+//
+// Frames are emitted to a multi-frame Terse object (with Terse::append), to a stream as a sequence of single-frame
+// Terse objects (which prolix expands), or to a callback.
+//
+//  Terse_reorder(Terse& stack, std::size_t window = 0)
+//  Terse_reorder(std::ostream& stream, std::size_t window = 0)
+//  Terse_reorder(std::function<void(std::size_t, Terse&&)> emit, std::size_t window = 0)
+//      Constructs a reorder buffer that emits frames to 'stack', 'stream', or 'emit', starting with frame index 0.
+//      A window of 0 means that the reorder buffer is unbounded.
+//  void insert(std::size_t index, Container const& frame)
+//  void insert(std::size_t index, Iterator begin, std::size_t size, std::vector<std::size_t> const& dim = {})
+//      Compresses a frame on the calling thread and inserts it. Thread-safe.
+//  void insert(std::size_t index, Terse&& frame)
+//      Inserts a frame that has already been compressed. Thread-safe.
+//  void skip(std::size_t index)
+//      Marks a frame as missing (for instance dropped), so that the frames after it are not held up. Thread-safe.
+//  std::size_t next() const
+//      Returns the index of the next frame to be emitted, which is the number of frames emitted so far.
+//  std::size_t pending() const
+//      Returns the number of frames that wait for frames with lower indices.
+//
+// Inserting an index that has already been inserted throws std::invalid_argument.
+//
+// If emitting a frame throws, the exception propagates to the thread that was emitting, and the reorder buffer fails:
+// the frame counts as emitted (so next() moves past it), the frames still waiting are discarded, and every later or
+// waiting insert() or skip() throws std::runtime_error instead of blocking for frames that will never be emitted.
+//
+// Example:
+//    Terse stack;
+//    Terse_reorder reorder(stack, 64);
+//    std::vector<std::thread> readout;
+//    for (int t = 0; t != 4; ++t)
+//        readout.emplace_back([&, t] {
+//            for (std::size_t i = t; i < 1000; i += 4)
+//                reorder.insert(i, read_frame(i));
+//        });
+//    for (auto& thread : readout)
+//        thread.join();
+//    stack.write(outfile);    // 1000 frames in index order
+
+namespace jpa {
+
+/**
+ * @class Terse_reorder
+ * @brief Compresses frames on the inserting threads and emits them in index order.
+ */
+class Terse_reorder {
+public:
+
+    /**
+     * @brief Constructs a reorder buffer that appends frames to a multi-frame Terse object.
+     *
+     * @param stack The Terse object that the frames are appended to. It must outlive the reorder buffer.
+     * @param window The maximum number of frames that a frame can be ahead of the next frame to be emitted (0: no limit).
+     */
+    explicit Terse_reorder(Terse& stack, std::size_t const window = 0) :
+    Terse_reorder([&stack](std::size_t, Terse&& frame) { stack.append(frame); }, window) {}
+
+    /**
+     * @brief Constructs a reorder buffer that writes frames to a stream, as single-frame Terse objects.
+     *
+     * @param stream The stream that the frames are written to. It must outlive the reorder buffer.
+     * @param window The maximum number of frames that a frame can be ahead of the next frame to be emitted (0: no limit).
+     */
+    explicit Terse_reorder(std::ostream& stream, std::size_t const window = 0) :
+    Terse_reorder([&stream](std::size_t, Terse&& frame) { frame.write(stream); }, window) {}
+
+    /**
+     * @brief Constructs a reorder buffer that passes frames to a callback.
+     *
+     * @param emit Called with the index and the compressed frame, in index order, by one thread at a time.
+     * @param window The maximum number of frames that a frame can be ahead of the next frame to be emitted (0: no limit).
+     */
+    explicit Terse_reorder(std::function<void(std::size_t, Terse&&)> emit, std::size_t const window = 0) :
+    d_emit(std::move(emit)),
+    d_window(window) {}
+
+    Terse_reorder(Terse_reorder const&) = delete;
+    Terse_reorder& operator=(Terse_reorder const&) = delete;
+
+    /**
+     * @brief Compresses a frame and inserts it.
+     *
+     * @tparam Container A container of integral values. If it has a member function dim(), that sets the dimensions.
+     * @param index The index of the frame.
+     * @param frame The frame.
+     */
+    template <typename Container> requires requires (Container& c) {c.begin(), c.end(), c.size();}
+    void insert(std::size_t const index, Container const& frame) {
+        f_check(index);
+        insert(index, Terse(frame));
+    }
+
+    /**
+     * @brief Compresses a frame and inserts it.
+     *
+     * @tparam Iterator An iterator or pointer to integral values.
+     * @param index The index of the frame.
+     * @param begin The first value of the frame.
+     * @param size The number of values of the frame.
+     * @param dim The dimensions of the frame (optional).
+     */
+    template <typename Iterator>
+    void insert(std::size_t const index, Iterator const begin, std::size_t const size, std::vector<std::size_t> const& dim = {}) {
+        f_check(index);
+        Terse frame(begin, size);
+        if (!dim.empty())
+            frame.dim(dim);
+        insert(index, std::move(frame));
+    }
+
+    /**
+     * @brief Inserts a frame that has already been compressed, and emits all frames that are in order.
+     *
+     * @param index The index of the frame.
+     * @param frame The compressed frame.
+     */
+    void insert(std::size_t const index, Terse&& frame) {
+        f_insert(index, std::move(frame));
+    }
+
+    /**
+     * @brief Marks a frame as missing, and emits all frames that are in order.
+     *
+     * @param index The index of the missing frame.
+     */
+    void skip(std::size_t const index) {
+        f_insert(index, std::nullopt);
+    }
+
+    /**
+     * @brief Returns the index of the next frame to be emitted.
+     *
+     * @return The number of frames emitted or skipped so far.
+     */
+    std::size_t next() const {
+        std::lock_guard lock(d_mutex);
+        return d_next;
+    }
+
+    /**
+     * @brief Returns the number of frames that wait for frames with lower indices.
+     *
+     * @return The number of waiting frames.
+     */
+    std::size_t pending() const {
+        std::lock_guard lock(d_mutex);
+        return d_waiting.size();
+    }
+
+private:
+    std::function<void(std::size_t, Terse&&)> const d_emit;
+    std::size_t const d_window;
+    mutable std::mutex d_mutex;
+    std::condition_variable d_changed;
+    std::map<std::size_t, std::optional<Terse>> d_waiting; // missing frames are std::nullopt
+    std::size_t d_next = 0;
+    bool d_emitting = false;
+    bool d_failed = false; // emitting a frame threw, nothing is emitted anymore
+
+    void f_insert(std::size_t const index, std::optional<Terse>&& frame) {
+        std::unique_lock lock(d_mutex);
+        d_changed.wait(lock, [&] { return d_failed || d_window == 0 || index < d_next + d_window; });
+        f_throw_if_failed();
+        if (index < d_next || !d_waiting.emplace(index, std::move(frame)).second)
+            throw std::invalid_argument("frame " + std::to_string(index) + " has already been inserted");
+        if (d_emitting)
+            return; // the emitting thread will pick it up
+        d_emitting = true;
+        while (!d_waiting.empty() && d_waiting.begin()->first == d_next) {
+            auto node = d_waiting.extract(d_waiting.begin());
+            lock.unlock();
+            try {
+                if (node.mapped())
+                    d_emit(node.key(), std::move(*node.mapped()));
+            }
+            catch (...) {
+                lock.lock();
+                d_emitting = false;
+                d_failed = true;
+                d_waiting.clear();
+                ++d_next;
+                d_changed.notify_all();
+                throw;
+            }
+            lock.lock();
+            ++d_next;
+            d_changed.notify_all();
+        }
+        d_emitting = false;
+    }
+
+    // Fails early, before compressing, for frames that have already been emitted.
+    void f_check(std::size_t const index) const {
+        std::lock_guard lock(d_mutex);
+        f_throw_if_failed();
+        if (index < d_next)
+            throw std::invalid_argument("frame " + std::to_string(index) + " has already been inserted");
+    }
+
+    // Called with the mutex locked.
+    void f_throw_if_failed() const {
+        if (d_failed)
+            throw std::runtime_error("Terse_reorder: emitting a frame failed");
+    }
+};
+
+} // end namespace jpa
+
+#endif /* Terse_reorder_h */
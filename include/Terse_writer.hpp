@@ -0,0 +1,180 @@
+//
+//  Terse_writer.hpp
+//  Terse_writer
+//
+
+#ifndef Terse_writer_h
+#define Terse_writer_h
+
+#include <limits>
+#include <cassert>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <ostream>
+#include <optional>
+#include <stdexcept>
+#include "Terse.hpp"
+
+// Terse_writer writes a multi-frame Terse object to a file frame by frame, so that a stack of compressed frames never
+// has to be held in memory. The file is identical to one written by Terse::write(), except that its XML header is
+// padded with spaces: the header holds the total size and the number of frames, which are only known once the last
+// frame has been written. So room for the largest possible header is reserved before the first frame, and the header
+// is rewritten by close(). The stream must therefore be able to seek, like a std::ofstream; streams that cannot seek,
+// like pipes, can take a sequence of single-frame Terse objects instead (see Terse_reorder), which prolix expands.
+//
+//  Terse_writer(std::ostream& out, std::size_t alignment = 1)
+//      Constructs a writer that writes a Terse object from the current position of 'out'. Throws std::invalid_argument
+//      if 'out' cannot seek. 'alignment' is the alignment of the header and of every frame (see Terse::alignment()).
+//  void write(Terse const& frames)
+//      Appends the frames of a Terse object, without decompressing them. The frames must have the same size,
+//      signedness and dimensions as the frames written before.
+//  void close()
+//      Rewrites the header. Called by the destructor; no frames can be written afterwards. If no frames have been
+//      written, nothing is written.
+//  std::size_t number_of_frames()
+//      Returns the number of frames written so far.
+//  std::size_t terse_size()
+//      Returns the number of bytes of Terse data written so far, excluding the header.
+//  std::vector<std::size_t> const& dim()
+//      Returns the dimensions of the frames (empty if no frames have been written, or if they have no dimensions).
+//
+// Example:
+//    std::ofstream file("movie.trpx", std::ios::binary);
+//    Terse_writer trpx(file);
+//    for (std::size_t i = 0; i != tif.image_stack_size(); ++i)
+//        trpx.write(Terse(tif.image<std::uint16_t>(i)));
+//    trpx.close();
+
+namespace jpa {
+
+/**
+ * @class Terse_writer
+ * @brief Writes a multi-frame Terse object frame by frame, without holding the stack in memory.
+ */
+class Terse_writer {
+public:
+
+    /**
+     * @brief Constructs a writer that writes a Terse object to a stream that can seek.
+     *
+     * @param out The stream. It must outlive the writer.
+     * @param alignment The alignment in bytes of the header and of each of the frames.
+     */
+    explicit Terse_writer(std::ostream& out, std::size_t const alignment = 1) :
+    d_out(out),
+    d_start(out.tellp()),
+    d_alignment(alignment) {
+        if (d_start == std::streampos(-1))
+            throw std::invalid_argument("Terse_writer requires a stream that can seek");
+        assert(alignment != 0);
+    }
+
+    Terse_writer(Terse_writer const&) = delete;
+    Terse_writer& operator=(Terse_writer const&) = delete;
+
+    ~Terse_writer() {
+        try {
+            close();
+        }
+        catch (...) {
+        }
+    }
+
+    /**
+     * @brief Appends the frames of a Terse object.
+     *
+     * @param frames The frames, which must have the same size, signedness and dimensions as the frames written before.
+     */
+    void write(Terse const& frames) {
+        if (d_closed)
+            throw std::logic_error("frames written to a closed Terse_writer");
+        if (frames.number_of_frames() == 0)
+            return;
+        assert(frames.number_of_frames() == 1 || frames.d_alignment == d_alignment); // frame offsets are kept
+        if (!d_stack) {
+            // The first frames determine the parameters of the stack, and the room that is reserved for the header
+            d_stack.emplace(frames);
+            d_stack->d_terse_data.clear();
+            d_stack->d_terse_data.shrink_to_fit();
+            d_stack->d_alignment = d_alignment;
+            d_stack->d_prolix_bits = 64;
+            d_header_size = d_stack->f_header(std::numeric_limits<std::size_t>::max(), std::numeric_limits<std::size_t>::max()).size();
+            d_stack->d_prolix_bits = frames.d_prolix_bits;
+            f_header();
+        }
+        else {
+            assert(d_stack->d_block == frames.d_block);
+            assert(d_stack->size() == frames.size()); // each frame of a multi-Terse object must have the same size
+            assert(d_stack->d_signed == frames.d_signed);
+            assert(frames.d_dim.empty() || frames.d_dim == d_stack->d_dim);
+            d_stack->d_prolix_bits = std::max(d_stack->d_prolix_bits, frames.d_prolix_bits);
+        }
+
+        // Every frame starts at a multiple of the alignment
+        std::size_t const size = frames.d_terse_data.size();
+        std::size_t const padded = (size + d_alignment - 1) / d_alignment * d_alignment;
+        d_out.write(reinterpret_cast<char const*>(frames.d_terse_data.data()), static_cast<std::streamsize>(size));
+        for (std::size_t i = size; i != padded; ++i)
+            d_out.put(0);
+        if (!d_out)
+            throw std::runtime_error("writing Terse data failed");
+        d_frames += frames.number_of_frames();
+        d_terse_size += padded;
+    }
+
+    /**
+     * @brief Rewrites the header with the size and the number of frames. No frames can be written afterwards.
+     */
+    void close() {
+        if (d_closed)
+            return;
+        d_closed = true;
+        if (!d_stack)
+            return;
+        std::streampos const end = d_out.tellp();
+        d_out.seekp(d_start);
+        f_header();
+        d_out.seekp(end);
+        d_out.flush();
+        if (!d_out)
+            throw std::runtime_error("writing Terse header failed");
+    }
+
+    /**
+     * @brief Returns the number of frames written so far.
+     */
+    std::size_t number_of_frames() const noexcept { return d_frames; }
+
+    /**
+     * @brief Returns the number of bytes of Terse data written so far, excluding the header.
+     */
+    std::size_t terse_size() const noexcept { return d_terse_size; }
+
+    /**
+     * @brief Returns the dimensions of the frames, which are set by the first frames written.
+     */
+    std::vector<std::size_t> const& dim() const noexcept { return d_stack ? d_stack->d_dim : s_no_dim; }
+
+private:
+    static inline std::vector<std::size_t> const s_no_dim;
+
+    std::ostream& d_out;
+    std::streampos const d_start;
+    std::size_t const d_alignment;
+    std::optional<Terse> d_stack; // the parameters of the stack, without Terse data
+    std::size_t d_header_size = 0;
+    std::size_t d_frames = 0;
+    std::size_t d_terse_size = 0;
+    bool d_closed = false;
+
+    void f_header() {
+        std::string const header = d_stack->f_header(d_frames, d_terse_size, d_header_size);
+        assert(header.size() == d_stack->f_aligned(d_header_size));
+        d_out.write(header.data(), static_cast<std::streamsize>(header.size()));
+    }
+};
+
+} // end namespace jpa
+
+#endif /* Terse_writer_h */
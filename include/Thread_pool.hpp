@@ -0,0 +1,205 @@
+//
+//  Thread_pool.hpp
+//  Thread_pool
+//
+
+#ifndef Thread_pool_h
+#define Thread_pool_h
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <atomic>
+#include <algorithm>
+
+// Thread_pool is a small work-stealing thread pool.
+//
+// Every worker thread owns a task queue. Tasks submitted from outside the pool are distributed round-robin
+// over the worker queues, tasks submitted by a worker are put on that worker's own queue. A worker takes its
+// tasks from the back of its own queue, and when its queue is empty it steals tasks from the front of the
+// queues of the other workers. Tasks of very different durations are therefore balanced over all workers.
+//
+//  Thread_pool(std::size_t threads)
+//      Starts a pool with 'threads' worker threads. If 'threads' is zero, std::thread::hardware_concurrency()
+//      workers are started.
+//  void submit(Task&& task)
+//      Schedules the callable 'task' for execution by one of the workers.
+//  void wait()
+//      Blocks until all submitted tasks have been completed. If a task has thrown an exception, the first
+//      exception is rethrown.
+//  std::size_t size()
+//      Returns the number of worker threads.
+//
+// Example:
+//    Thread_pool pool(4);
+//    std::vector<int> squares(100);
+//    for (int i = 0; i != 100; ++i)
+//        pool.submit([&squares, i] { squares[i] = i * i; });
+//    pool.wait();
+
+namespace jpa {
+
+/**
+ * @class Thread_pool
+ * @brief A work-stealing thread pool.
+ *
+ * Each worker owns a task queue. Workers process their own queue last-in-first-out, and steal tasks first-in-first-out
+ * from the queues of other workers when their own queue runs dry. This balances tasks of widely varying durations
+ * (for instance files of very different sizes) over all cores.
+ */
+class Thread_pool {
+public:
+
+    /**
+     * @brief Starts a pool of worker threads.
+     *
+     * @param threads The number of worker threads. If zero, std::thread::hardware_concurrency() threads are started.
+     */
+    explicit Thread_pool(std::size_t threads = 0) :
+    d_queues(threads == 0 ? std::max(1u, std::thread::hardware_concurrency()) : threads) {
+        for (std::size_t i = 0; i != d_queues.size(); ++i)
+            d_workers.emplace_back([this, i] { f_work(i); });
+    }
+
+    Thread_pool(Thread_pool const&) = delete;
+    Thread_pool& operator=(Thread_pool const&) = delete;
+
+    /**
+     * @brief Waits for all pending tasks to finish and stops the worker threads.
+     */
+    ~Thread_pool() {
+        {
+            std::unique_lock lock(d_mutex);
+            d_idle.wait(lock, [this] { return d_pending == 0; });
+            d_stop = true;
+        }
+        d_wake.notify_all();
+        for (auto& worker : d_workers)
+            worker.join();
+    }
+
+    /**
+     * @brief Schedules a task for execution.
+     *
+     * When called from one of the pool's own workers, the task is put on that worker's queue; otherwise tasks are
+     * distributed round-robin over the worker queues.
+     *
+     * @tparam Task A callable without parameters.
+     * @param task The task to be executed.
+     */
+    template <typename Task>
+    void submit(Task&& task) {
+        std::size_t const q = (s_pool == this) ? s_index : d_next_queue++ % d_queues.size();
+        {
+            std::lock_guard lock(d_queues[q].mutex);
+            d_queues[q].tasks.emplace_back(std::forward<Task>(task));
+        }
+        {
+            std::lock_guard lock(d_mutex);
+            ++d_pending;
+            ++d_queued;
+        }
+        d_wake.notify_one();
+    }
+
+    /**
+     * @brief Blocks until all submitted tasks have been completed.
+     *
+     * If any of the tasks threw an exception, the first exception is rethrown.
+     */
+    void wait() {
+        std::unique_lock lock(d_mutex);
+        d_idle.wait(lock, [this] { return d_pending == 0; });
+        if (d_exception) {
+            std::exception_ptr e = nullptr;
+            std::swap(e, d_exception);
+            std::rethrow_exception(e);
+        }
+    }
+
+    /**
+     * @brief Returns the number of worker threads.
+     *
+     * @return The number of worker threads.
+     */
+    std::size_t size() const noexcept { return d_workers.size(); }
+
+private:
+    struct Task_queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<Task_queue> d_queues;
+    std::vector<std::thread> d_workers;
+    std::mutex d_mutex;
+    std::condition_variable d_wake;
+    std::condition_variable d_idle;
+    std::size_t d_pending = 0; // submitted, but not yet completed
+    std::size_t d_queued = 0; // submitted, but not yet claimed by a worker
+    std::atomic<std::size_t> d_next_queue = 0;
+    bool d_stop = false;
+    std::exception_ptr d_exception = nullptr;
+
+    static inline thread_local Thread_pool const* s_pool = nullptr;
+    static inline thread_local std::size_t s_index = 0;
+
+    // Take a task from the back of the worker's own queue, or steal one from the front of another queue.
+    bool f_pop(std::size_t const index, std::function<void()>& task) {
+        {
+            std::lock_guard lock(d_queues[index].mutex);
+            if (!d_queues[index].tasks.empty()) {
+                task = std::move(d_queues[index].tasks.back());
+                d_queues[index].tasks.pop_back();
+                return true;
+            }
+        }
+        for (std::size_t i = 1; i != d_queues.size(); ++i) {
+            Task_queue& victim = d_queues[(index + i) % d_queues.size()];
+            std::lock_guard lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void f_work(std::size_t const index) {
+        s_pool = this;
+        s_index = index;
+        for (;;) {
+            {
+                std::unique_lock lock(d_mutex);
+                d_wake.wait(lock, [this] { return d_stop || d_queued != 0; });
+                if (d_queued == 0)
+                    return;
+                --d_queued;
+            }
+            // A task has been claimed, so at least one task is waiting in one of the queues.
+            std::function<void()> task;
+            while (!f_pop(index, task))
+                std::this_thread::yield();
+            try {
+                task();
+            }
+            catch (...) {
+                std::lock_guard lock(d_mutex);
+                if (!d_exception)
+                    d_exception = std::current_exception();
+            }
+            std::lock_guard lock(d_mutex);
+            if (--d_pending == 0)
+                d_idle.notify_all();
+        }
+    }
+};
+
+} // end namespace jpa
+
+#endif /* Thread_pool_h */
@@ -0,0 +1,491 @@
+//
+//  Trpx_client.hpp
+//  Trpx_client
+//
+
+#ifndef Trpx_client_h
+#define Trpx_client_h
+
+#include <vector>
+#include <string>
+#include <span>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+#include <filesystem>
+#include <stdexcept>
+#include <system_error>
+#include <initializer_list>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "Terse.hpp"
+
+// Trpx_client compresses frames with a trpxd compression service on the same node, so that several acquisition
+// processes share one warm thread pool. Frames are sent over a Unix domain socket, either by copying them into the
+// socket, or without copying by passing the file descriptor of a Trpx_shared_buffer (a memfd) that holds the frame.
+// The service returns the compressed frame as a Terse object, or appends it to a trpx file.
+//
+// Requests of one client are answered in order. submit_compress() and submit_append() only send a request, so that a
+// client can keep several frames in flight; result() waits for the answer to the oldest request.
+//
+// Trpx_shared_buffer:
+//  Trpx_shared_buffer(std::size_t size)
+//      Creates a shared memory buffer of 'size' bytes that can be passed to trpxd without copying.
+//  std::span<T> as<T>()
+//      The buffer as a span of pixels of type T.
+//
+// Trpx_client:
+//  Trpx_client(std::filesystem::path const& socket = Trpx_client::default_socket())
+//      Connects to trpxd. Throws std::system_error if the service cannot be reached.
+//  Terse compress(std::span<T const> frame, std::array<std::size_t,2> const& dim)
+//  Terse compress<T>(Trpx_shared_buffer const& frame, std::array<std::size_t,2> const& dim)
+//      Compresses a frame of dim[0] x dim[1] pixels of type T and returns it as a Terse object.
+//  void append(std::filesystem::path const& trpx_file, std::span<T const> frame, std::array<std::size_t,2> const& dim)
+//  void append<T>(std::filesystem::path const& trpx_file, Trpx_shared_buffer const& frame, std::array<std::size_t,2> const& dim)
+//      Compresses a frame and appends it to 'trpx_file' as a Terse object. prolix expands such files.
+//  void submit_compress(...), void submit_append(...), Terse result()
+//      Send a request without waiting, and wait for the result of the oldest outstanding request.
+//  std::string stats()
+//      Returns the throughput and queue metrics of all clients of the service.
+//
+// Errors reported by the service are thrown as std::runtime_error.
+//
+// Example:
+//    Trpx_client trpxd;
+//    Trpx_shared_buffer frame(512 * 512 * sizeof(std::uint16_t));
+//    acquire(frame.as<std::uint16_t>());
+//    trpxd.append<std::uint16_t>("run.trpx", frame, {512, 512});
+
+namespace jpa {
+
+/**
+ * @brief The requests understood by trpxd.
+ */
+enum class Trpx_command : std::uint32_t { compress = 1, append = 2, stats = 3 };
+
+/**
+ * @brief The pixel types of frames sent to trpxd.
+ */
+enum class Trpx_pixel : std::uint32_t { int8, uint8, int16, uint16, int32, uint32, int64, uint64 };
+
+/**
+ * @brief Returns the Trpx_pixel code of an integral type.
+ *
+ * @tparam T An integral type of at most 64 bits.
+ * @return The pixel code.
+ */
+template <typename T> requires std::is_integral_v<T>
+constexpr Trpx_pixel trpx_pixel() noexcept {
+    constexpr std::uint32_t bytes_code = sizeof(T) == 1 ? 0 : sizeof(T) == 2 ? 2 : sizeof(T) == 4 ? 4 : 6;
+    return Trpx_pixel(bytes_code + (std::is_signed_v<T> ? 0 : 1));
+}
+
+/**
+ * @brief The fixed-size header of every request. It is followed by the trpx file name (append) and by the pixel data,
+ * unless the pixel data are passed as a shared memory file descriptor.
+ */
+struct Trpx_request {
+    std::uint32_t magic;
+    Trpx_command command;
+    Trpx_pixel pixel;
+    std::uint32_t shared;      ///< 1 if the pixel data are in a shared memory buffer passed with the request.
+    std::uint64_t dim[2];      ///< The dimensions of the frame.
+    std::uint64_t data_size;   ///< The number of bytes of pixel data.
+    std::uint64_t path_size;   ///< The number of bytes of the trpx file name.
+};
+
+/**
+ * @brief The fixed-size header of every response. It is followed by 'size' bytes: a Terse object for compress, the
+ * metrics text for stats, or an error message if 'error' is not zero.
+ */
+struct Trpx_response {
+    std::uint32_t magic;
+    std::int32_t error;
+    std::uint64_t size;
+};
+
+/**
+ * @class Trpx_socket
+ * @brief A connected Unix domain socket that transfers messages and file descriptors between trpxd and its clients.
+ */
+class Trpx_socket {
+public:
+    static constexpr std::uint32_t s_magic = 0x58505254; // "TRPX"
+
+    /**
+     * @brief Takes ownership of a connected socket.
+     *
+     * @param fd The file descriptor of the socket.
+     */
+    explicit Trpx_socket(int const fd) noexcept : d_fd(fd) {}
+
+    Trpx_socket(Trpx_socket&& other) noexcept : d_fd(other.d_fd) { other.d_fd = -1; }
+    Trpx_socket& operator=(Trpx_socket&& other) noexcept {
+        std::swap(d_fd, other.d_fd);
+        return *this;
+    }
+    ~Trpx_socket() {
+        if (d_fd >= 0)
+            close(d_fd);
+    }
+
+    /**
+     * @brief Connects to a listening socket.
+     *
+     * @param path The path of the socket.
+     * @return The connected socket.
+     */
+    static Trpx_socket connect(std::filesystem::path const& path) {
+        Trpx_socket socket(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        if (socket.d_fd < 0)
+            throw std::system_error(errno, std::generic_category(), "socket");
+        sockaddr_un const address = f_address(path);
+        if (::connect(socket.d_fd, reinterpret_cast<sockaddr const*>(&address), sizeof(address)) != 0)
+            throw std::system_error(errno, std::generic_category(), "connecting to \"" + path.string() + "\"");
+        return socket;
+    }
+
+    /**
+     * @brief Creates a listening socket, replacing a stale socket file.
+     *
+     * @param path The path of the socket.
+     * @return The listening socket.
+     */
+    static Trpx_socket listen(std::filesystem::path const& path) {
+        Trpx_socket socket(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        if (socket.d_fd < 0)
+            throw std::system_error(errno, std::generic_category(), "socket");
+        sockaddr_un const address = f_address(path);
+        unlink(path.c_str());
+        if (::bind(socket.d_fd, reinterpret_cast<sockaddr const*>(&address), sizeof(address)) != 0 || ::listen(socket.d_fd, 64) != 0)
+            throw std::system_error(errno, std::generic_category(), "listening on \"" + path.string() + "\"");
+        return socket;
+    }
+
+    /**
+     * @brief Sends the parts of a message, and optionally passes a file descriptor along with it.
+     *
+     * @param parts The parts of the message, sent back-to-back.
+     * @param pass_fd A file descriptor to pass to the receiver, or -1.
+     */
+    void send(std::initializer_list<std::span<std::byte const>> const parts, int const pass_fd = -1) {
+        std::vector<iovec> iov;
+        for (auto const& part : parts)
+            if (!part.empty())
+                iov.push_back({const_cast<std::byte*>(part.data()), part.size()});
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+        bool pass = pass_fd >= 0;
+        for (std::size_t first = 0; first != iov.size(); ) {
+            msghdr message{};
+            message.msg_iov = iov.data() + first;
+            message.msg_iovlen = iov.size() - first;
+            if (pass) {
+                message.msg_control = control;
+                message.msg_controllen = sizeof(control);
+                cmsghdr* const cmsg = CMSG_FIRSTHDR(&message);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+                std::memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+            }
+            ssize_t sent = sendmsg(d_fd, &message, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent < 0)
+                throw std::system_error(errno, std::generic_category(), "sending to trpxd socket");
+            pass = false;
+            for (; first != iov.size() && std::size_t(sent) >= iov[first].iov_len; ++first)
+                sent -= iov[first].iov_len;
+            if (first != iov.size()) {
+                iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + sent;
+                iov[first].iov_len -= sent;
+            }
+        }
+    }
+
+    /**
+     * @brief Receives exactly data.size() bytes, and a file descriptor if one was passed with them.
+     *
+     * @param data The buffer to be filled.
+     * @param passed_fd If not null, receives the passed file descriptor, or -1 if none was passed.
+     * @return False if the peer closed the connection before the first byte; throws if it closes in the middle.
+     */
+    bool receive(std::span<std::byte> data, int* const passed_fd = nullptr) {
+        if (passed_fd != nullptr)
+            *passed_fd = -1;
+        for (std::size_t done = 0; done != data.size(); ) {
+            iovec iov{data.data() + done, data.size() - done};
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+            msghdr message{};
+            message.msg_iov = &iov;
+            message.msg_iovlen = 1;
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+            ssize_t const received = recvmsg(d_fd, &message, MSG_CMSG_CLOEXEC);
+            if (received < 0 && errno == EINTR)
+                continue;
+            if (received < 0)
+                throw std::system_error(errno, std::generic_category(), "receiving from trpxd socket");
+            for (cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg != nullptr; cmsg = CMSG_NXTHDR(&message, cmsg))
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                    int fd;
+                    std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+                    if (passed_fd != nullptr && *passed_fd < 0)
+                        *passed_fd = fd;
+                    else
+                        close(fd);
+                }
+            if (received == 0 && done == 0)
+                return false;
+            if (received == 0)
+                throw std::runtime_error("trpxd connection closed in the middle of a message");
+            done += received;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Returns the file descriptor of the socket.
+     *
+     * @return The file descriptor.
+     */
+    int fd() const noexcept { return d_fd; }
+
+private:
+    int d_fd;
+
+    static sockaddr_un f_address(std::filesystem::path const& path) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.native().size() >= sizeof(address.sun_path))
+            throw std::runtime_error("socket path too long: \"" + path.string() + "\"");
+        std::strcpy(address.sun_path, path.c_str());
+        return address;
+    }
+};
+
+/**
+ * @class Trpx_shared_buffer
+ * @brief A shared memory buffer (memfd) that is passed to trpxd by file descriptor, so that frames are not copied.
+ */
+class Trpx_shared_buffer {
+public:
+
+    /**
+     * @brief Creates a shared memory buffer.
+     *
+     * @param size The size of the buffer in bytes.
+     */
+    explicit Trpx_shared_buffer(std::size_t const size) : d_size(size) {
+        d_fd = memfd_create("trpx_frame", MFD_CLOEXEC);
+        if (d_fd < 0 || ftruncate(d_fd, static_cast<off_t>(d_size)) != 0)
+            throw std::system_error(errno, std::generic_category(), "creating shared frame buffer");
+        void* const p = mmap(nullptr, std::max(d_size, std::size_t(1)), PROT_READ | PROT_WRITE, MAP_SHARED, d_fd, 0);
+        if (p == MAP_FAILED)
+            throw std::system_error(errno, std::generic_category(), "mapping shared frame buffer");
+        d_data = static_cast<std::byte*>(p);
+    }
+
+    Trpx_shared_buffer(Trpx_shared_buffer const&) = delete;
+    Trpx_shared_buffer& operator=(Trpx_shared_buffer const&) = delete;
+
+    ~Trpx_shared_buffer() {
+        munmap(d_data, std::max(d_size, std::size_t(1)));
+        close(d_fd);
+    }
+
+    /**
+     * @brief Returns the buffer as a span of pixels.
+     *
+     * @tparam T The pixel type.
+     * @return The pixels in the buffer.
+     */
+    template <typename T>
+    std::span<T> as() const noexcept { return std::span<T>(reinterpret_cast<T*>(d_data), d_size / sizeof(T)); }
+
+    /**
+     * @brief Returns the size of the buffer.
+     *
+     * @return The size in bytes.
+     */
+    std::size_t size() const noexcept { return d_size; }
+
+    /**
+     * @brief Returns the file descriptor of the shared memory.
+     *
+     * @return The file descriptor.
+     */
+    int fd() const noexcept { return d_fd; }
+
+private:
+    std::size_t const d_size;
+    int d_fd = -1;
+    std::byte* d_data = nullptr;
+};
+
+/**
+ * @class Trpx_client
+ * @brief A client of the trpxd compression service.
+ */
+class Trpx_client {
+public:
+
+    /**
+     * @brief Returns the default socket of trpxd: $XDG_RUNTIME_DIR/trpxd.sock, or /tmp/trpxd.sock.
+     *
+     * @return The path of the socket.
+     */
+    static std::filesystem::path default_socket() {
+        char const* const runtime_dir = std::getenv("XDG_RUNTIME_DIR");
+        return std::filesystem::path(runtime_dir != nullptr && *runtime_dir != 0 ? runtime_dir : "/tmp") / "trpxd.sock";
+    }
+
+    /**
+     * @brief Connects to trpxd.
+     *
+     * @param socket The socket of the service.
+     */
+    explicit Trpx_client(std::filesystem::path const& socket = default_socket()) : d_socket(Trpx_socket::connect(socket)) {}
+
+    /**
+     * @brief Compresses a frame that is copied to the service.
+     *
+     * @tparam T The pixel type.
+     * @param frame The pixels of the frame.
+     * @param dim The dimensions of the frame.
+     * @return The compressed frame.
+     */
+    template <typename T>
+    Terse compress(std::span<T const> const frame, std::array<std::size_t,2> const& dim) {
+        submit_compress(frame, dim);
+        return result();
+    }
+
+    /**
+     * @brief Compresses a frame in shared memory, without copying it.
+     *
+     * @tparam T The pixel type.
+     * @param frame The shared memory buffer with the pixels of the frame.
+     * @param dim The dimensions of the frame.
+     * @return The compressed frame.
+     */
+    template <typename T>
+    Terse compress(Trpx_shared_buffer const& frame, std::array<std::size_t,2> const& dim) {
+        submit_compress<T>(frame, dim);
+        return result();
+    }
+
+    /**
+     * @brief Compresses a frame that is copied to the service, and appends it to a trpx file.
+     *
+     * @tparam T The pixel type.
+     * @param trpx_file The file to append to. Relative paths are relative to the working directory of the client.
+     * @param frame The pixels of the frame.
+     * @param dim The dimensions of the frame.
+     */
+    template <typename T>
+    void append(std::filesystem::path const& trpx_file, std::span<T const> const frame, std::array<std::size_t,2> const& dim) {
+        submit_append(trpx_file, frame, dim);
+        result();
+    }
+
+    /**
+     * @brief Compresses a frame in shared memory, without copying it, and appends it to a trpx file.
+     *
+     * @tparam T The pixel type.
+     * @param trpx_file The file to append to. Relative paths are relative to the working directory of the client.
+     * @param frame The shared memory buffer with the pixels of the frame.
+     * @param dim The dimensions of the frame.
+     */
+    template <typename T>
+    void append(std::filesystem::path const& trpx_file, Trpx_shared_buffer const& frame, std::array<std::size_t,2> const& dim) {
+        submit_append<T>(trpx_file, frame, dim);
+        result();
+    }
+
+    /**
+     * @brief Sends a compression request without waiting for the result.
+     */
+    template <typename T>
+    void submit_compress(std::span<T const> const frame, std::array<std::size_t,2> const& dim) {
+        f_submit(Trpx_command::compress, trpx_pixel<std::remove_const_t<T>>(), {}, std::as_bytes(frame), -1, dim);
+    }
+
+    /**
+     * @brief Sends a compression request for a frame in shared memory without waiting for the result. The buffer must
+     * not be changed until the result has been received.
+     */
+    template <typename T>
+    void submit_compress(Trpx_shared_buffer const& frame, std::array<std::size_t,2> const& dim) {
+        f_submit(Trpx_command::compress, trpx_pixel<T>(), {}, std::span<std::byte const>(static_cast<std::byte const*>(nullptr), frame.size()), frame.fd(), dim);
+    }
+
+    /**
+     * @brief Sends an append request without waiting for the result.
+     */
+    template <typename T>
+    void submit_append(std::filesystem::path const& trpx_file, std::span<T const> const frame, std::array<std::size_t,2> const& dim) {
+        f_submit(Trpx_command::append, trpx_pixel<std::remove_const_t<T>>(), std::filesystem::absolute(trpx_file).string(), std::as_bytes(frame), -1, dim);
+    }
+
+    /**
+     * @brief Sends an append request for a frame in shared memory without waiting for the result. The buffer must not be
+     * changed until the result has been received.
+     */
+    template <typename T>
+    void submit_append(std::filesystem::path const& trpx_file, Trpx_shared_buffer const& frame, std::array<std::size_t,2> const& dim) {
+        f_submit(Trpx_command::append, trpx_pixel<T>(), std::filesystem::absolute(trpx_file).string(), std::span<std::byte const>(static_cast<std::byte const*>(nullptr), frame.size()), frame.fd(), dim);
+    }
+
+    /**
+     * @brief Waits for the result of the oldest outstanding request.
+     *
+     * @return The compressed frame; an empty Terse object for append requests.
+     */
+    Terse result() {
+        std::string data = f_response();
+        if (data.empty())
+            return Terse();
+        std::istringstream terse_stream(std::move(data));
+        return Terse(terse_stream);
+    }
+
+    /**
+     * @brief Returns the metrics of the service.
+     *
+     * @return One line per client with throughput and queue metrics.
+     */
+    std::string stats() {
+        f_submit(Trpx_command::stats, Trpx_pixel::uint8, {}, {}, -1, {0, 0});
+        return f_response();
+    }
+
+private:
+    Trpx_socket d_socket;
+
+    void f_submit(Trpx_command const command, Trpx_pixel const pixel, std::string const& path, std::span<std::byte const> const data, int const shared_fd, std::array<std::size_t,2> const& dim) {
+        Trpx_request const request{Trpx_socket::s_magic, command, pixel, shared_fd >= 0, {dim[0], dim[1]}, data.size(), path.size()};
+        d_socket.send({std::as_bytes(std::span(&request, 1)), std::as_bytes(std::span(path)), shared_fd >= 0 ? std::span<std::byte const>() : data}, shared_fd);
+    }
+
+    std::string f_response() {
+        Trpx_response response;
+        if (!d_socket.receive(std::as_writable_bytes(std::span(&response, 1))) || response.magic != Trpx_socket::s_magic)
+            throw std::runtime_error("trpxd closed the connection");
+        std::string data(response.size, '\0');
+        d_socket.receive(std::as_writable_bytes(std::span(data)));
+        if (response.error != 0)
+            throw std::runtime_error("trpxd: " + data);
+        return data;
+    }
+};
+
+} // end namespace jpa
+
+#endif /* Trpx_client_h */
@@ -0,0 +1,153 @@
+//
+//  Trpx_index.hpp
+//  Trpx_index
+//
+
+#ifndef Trpx_index_h
+#define Trpx_index_h
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <istream>
+#include <algorithm>
+#include <stdexcept>
+#include <filesystem>
+#include "XML_element.hpp"
+
+// Trpx_index indexes the frames of a trpx file from the XML headers of its consecutive Terse objects, without reading
+// their compressed data. It records where every Terse object starts in the file, so that a single Terse object can be
+// loaded to expand a frame, and which Terse object holds which frame of the stack.
+//
+//  Trpx_index(std::filesystem::path const& path)
+//      Indexes a trpx file. Throws std::runtime_error if the file cannot be opened, a header cannot be parsed, or the
+//      data of a Terse object extend beyond the end of the file.
+//  std::vector<Object> const& objects()
+//      Returns the Terse objects of the file, in order.
+//  std::size_t number_of_frames()
+//      Returns the number of frames of all Terse objects.
+//  std::pair<std::size_t, std::size_t> locate(std::size_t frame)
+//      Returns the index of the Terse object that holds a frame of the stack, and the index of the frame in that object.
+//
+// Object has these members:
+//  std::uint64_t offset        The offset of the Terse object (its XML header) in the file.
+//  std::size_t first_frame     The index in the stack of the first frame of the object.
+//  std::size_t frames          The number of frames of the object.
+//  std::size_t values          The number of values of each frame.
+//  std::vector<std::size_t> dim    The dimensions of the frames, if they are known.
+//  unsigned bits               The number of significant bits of the values (prolix_bits).
+//  bool is_signed              True if the values are signed.
+//
+// Example:
+//    Trpx_index const index("movie.trpx");
+//    auto const [object, frame] = index.locate(1000);
+//    std::ifstream file("movie.trpx", std::ios::binary);
+//    file.seekg(index.objects()[object].offset);
+//    Terse trpx(file);
+//    std::vector<std::uint16_t> image(trpx.size());
+//    trpx.prolix(image, frame);
+
+namespace jpa {
+
+/**
+ * @class Trpx_index
+ * @brief The frames of the Terse objects of a trpx file, read from their headers.
+ */
+class Trpx_index {
+public:
+
+    /**
+     * @brief A Terse object in a trpx file.
+     */
+    struct Object {
+        std::uint64_t offset = 0;
+        std::size_t first_frame = 0;
+        std::size_t frames = 0;
+        std::size_t values = 0;
+        std::vector<std::size_t> dim;
+        unsigned bits = 0;
+        bool is_signed = false;
+    };
+
+    /**
+     * @brief Indexes a trpx file.
+     *
+     * @param path The trpx file.
+     */
+    explicit Trpx_index(std::filesystem::path const& path) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open())
+            throw std::runtime_error("cannot open \"" + path.string() + "\"\n");
+        std::uint64_t const file_size = std::filesystem::file_size(path);
+        while ((file >> std::ws).peek() != std::char_traits<char>::eof()) {
+            Object object;
+            object.offset = static_cast<std::uint64_t>(file.tellg());
+            object.first_frame = d_frames;
+            // A Terse header is an empty XML element; XML_element would search the rest of the text for the end tag of
+            // any other element
+            std::string text;
+            if (!std::getline(file, text, '>') || text.empty() || text.back() != '/')
+                throw std::runtime_error("\"" + path.string() + "\" holds an invalid Terse header\n");
+            text += '>';
+            XML_element const terse(text, "Terse");
+            std::uint64_t memory_size = 0;
+            try {
+                std::string const frames = terse.attribute("number_of_frames");
+                object.frames = frames.empty() ? 1 : std::stoull(frames);
+                object.values = std::stoull(terse.attribute("number_of_values"));
+                object.bits = static_cast<unsigned>(std::stoul(terse.attribute("prolix_bits")));
+                object.is_signed = std::stoul(terse.attribute("signed")) != 0;
+                std::istringstream dimensions(terse.attribute("dimensions"));
+                for (std::size_t d; dimensions >> d; )
+                    object.dim.push_back(d);
+                memory_size = std::stoull(terse.attribute("memory_size"));
+            }
+            catch (std::exception const&) {
+                throw std::runtime_error("\"" + path.string() + "\" holds an invalid Terse header\n");
+            }
+            // Seeking beyond the end of a file succeeds, so the end of the data is checked against the size of the file
+            std::uint64_t const data = static_cast<std::uint64_t>(file.tellg());
+            if (memory_size > file_size - data)
+                throw std::runtime_error("\"" + path.string() + "\" is truncated\n");
+            file.seekg(static_cast<std::streamoff>(memory_size), std::ios::cur);
+            d_frames += object.frames;
+            d_objects.push_back(std::move(object));
+        }
+    }
+
+    /**
+     * @brief Returns the Terse objects of the file, in order.
+     */
+    std::vector<Object> const& objects() const noexcept { return d_objects; }
+
+    /**
+     * @brief Returns the number of frames of all Terse objects.
+     */
+    std::size_t number_of_frames() const noexcept { return d_frames; }
+
+    /**
+     * @brief Finds the Terse object that holds a frame.
+     *
+     * @param frame The index of the frame in the stack.
+     * @return The index of the Terse object and the index of the frame in that object.
+     */
+    std::pair<std::size_t, std::size_t> locate(std::size_t const frame) const {
+        if (frame >= d_frames)
+            throw std::out_of_range("frame " + std::to_string(frame) + " is beyond the stack of " + std::to_string(d_frames) + " frames");
+        auto const next = std::upper_bound(d_objects.begin(), d_objects.end(), frame,
+                                           [](std::size_t const f, Object const& object) { return f < object.first_frame; });
+        std::size_t const object = static_cast<std::size_t>(next - d_objects.begin()) - 1;
+        return {object, frame - d_objects[object].first_frame};
+    }
+
+private:
+    std::vector<Object> d_objects;
+    std::size_t d_frames = 0;
+};
+
+} // end namespace jpa
+
+#endif /* Trpx_index_h */
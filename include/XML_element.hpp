@@ -294,7 +294,7 @@ public:
      * @return     The attribute value or an empty string if the attribute is not found.
      */
     std::string const attribute(std::string const& name) const noexcept {
-        for (int i = 0; i <= (d_attributes.size() - name.size() - 3); ++i) {
+        for (std::size_t i = 0; i + name.size() + 3 <= d_attributes.size(); ++i) { // no underflow for short attributes
             if ((d_attributes[i + name.size()] == '=') && (name == d_attributes.substr(i, name.size()))) {
                 auto strt = 1 + (i += name.size() + 1);
                 for (char q = d_attributes[i]; d_attributes[++i] != q;);
@@ -530,7 +530,7 @@ private:
     
     std::string f_read_element(std::istream& istr, std::string const& tag) {
         std::string element = f_read_upto(istr, '<');
-        for (; !f_next_is(istr, '/' + tag + '>'); element += f_read_upto(istr, '<')) {
+        for (; istr.good() && !f_next_is(istr, '/' + tag + '>'); element += f_read_upto(istr, '<')) { // stop at the end of an unterminated element
             if (f_next_is(istr, "![CDATA["))
                 for (element += f_read_upto(istr, '>'); !element.compare(element.size() - 3, 3, "]]>"); element += f_read_upto(istr, '>'));
             else if (f_next_is(istr, "!--"))
@@ -0,0 +1,75 @@
+//
+//  frame_simulator.cpp
+//
+//  Simulates a detector readout process: writes frames of sparse, Poisson distributed counts into a shared memory
+//  Frame_ring, for testing consumers such as terse -ring.
+//
+
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <thread>
+#include "Command_line.hpp"
+#include "Frame_ring.hpp"
+
+int main(int argc, char const* argv[]) {
+    using namespace jpa;
+    using Clock = std::chrono::steady_clock;
+    Command_line_option help("-help", "print help");
+    Command_line_option verbose("-verbose", "print the counters of the ring when done");
+    Command_line_option ring_name("-ring", "the name of the shared memory ring", {"/trpx_simulator"});
+    Command_line_option frames("-frames", "number of frames to write", {"1000"});
+    Command_line_option size("-size", "width and height of the frames", {"512", "512"});
+    Command_line_option slots("-slots", "number of frames that the ring holds", {"64"});
+    Command_line_option rate("-rate", "frames per second (0: as fast as the consumers allow)", {"0"});
+    Command_line_option counts("-counts", "mean number of counts per pixel", {"0.5"});
+    Command_line_option drop("-drop", "drop frames when the ring is full, instead of waiting for the consumers");
+    Command_line input(argc, argv, {help, verbose, ring_name, frames, size, slots, rate, counts, drop});
+    if (input.option("-help").found()) {
+        std::cout << "frame_simulator [-help] [-verbose] [-ring NAME] [-frames N] [-size W H] [-slots N] [-rate FPS] [-counts C] [-drop]\n";
+        std::cout << "  writes simulated uint16 detector frames into a shared memory ring, and closes it when done.\n";
+        std::cout << "Examples:\n";
+        std::cout << "   frame_simulator -frames 10000 & terse -ring /trpx_simulator -j 0 run.trpx\n";
+        std::cout << "   frame_simulator -rate 2000 -drop -verbose & terse -ring /trpx_simulator -stats 1 run.trpx\n";
+        std::cout << "\nkeywords:\n";
+        std::cout << input.help() << std::endl;
+        return 0;
+    }
+
+    std::string const name = input.option("-ring").param<std::string>()[0];
+    std::array<std::uint64_t,2> const dim = {input.option("-size").param<std::uint64_t>()[0], input.option("-size").param<std::uint64_t>()[1]};
+    std::size_t const number_of_frames = input.option("-frames").param<std::size_t>()[0];
+    double const frames_per_second = input.option("-rate").param<double>()[0];
+    Frame_ring::Policy const policy = input.option("-drop").found() ? Frame_ring::Policy::drop : Frame_ring::Policy::block;
+
+    // A few different frames are generated in advance, so that the simulator is not slowed down by generating them
+    std::mt19937 generator(1);
+    std::poisson_distribution<int> poisson(input.option("-counts").param<double>()[0]);
+    std::vector<std::vector<std::uint16_t>> patterns(8, std::vector<std::uint16_t>(dim[0] * dim[1]));
+    for (auto& pattern : patterns)
+        for (auto& pixel : pattern)
+            pixel = static_cast<std::uint16_t>(std::min(poisson(generator), 65535));
+
+    try {
+        Frame_ring ring = Frame_ring::create(name, input.option("-slots").param<std::size_t>()[0], dim[0] * dim[1] * sizeof(std::uint16_t), sizeof(std::uint16_t), false);
+        auto const start = Clock::now();
+        for (std::size_t number = 0; number != number_of_frames; ++number) {
+            if (frames_per_second > 0)
+                std::this_thread::sleep_until(start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(number / frames_per_second)));
+            ring.push(std::span<std::uint16_t const>(patterns[number % patterns.size()]), dim, number, policy);
+        }
+        ring.close();
+        std::chrono::duration<double> const seconds = Clock::now() - start;
+        if (input.option("-verbose").found()) {
+            Frame_ring::Counters const counters = ring.counters();
+            std::cout << "frame_simulator: " << counters.written << " frames written (" << std::round(counters.written / seconds.count())
+                      << " frames/s), " << counters.dropped << " dropped, maximum lag " << counters.max_lag << " frames" << std::endl;
+        }
+    }
+    catch (std::exception const& e) {
+        std::cerr << "frame_simulator: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
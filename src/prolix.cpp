@@ -9,120 +9,722 @@
 #include <chrono>
 #include <cmath>
 #include <filesystem>
+#include <optional>
+#include <sstream>
+#include <span>
+#include <future>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <latch>
+#include <mutex>
+#include <cstring>
 #include "Command_line.hpp"
 #include "Terse.hpp"
 #include "Grey_tif.hpp"
+#include "Grey_tif_writer.hpp"
+#include "Mrc_writer.hpp"
+#include "Npy_map.hpp"
+#include "Mapped_file.hpp"
+#include "File_pipeline.hpp"
+#include "Pipe_writer.hpp"
+#include "Thread_pool.hpp"
 
 namespace fs = std::filesystem;
 
+// The outcome of expanding a single file.
+struct File_report {
+    bool expanded = false;
+    std::string error;
+};
+
+// A trpx file that is expanded by the File_pipeline: the pipeline reads the trpx file, process() expands its frames
+// into a tiff stack, and the pipeline writes the tif file and deletes the trpx file. Messages are collected in the
+// report instead of being printed, so that they can be printed in the order of the input files.
+class Expansion_job {
+public:
+    using Input = std::string;
+    Expansion_job(fs::path const& filename) : d_filename(filename), d_tif_filename(fs::path(filename).replace_extension(".tif")) {}
+    fs::path const& input_path() const { return d_filename; }
+    fs::path const& output_path() const { return d_tif_filename; }
+    std::size_t memory_size() const;
+    void process(Input&& trpx);
+    std::span<std::byte const> output() const { return d_tif_data->raw_data(); }
+    void written();
+    void fail(std::string const& message) { d_report.error = "Error processing \"" + d_filename.string() + "\": " + message + "\n"; }
+    bool failed() const { return !d_report.error.empty(); }
+    File_report const& report() const { return d_report; }
+    
+private:
+    fs::path d_filename;
+    fs::path d_tif_filename;
+    std::optional<jpa::Grey_tif<std::byte>> d_tif_data;
+    File_report d_report;
+};
+
+bool Expand(jpa::Terse const& trpx_data, jpa::Grey_tif<std::byte>& tif_data);
+void For_each_header(fs::path const& trpx_filename, std::function<void(jpa::XML_element const&)> const& header);
+std::size_t Number_of_frames(jpa::XML_element const& terse);
+int Expand_to_stdout(std::vector<std::string> const& inputs, bool raw, bool verbose);
+enum class Mapped_format { tif, npy, raw };
+bool Expand_mrc_file(fs::path const& trpx_filename, fs::path const& mrc_filename, jpa::Thread_pool& pool);
+bool Expand_mapped_file(fs::path const& trpx_filename, fs::path const& filename, Mapped_format format, jpa::Thread_pool& pool,
+                        bool verbose);
+
 int main(int argc, char const* argv[]) {
     using namespace jpa;
     Command_line_option help("-help", "print help");
     Command_line_option verbose("-verbose", "print expanded file names and compute times");
-    Command_line input(argc, argv, {help, verbose});
+    Command_line_option threads("-j", "number of threads that expand files in parallel (0: one per core)", {"1"});
+    Command_line_option readers("-readers", "number of threads that read and prefetch trpx files", {"1"});
+    Command_line_option writers("-writers", "number of threads that write tif files and delete trpx files", {"1"});
+    Command_line_option queue("-queue", "maximum number of files waiting to be expanded, and waiting to be written", {"4"});
+    Command_line_option memory("-memory", "maximum memory in MB used by files in flight; larger files are expanded frame by frame", {"1024"});
+    Command_line_option fuse("-fuse", "files that expand to more than MB are not expanded in memory, but straight into a mapped tif file, with their frames expanded in parallel (0: all files)", {"256"});
+    Command_line_option io("-io", "file I/O backend: auto, sync or io_uring (auto selects io_uring if the kernel supports it)", {"auto"});
+    Command_line_option batch("-batch", "maximum number of files that are read or written in one batch", {"16"});
+    Command_line_option direct("-direct", "read and write with direct I/O (O_DIRECT), bypassing the page cache");
+    Command_line_option to_stdout("-stdout", "write the expanded images to stdout instead of to tif files, and keep the input files; '-' as file name reads from stdin");
+    Command_line_option raw("-raw", "write raw frames in native byte order instead of a tif stack: with -stdout, frame by frame, otherwise to files with .raw extensions, like -npy");
+    Command_line_option mrc("-mrc", "expand to MRC files with .mrc extensions instead of tiff files, frame by frame, with the frames of a file expanded in parallel by -j threads");
+    Command_line_option npy("-npy", "expand to NumPy files with .npy extensions instead of tiff files, of the smallest integer type that holds all values; the file is sized in advance and the frames are expanded into it in parallel by -j threads");
+    Command_line input(argc, argv, {help, verbose, threads, readers, writers, queue, memory, fuse, io, batch, direct, to_stdout, raw, mrc, npy});
     if (input.option("-help").found()) {
-        std::cout << "prolix [-help] [-verbose] [file ...]\n";
+        std::cout << "prolix [-help] [-verbose] [-j N] [-readers N] [-writers N] [-queue N] [-memory MB] [-fuse MB] [-io auto|sync|io_uring] [-batch N] [-direct] [-stdout] [-raw | -mrc | -npy] [file ... | -]\n";
         std::cout << "  expands trpx files to tiff files.\n";
+        std::cout << "  Reading, expanding and writing overlap: while files are expanded, the next files are read\n";
+        std::cout << "  and previous files are written.\n";
         std::cout << "Examples:\n";
         std::cout << "   prolix *              // all TRPX files with .trpx extensions are expanded to tiff files with .tif extensions.\n";
         std::cout << "   prolix ˜/dir/my_img*  // decompresses all trpx files in the directory ~/dir that start with my_img\n";
+        std::cout << "   prolix -j 0 *         // expands all trpx files in this directory, using all cores\n";
+        std::cout << "   prolix -direct *      // expands all trpx files in this directory without filling the page cache\n";
+        std::cout << "   prolix -mrc -j 0 *    // expands all trpx files in this directory to MRC files, using all cores\n";
+        std::cout << "   prolix -fuse 0 -j 0 * // expands all trpx files in this directory straight into mapped tif files, using all cores\n";
+        std::cout << "   prolix -npy -j 0 *    // expands all trpx files in this directory to NumPy files, using all cores\n";
+        std::cout << "   prolix -raw -verbose run.trpx\n";
+        std::cout << "                         // expands run.trpx to the raw file run.raw, and prints its frame size and pixel type\n";
+        std::cout << "   ssh host 'cat run.trpx' | prolix -raw - | process\n";
+        std::cout << "                         // expands a stream of trpx frames from stdin to raw frames on stdout, frame by frame\n";
+        std::cout << "  A tif stack written to stdout is written as BigTIFF if it would exceed 4 GB. The size of a stream from\n";
+        std::cout << "  stdin is not known in advance, so its tif stack is limited to 4 GB; use -raw for larger streams.\n";
         std::cout << "\nkeywords:\n";
         std::cout << input.help() << std::endl;
         return 0;
     }
     
-    // Some timers and counters are required for the 'verbose' option.
-    std::chrono::duration<double> user_time;
-    std::chrono::duration<double> IO_time;
-    std::size_t expanded_files = 0;
+    // Expand to stdout if requested, or if the input is read from stdin
+    std::vector<std::string> const params = input.params();
+    if (input.option("-stdout").found() || std::find(params.begin(), params.end(), "-") != params.end())
+        return Expand_to_stdout(params, input.option("-raw").found(), input.option("-verbose").found());
     
-    // Loop over all input file names
-    for (fs::path filename : input.params()) {
-        
-        // Only trpx files will be compressed
-        if (fs::is_regular_file(filename) && filename.extension() ==".trpx") {
-            
-            // Start the IO timer and open the next file
-            auto start_IO_time = std::chrono::high_resolution_clock::now();
-            std::ifstream trpx_file(filename, std::ios::binary);
-            if (!trpx_file.is_open())
-                std::cerr << "Failed to open input file " << filename << std::endl;
-            else {
-                
-                // A trpx file was opened. read its data. It may contain one ore more images in a stack.
-                Terse trpx_data(trpx_file);
-                trpx_file.close();
-                
-                // stop the IO timer, start the user timer
-                IO_time += std::chrono::high_resolution_clock::now() - start_IO_time;
-                auto start_user_time = std::chrono::high_resolution_clock::now();
-                
-                // Get the x&y dimensions of the images
-                std::array<std::ptrdiff_t,2> dim;
-                if (trpx_data.dim().size() == 0) // No dimensions given, so assume a square image
-                    dim[0] = dim[1] = std::sqrt(trpx_data.size());
-                else
-                    std::copy_n(trpx_data.dim().begin(), 2, dim.begin());
-                
-                jpa::Grey_tif<std::byte> tif_data;
-                // Expand the images in the Terse stack and push them on the tiff stack
-                if (trpx_data.bits_per_val() <= 16 && trpx_data.is_signed()) {
-                    for (int i = 0; i != trpx_data.number_of_frames(); ++i) {
-                        tif_data.push_back<std::int16_t>(dim);
-                        trpx_data.prolix(tif_data.image<std::int16_t>(i), i);
-                    }
-                }
-                else if (trpx_data.bits_per_val() <= 16 && !trpx_data.is_signed()) {
-                    for (int i = 0; i != trpx_data.number_of_frames(); ++i) {
-                        tif_data.push_back<std::uint16_t>(dim);
-                        trpx_data.prolix(tif_data.image<std::uint16_t>(i), i);
-                    }
-                }
-                else if (trpx_data.bits_per_val() <= 32 && trpx_data.is_signed()) {
-                    for (int i = 0; i != trpx_data.number_of_frames(); ++i) {
-                        tif_data.push_back<std::int32_t>(dim);
-                        trpx_data.prolix(tif_data.image<std::int16_t>(i), i);
-                    }
-                }
-                else if (trpx_data.bits_per_val() <= 32 && !trpx_data.is_signed()) {
-                    for (int i = 0; i != trpx_data.number_of_frames(); ++i) {
-                        tif_data.push_back<std::uint32_t>(dim);
-                        trpx_data.prolix(tif_data.image<std::uint16_t>(i), i);
-                    }
-                }
-                else {
-                    std::cerr << "Terse file " << filename << " encodes data that requires 64 bits per pixel." <<  std::endl;
-                    std::cerr << "Prolix cannot process such trpx-stacks." << std::endl;
-                    return 0;
-                }
-                
-                // Stop the user timer, start the IO timer
-                user_time += std::chrono::high_resolution_clock::now() - start_user_time;
-                start_IO_time = std::chrono::high_resolution_clock::now();
-                
-                // Write the compressed data to the tif file
-                std::ofstream tif_file(filename.replace_extension(".tif"), std::ios::binary);
-                if (!tif_file.is_open())
-                    std::cerr << "Failed to open trpx file " << filename.replace_extension(".trpx") << std::endl;
-                else {
-                    tif_data.write(tif_file);
-                    tif_file.close();
-                    fs::remove(filename.replace_extension(".trpx"));
-                    ++expanded_files;
-                }
+    // Expand to mrc, npy or raw files, one file at a time, with the frames of each file expanded in parallel
+    bool const to_mrc = input.option("-mrc").found();
+    bool const to_npy = input.option("-npy").found();
+    if (to_mrc || to_npy || input.option("-raw").found()) {
+        Thread_pool pool(input.option("-j").param<std::size_t>()[0]); // expands the frames of all files
+        bool const verbose = input.option("-verbose").found();
+        std::size_t expanded_files = 0;
+        for (fs::path filename : params) {
+            if (!fs::is_regular_file(filename) || filename.extension() != ".trpx")
+                continue;
+            fs::path const output = fs::path(filename).replace_extension(to_mrc ? ".mrc" : to_npy ? ".npy" : ".raw");
+            if (to_mrc ? Expand_mrc_file(filename, output, pool)
+                       : Expand_mapped_file(filename, output, to_npy ? Mapped_format::npy : Mapped_format::raw, pool, verbose)) {
+                if (verbose)
+                    std::cout << "Expanded: " << filename << std::endl;
+                ++expanded_files;
             }
-            // stop the IO timer
-            IO_time += std::chrono::high_resolution_clock::now() - start_IO_time;
         }
+        if (input.option("-verbose").found())
+            std::cout << "Prolix expanded : " << expanded_files << " files\n";
+        return 0;
     }
     
-    // If required, provide verbose output
+    // Only trpx files will be expanded
+    // Files of which the tif stack exceeds the -fuse size or does not fit in the memory budget are expanded straight into
+    // mapped tif files instead, after the others
+    std::size_t const memory_budget = input.option("-memory").param<std::size_t>()[0] << 20;
+    std::size_t const fuse_size = input.option("-fuse").param<std::size_t>()[0] << 20;
+    std::vector<Expansion_job> jobs;
+    std::vector<Expansion_job> large_jobs;
+    for (fs::path filename : params)
+        if (fs::is_regular_file(filename) && filename.extension() == ".trpx") {
+            Expansion_job job(filename);
+            bool large = false;
+            try {
+                large = job.memory_size() > std::min(memory_budget, fuse_size);
+            }
+            catch (std::exception const&) {
+                // the pipeline reports the error
+            }
+            (large ? large_jobs : jobs).push_back(std::move(job));
+        }
+    
+    std::string const backend = input.option("-io").param<std::string>()[0];
+    if (backend != "auto" && backend != "sync" && backend != "io_uring") {
+        std::cerr << "Unknown I/O backend \"" << backend << "\"" << std::endl;
+        return 1;
+    }
+    
+    // Expand the files. Reports are printed in the order of the input files, so the output is identical for any
+    // number of threads.
+    File_pipeline<Expansion_job> pipeline({
+        .readers = input.option("-readers").param<std::size_t>()[0],
+        .workers = input.option("-j").param<std::size_t>()[0],
+        .writers = input.option("-writers").param<std::size_t>()[0],
+        .queue_depth = input.option("-queue").param<std::size_t>()[0],
+        .memory_budget = memory_budget,
+        .io = backend == "sync" ? File_io::Backend::sync : backend == "io_uring" ? File_io::Backend::io_uring : File_io::Backend::automatic,
+        .batch = input.option("-batch").param<std::size_t>()[0],
+        .direct = input.option("-direct").found()});
+    auto const start_wall_time = std::chrono::high_resolution_clock::now();
+    pipeline.run(jobs, [&](std::size_t i) { std::cerr << jobs[i].report().error; });
+    std::size_t mapped_files = 0;
+    if (!large_jobs.empty()) {
+        Thread_pool pool(input.option("-j").param<std::size_t>()[0]); // started once the pipeline has finished
+        for (auto const& job : large_jobs)
+            if (Expand_mapped_file(job.input_path(), job.output_path(), Mapped_format::tif, pool, false)) {
+                if (input.option("-verbose").found())
+                    std::cout << "Expanded: " << job.input_path() << std::endl;
+                ++mapped_files;
+            }
+    }
+    std::chrono::duration<double> wall_time = std::chrono::high_resolution_clock::now() - start_wall_time;
+    
+    // If required, provide verbose output, with the times of each stage summed over all threads
     if (input.option("-verbose").found()) {
-        for (fs::path tif_filename : input.params())
-            std::cout << "Expanded: " << tif_filename << std::endl;
-        std::cout << "Prolix expanded : " << expanded_files << " files\n";
-        std::cout << "User time       : " << user_time.count() << " seconds\n";
-        std::cout << "IO time         : " << IO_time.count() << " seconds\n";
+        auto const& times = pipeline.times();
+        std::size_t expanded_files = 0;
+        for (auto const& job : jobs) {
+            if (job.report().expanded) {
+                std::cout << "Expanded: " << job.input_path() << std::endl;
+                ++expanded_files;
+            }
+        }
+        std::cout << "Prolix expanded : " << expanded_files + mapped_files << " files\n";
+        std::cout << "User time       : " << times.process.count() << " seconds\n";
+        std::cout << "IO time         : " << (times.read + times.write).count() << " seconds\n";
+        std::cout << "  read          : " << times.read.count() << " seconds\n";
+        std::cout << "  write         : " << times.write.count() << " seconds\n";
+        std::cout << "Wall time       : " << wall_time.count() << " seconds\n";
     }
     return 0;
 }
+
+// The trpx file plus the expanded tif stack, as estimated from the headers of all Terse objects of the file.
+std::size_t Expansion_job::memory_size() const {
+    std::size_t pixel_bytes = 0;
+    For_each_header(d_filename, [&](jpa::XML_element const& terse) {
+        std::size_t const values = std::stoull(terse.attribute("number_of_values"));
+        std::size_t const bytes_per_value = std::stoul(terse.attribute("prolix_bits")) <= 16 ? 2 : 4;
+        pixel_bytes += values * bytes_per_value * Number_of_frames(terse);
+    });
+    return fs::file_size(d_filename) + pixel_bytes;
+}
+
+void Expansion_job::process(Input&& trpx) {
+    // The trpx file may contain one ore more images in a stack, and may consist of several consecutive Terse objects.
+    std::istringstream trpx_stream(std::move(trpx));
+    d_tif_data.emplace();
+    do {
+        jpa::Terse trpx_data(trpx_stream);
+        if (!Expand(trpx_data, *d_tif_data)) {
+            d_report.error = "Terse file \"" + d_filename.string() + "\" encodes data that requires 64 bits per pixel.\n"
+                             "Prolix cannot process such trpx-stacks.\n";
+            return;
+        }
+    } while ((trpx_stream >> std::ws).peek() != std::char_traits<char>::eof());
+}
+
+// Get the x&y dimensions of the images
+std::array<long,2> Dimensions(std::vector<std::size_t> const& terse_dim, std::size_t const values) {
+    std::array<long,2> dim;
+    if (terse_dim.size() == 0) // No dimensions given, so assume a square image
+        dim[0] = dim[1] = std::sqrt(values);
+    else
+        std::copy_n(terse_dim.begin(), 2, dim.begin());
+    return dim;
+}
+
+std::array<long,2> Dimensions(jpa::Terse const& trpx_data) {
+    return Dimensions(trpx_data.dim(), trpx_data.size());
+}
+
+// Expands the images in the Terse stack and pushes them on the tiff stack. Returns false for 64-bit data.
+bool Expand(jpa::Terse const& trpx_data, jpa::Grey_tif<std::byte>& tif_data) {
+    std::array<long,2> const dim = Dimensions(trpx_data);
+    std::size_t const first = tif_data.image_stack_size();
+    // Reserve the stack of the first Terse object, so that the tiff data are not moved while it is built. Later Terse
+    // objects (of streams of single frames) rely on the geometric growth of the tiff data.
+    if (first == 0 && trpx_data.bits_per_val() <= 32)
+        tif_data.reserve(trpx_data.number_of_frames(), dim, trpx_data.bits_per_val() <= 16 ? 2 : 4);
+    if (trpx_data.bits_per_val() <= 16 && trpx_data.is_signed()) {
+        for (std::size_t i = 0; i != trpx_data.number_of_frames(); ++i) {
+            tif_data.push_back<std::int16_t>(dim);
+            trpx_data.prolix(tif_data.image<std::int16_t>(first + i), i);
+        }
+    }
+    else if (trpx_data.bits_per_val() <= 16 && !trpx_data.is_signed()) {
+        for (std::size_t i = 0; i != trpx_data.number_of_frames(); ++i) {
+            tif_data.push_back<std::uint16_t>(dim);
+            trpx_data.prolix(tif_data.image<std::uint16_t>(first + i), i);
+        }
+    }
+    else if (trpx_data.bits_per_val() <= 32 && trpx_data.is_signed()) {
+        for (std::size_t i = 0; i != trpx_data.number_of_frames(); ++i) {
+            tif_data.push_back<std::int32_t>(dim);
+            trpx_data.prolix(tif_data.image<std::int32_t>(first + i), i);
+        }
+    }
+    else if (trpx_data.bits_per_val() <= 32 && !trpx_data.is_signed()) {
+        for (std::size_t i = 0; i != trpx_data.number_of_frames(); ++i) {
+            tif_data.push_back<std::uint32_t>(dim);
+            trpx_data.prolix(tif_data.image<std::uint32_t>(first + i), i);
+        }
+    }
+    else
+        return false;
+    return true;
+}
+
+// Expands the frames of a Terse object as raw values of type T, and hands every frame to the pipe as soon as it has been
+// expanded.
+template <typename T>
+void Write_raw(jpa::Terse const& trpx_data, jpa::Pipe_writer& out) {
+    for (std::size_t i = 0; i != trpx_data.number_of_frames(); ++i) {
+        jpa::Page_buffer frame(trpx_data.size() * sizeof(T));
+        trpx_data.prolix(reinterpret_cast<T*>(frame.data()), i);
+        out.write(std::move(frame));
+    }
+}
+
+// Reads the XML header of the next Terse object of a stream. The header is an empty XML element, so it ends at the first
+// '>'. Anything else is rejected here, because XML_element would search the rest of the text for its end tag.
+std::string Read_header(std::istream& in) {
+    std::string header;
+    if (!std::getline(in, header, '>') || header.empty() || header.back() != '/')
+        throw std::runtime_error("invalid Terse header");
+    return header + '>';
+}
+
+// Reads the next Terse object from a stream that may not be able to seek, like a pipe.
+jpa::Terse Read_terse(std::istream& in) {
+    std::string trpx = Read_header(in);
+    std::size_t const header_size = trpx.size();
+    trpx.resize(header_size + std::stoull(jpa::XML_element(trpx, "Terse").attribute("memory_size")));
+    if (!in.read(trpx.data() + header_size, trpx.size() - header_size))
+        throw std::runtime_error("incomplete Terse data");
+    std::istringstream trpx_stream(std::move(trpx));
+    return jpa::Terse(trpx_stream);
+}
+
+// A frame that has been expanded and waits to be written to a tif stack.
+struct Expanded_frame {
+    std::vector<std::byte> pixels;
+    jpa::POD_type_traits type;
+    std::array<long,2> dim;
+};
+
+template <typename T>
+Expanded_frame Expand_frame(jpa::Terse const& trpx_data, std::size_t const frame) {
+    Expanded_frame expanded{std::vector<std::byte>(trpx_data.size() * sizeof(T)),
+                            {.size = sizeof(T), .is_signed = std::is_signed_v<T>, .is_integral = std::is_integral_v<T>}, Dimensions(trpx_data)};
+    trpx_data.prolix(reinterpret_cast<T*>(expanded.pixels.data()), frame);
+    return expanded;
+}
+
+// Expands a frame into the smallest tif pixel type that holds its values.
+Expanded_frame Expand_frame(jpa::Terse const& trpx_data, std::size_t const frame) {
+    if (trpx_data.bits_per_val() <= 16 &&  trpx_data.is_signed()) return Expand_frame<std::int16_t> (trpx_data, frame);
+    if (trpx_data.bits_per_val() <= 16 && !trpx_data.is_signed()) return Expand_frame<std::uint16_t>(trpx_data, frame);
+    if (trpx_data.bits_per_val() <= 32 &&  trpx_data.is_signed()) return Expand_frame<std::int32_t> (trpx_data, frame);
+    if (trpx_data.bits_per_val() <= 32 && !trpx_data.is_signed()) return Expand_frame<std::uint32_t>(trpx_data, frame);
+    throw std::runtime_error("the Terse data require 64 bits per pixel");
+}
+
+// Calls 'header' with the XML header of every Terse object of a trpx file. The Terse data are skipped over.
+void For_each_header(fs::path const& trpx_filename, std::function<void(jpa::XML_element const&)> const& header) {
+    std::ifstream trpx_file(trpx_filename, std::ios::binary);
+    while ((trpx_file >> std::ws).peek() != std::char_traits<char>::eof()) {
+        jpa::XML_element const terse(Read_header(trpx_file), "Terse");
+        header(terse);
+        if (!trpx_file.seekg(std::stoll(terse.attribute("memory_size")), std::ios::cur))
+            break;
+    }
+}
+
+std::size_t Number_of_frames(jpa::XML_element const& terse) {
+    std::string const frames = terse.attribute("number_of_frames");
+    return frames.empty() ? 1 : std::stoull(frames);
+}
+
+std::vector<std::size_t> Terse_dimensions(jpa::XML_element const& terse) {
+    std::vector<std::size_t> dim;
+    std::istringstream dimensions(terse.attribute("dimensions"));
+    for (std::size_t d; dimensions >> d; )
+        dim.push_back(d);
+    return dim;
+}
+
+// The frames of the Terse objects of a trpx file, as they are laid out in the tif stack it expands to.
+struct Tif_object {
+    std::size_t frames;
+    jpa::POD_type_traits type; // the smallest tif pixel type that holds the values, as for Expand_frame()
+    std::array<long,2> dim;
+};
+
+std::vector<Tif_object> Read_tif_objects(fs::path const& trpx_filename) {
+    std::vector<Tif_object> objects;
+    For_each_header(trpx_filename, [&](jpa::XML_element const& terse) {
+        std::size_t const values = std::stoull(terse.attribute("number_of_values"));
+        unsigned long const bits = std::stoul(terse.attribute("prolix_bits"));
+        if (bits > 32)
+            throw std::runtime_error("the Terse data require 64 bits per pixel");
+        std::array<long,2> const dim = Dimensions(Terse_dimensions(terse), values);
+        if (static_cast<std::size_t>(dim[0] * dim[1]) != values)
+            throw std::runtime_error("the frames have no dimensions and are not square");
+        objects.push_back({Number_of_frames(terse),
+                           {.size = bits <= 16 ? 2u : 4u, .is_signed = std::stoul(terse.attribute("signed")) != 0, .is_integral = true},
+                           dim});
+    });
+    return objects;
+}
+
+// The size of the tif stack of the frames of a trpx file: a classic tif stack, or a BigTIFF stack if that exceeds 4 GB.
+std::uint64_t Tif_size(std::vector<Tif_object> const& objects) {
+    std::uint64_t pixel_bytes = 0;
+    std::size_t odd_frames = 0;
+    std::size_t frames = 0;
+    for (auto const& object : objects) {
+        std::uint64_t const frame_size = object.dim[0] * object.dim[1] * object.type.size;
+        pixel_bytes += object.frames * frame_size;
+        odd_frames += object.frames * (frame_size & 1);
+        frames += object.frames;
+    }
+    std::uint64_t const size = jpa::Grey_tif_writer::file_size(pixel_bytes, odd_frames, frames, false);
+    if (size <= std::numeric_limits<std::uint32_t>::max())
+        return size;
+    return jpa::Grey_tif_writer::file_size(pixel_bytes, odd_frames, frames, true);
+}
+
+// The frames of a trpx file, from the headers of its Terse objects.
+struct Stack_info {
+    std::size_t frames = 0;
+    std::size_t values = 0;        // of each frame
+    std::vector<std::size_t> dim;  // of the frames, if they are known
+    bool same_size = true;         // false if the Terse objects have frames of different sizes
+    bool is_signed = false;
+    unsigned signed_bits = 0;
+    unsigned unsigned_bits = 0;
+    
+    // The number of bits of an integer type that holds all values. Unsigned values need one more bit in a signed type.
+    unsigned bits() const { return is_signed ? std::max(signed_bits, unsigned_bits + 1) : unsigned_bits; }
+};
+
+Stack_info Read_stack_info(fs::path const& trpx_filename) {
+    Stack_info info;
+    For_each_header(trpx_filename, [&](jpa::XML_element const& terse) {
+        std::size_t const values = std::stoull(terse.attribute("number_of_values"));
+        std::vector<std::size_t> const dim = Terse_dimensions(terse);
+        if (info.frames == 0) {
+            info.values = values;
+            info.dim = dim;
+        }
+        else if (values != info.values || dim != info.dim)
+            info.same_size = false;
+        unsigned const bits = static_cast<unsigned>(std::stoul(terse.attribute("prolix_bits")));
+        if (std::stoul(terse.attribute("signed")) != 0) {
+            info.is_signed = true;
+            info.signed_bits = std::max(info.signed_bits, bits);
+        }
+        else
+            info.unsigned_bits = std::max(info.unsigned_bits, bits);
+        info.frames += Number_of_frames(terse);
+    });
+    return info;
+}
+
+// The pixel type of the mrc file that a trpx file expands to: the smallest of the mrc pixel types (int8, uint8, int16,
+// uint16 and float) that holds the values of all its Terse objects.
+jpa::POD_type_traits Mrc_type(Stack_info const& info, fs::path const& trpx_filename) {
+    if (info.bits() <= 8)
+        return {.size = 1, .is_signed = info.is_signed, .is_integral = true};
+    if (info.bits() <= 16)
+        return {.size = 2, .is_signed = info.is_signed, .is_integral = true};
+    if (info.bits() > 25)
+        std::cerr << "Warning: \"" << trpx_filename.string() << "\" holds values of more than 24 bits, which are rounded to floats in the MRC file" << std::endl;
+    return {.size = 4, .is_signed = true, .is_integral = false};
+}
+
+// The pixel type of the npy or raw file that a trpx file expands to: the smallest integer type that holds the values
+// of all its Terse objects.
+jpa::POD_type_traits Npy_type(Stack_info const& info) {
+    std::size_t size = 1;
+    while (size != 8 && 8 * size < info.bits())
+        size *= 2;
+    return {.size = size, .is_signed = info.is_signed || size == 8, .is_integral = true};
+}
+
+std::string Type_name(jpa::POD_type_traits const& type) {
+    return std::string(!type.is_integral ? "float" : type.is_signed ? "int" : "uint") + std::to_string(8 * type.size);
+}
+
+// Expands a frame into 'pixels', as pixels of 'type': an 8, 16, 32 or 64-bit integer, or a float.
+void Expand_into(jpa::Terse const& trpx_data, std::size_t const frame, jpa::POD_type_traits const& type, std::byte* const pixels) {
+    if      (type.is<std::int8_t>())   trpx_data.prolix(reinterpret_cast<std::int8_t*>  (pixels), frame);
+    else if (type.is<std::uint8_t>())  trpx_data.prolix(reinterpret_cast<std::uint8_t*> (pixels), frame);
+    else if (type.is<std::int16_t>())  trpx_data.prolix(reinterpret_cast<std::int16_t*> (pixels), frame);
+    else if (type.is<std::uint16_t>()) trpx_data.prolix(reinterpret_cast<std::uint16_t*>(pixels), frame);
+    else if (type.is<std::int32_t>())  trpx_data.prolix(reinterpret_cast<std::int32_t*> (pixels), frame);
+    else if (type.is<std::uint32_t>()) trpx_data.prolix(reinterpret_cast<std::uint32_t*>(pixels), frame);
+    else if (type.is<std::int64_t>())  trpx_data.prolix(reinterpret_cast<std::int64_t*> (pixels), frame);
+    else if (type.is<float>())         trpx_data.prolix(reinterpret_cast<float*>        (pixels), frame);
+    else
+        throw std::runtime_error("cannot expand to pixels of type " + Type_name(type));
+}
+
+// Expands a frame into pixels of 'type'.
+Expanded_frame Expand_frame(jpa::Terse const& trpx_data, std::size_t const frame, jpa::POD_type_traits const& type) {
+    Expanded_frame expanded{std::vector<std::byte>(trpx_data.size() * type.size), type, Dimensions(trpx_data)};
+    Expand_into(trpx_data, frame, type, expanded.pixels.data());
+    return expanded;
+}
+
+// Calls 'expand' for every frame of the consecutive Terse objects of a stream, with the Terse object, the index of the
+// frame in the Terse object and the index of the frame in the stream. The frames of each Terse object are expanded by
+// the workers of 'pool', in batches of two frames per worker, and 'expanded' is called with the size of each batch
+// once it has been expanded. Returns the number of frames.
+std::size_t Expand_batches(std::istream& trpx_file, jpa::Thread_pool& pool,
+                           std::function<void(jpa::Terse const&, std::size_t, std::size_t)> const& expand,
+                           std::function<void(std::size_t)> const& expanded = {}) {
+    std::size_t const threads = pool.size();
+    std::size_t frames = 0;
+    while ((trpx_file >> std::ws).peek() != std::char_traits<char>::eof()) {
+        jpa::Terse trpx_data(trpx_file);
+        if (!trpx_file)
+            throw std::runtime_error("the file is truncated");
+        for (std::size_t first = 0; first < trpx_data.number_of_frames(); first += 2 * threads) {
+            std::size_t const batch = std::min(2 * threads, trpx_data.number_of_frames() - first);
+            std::size_t const workers = std::min(threads, batch);
+            std::atomic<std::size_t> next = 0;
+            std::latch done(static_cast<std::ptrdiff_t>(workers));
+            std::mutex error_mutex;
+            std::exception_ptr error;
+            for (std::size_t t = 0; t != workers; ++t)
+                pool.submit([&] {
+                    try {
+                        for (std::size_t i; (i = next++) < batch; )
+                            expand(trpx_data, first + i, frames + i);
+                    }
+                    catch (...) {
+                        std::lock_guard lock(error_mutex);
+                        if (!error)
+                            error = std::current_exception();
+                    }
+                    done.count_down();
+                });
+            done.wait(); // not pool.wait(), which waits for all tasks of the pool
+            if (error)
+                std::rethrow_exception(error);
+            frames += batch;
+            if (expanded)
+                expanded(batch);
+        }
+    }
+    return frames;
+}
+
+// Expands the consecutive Terse objects of a stream into a tif stack that is passed to 'sink' piece by piece. While a
+// frame is written, the next frame is expanded by a worker of 'pool', so at most two frames are held in memory. Nothing
+// is written if the stream holds no frames. The stack is written as BigTIFF if 'expected_size' exceeds 4 GB. Returns
+// the number of frames.
+std::size_t Expand_tif_stream(std::istream& in, jpa::Thread_pool& pool, std::function<void(std::span<std::byte const>)> const& sink,
+                              std::uint64_t const expected_size = 0) {
+    std::optional<jpa::Grey_tif_writer> tif;
+    std::future<Expanded_frame> expanding;
+    auto const write = [&](Expanded_frame const& frame) {
+        if (!tif)
+            tif.emplace(sink, expected_size);
+        tif->write(frame.pixels, frame.type, frame.dim);
+    };
+    std::size_t frames = 0;
+    while ((in >> std::ws).peek() != std::char_traits<char>::eof()) {
+        auto const trpx_data = std::make_shared<jpa::Terse>(Read_terse(in));
+        for (std::size_t i = 0; i != trpx_data->number_of_frames(); ++i, ++frames) {
+            std::optional<Expanded_frame> previous;
+            if (expanding.valid())
+                previous = expanding.get(); // one frame of a Terse object is expanded at a time
+            auto task = std::make_shared<std::packaged_task<Expanded_frame()>>([trpx_data, i] { return Expand_frame(*trpx_data, i); });
+            expanding = task->get_future();
+            pool.submit([task] { (*task)(); });
+            if (previous)
+                write(*previous);
+        }
+    }
+    if (expanding.valid())
+        write(expanding.get());
+    if (tif)
+        tif->close();
+    return frames;
+}
+
+// Expands a trpx file into an mrc file and deletes the trpx file. The frames are expanded in parallel, in batches, and
+// written in order. Returns false, after printing an error message, if the file could not be expanded.
+bool Expand_mrc_file(fs::path const& trpx_filename, fs::path const& mrc_filename, jpa::Thread_pool& pool) {
+    try {
+        Stack_info const info = Read_stack_info(trpx_filename);
+        jpa::POD_type_traits const type = Mrc_type(info, trpx_filename);
+        std::ifstream trpx_file(trpx_filename, std::ios::binary);
+        std::ofstream mrc_file(mrc_filename, std::ios::binary | std::ios::trunc);
+        if (!trpx_file.is_open() || !mrc_file.is_open())
+            throw std::runtime_error("cannot open file");
+        jpa::Mrc_writer mrc(mrc_file, info.frames);
+        std::vector<Expanded_frame> expanded(2 * pool.size()); // frame i of a Terse object is expanded into expanded[i % size]
+        Expand_batches(trpx_file, pool, [&](jpa::Terse const& trpx_data, std::size_t const frame, std::size_t) {
+            expanded[frame % expanded.size()] = Expand_frame(trpx_data, frame, type);
+        }, [&](std::size_t const batch) {
+            for (std::size_t i = 0; i != batch; ++i)
+                mrc.write(expanded[i].pixels, expanded[i].type, expanded[i].dim);
+        });
+        mrc.close();
+        mrc_file.close();
+        if (mrc.image_stack_size() == 0 || !mrc_file)
+            throw std::runtime_error(mrc.image_stack_size() == 0 ? "no frames" : "writing \"" + mrc_filename.string() + "\" failed");
+        fs::remove(trpx_filename);
+        return true;
+    }
+    catch (std::exception const& e) {
+        std::error_code ignore;
+        fs::remove(mrc_filename, ignore);
+        std::cerr << "Error processing \"" << trpx_filename.string() << "\": " << e.what() << std::endl;
+        return false;
+    }
+}
+
+// Where the pixels of a frame go in a mapped file, and their type.
+struct Mapped_frame {
+    std::uint64_t offset;
+    jpa::POD_type_traits type;
+};
+
+// Expands a trpx file into a tif stack, an npy file, or a raw file of frames without a header, and deletes the trpx
+// file. A tif stack has the pixel types of Expand_frame(); npy and raw files have the smallest integer type that holds
+// all values. The file is sized and mapped, and its header and tif IFDs are written, before the frames are expanded;
+// the frames are then expanded in parallel straight into the mapped file, at their offsets in the file, so the pixels
+// are written once, without an intermediate buffer. Returns false, after printing an error message, if the file could
+// not be expanded.
+bool Expand_mapped_file(fs::path const& trpx_filename, fs::path const& filename, Mapped_format const format,
+                        jpa::Thread_pool& pool, bool const verbose) {
+    try {
+        std::vector<Mapped_frame> frames;
+        std::optional<jpa::Mapped_file> output;
+        std::ostringstream wrote; // the shape and type of npy and raw files, for verbose output
+        if (format == Mapped_format::tif) {
+            // Lay out the tif stack, as BigTIFF if it exceeds 4 GB; the writer only writes the header and the IFDs
+            std::vector<Tif_object> const objects = Read_tif_objects(trpx_filename);
+            if (std::ranges::all_of(objects, [](Tif_object const& object) { return object.frames == 0; }))
+                throw std::runtime_error("no frames");
+            output.emplace(filename, Tif_size(objects));
+            jpa::Grey_tif_writer tif(output->data());
+            for (auto const& object : objects)
+                for (std::size_t i = 0; i != object.frames; ++i)
+                    frames.push_back({tif.place(object.type, object.dim), object.type});
+            tif.close();
+        }
+        else {
+            Stack_info const info = Read_stack_info(trpx_filename);
+            if (info.frames == 0)
+                throw std::runtime_error("no frames");
+            if (!info.same_size)
+                throw std::runtime_error("the frames vary in size");
+            jpa::POD_type_traits const type = Npy_type(info);
+            
+            // A single frame is an array of two axes (rows and columns), a stack of frames an array of three axes.
+            // Frames without dimensions are a single axis.
+            std::vector<std::size_t> shape(info.dim.rbegin(), info.dim.rend());
+            if (shape.empty())
+                shape.push_back(info.values);
+            if (info.frames != 1 || shape.size() == 1)
+                shape.insert(shape.begin(), info.frames);
+            std::string const header = format == Mapped_format::npy ? jpa::Npy_map::header(type, shape) : std::string();
+            std::size_t const frame_size = info.values * type.size;
+            output.emplace(filename, header.size() + info.frames * frame_size);
+            std::memcpy(output->data().data(), header.data(), header.size());
+            for (std::size_t i = 0; i != info.frames; ++i)
+                frames.push_back({header.size() + i * frame_size, type});
+            wrote << "Wrote " << filename << ": " << info.frames << " frame" << (info.frames == 1 ? "" : "s") << " of ";
+            for (std::size_t i = info.frames != 1 || shape.size() == 1; i != shape.size(); ++i)
+                wrote << shape[i] << (i + 1 != shape.size() ? " x " : " ");
+            wrote << Type_name(type) << " pixels";
+        }
+        std::ifstream trpx_file(trpx_filename, std::ios::binary);
+        if (!trpx_file.is_open())
+            throw std::runtime_error("cannot open file");
+        std::byte* const data = output->data().data();
+        std::size_t const expanded = Expand_batches(trpx_file, pool, [&](jpa::Terse const& trpx_data, std::size_t const frame, std::size_t const index) {
+            if (index >= frames.size())
+                throw std::runtime_error("the file changed while it was expanded");
+            Expand_into(trpx_data, frame, frames[index].type, data + frames[index].offset);
+        });
+        if (expanded != frames.size())
+            throw std::runtime_error("the file changed while it was expanded");
+        output->close();
+        if (verbose && format != Mapped_format::tif)
+            std::cout << wrote.str() << std::endl;
+        fs::remove(trpx_filename);
+        return true;
+    }
+    catch (std::exception const& e) {
+        std::error_code ignore;
+        fs::remove(filename, ignore);
+        std::cerr << "Error processing \"" << trpx_filename.string() << "\": " << e.what() << std::endl;
+        return false;
+    }
+}
+
+// Expands the named trpx files, or stdin for "-", to stdout. Consecutive Terse objects in the input (as written by
+// terse -stdout) are expanded one after the other. Raw frames are written as soon as they have been expanded; a tif
+// stack is written frame by frame, while the next frame is expanded. The input files are kept.
+int Expand_to_stdout(std::vector<std::string> const& inputs, bool const raw, bool const verbose) {
+    std::ios::sync_with_stdio(false);
+    jpa::Pipe_writer out;
+    jpa::Thread_pool expanding(1); // expands the next frame of a tif stack while a frame is written
+    std::size_t frames = 0;
+    for (std::string const& name : inputs) {
+        try {
+            std::ifstream file;
+            if (name != "-" && (file.open(name, std::ios::binary), !file.is_open()))
+                throw std::runtime_error("cannot open file");
+            std::istream& in = (name == "-") ? std::cin : file;
+            if (!raw) {
+                frames += Expand_tif_stream(in, expanding, [&out](std::span<std::byte const> const data) { out.write(data); },
+                                            name == "-" ? 0 : Tif_size(Read_tif_objects(name)));
+                continue;
+            }
+            while ((in >> std::ws).peek() != std::char_traits<char>::eof()) {
+                jpa::Terse trpx_data = Read_terse(in);
+                frames += trpx_data.number_of_frames();
+                if      (trpx_data.bits_per_val() <= 16 &&  trpx_data.is_signed()) Write_raw<std::int16_t> (trpx_data, out);
+                else if (trpx_data.bits_per_val() <= 16 && !trpx_data.is_signed()) Write_raw<std::uint16_t>(trpx_data, out);
+                else if (trpx_data.bits_per_val() <= 32 &&  trpx_data.is_signed()) Write_raw<std::int32_t> (trpx_data, out);
+                else if (trpx_data.bits_per_val() <= 32 && !trpx_data.is_signed()) Write_raw<std::uint32_t>(trpx_data, out);
+                else if (trpx_data.is_signed())                                    Write_raw<std::int64_t> (trpx_data, out);
+                else                                                               Write_raw<std::uint64_t>(trpx_data, out);
+            }
+        }
+        catch (std::exception const& e) {
+            std::cerr << "Error processing \"" << name << "\": " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    if (verbose)
+        std::cerr << "Prolix expanded : " << frames << " frames\n";
+    return 0;
+}
+
+void Expansion_job::written() {
+    d_tif_data.reset();
+    d_report.expanded = true;
+}
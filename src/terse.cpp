@@ -9,118 +9,725 @@
 #include <chrono>
 #include <cmath>
 #include <filesystem>
+#include <sstream>
+#include <span>
+#include <thread>
+#include <stop_token>
+#include <mutex>
+#include <atomic>
+#include <csignal>
+#include <optional>
+#include <functional>
+#include <unordered_set>
 #include "Terse.hpp"
+#include "Terse_writer.hpp"
 #include "Command_line.hpp"
 #include "Grey_tif.hpp"
+#include "Grey_tif_map.hpp"
+#include "Mrc_map.hpp"
+#include "Npy_map.hpp"
+#include "File_pipeline.hpp"
+#include "Frame_ring.hpp"
+#include "Terse_reorder.hpp"
+#include "Compression_queue.hpp"
+#if __has_include(<sys/inotify.h>)
+#include "Directory_watcher.hpp"
+#endif
 
 namespace fs = std::filesystem;
 
+// The outcome of compressing a single file.
+struct File_report {
+    bool compressed = false;
+    std::string message;
+    std::string error;
+    double tiff_size = 0;
+    double trpx_size = 0;
+};
+
+// The frame size and pixel type of raw files, which have no header.
+struct Raw_format {
+    jpa::POD_type_traits type;
+    std::array<long,2> dim;
+};
+
+// A tiff file that is compressed by the File_pipeline: the pipeline reads the tiff file, process() compresses its
+// images, and the pipeline writes the trpx file and deletes the tiff file. Messages are collected in the report
+// instead of being printed, so that they can be printed in the order of the input files.
+class Compression_job {
+public:
+    using Input = std::vector<std::byte>;
+    Compression_job(fs::path const& tif_filename, std::size_t alignment, std::optional<Raw_format> const& raw = {}) : d_tif_filename(tif_filename), d_trpx_filename(fs::path(tif_filename).replace_extension(".trpx")), d_alignment(alignment), d_raw(raw) {}
+    fs::path const& input_path() const { return d_tif_filename; }
+    fs::path const& output_path() const { return d_trpx_filename; }
+    std::size_t memory_size() const { return 2 * fs::file_size(d_tif_filename); }
+    void process(Input&& tif);
+    void transcode(std::size_t threads);
+    std::span<std::byte const> output() const { return std::as_bytes(std::span(d_trpx_data)); }
+    void written();
+    void fail(std::string const& message) { d_report.error = "Error processing \"" + d_tif_filename.string() + "\": " + message + "\n"; }
+    bool failed() const { return !d_report.error.empty(); }
+    File_report const& report() const { return d_report; }
+    
+private:
+    fs::path d_tif_filename;
+    fs::path d_trpx_filename;
+    std::size_t d_alignment;
+    std::optional<Raw_format> d_raw; // for raw files
+    std::string d_trpx_data;
+    File_report d_report;
+    
+    template <typename Stack> void f_transcode(Stack const& images, std::size_t threads);
+};
+
 template <typename T> void Terse_pushback(jpa::Terse&, jpa::Grey_tif_image<T> const&);
+template <typename Stack> std::size_t Compress_frames(Stack const& images, std::size_t threads, std::function<void(jpa::Terse&&)> const& emit);
+// The parameters of compressing raw frames from a stream.
+struct Raw_options {
+    std::size_t workers;
+    std::size_t queue_depth;
+    bool verbose;
+};
+
+int Compress_to_stdout(std::vector<std::string> const& inputs, std::optional<Raw_format> const& raw, Raw_options const& options);
+int Watch(fs::path const& directory, jpa::File_pipeline<Compression_job>::Options const& options, std::size_t alignment,
+          std::size_t backlog_size, double stats_interval, bool verbose);
+int Compress_ring(std::string const& name, std::string const& output, std::size_t threads, double stats_interval, bool verbose);
+
+bool Is_tiff(fs::path const& filename) {
+    return filename.extension() == ".tiff" || filename.extension() == ".tif" ||
+           filename.extension() == ".TIFF" || filename.extension() == ".TIF";
+}
+
+bool Is_mrc(fs::path const& filename) {
+    return filename.extension() == ".mrc" || filename.extension() == ".mrcs" ||
+           filename.extension() == ".MRC" || filename.extension() == ".MRCS";
+}
+
+bool Is_npy(fs::path const& filename) {
+    return filename.extension() == ".npy" || filename.extension() == ".NPY";
+}
+
+bool Is_raw(fs::path const& filename) {
+    return filename.extension() == ".raw" || filename.extension() == ".bin" || filename.extension() == ".dat" ||
+           filename.extension() == ".RAW" || filename.extension() == ".BIN" || filename.extension() == ".DAT";
+}
+
+// The frame size and pixel type of raw files given by the -raw option.
+Raw_format Parse_raw(jpa::Command_line_option const& raw) {
+    std::vector<std::string> const format = raw.param<std::string>();
+    std::array<long,2> const dim = {std::stol(format[0]), std::stol(format[1])};
+    if (dim[0] <= 0 || dim[1] <= 0)
+        throw std::runtime_error("-raw requires the width and height of the frames");
+    std::string const& type = format[2];
+    if (type == "int8"  || type == "int16"  || type == "int32" ||
+        type == "uint8" || type == "uint16" || type == "uint32")
+        return {{.size = std::stoul(type.substr(type[0] == 'u' ? 4 : 3)) / 8, .is_signed = type[0] != 'u', .is_integral = true}, dim};
+    throw std::runtime_error("unknown pixel type \"" + type + "\"");
+}
 
 int main(int argc, char const* argv[]) {
     using namespace jpa;
     Command_line_option help("-help", "print help");
     Command_line_option verbose("-verbose", "print compressed filenames, compute times and compression rate");
-    Command_line input(argc, argv, {help, verbose});
+    Command_line_option threads("-j", "number of threads that compress files in parallel (0: one per core)", {"1"});
+    Command_line_option readers("-readers", "number of threads that read and prefetch tiff files", {"1"});
+    Command_line_option writers("-writers", "number of threads that write trpx files and delete tiff files", {"1"});
+    Command_line_option queue("-queue", "maximum number of files (with -raw: frames) waiting to be compressed, and waiting to be written", {"4"});
+    Command_line_option memory("-memory", "maximum memory in MB used by files in flight", {"1024"});
+    Command_line_option fuse("-fuse", "files larger than MB are not read into memory, but mapped and written frame by frame, with their frames compressed in parallel (0: all files)", {"256"});
+    Command_line_option io("-io", "file I/O backend: auto, sync or io_uring (auto selects io_uring if the kernel supports it)", {"auto"});
+    Command_line_option batch("-batch", "maximum number of files that are read or written in one batch", {"16"});
+    Command_line_option direct("-direct", "read and write with direct I/O (O_DIRECT), bypassing the page cache, and align the trpx header and frames to 4096 bytes");
+    Command_line_option to_stdout("-stdout", "write the compressed frames to stdout instead of to trpx files, and keep the input files; '-' as file name reads from stdin");
+    Command_line_option raw("-raw", "the input consists of raw frames of WIDTH HEIGHT pixels of TYPE (int8, uint8, int16, uint16, int32 or uint32) in native byte order: stdin or the named files with -stdout, otherwise the files with .raw, .bin or .dat extensions", {"0", "0", "uint16"});
+    Command_line_option watch("-watch", "keep compressing tiff files in DIR as soon as they have been written, until interrupted", {""});
+    Command_line_option backlog("-backlog", "with -watch: maximum number of written tiff files waiting to be compressed", {"1000"});
+    Command_line_option stats("-stats", "with -watch or -ring: seconds between reports of the throughput and backlog (0: no reports)", {"10"});
+    Command_line_option ring("-ring", "compress the frames in the shared memory ring NAME, written by a detector readout process, to a trpx file (or stdout), until the ring is closed", {""});
+    Command_line input(argc, argv, {help, verbose, threads, readers, writers, queue, memory, fuse, io, batch, direct, to_stdout, raw, watch, backlog, stats, ring});
     if (input.option("-help").found()) {
-        std::cout << "terse [-help] [-verbose] [file ...]\n";
-        std::cout << "  compresses all files with .tiff or .tif extensions to terse files with .trpx extensions.\n";
+        std::cout << "terse [-help] [-verbose] [-j N] [-readers N] [-writers N] [-queue N] [-memory MB] [-fuse MB] [-io auto|sync|io_uring] [-batch N] [-direct] [-raw W H TYPE] [-stdout] [-watch DIR [-backlog N] [-stats S]] [-ring NAME [-stats S]] [file ... | -]\n";
+        std::cout << "  compresses all files with .tiff, .tif, .mrc, .mrcs or .npy extensions to terse files with .trpx extensions,\n";
+        std::cout << "  and, with -raw, all files with .raw, .bin or .dat extensions.\n";
+        std::cout << "  Reading, compressing and writing overlap: while files are compressed, the next files are read\n";
+        std::cout << "  and previous files are written. Large files are compressed frame by frame instead, so that only a few\n";
+        std::cout << "  frames are in memory at any time. MRC, NumPy and raw files are always compressed frame by frame.\n";
         std::cout << "Examples:\n";
         std::cout << "   terse *                   // all tiff files in this directory are compressed to trpx files.\n";
         std::cout << "   terse ˜/dir/my_img*       // compresses all tiff files in the directory ~/dir that start with my_img\n";
+        std::cout << "   terse -j 0 *              // compresses all tiff files in this directory, using all cores\n";
+        std::cout << "   terse -direct *           // compresses without filling the page cache, writing 4096 byte aligned frames\n";
+        std::cout << "   terse -raw 512 512 uint16 *.raw  // compresses raw files of 512x512 frames of 16-bit unsigned pixels\n";
+        std::cout << "   acquire | terse -raw 512 512 uint16 - | ssh host 'cat > run.trpx'\n";
+        std::cout << "                             // compresses a stream of raw 512x512 frames from stdin to stdout, frame by frame\n";
+        std::cout << "   terse -watch spool -j 0   // compresses tiff files written into the directory spool until interrupted\n";
+        std::cout << "   terse -ring /detector -j 0 run.trpx\n";
+        std::cout << "                             // compresses the frames that a readout process writes into shared memory\n";
         std::cout << "\nkeywords:\n";
         std::cout << input.help() << std::endl;
         return 0;
     }
     
-    // Some timers and counters are required for the 'verbose' option.
-    std::chrono::duration<double> user_time(0);
-    std::chrono::duration<double> IO_time(0);
-    double total_trpx_size = 0;
-    double total_tiff_size = 0;
-    std::size_t compressed_files = 0;
+    // Compress the frames in a shared memory ring, in parallel, writing them in frame order
+    std::vector<std::string> const params = input.params();
+    if (input.option("-ring").found())
+        return Compress_ring(input.option("-ring").param<std::string>()[0],
+                             input.option("-stdout").found() || params.empty() ? "-" : params[0],
+                             input.option("-j").param<std::size_t>()[0], input.option("-stats").param<double>()[0],
+                             input.option("-verbose").found());
+    
+    // The frame size and pixel type of raw input, on stdin or in files
+    std::optional<Raw_format> raw_format;
+    try {
+        if (input.option("-raw").found())
+            raw_format = Parse_raw(input.option("-raw"));
+    }
+    catch (std::exception const& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    
+    // Compress to stdout, frame by frame, if requested or if the input is read from stdin
+    if (input.option("-stdout").found() || std::find(params.begin(), params.end(), "-") != params.end())
+        return Compress_to_stdout(params, raw_format, {input.option("-j").param<std::size_t>()[0],
+                                  input.option("-queue").param<std::size_t>()[0], input.option("-verbose").found()});
+    
+    std::string const backend = input.option("-io").param<std::string>()[0];
+    if (backend != "auto" && backend != "sync" && backend != "io_uring") {
+        std::cerr << "Unknown I/O backend \"" << backend << "\"" << std::endl;
+        return 1;
+    }
+    
+    // Direct I/O reads and writes in blocks of 4096 bytes, so then trpx frames are aligned to 4096 bytes as well.
+    bool const direct_io = input.option("-direct").found();
+    std::size_t const alignment = direct_io ? 4096 : 1;
+    File_pipeline<Compression_job>::Options const options{
+        .readers = input.option("-readers").param<std::size_t>()[0],
+        .workers = input.option("-j").param<std::size_t>()[0],
+        .writers = input.option("-writers").param<std::size_t>()[0],
+        .queue_depth = input.option("-queue").param<std::size_t>()[0],
+        .memory_budget = input.option("-memory").param<std::size_t>()[0] << 20,
+        .io = backend == "sync" ? File_io::Backend::sync : backend == "io_uring" ? File_io::Backend::io_uring : File_io::Backend::automatic,
+        .batch = input.option("-batch").param<std::size_t>()[0],
+        .direct = direct_io};
+    
+    // Keep compressing the files that are written into a directory
+    if (input.option("-watch").found())
+        return Watch(input.option("-watch").param<std::string>()[0], options, alignment,
+                     input.option("-backlog").param<std::size_t>()[0], input.option("-stats").param<double>()[0],
+                     input.option("-verbose").found());
+    
+    // Collect all input files with a tiff, mrc or npy extension, and with -raw, all files with a raw extension.
+    std::vector<Compression_job> jobs;
+    for (fs::path tif_filename : params)
+        if (fs::is_regular_file(tif_filename) && (Is_tiff(tif_filename) || Is_mrc(tif_filename) || Is_npy(tif_filename)))
+            jobs.emplace_back(tif_filename, alignment);
+        else if (fs::is_regular_file(tif_filename) && raw_format && Is_raw(tif_filename))
+            jobs.emplace_back(tif_filename, alignment, raw_format);
+    
+    // Compress the files. Runs of tiff files up to the -fuse size go through the pipeline; larger files and mrc, npy and
+    // raw files are transcoded one at a time, with their frames compressed in parallel. Reports are printed in the order of the input files, so the
+    // output is identical for any number of threads.
+    File_pipeline<Compression_job> pipeline(options);
+    std::uintmax_t const fuse_size = input.option("-fuse").param<std::uintmax_t>()[0] << 20;
+    auto const report = [](Compression_job const& job) {
+        std::cout << job.report().message;
+        std::cerr << job.report().error;
+    };
+    std::chrono::duration<double> transcode_time{0};
+    auto const start_wall_time = std::chrono::high_resolution_clock::now();
+    for (std::size_t first = 0; first != jobs.size(); ) {
+        std::size_t last = first;
+        while (last != jobs.size() && fuse_size != 0 && Is_tiff(jobs[last].input_path()) && fs::file_size(jobs[last].input_path()) <= fuse_size)
+            ++last;
+        if (last != first) {
+            std::vector<Compression_job> batch(std::make_move_iterator(jobs.begin() + first), std::make_move_iterator(jobs.begin() + last));
+            pipeline.run(batch, [&](std::size_t i) { report(batch[i]); });
+            std::move(batch.begin(), batch.end(), jobs.begin() + first);
+        }
+        if (last != jobs.size()) {
+            auto const start = std::chrono::high_resolution_clock::now();
+            jobs[last].transcode(options.workers);
+            transcode_time += std::chrono::high_resolution_clock::now() - start;
+            report(jobs[last++]);
+        }
+        first = last;
+    }
+    std::chrono::duration<double> wall_time = std::chrono::high_resolution_clock::now() - start_wall_time;
     
-    // Loop over all input file names
-    for (fs::path tif_filename : input.params()) {
-        if (fs::is_regular_file(tif_filename) && (tif_filename.extension() == ".tiff" ||
-                                                  tif_filename.extension() == ".tif" ||
-                                                  tif_filename.extension() == ".TIFF" ||
-                                                  tif_filename.extension() == ".TIF")) {
+    // If required, provide verbose output, with the times of each stage summed over all threads
+    if (input.option("-verbose").found()) {
+        auto const& times = pipeline.times();
+        double total_trpx_size = 0;
+        double total_tiff_size = 0;
+        std::size_t compressed_files = 0;
+        for (auto const& job : jobs) {
+            File_report const& report = job.report();
+            if (report.compressed) {
+                std::cout << "Compressed: " << job.input_path() << std::endl;
+                ++compressed_files;
+            }
+            total_tiff_size += report.tiff_size;
+            total_trpx_size += report.trpx_size;
+        }
+        std::cout << "Terse compressed: " << compressed_files << " files\n";
+        std::cout << "User time       : " << (times.process + transcode_time).count() << " seconds\n";
+        std::cout << "IO time         : " << (times.read + times.write).count() << " seconds\n";
+        std::cout << "  read          : " << times.read.count() << " seconds\n";
+        std::cout << "  write         : " << times.write.count() << " seconds\n";
+        std::cout << "Wall time       : " << wall_time.count() << " seconds\n";
+        if (total_tiff_size > 0)
+            std::cout << "Compression rate: " << std::round(1000 * (1 - total_trpx_size / total_tiff_size)) / 10 << "%\n";
+    }
+    return 0;
+}
+
+void Compression_job::process(Input&& tif) {
+    jpa::Grey_tif<std::byte> const tif_data(std::move(tif));
+    jpa::Terse compressed;
+    compressed.alignment(d_alignment);
+    for (std::size_t i = 0; i != tif_data.image_stack_size(); ++i) {
+        if (tif_data.dim() != tif_data.image(i).dim()) {
+            throw std::runtime_error("TIFF file contains a stack of images with varying sizes.");
+        }
+        Terse_pushback(compressed, tif_data.image(i));
+    }
+    std::ostringstream trpx_stream;
+    compressed.write(trpx_stream);
+    d_trpx_data = std::move(trpx_stream).str();
+    d_report.tiff_size = tif_data.raw_data_size();
+    d_report.trpx_size = compressed.terse_size();
+}
+
+void Compression_job::written() {
+    d_trpx_data = std::string();
+    d_report.message = std::string("Deleting original ") + (d_raw ? "raw" : Is_npy(d_tif_filename) ? "NumPy" : Is_mrc(d_tif_filename) ? "MRC" : "TIFF") + " file: \"" + d_tif_filename.string() + "\"\n";
+    d_report.compressed = true;
+}
+
+// Compresses the tiff, mrc, npy or raw file without reading it into memory: the file is mapped, its frames are
+// compressed in parallel, and each compressed frame is written to the trpx file as soon as the frames before it have
+// been written.
+void Compression_job::transcode(std::size_t const threads) {
+    try {
+        if (d_raw)
+            f_transcode(jpa::Npy_map(d_tif_filename, d_raw->type, d_raw->dim), threads);
+        else if (Is_npy(d_tif_filename))
+            f_transcode(jpa::Npy_map(d_tif_filename), threads);
+        else if (Is_mrc(d_tif_filename))
+            f_transcode(jpa::Mrc_map(d_tif_filename), threads);
+        else
+            f_transcode(jpa::Grey_tif_map(d_tif_filename), threads);
+        fs::remove(d_tif_filename);
+    }
+    catch (std::exception const& e) {
+        std::error_code ignored;
+        fs::remove(d_trpx_filename, ignored);
+        fail(e.what());
+        return;
+    }
+    written();
+}
+
+template <typename Stack>
+void Compression_job::f_transcode(Stack const& images, std::size_t const threads) {
+    std::ofstream trpx_file(d_trpx_filename, std::ios::binary | std::ios::trunc);
+    if (!trpx_file.is_open())
+        throw std::runtime_error("cannot open \"" + d_trpx_filename.string() + "\"");
+    jpa::Terse_writer trpx(trpx_file, d_alignment);
+    Compress_frames(images, threads, [&trpx](jpa::Terse&& frame) {
+        if (trpx.number_of_frames() != 0 && frame.dim() != trpx.dim())
+            throw std::runtime_error("TIFF file contains a stack of images with varying sizes.");
+        trpx.write(frame);
+    });
+    trpx.close();
+    trpx_file.close();
+    if (!trpx_file)
+        throw std::runtime_error("cannot write \"" + d_trpx_filename.string() + "\"");
+    d_report.tiff_size = images.raw_data_size();
+    d_report.trpx_size = trpx.terse_size();
+}
+
+// Compresses the images of a mapped tiff file (Grey_tif_map), mrc file (Mrc_map) or npy or raw file (Npy_map) on 'threads' threads (0: one per
+// core), and passes the compressed frames to 'emit' in image order. Each thread claims the next image, byte-swaps or gathers it into its own buffer if needed,
+// compresses it and releases its pages. A thread that runs more than two frames per thread ahead of the next frame to
+// be emitted waits, so only a few frames per thread are in memory, whatever the size of the stack.
+template <typename Stack>
+std::size_t Compress_frames(Stack const& images, std::size_t threads, std::function<void(jpa::Terse&&)> const& emit) {
+    std::size_t const frames = images.image_stack_size();
+    if (frames == 0)
+        throw std::runtime_error("the file contains no images.");
+    threads = std::min<std::size_t>(threads == 0 ? std::max(1u, std::thread::hardware_concurrency()) : threads, frames);
+    
+    // After an error, no further frames are compressed or emitted, but the frames that have been claimed are skipped,
+    // so that no thread keeps waiting for them
+    std::atomic<bool> stop = false;
+    std::mutex error_mutex;
+    std::string error;
+    auto const failed = [&](std::string const& message) {
+        std::lock_guard lock(error_mutex);
+        if (error.empty())
+            error = message;
+        stop = true;
+    };
+    jpa::Terse_reorder reorder([&](std::size_t, jpa::Terse&& frame) {
+        try {
+            if (!stop)
+                emit(std::move(frame));
+        }
+        catch (std::exception const& e) {
+            failed(e.what());
+        }
+    }, 2 * threads);
+    std::atomic<std::size_t> next = 0;
+    auto const compress = [&] {
+        std::vector<std::byte> buffer;
+        for (std::size_t i; !stop && (i = next++) < frames; ) {
             try {
-                auto start_IO_time = std::chrono::high_resolution_clock::now();
-                std::ifstream tif_file(tif_filename, std::ios::binary);
-                if (!tif_file.is_open()) {
-                    std::cerr << "Failed to open input file " << tif_filename << std::endl;
-                    continue; // Skip to next file
-                }
+                images.prefetch(i + threads);
+                jpa::Terse compressed;
+                Terse_pushback(compressed, images.image(i, buffer));
+                images.release(i);
+                reorder.insert(i, std::move(compressed));
+            }
+            catch (std::exception const& e) {
+                failed(e.what());
+                reorder.skip(i);
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (std::size_t i = 1; i < threads; ++i)
+        workers.emplace_back(compress);
+    compress();
+    for (auto& worker : workers)
+        worker.join();
+    if (!error.empty())
+        throw std::runtime_error(error);
+    return frames;
+}
 
-                jpa::Grey_tif<std::byte> tif_data(tif_file);
-                tif_file.close();
+// Reads the input stream until its end.
+std::vector<std::byte> Read_all(std::istream& in) {
+    std::vector<std::byte> data;
+    std::size_t size = 0;
+    do {
+        data.resize(std::max(2 * data.size(), std::size_t(1) << 20));
+        in.read(reinterpret_cast<char*>(data.data() + size), data.size() - size);
+        size += in.gcount();
+    } while (in);
+    data.resize(size);
+    return data;
+}
 
-                total_tiff_size += tif_data.raw_data_size();
-                auto start_user_time = std::chrono::high_resolution_clock::now();
+// Compresses raw frames of type T, until the end of the input stream. While frames are read, the previous frames are
+// compressed by the workers of a Compression_queue, which writes them in order and tracks their latencies.
+template <typename T>
+std::size_t Compress_raw(std::istream& in, std::array<long,2> const& dim, Raw_options const& options) {
+    jpa::Compression_queue<T> queue(std::cout, {.workers = options.workers, .queue_depth = options.queue_depth});
+    std::size_t frames = 0;
+    for (std::vector<T> frame(dim[0] * dim[1]); in.read(reinterpret_cast<char*>(frame.data()), frame.size() * sizeof(T)); ++frames) {
+        queue.submit(std::move(frame), {std::size_t(dim[0]), std::size_t(dim[1])});
+        frame.resize(dim[0] * dim[1]);
+    }
+    queue.close();
+    if (options.verbose)
+        std::cerr << "Latencies: " << queue.report() << std::endl;
+    if (in.gcount() != 0)
+        throw std::runtime_error("the input ends with an incomplete frame");
+    return frames;
+}
 
-                Terse compressed;
-                for (int i = 0; i != tif_data.image_stack_size(); ++i) {
-                    if (tif_data.dim() != tif_data.image(i).dim()) {
-                        throw std::runtime_error("TIFF file contains a stack of images with varying sizes.");
-                    }
+std::size_t Compress_raw(std::istream& in, Raw_format const& raw, Raw_options const& options) {
+    if (raw.type.is<std::int8_t>())   return Compress_raw<std::int8_t>  (in, raw.dim, options);
+    if (raw.type.is<std::uint8_t>())  return Compress_raw<std::uint8_t> (in, raw.dim, options);
+    if (raw.type.is<std::int16_t>())  return Compress_raw<std::int16_t> (in, raw.dim, options);
+    if (raw.type.is<std::uint16_t>()) return Compress_raw<std::uint16_t>(in, raw.dim, options);
+    if (raw.type.is<std::int32_t>())  return Compress_raw<std::int32_t> (in, raw.dim, options);
+    return Compress_raw<std::uint32_t>(in, raw.dim, options); // Parse_raw accepts no other types
+}
+
+// Compresses the named files, or stdin for "-", to stdout. Every frame is written as a separate Terse object as soon as it
+// has been compressed, so that the next process in a pipeline can expand frames while later frames are still coming in.
+// Streams of consecutive Terse objects are expanded by prolix. The input files are kept.
+int Compress_to_stdout(std::vector<std::string> const& inputs, std::optional<Raw_format> const& raw, Raw_options const& options) {
+    std::ios::sync_with_stdio(false);
+    std::cin.tie(nullptr); // compressed frames are written to std::cout by other threads while std::cin is read
+    std::size_t frames = 0;
+    for (std::string const& name : inputs) {
+        try {
+            if (name != "-" && !raw && fs::is_regular_file(name)) {
+                // Map the file instead of reading it, so that the first frame is written before the rest has been read
+                auto const write = [](jpa::Terse&& frame) { frame.write(std::cout); };
+                if (Is_mrc(name))
+                    frames += Compress_frames(jpa::Mrc_map(name), options.workers, write);
+                else if (Is_npy(name))
+                    frames += Compress_frames(jpa::Npy_map(name), options.workers, write);
+                else
+                    frames += Compress_frames(jpa::Grey_tif_map(name), options.workers, write);
+                continue;
+            }
+            std::ifstream file;
+            if (name != "-" && (file.open(name, std::ios::binary), !file.is_open()))
+                throw std::runtime_error("cannot open file");
+            std::istream& in = (name == "-") ? std::cin : file;
+            if (raw)
+                frames += Compress_raw(in, *raw, options);
+            else {
+                jpa::Grey_tif<std::byte> const tif_data(Read_all(in));
+                jpa::Terse compressed; // reused, so that its memory is allocated once
+                for (std::size_t i = 0; i != tif_data.image_stack_size(); ++i, ++frames) {
+                    compressed.clear();
                     Terse_pushback(compressed, tif_data.image(i));
+                    compressed.write(std::cout);
                 }
-                total_trpx_size += compressed.terse_size();
+            }
+        }
+        catch (std::exception const& e) {
+            std::cerr << "Error processing \"" << name << "\": " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    if (!std::cout)
+        return 1;
+    if (options.verbose)
+        std::cerr << "Terse compressed: " << frames << " frames\n";
+    return 0;
+}
 
-                fs::path trpx_filename = tif_filename;
-                trpx_filename.replace_extension(".trpx");
-                std::ofstream trpx_file(trpx_filename, std::ios::binary);
-                if (!trpx_file.is_open()) {
-                    throw std::runtime_error("Failed to open trpx file for output.");
-                }
-                
-                compressed.write(trpx_file);
-                trpx_file.close();
-                std::cout << "Deleting original TIFF file: " << tif_filename << std::endl;
-                fs::remove(tif_filename);
-                ++compressed_files;
+// Compresses a frame of pixels of type T into a single-frame Terse object.
+template <typename T>
+jpa::Terse Compress_frame(std::span<std::byte const> const pixels, std::array<std::uint64_t,2> const& dim) {
+    jpa::Terse compressed(reinterpret_cast<T const*>(pixels.data()), pixels.size() / sizeof(T));
+    compressed.dim({dim[0], dim[1]});
+    return compressed;
+}
+
+jpa::Terse Compress_frame(jpa::Frame_ring::Frame const& frame, unsigned const pixel_size, bool const is_signed) {
+    switch (pixel_size) {
+        case 1: return is_signed ? Compress_frame<std::int8_t>(frame.data(), frame.dim())  : Compress_frame<std::uint8_t>(frame.data(), frame.dim());
+        case 2: return is_signed ? Compress_frame<std::int16_t>(frame.data(), frame.dim()) : Compress_frame<std::uint16_t>(frame.data(), frame.dim());
+        case 4: return is_signed ? Compress_frame<std::int32_t>(frame.data(), frame.dim()) : Compress_frame<std::uint32_t>(frame.data(), frame.dim());
+        default: return is_signed ? Compress_frame<std::int64_t>(frame.data(), frame.dim()) : Compress_frame<std::uint64_t>(frame.data(), frame.dim());
+    }
+}
 
-                auto end_user_time = std::chrono::high_resolution_clock::now();
-                user_time += end_user_time - start_user_time;
-                IO_time += start_user_time - start_IO_time;
-            } catch (const std::exception& e) {
-                std::cerr << "Error processing " << tif_filename << ": " << e.what() << std::endl;
+// Compresses the frames of a shared memory Frame_ring until its producer closes it. Each thread claims frames from the
+// ring and compresses them in place, so that the slots are released as soon as possible. A Terse_reorder writes the
+// compressed frames in frame order as a sequence of single-frame Terse objects, which prolix expands. Threads that run
+// ahead of the next frame to be written by more than a few frames per thread wait, which bounds the reorder buffer.
+int Compress_ring(std::string const& name, std::string const& output, std::size_t threads, double const stats_interval, bool const verbose) {
+    using Clock = std::chrono::steady_clock;
+    std::optional<jpa::Frame_ring> ring;
+    std::ofstream file;
+    try {
+        ring.emplace(jpa::Frame_ring::open(name));
+        if (ring->pixel_size() != 1 && ring->pixel_size() != 2 && ring->pixel_size() != 4 && ring->pixel_size() != 8)
+            throw std::runtime_error("unsupported pixel size " + std::to_string(ring->pixel_size()));
+        if (output != "-" && (file.open(output, std::ios::binary | std::ios::trunc), !file.is_open()))
+            throw std::runtime_error("cannot open \"" + output + "\"");
+    }
+    catch (std::exception const& e) {
+        std::cerr << "Cannot compress ring \"" << name << "\": " << e.what() << std::endl;
+        return 1;
+    }
+    std::ostream& out = output == "-" ? std::cout : file;
+    
+    threads = threads == 0 ? std::max(1u, std::thread::hardware_concurrency()) : threads;
+    jpa::Terse_reorder reorder(out, 4 * threads);
+    std::atomic<std::size_t> running = threads;
+    std::mutex error_mutex;
+    std::string error;
+    std::stop_source stopping; // once a frame has failed, the workers stop claiming frames
+    std::vector<std::thread> workers;
+    for (std::size_t i = 0; i != threads; ++i)
+        workers.emplace_back([&] {
+            while (auto frame = ring->pop(stopping.get_token())) {
+                std::size_t const index = frame->index();
+                try {
+                    jpa::Terse compressed = Compress_frame(*frame, ring->pixel_size(), ring->is_signed());
+                    frame.reset();
+                    reorder.insert(index, std::move(compressed));
+                }
+                catch (std::exception const& e) {
+                    {
+                        std::lock_guard lock(error_mutex);
+                        if (error.empty())
+                            error = e.what();
+                    }
+                    stopping.request_stop();
+                    // Workers that wait for this frame to be written go on, and find that they have to stop
+                    try {
+                        reorder.skip(index);
+                    }
+                    catch (std::exception const&) {
+                    }
+                }
             }
+            --running;
+        });
+    
+    // Report the counters of the ring while the frames are compressed
+    auto last_report = Clock::now();
+    jpa::Frame_ring::Counters last = ring->counters();
+    while (running != 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(stats_interval > 0 ? 50 : 200));
+        std::chrono::duration<double> const seconds = Clock::now() - last_report;
+        if (stats_interval > 0 && seconds.count() >= stats_interval) {
+            jpa::Frame_ring::Counters const counters = ring->counters();
+            std::cerr << "Compressed " << counters.consumed - last.consumed << " frames ("
+                      << std::round((counters.consumed - last.consumed) / seconds.count()) << " frames/s), lag "
+                      << counters.written - counters.consumed << " frames (max " << counters.max_lag << "), "
+                      << counters.dropped << " dropped in total" << std::endl;
+            last_report = Clock::now();
+            last = counters;
         }
     }
-    // If required, provide verbose output
-    if (input.option("-verbose").found()) {
-        for (fs::path tif_filename : input.params()) 
-            std::cout << "Compressed: " << tif_filename << std::endl;
-        std::cout << "Terse compressed: " << compressed_files << " files\n";
-        std::cout << "User time       : " << user_time.count() << " seconds\n";
-        std::cout << "IO time         : " << IO_time.count() << " seconds\n";
-        if (total_tiff_size > 0)
-            std::cout << "Compression rate: " << std::round(1000 * (1 - total_trpx_size / total_tiff_size)) / 10 << "%\n";
+    for (auto& worker : workers)
+        worker.join();
+    out.flush();
+    jpa::Frame_ring::remove(name);
+    
+    jpa::Frame_ring::Counters const counters = ring->counters();
+    if (verbose)
+        std::cerr << "Terse compressed: " << reorder.next() << " frames from ring \"" << name << "\", " << counters.dropped
+                  << " dropped by the producer, maximum lag " << counters.max_lag << " frames\n";
+    if (!error.empty() || !out) {
+        std::cerr << "Error compressing ring \"" << name << "\": " << (error.empty() ? "cannot write output" : error) << std::endl;
+        return 1;
     }
     return 0;
 }
 
+#if __has_include(<sys/inotify.h>)
+volatile std::sig_atomic_t s_stop_watching = 0;
+
+// Compresses the tiff files in 'directory' as soon as they have been written, until SIGINT or SIGTERM is received. A
+// watcher thread queues the completed tiff files in a bounded backlog. While the backlog is full, further events wait in
+// the kernel's inotify queue, and if that overflows the directory is rescanned. The main thread compresses all files in
+// the backlog in one run of the File_pipeline, while the watcher thread keeps queueing the files that arrive meanwhile.
+int Watch(fs::path const& directory, jpa::File_pipeline<Compression_job>::Options const& options, std::size_t const alignment,
+          std::size_t const backlog_size, double const stats_interval, bool const verbose) {
+    using Clock = std::chrono::steady_clock;
+    std::signal(SIGINT, [](int) { s_stop_watching = 1; });
+    std::signal(SIGTERM, [](int) { s_stop_watching = 1; });
+    std::optional<jpa::Directory_watcher> watcher;
+    try {
+        watcher.emplace(directory);
+    }
+    catch (std::exception const& e) {
+        std::cerr << "Cannot watch \"" << directory.string() << "\": " << e.what() << std::endl;
+        return 1;
+    }
+    
+    jpa::Bounded_queue<fs::path> backlog(backlog_size);
+    std::mutex pending_mutex;
+    std::unordered_set<std::string> pending; // files in the backlog or being compressed, to ignore repeated events
+    std::atomic<std::size_t> compressed_files = 0;
+    std::atomic<std::size_t> failed_files = 0;
+    std::atomic<double> compressed_bytes = 0;
+    
+    std::thread watch([&] {
+        auto const queue = [&](std::vector<fs::path> const& files) {
+            for (fs::path const& file : files)
+                if (Is_tiff(file)) {
+                    {
+                        std::lock_guard lock(pending_mutex);
+                        if (!pending.insert(file.string()).second)
+                            continue;
+                    }
+                    backlog.push(file);
+                }
+        };
+        try {
+            queue(watcher->scan()); // files that were written before watching started; recent ones are reported by wait()
+            auto const interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(stats_interval));
+            auto last_report = Clock::now();
+            std::size_t last_files = 0;
+            double last_bytes = 0;
+            while (!s_stop_watching) {
+                queue(watcher->wait(std::chrono::milliseconds(200)));
+                auto const now = Clock::now();
+                if (stats_interval > 0 && now - last_report >= interval) {
+                    std::chrono::duration<double> const seconds = now - last_report;
+                    std::size_t const files = compressed_files;
+                    double const bytes = compressed_bytes;
+                    std::size_t waiting;
+                    {
+                        std::lock_guard lock(pending_mutex);
+                        waiting = pending.size();
+                    }
+                    std::cout << "Compressed " << files - last_files << " files (" << std::round((files - last_files) / seconds.count()) << " files/s, "
+                              << std::round((bytes - last_bytes) / seconds.count() / 1e6) << " MB/s), backlog " << waiting << " files, "
+                              << failed_files << " failed in total" << std::endl;
+                    last_report = now;
+                    last_files = files;
+                    last_bytes = bytes;
+                }
+            }
+        }
+        catch (std::exception const& e) {
+            std::cerr << "Stopped watching \"" << directory.string() << "\": " << e.what() << std::endl;
+        }
+        backlog.close();
+    });
+    
+    // Compress everything in the backlog, until the backlog has been closed and is empty
+    jpa::File_pipeline<Compression_job> pipeline(options);
+    while (auto first = backlog.pop()) {
+        std::vector<Compression_job> jobs;
+        jobs.emplace_back(*first, alignment);
+        while (auto file = backlog.try_pop())
+            jobs.emplace_back(*file, alignment);
+        pipeline.run(jobs, [&](std::size_t i) {
+            File_report const& report = jobs[i].report();
+            if (verbose)
+                std::cout << report.message;
+            std::cerr << report.error;
+            if (report.compressed) {
+                ++compressed_files;
+                compressed_bytes += report.tiff_size;
+            }
+            else
+                ++failed_files;
+        });
+        std::lock_guard lock(pending_mutex);
+        for (auto const& job : jobs)
+            pending.erase(job.input_path().string());
+    }
+    watch.join();
+    if (verbose)
+        std::cout << "Terse compressed: " << compressed_files << " files, " << failed_files << " failed\n";
+    return failed_files == 0 ? 0 : 1;
+}
+#else
+int Watch(fs::path const& directory, jpa::File_pipeline<Compression_job>::Options const&, std::size_t, std::size_t, double, bool) {
+    std::cerr << "Watching directories is not supported on this platform" << std::endl;
+    return 1;
+}
+#endif
+
 template <typename T>
 void Terse_pushback(jpa::Terse& compressed, jpa::Grey_tif_image<T> const& img) {
     using namespace jpa;
-    if constexpr (!std::is_same_v<T, std::byte>)
+    if constexpr (!std::is_same_v<std::remove_const_t<T>, std::byte>)
         compressed.push_back(img);
     else {
         POD_type_traits const& img_type = img.type();
-        if      (img_type.is<std::int8_t>())   Terse_pushback<std::int8_t>  (compressed, img);
-        else if (img_type.is<std::uint8_t>())  Terse_pushback<std::uint8_t> (compressed, img);
-        else if (img_type.is<std::int16_t>())  Terse_pushback<std::int16_t> (compressed, img);
-        else if (img_type.is<std::uint16_t>()) Terse_pushback<std::uint16_t>(compressed, img);
-        else if (img_type.is<std::int32_t>())  Terse_pushback<std::int32_t> (compressed, img);
-        else if (img_type.is<std::uint32_t>()) Terse_pushback<std::uint32_t>(compressed, img);
+        if      (img_type.is<std::int8_t>())   Terse_pushback<std::int8_t const>  (compressed, img);
+        else if (img_type.is<std::uint8_t>())  Terse_pushback<std::uint8_t const> (compressed, img);
+        else if (img_type.is<std::int16_t>())  Terse_pushback<std::int16_t const> (compressed, img);
+        else if (img_type.is<std::uint16_t>()) Terse_pushback<std::uint16_t const>(compressed, img);
+        else if (img_type.is<std::int32_t>())  Terse_pushback<std::int32_t const> (compressed, img);
+        else if (img_type.is<std::uint32_t>()) Terse_pushback<std::uint32_t const>(compressed, img);
         else {
             std::vector<int64_t> tmp(img.dim()[0] * img.dim()[1]);
             if      (img_type.is<float>())  std::copy_n(Grey_tif_image<float const>(img).begin(),  tmp.size(), tmp.begin());
             else if (img_type.is<double>()) std::copy_n(Grey_tif_image<double const>(img).begin(), tmp.size(), tmp.begin());
             compressed.push_back(tmp);
+            if (compressed.dim().empty())
+                compressed.dim({std::size_t(img.dim()[0]), std::size_t(img.dim()[1])});
         }
     }
 }
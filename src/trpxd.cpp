@@ -0,0 +1,407 @@
+//
+//  trpxd.cpp
+//
+//  A local compression service: acquisition processes on one node send raw frames to trpxd over a Unix domain socket,
+//  and share its warm thread pool for compression. See Trpx_client.hpp for the client library and the protocol.
+//
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cmath>
+#include <list>
+#include <memory>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <csignal>
+#include <climits>
+#include <unordered_map>
+#include <poll.h>
+#include <sys/stat.h>
+#include "Terse.hpp"
+#include "Command_line.hpp"
+#include "Thread_pool.hpp"
+#include "Bounded_queue.hpp"
+#include "Trpx_client.hpp"
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+volatile std::sig_atomic_t s_stop = 0;
+
+// The pixels of a request: either received inline, or a read-only mapping of the shared memory passed by the client.
+class Frame {
+public:
+    explicit Frame(std::vector<std::byte>&& data) : d_inline(std::move(data)), d_pixels(d_inline) {}
+    Frame(int const fd, std::size_t const size) {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < size)
+            throw std::runtime_error("shared frame buffer is smaller than the frame");
+        if (size != 0) {
+            void* const p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED)
+                throw std::system_error(errno, std::generic_category(), "mapping shared frame buffer");
+            d_mapping = static_cast<std::byte*>(p);
+        }
+        d_pixels = std::span<std::byte const>(d_mapping, size);
+    }
+    Frame(Frame const&) = delete;
+    Frame& operator=(Frame const&) = delete;
+    ~Frame() {
+        if (d_mapping != nullptr)
+            munmap(d_mapping, d_pixels.size());
+    }
+    std::span<std::byte const> pixels() const { return d_pixels; }
+
+private:
+    std::vector<std::byte> d_inline;
+    std::byte* d_mapping = nullptr;
+    std::span<std::byte const> d_pixels;
+};
+
+// The answer to a request, computed by the thread pool and sent by the session's sender thread.
+struct Reply {
+    std::int32_t error = 0;
+    std::string data;          // the Terse object, the metrics text, or the error message
+    std::string append_to;     // for append requests: the trpx file that 'data' is appended to
+    double bytes_in = 0;       // size of the uncompressed frame
+    double seconds = 0;        // compute time
+};
+
+// Throughput and queue metrics of a client. They are updated by the session threads and read by stats requests.
+struct Client_metrics {
+    pid_t pid = 0;
+    Clock::time_point const connected = Clock::now();
+    std::atomic<std::size_t> frames = 0;
+    std::atomic<std::size_t> failed = 0;
+    std::atomic<std::size_t> queued = 0;
+    std::atomic<double> bytes_in = 0;
+    std::atomic<double> bytes_out = 0;
+    std::atomic<double> compute_seconds = 0;
+};
+
+// A connected client: the reader thread receives requests and hands them to the thread pool, the sender thread sends
+// the replies in the order of the requests, appending compressed frames to trpx files first. At most 'queue_depth'
+// requests of a client are in flight; further requests wait in the socket, which throttles the client.
+class Session {
+public:
+    Session(jpa::Trpx_socket&& socket, jpa::Thread_pool& pool, std::size_t queue_depth);
+    Session(Session const&) = delete;
+    Session& operator=(Session const&) = delete;
+    ~Session();
+    void stop() { shutdown(d_socket.fd(), SHUT_RD); }
+    bool finished() const { return d_finished; }
+    std::shared_ptr<Client_metrics const> metrics() const { return d_metrics; }
+
+private:
+    jpa::Trpx_socket d_socket;
+    jpa::Thread_pool& d_pool;
+    jpa::Bounded_queue<std::future<Reply>> d_replies;
+    std::shared_ptr<Client_metrics> d_metrics = std::make_shared<Client_metrics>();
+    std::atomic<bool> d_finished = false;
+    std::thread d_reader;
+    std::thread d_sender;
+
+    void f_read();
+    void f_send();
+};
+
+std::string Stats();
+std::mutex s_sessions_mutex;
+std::list<Session> s_sessions;
+std::size_t s_threads = 0;
+
+int main(int argc, char const* argv[]) {
+    using namespace jpa;
+    Command_line_option help("-help", "print help");
+    Command_line_option verbose("-verbose", "print connecting and disconnecting clients");
+    Command_line_option socket_option("-socket", "the Unix domain socket that clients connect to", {Trpx_client::default_socket().string()});
+    Command_line_option mode("-mode", "the permissions of the socket, in octal", {"600"});
+    Command_line_option threads("-j", "number of threads that compress frames (0: one per core)", {"0"});
+    Command_line_option queue("-queue", "maximum number of frames of one client that are compressed or waiting to be sent back", {"16"});
+    Command_line_option stats("-stats", "seconds between printing the metrics of all clients (0: never)", {"0"});
+    Command_line input(argc, argv, {help, verbose, socket_option, mode, threads, queue, stats});
+    if (input.option("-help").found()) {
+        std::cout << "trpxd [-help] [-verbose] [-socket PATH] [-mode OCTAL] [-j N] [-queue N] [-stats S]\n";
+        std::cout << "  compresses frames for local clients that connect to a Unix domain socket, until interrupted.\n";
+        std::cout << "  Clients use the Trpx_client library. Frames are copied over the socket, or passed without copying\n";
+        std::cout << "  in shared memory. trpxd returns the compressed frames, or appends them to trpx files. trpx files\n";
+        std::cout << "  are written with the permissions of trpxd.\n";
+        std::cout << "Examples:\n";
+        std::cout << "   trpxd                     // serves $XDG_RUNTIME_DIR/trpxd.sock (or /tmp/trpxd.sock) using all cores\n";
+        std::cout << "   trpxd -j 8 -stats 10      // compresses with 8 threads and prints the client metrics every 10 s\n";
+        std::cout << "\nkeywords:\n";
+        std::cout << input.help() << std::endl;
+        return 0;
+    }
+
+    fs::path const socket_path = input.option("-socket").param<std::string>()[0];
+    std::optional<Trpx_socket> listener;
+    try {
+        listener.emplace(Trpx_socket::listen(socket_path));
+        if (chmod(socket_path.c_str(), static_cast<mode_t>(std::stoul(input.option("-mode").param<std::string>()[0], nullptr, 8))) != 0)
+            throw std::system_error(errno, std::generic_category(), "chmod");
+    }
+    catch (std::exception const& e) {
+        std::cerr << "Cannot serve \"" << socket_path.string() << "\": " << e.what() << std::endl;
+        return 1;
+    }
+    std::signal(SIGINT, [](int) { s_stop = 1; });
+    std::signal(SIGTERM, [](int) { s_stop = 1; });
+    std::signal(SIGPIPE, SIG_IGN);
+
+    Thread_pool pool(input.option("-j").param<std::size_t>()[0]);
+    s_threads = pool.size();
+    std::size_t const queue_depth = input.option("-queue").param<std::size_t>()[0];
+    double const stats_interval = input.option("-stats").param<double>()[0];
+    bool const print_clients = input.option("-verbose").found();
+    if (print_clients)
+        std::cout << "trpxd: serving \"" << socket_path.string() << "\" with " << s_threads << " threads" << std::endl;
+
+    // Accept clients until interrupted, and clean up after clients that have disconnected
+    auto last_report = Clock::now();
+    while (!s_stop) {
+        pollfd pfd{listener->fd(), POLLIN, 0};
+        if (poll(&pfd, 1, 200) > 0) {
+            int const fd = accept4(listener->fd(), nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                std::lock_guard lock(s_sessions_mutex);
+                s_sessions.emplace_back(Trpx_socket(fd), pool, queue_depth);
+                if (print_clients)
+                    std::cout << "trpxd: client pid " << s_sessions.back().metrics()->pid << " connected" << std::endl;
+            }
+        }
+        {
+            std::lock_guard lock(s_sessions_mutex);
+            s_sessions.remove_if([&](Session const& session) {
+                if (session.finished() && print_clients) {
+                    auto const& m = *session.metrics();
+                    std::cout << "trpxd: client pid " << m.pid << " disconnected after " << m.frames << " frames, " << m.failed << " failed" << std::endl;
+                }
+                return session.finished();
+            });
+        }
+        if (stats_interval > 0 && Clock::now() - last_report >= std::chrono::duration<double>(stats_interval)) {
+            std::cout << Stats() << std::flush;
+            last_report = Clock::now();
+        }
+    }
+
+    // Let the clients finish the requests they have sent
+    {
+        std::lock_guard lock(s_sessions_mutex);
+        for (auto& session : s_sessions)
+            session.stop();
+    }
+    std::list<Session> sessions;
+    {
+        std::lock_guard lock(s_sessions_mutex);
+        sessions.splice(sessions.end(), s_sessions);
+    }
+    sessions.clear();
+    unlink(socket_path.c_str());
+    return 0;
+}
+
+// Returns the metrics of all connected clients, one line per client. Rates are averages since the client connected.
+std::string Stats() {
+    std::ostringstream stats;
+    std::lock_guard lock(s_sessions_mutex);
+    std::size_t queued = 0;
+    for (auto const& session : s_sessions)
+        queued += session.metrics()->queued;
+    stats << "trpxd: " << s_threads << " threads, " << s_sessions.size() << " clients, " << queued << " frames queued\n";
+    for (auto const& session : s_sessions) {
+        auto const& m = *session.metrics();
+        std::chrono::duration<double> const seconds = Clock::now() - m.connected;
+        double const in = m.bytes_in;
+        double const out = m.bytes_out;
+        stats << "  client pid " << m.pid << ": " << m.frames << " frames (" << m.failed << " failed), "
+              << std::round(m.frames / seconds.count()) << " frames/s, " << std::round(in / seconds.count() / 1e6) << " MB/s in, "
+              << std::round(out / seconds.count() / 1e6) << " MB/s out, compression rate " << (out == 0 ? 0 : std::round(100 * in / out) / 100)
+              << ", " << std::round(1000 * m.compute_seconds / std::max<std::size_t>(m.frames, 1)) / 1000 << " s/frame, queue " << m.queued << "\n";
+    }
+    return stats.str();
+}
+
+// Compresses a frame of pixels of type T into a Terse object with the given dimensions, and returns its serialisation.
+template <typename T>
+std::string Compress(std::span<std::byte const> const pixels, std::uint64_t const (&dim)[2]) {
+    std::size_t const size = pixels.size() / sizeof(T);
+    if (dim[0] * dim[1] != size || size * sizeof(T) != pixels.size())
+        throw std::invalid_argument("the frame size does not match its dimensions and pixel type");
+    jpa::Terse terse(reinterpret_cast<T const*>(pixels.data()), size);
+    terse.dim({dim[0], dim[1]});
+    std::ostringstream terse_stream;
+    terse.write(terse_stream);
+    return std::move(terse_stream).str();
+}
+
+std::string Compress(jpa::Trpx_pixel const pixel, std::span<std::byte const> const pixels, std::uint64_t const (&dim)[2]) {
+    using jpa::Trpx_pixel;
+    switch (pixel) {
+        case Trpx_pixel::int8:   return Compress<std::int8_t>(pixels, dim);
+        case Trpx_pixel::uint8:  return Compress<std::uint8_t>(pixels, dim);
+        case Trpx_pixel::int16:  return Compress<std::int16_t>(pixels, dim);
+        case Trpx_pixel::uint16: return Compress<std::uint16_t>(pixels, dim);
+        case Trpx_pixel::int32:  return Compress<std::int32_t>(pixels, dim);
+        case Trpx_pixel::uint32: return Compress<std::uint32_t>(pixels, dim);
+        case Trpx_pixel::int64:  return Compress<std::int64_t>(pixels, dim);
+        case Trpx_pixel::uint64: return Compress<std::uint64_t>(pixels, dim);
+    }
+    throw std::invalid_argument("unknown pixel type");
+}
+
+// Appends a compressed frame to a trpx file. Appends to the same file are serialised, also between clients.
+void Append(std::string const& trpx_file, std::string const& terse) {
+    static std::mutex files_mutex;
+    static std::unordered_map<std::string, std::mutex> file_mutexes;
+    std::mutex* file_mutex;
+    {
+        std::lock_guard lock(files_mutex);
+        file_mutex = &file_mutexes[trpx_file];
+    }
+    std::lock_guard lock(*file_mutex);
+    std::ofstream file(trpx_file, std::ios::binary | std::ios::app);
+    file.write(terse.data(), static_cast<std::streamsize>(terse.size()));
+    file.close();
+    if (!file)
+        throw std::runtime_error("cannot append to \"" + trpx_file + "\"");
+}
+
+Session::Session(jpa::Trpx_socket&& socket, jpa::Thread_pool& pool, std::size_t const queue_depth) :
+d_socket(std::move(socket)),
+d_pool(pool),
+d_replies(queue_depth) {
+    ucred credentials;
+    socklen_t length = sizeof(credentials);
+    if (getsockopt(d_socket.fd(), SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0)
+        d_metrics->pid = credentials.pid;
+    d_reader = std::thread([this] { f_read(); });
+    d_sender = std::thread([this] { f_send(); });
+}
+
+Session::~Session() {
+    stop();
+    d_reader.join();
+    d_sender.join();
+}
+
+void Session::f_read() {
+    using namespace jpa;
+    try {
+        Trpx_request request;
+        int passed_fd;
+        while (d_socket.receive(std::as_writable_bytes(std::span(&request, 1)), &passed_fd)) {
+            std::unique_ptr<int, void(*)(int*)> const fd_guard(passed_fd >= 0 ? &passed_fd : nullptr, [](int* fd) { close(*fd); });
+            if (request.magic != Trpx_socket::s_magic || request.path_size > PATH_MAX || (request.shared != 0) != (passed_fd >= 0))
+                throw std::runtime_error("invalid request");
+            std::string path(request.path_size, '\0');
+            d_socket.receive(std::as_writable_bytes(std::span(path)));
+            if (request.command == Trpx_command::stats) {
+                std::promise<Reply> reply;
+                d_replies.push(reply.get_future());
+                ++d_metrics->queued;
+                reply.set_value(Reply{.error = 0, .data = Stats(), .append_to = {}, .bytes_in = 0, .seconds = 0});
+                continue;
+            }
+
+            // Receive the frame before its reply is queued, so that a client that fails or disconnects halfway leaves
+            // no reply that is never given
+            std::shared_ptr<Frame> frame;
+            std::string error;
+            if (request.command != Trpx_command::compress && request.command != Trpx_command::append)
+                error = "unknown request";
+            else if (request.shared)
+                try {
+                    frame = std::make_shared<Frame>(passed_fd, request.data_size);
+                }
+                catch (std::exception const& e) {
+                    error = e.what();
+                }
+            else if (request.data_size > (std::uint64_t(1) << 40))
+                throw std::runtime_error("frame too large");
+            else {
+                std::vector<std::byte> data(request.data_size);
+                d_socket.receive(data);
+                frame = std::make_shared<Frame>(std::move(data));
+            }
+            std::promise<Reply> reply;
+            d_replies.push(reply.get_future());
+            ++d_metrics->queued;
+            if (!error.empty()) {
+                reply.set_value(Reply{.error = EINVAL, .data = error, .append_to = {}, .bytes_in = 0, .seconds = 0});
+                continue;
+            }
+
+            // Compress the frame in the thread pool
+            auto task = std::make_shared<std::promise<Reply>>(std::move(reply));
+            d_pool.submit([task, frame, request, path = std::move(path)] {
+                Reply reply;
+                auto const start = Clock::now();
+                try {
+                    reply.data = Compress(request.pixel, frame->pixels(), request.dim);
+                    if (request.command == Trpx_command::append)
+                        reply.append_to = path;
+                }
+                catch (std::exception const& e) {
+                    reply.error = EINVAL;
+                    reply.data = e.what();
+                }
+                reply.bytes_in = frame->pixels().size();
+                reply.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+                task->set_value(std::move(reply));
+            });
+        }
+    }
+    catch (std::exception const& e) {
+        std::cerr << "trpxd: client pid " << d_metrics->pid << ": " << e.what() << std::endl;
+    }
+    d_replies.close();
+}
+
+void Session::f_send() {
+    using namespace jpa;
+    bool connected = true;
+    while (auto future = d_replies.pop()) {
+        Reply reply;
+        try {
+            reply = future->get();
+        }
+        catch (std::exception const& e) { // a reply that is never given fails its request, not the daemon
+            reply = Reply{.error = EIO, .data = e.what(), .append_to = {}, .bytes_in = 0, .seconds = 0};
+        }
+        std::size_t const bytes_out = reply.data.size(); // the Terse object, before it is appended
+        if (reply.error == 0 && !reply.append_to.empty())
+            try {
+                Append(reply.append_to, reply.data);
+                reply.data.clear();
+            }
+            catch (std::exception const& e) {
+                reply.error = EIO;
+                reply.data = e.what();
+            }
+        if (reply.bytes_in != 0) {
+            ++(reply.error == 0 ? d_metrics->frames : d_metrics->failed);
+            d_metrics->bytes_in += reply.bytes_in;
+            d_metrics->compute_seconds += reply.seconds;
+            if (reply.error == 0)
+                d_metrics->bytes_out += bytes_out;
+        }
+        --d_metrics->queued;
+        // Once the client has gone, the remaining frames are still appended, but no longer answered
+        if (connected)
+            try {
+                Trpx_response const response{Trpx_socket::s_magic, reply.error, reply.data.size()};
+                d_socket.send({std::as_bytes(std::span(&response, 1)), std::as_bytes(std::span(reply.data))});
+            }
+            catch (std::exception const&) {
+                connected = false;
+                stop();
+            }
+    }
+    d_finished = true;
+}
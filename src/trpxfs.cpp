@@ -0,0 +1,392 @@
+//
+//  trpxfs.cpp
+//
+//  A read-only FUSE file system that presents a directory of trpx files as tif or mrc files. Only the frames that a
+//  read() touches are expanded, in parallel, and expanded frames are kept in a Frame_cache.
+//
+
+#define FUSE_USE_VERSION 31
+
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <optional>
+#include <functional>
+#include <future>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <memory>
+#include <cstring>
+#include <cmath>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <fuse.h>
+#include "Command_line.hpp"
+#include "Terse.hpp"
+#include "Grey_tif_writer.hpp"
+#include "Mrc_writer.hpp"
+#include "Trpx_index.hpp"
+#include "Frame_cache.hpp"
+#include "Thread_pool.hpp"
+
+namespace fs = std::filesystem;
+
+// Expands a frame into pixels of 'type': an 8, 16 or 32-bit integer, or a float.
+void Expand_into(jpa::Terse const& trpx_data, std::size_t const frame, jpa::POD_type_traits const& type, std::byte* const pixels) {
+    if      (type.is<std::int8_t>())   trpx_data.prolix(reinterpret_cast<std::int8_t*>  (pixels), frame);
+    else if (type.is<std::uint8_t>())  trpx_data.prolix(reinterpret_cast<std::uint8_t*> (pixels), frame);
+    else if (type.is<std::int16_t>())  trpx_data.prolix(reinterpret_cast<std::int16_t*> (pixels), frame);
+    else if (type.is<std::uint16_t>()) trpx_data.prolix(reinterpret_cast<std::uint16_t*>(pixels), frame);
+    else if (type.is<std::int32_t>())  trpx_data.prolix(reinterpret_cast<std::int32_t*> (pixels), frame);
+    else if (type.is<std::uint32_t>()) trpx_data.prolix(reinterpret_cast<std::uint32_t*>(pixels), frame);
+    else if (type.is<float>())         trpx_data.prolix(reinterpret_cast<float*>        (pixels), frame);
+    else
+        throw std::runtime_error("cannot expand to pixels of " + std::to_string(8 * type.size) + " bits");
+}
+
+// Get the x&y dimensions of the images
+std::array<long,2> Dimensions(jpa::Trpx_index::Object const& object) {
+    std::array<long,2> dim;
+    if (object.dim.size() == 0) // No dimensions given, so assume a square image
+        dim[0] = dim[1] = std::sqrt(object.values);
+    else
+        std::copy_n(object.dim.begin(), 2, dim.begin());
+    if (static_cast<std::size_t>(dim[0] * dim[1]) != object.values)
+        throw std::runtime_error("the frames have no dimensions and are not square");
+    return dim;
+}
+
+// A tif or mrc file that a trpx file is presented as. The file is laid out from the headers of the Terse objects of the
+// trpx file: it consists of segments that are either a piece of the header or the IFDs, or the pixels of a frame. The
+// Terse objects are loaded when the file is opened, and released when it is no longer open.
+class Virtual_file {
+public:
+    Virtual_file(fs::path const& trpx_filename, bool const mrc) :
+    d_trpx_filename(trpx_filename),
+    d_name(fs::path(trpx_filename.filename()).replace_extension(mrc ? ".mrc" : ".tif").string()),
+    d_index(trpx_filename),
+    d_mtime(fs::last_write_time(trpx_filename)) {
+        if (d_index.number_of_frames() == 0)
+            throw std::runtime_error("no frames");
+        if (mrc)
+            f_mrc_layout();
+        else
+            f_tif_layout();
+        d_terse.resize(d_index.objects().size());
+    }
+
+    std::string const& name() const noexcept { return d_name; }
+    std::uint64_t size() const noexcept { return d_size; }
+    fs::file_time_type mtime() const noexcept { return d_mtime; }
+
+    void open() {
+        std::lock_guard lock(d_mutex);
+        ++d_open;
+    }
+
+    void release() {
+        std::lock_guard lock(d_mutex);
+        if (--d_open == 0)
+            std::fill(d_terse.begin(), d_terse.end(), nullptr);
+    }
+
+    // Reads 'size' bytes at 'offset' into 'buffer', and returns the number of bytes read. The frames are taken from
+    // 'cache', or expanded by up to 'threads' threads at a time. 'id' identifies the file in the cache.
+    std::size_t read(char* const buffer, std::size_t size, std::uint64_t const offset, jpa::Frame_cache& cache, std::size_t const id,
+                     std::size_t const threads) {
+        if (offset >= d_size)
+            return 0;
+        size = static_cast<std::size_t>(std::min<std::uint64_t>(size, d_size - offset));
+        std::vector<Segment const*> frames;
+        auto segment = std::upper_bound(d_segments.begin(), d_segments.end(), offset,
+                                        [](std::uint64_t const o, Segment const& s) { return o < s.offset; }) - 1;
+        for (; segment != d_segments.end() && segment->offset < offset + size; ++segment)
+            if (segment->frame == s_metadata)
+                f_copy(buffer, size, offset, *segment, d_metadata.data() + segment->metadata);
+            else
+                frames.push_back(&*segment);
+        std::atomic<std::size_t> next = 0;
+        auto const copy_frames = [&] {
+            for (std::size_t i; (i = next++) < frames.size(); ) {
+                jpa::Frame_cache::Frame const frame = cache.get(id, frames[i]->frame, d_index.number_of_frames(),
+                                                                [this](std::size_t const f) { return f_expand(f); });
+                f_copy(buffer, size, offset, *frames[i], frame->data());
+            }
+        };
+        std::vector<std::future<void>> workers;
+        for (std::size_t t = 1; t < std::min(threads, frames.size()); ++t)
+            workers.push_back(std::async(std::launch::async, copy_frames));
+        copy_frames();
+        for (auto& worker : workers)
+            worker.get();
+        return size;
+    }
+
+private:
+    static constexpr std::size_t s_metadata = std::size_t(-1);
+
+    struct Segment {
+        std::uint64_t offset;
+        std::uint64_t size;
+        std::size_t frame;      // s_metadata for a piece of the header or the IFDs
+        std::size_t metadata;   // the offset of the piece in d_metadata
+    };
+
+    fs::path const d_trpx_filename;
+    std::string const d_name;
+    jpa::Trpx_index const d_index;
+    fs::file_time_type const d_mtime;
+    std::vector<jpa::POD_type_traits> d_types;  // of the frames of each Terse object
+    std::vector<std::byte> d_metadata;
+    std::vector<Segment> d_segments;            // in the order of the file
+    std::uint64_t d_size = 0;
+    std::mutex d_mutex;
+    std::size_t d_open = 0;
+    std::vector<std::shared_ptr<jpa::Terse const>> d_terse; // the Terse objects that have been loaded
+
+    // Lays out a tif stack, with the pixel types of prolix: 16-bit integers for up to 16 bits, 32-bit integers otherwise.
+    void f_tif_layout() {
+        std::uint64_t pixel_bytes = 0;
+        for (auto const& object : d_index.objects()) {
+            if (object.bits > 32)
+                throw std::runtime_error("the Terse data require 64 bits per pixel");
+            d_types.push_back({.size = object.bits <= 16 ? 2u : 4u, .is_signed = object.is_signed, .is_integral = true});
+            pixel_bytes += object.frames * object.values * d_types.back().size;
+        }
+        std::optional<jpa::Grey_tif_writer> tif;
+        tif.emplace([this, &tif](std::span<std::byte const> const piece) {
+            d_segments.push_back({tif->size(), piece.size(), s_metadata, d_metadata.size()});
+            d_metadata.insert(d_metadata.end(), piece.begin(), piece.end());
+        }, jpa::Grey_tif_writer::file_size(pixel_bytes, 0, d_index.number_of_frames(), false));
+        for (std::size_t i = 0; i != d_index.objects().size(); ++i) {
+            auto const& object = d_index.objects()[i];
+            std::array<long,2> const dim = Dimensions(object);
+            for (std::size_t frame = 0; frame != object.frames; ++frame) {
+                std::uint64_t const offset = tif->place(d_types[i], dim);
+                d_segments.push_back({offset, object.values * d_types[i].size, object.first_frame + frame, 0});
+            }
+        }
+        tif->close();
+        d_size = tif->size();
+        std::sort(d_segments.begin(), d_segments.end(), [](Segment const& a, Segment const& b) { return a.offset < b.offset; });
+    }
+
+    // Lays out an mrc stack, of the smallest of the mrc pixel types (int8, uint8, int16, uint16 and float) that holds
+    // the values of all Terse objects.
+    void f_mrc_layout() {
+        auto const& objects = d_index.objects();
+        bool is_signed = false;
+        unsigned signed_bits = 0, unsigned_bits = 0;
+        for (auto const& object : objects) {
+            if (object.values != objects.front().values || object.dim != objects.front().dim)
+                throw std::runtime_error("the frames vary in size");
+            (object.is_signed ? signed_bits : unsigned_bits) = std::max(object.is_signed ? signed_bits : unsigned_bits, object.bits);
+            is_signed |= object.is_signed;
+        }
+        unsigned const bits = is_signed ? std::max(signed_bits, unsigned_bits + 1) : unsigned_bits;
+        jpa::POD_type_traits const type = bits <= 8  ? jpa::POD_type_traits{.size = 1, .is_signed = is_signed, .is_integral = true} :
+                                          bits <= 16 ? jpa::POD_type_traits{.size = 2, .is_signed = is_signed, .is_integral = true} :
+                                                       jpa::POD_type_traits{.size = 4, .is_signed = true, .is_integral = false};
+        d_types.assign(objects.size(), type);
+        std::array<long,2> const dim = Dimensions(objects.front());
+        auto const header = jpa::Mrc_writer::header(type, dim, d_index.number_of_frames());
+        d_metadata.assign(header.begin(), header.end());
+        d_segments.push_back({0, header.size(), s_metadata, 0});
+        std::uint64_t const frame_size = objects.front().values * type.size;
+        for (std::size_t frame = 0; frame != d_index.number_of_frames(); ++frame)
+            d_segments.push_back({header.size() + frame * frame_size, frame_size, frame, 0});
+        d_size = header.size() + d_index.number_of_frames() * frame_size;
+    }
+
+    // Copies the part of 'segment' that overlaps the 'size' bytes at 'offset' into 'buffer'.
+    static void f_copy(char* const buffer, std::size_t const size, std::uint64_t const offset, Segment const& segment,
+                       std::byte const* const data) {
+        std::uint64_t const from = std::max(offset, segment.offset);
+        std::uint64_t const to = std::min(offset + size, segment.offset + segment.size);
+        if (from < to)
+            std::memcpy(buffer + (from - offset), data + (from - segment.offset), to - from);
+    }
+
+    // Returns a Terse object, which is loaded if it has not been loaded. Threads expand its frames at the same time. It
+    // is kept while the file is open; a frame that is prefetched after the file has been released does not keep it.
+    std::shared_ptr<jpa::Terse const> f_terse(std::size_t const object) {
+        std::lock_guard lock(d_mutex);
+        if (d_terse[object] == nullptr) {
+            std::ifstream trpx_file(d_trpx_filename, std::ios::binary);
+            if (!trpx_file.seekg(static_cast<std::streamoff>(d_index.objects()[object].offset)))
+                throw std::runtime_error("cannot read \"" + d_trpx_filename.string() + "\"");
+            auto const trpx_data = std::make_shared<jpa::Terse const>(trpx_file);
+            if (!trpx_file)
+                throw std::runtime_error("\"" + d_trpx_filename.string() + "\" is truncated");
+            if (d_open == 0)
+                return trpx_data;
+            d_terse[object] = trpx_data;
+        }
+        return d_terse[object];
+    }
+
+    jpa::Frame_cache::Frame f_expand(std::size_t const frame) {
+        auto const [object, frame_in_object] = d_index.locate(frame);
+        std::shared_ptr<jpa::Terse const> const trpx_data = f_terse(object);
+        auto pixels = std::make_shared<std::vector<std::byte>>(trpx_data->size() * d_types[object].size);
+        Expand_into(*trpx_data, frame_in_object, d_types[object], pixels->data());
+        return pixels;
+    }
+};
+
+// The state of the mounted file system. The pool prefetches frames for the cache.
+struct Trpx_filesystem {
+    std::vector<std::unique_ptr<Virtual_file>> files;
+    std::map<std::string, std::size_t> paths; // "/name" to the index of the file
+    jpa::Thread_pool pool;
+    jpa::Frame_cache cache;
+    std::size_t const threads;
+
+    Trpx_filesystem(std::size_t const budget, std::size_t const threads, std::size_t const prefetch) :
+    pool(threads),
+    cache(budget, pool, prefetch),
+    threads(pool.size()) {}
+
+    static Trpx_filesystem& get() { return *static_cast<Trpx_filesystem*>(fuse_get_context()->private_data); }
+
+    Virtual_file* find(char const* const path) {
+        auto const file = paths.find(path);
+        return file == paths.end() ? nullptr : files[file->second].get();
+    }
+};
+
+timespec Timespec(fs::file_time_type const time) {
+    auto const since_epoch = std::chrono::file_clock::to_sys(time).time_since_epoch();
+    auto const seconds = std::chrono::floor<std::chrono::seconds>(since_epoch);
+    return {static_cast<time_t>(seconds.count()),
+            static_cast<long>(std::chrono::duration_cast<std::chrono::nanoseconds>(since_epoch - seconds).count())};
+}
+
+int Getattr(char const* const path, struct stat* const st, fuse_file_info*) {
+    std::memset(st, 0, sizeof(struct stat));
+    if (std::strcmp(path, "/") == 0) {
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+        return 0;
+    }
+    Virtual_file const* const file = Trpx_filesystem::get().find(path);
+    if (file == nullptr)
+        return -ENOENT;
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_size = static_cast<off_t>(file->size());
+    st->st_mtim = st->st_ctim = st->st_atim = Timespec(file->mtime());
+    return 0;
+}
+
+int Readdir(char const* const path, void* const buffer, fuse_fill_dir_t const filler, off_t, fuse_file_info*, fuse_readdir_flags) {
+    if (std::strcmp(path, "/") != 0)
+        return -ENOENT;
+    filler(buffer, ".", nullptr, 0, fuse_fill_dir_flags(0));
+    filler(buffer, "..", nullptr, 0, fuse_fill_dir_flags(0));
+    for (auto const& file : Trpx_filesystem::get().files)
+        filler(buffer, file->name().c_str(), nullptr, 0, fuse_fill_dir_flags(0));
+    return 0;
+}
+
+int Open(char const* const path, fuse_file_info* const fi) {
+    Trpx_filesystem& filesystem = Trpx_filesystem::get();
+    auto const file = filesystem.paths.find(path);
+    if (file == filesystem.paths.end())
+        return -ENOENT;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EROFS;
+    filesystem.files[file->second]->open();
+    fi->fh = file->second;
+    fi->keep_cache = 1; // the files never change
+    return 0;
+}
+
+int Read(char const*, char* const buffer, std::size_t const size, off_t const offset, fuse_file_info* const fi) {
+    Trpx_filesystem& filesystem = Trpx_filesystem::get();
+    Virtual_file& file = *filesystem.files[fi->fh];
+    try {
+        return static_cast<int>(file.read(buffer, size, static_cast<std::uint64_t>(offset), filesystem.cache, fi->fh, filesystem.threads));
+    }
+    catch (std::exception const& e) {
+        std::cerr << "Error reading \"" << file.name() << "\": " << e.what() << std::endl;
+        return -EIO;
+    }
+}
+
+int Release(char const*, fuse_file_info* const fi) {
+    Trpx_filesystem::get().files[fi->fh]->release();
+    return 0;
+}
+
+int main(int argc, char const* argv[]) {
+    using namespace jpa;
+    Command_line_option help("-help", "print help");
+    Command_line_option verbose("-verbose", "print the files that are presented, and the use of the cache when unmounted");
+    Command_line_option threads("-j", "number of threads that expand the frames of a read in parallel (0: one per core)", {"0"});
+    Command_line_option cache("-cache", "memory in MB for frames that have been expanded", {"1024"});
+    Command_line_option prefetch("-prefetch", "number of frames that are expanded in advance after a frame that is read", {"0"});
+    Command_line_option mrc("-mrc", "present the trpx files as mrc files instead of tif files");
+    Command_line_option foreground("-foreground", "stay in the foreground, and print errors to the terminal");
+    Command_line_option options("-o", "comma-separated mount options that are passed on to FUSE", {"ro"});
+    Command_line input(argc, argv, {help, verbose, threads, cache, prefetch, mrc, foreground, options});
+    std::vector<std::string> const params = input.params();
+    if (input.option("-help").found() || params.size() != 2) {
+        std::cout << "trpxfs [-help] [-verbose] [-j N] [-cache MB] [-prefetch N] [-mrc] [-foreground] [-o OPTIONS] trpx_directory mount_point\n";
+        std::cout << "  presents the trpx files in a directory as tif (or mrc) files in a read-only file system, without\n";
+        std::cout << "  expanding them on disk. Only the frames that are read are expanded, and they are cached.\n";
+        std::cout << "Examples:\n";
+        std::cout << "   trpxfs run/ /mnt/run          // presents run/*.trpx as /mnt/run/*.tif\n";
+        std::cout << "   trpxfs -mrc -cache 8192 run/ /mnt/run\n";
+        std::cout << "                                 // presents run/*.trpx as mrc files, and caches up to 8 GB of frames\n";
+        std::cout << "   fusermount3 -u /mnt/run       // unmounts the file system\n";
+        std::cout << "\nkeywords:\n";
+        std::cout << input.help() << std::endl;
+        return input.option("-help").found() ? 0 : 1;
+    }
+
+    // Lay out the files; files that cannot be presented are reported and left out
+    Trpx_filesystem filesystem(input.option("-cache").param<std::size_t>()[0] << 20, input.option("-j").param<std::size_t>()[0],
+                               input.option("-prefetch").param<std::size_t>()[0]);
+    std::vector<fs::path> trpx_files;
+    for (auto const& entry : fs::directory_iterator(params[0]))
+        if (entry.is_regular_file() && entry.path().extension() == ".trpx")
+            trpx_files.push_back(entry.path());
+    std::sort(trpx_files.begin(), trpx_files.end());
+    for (auto const& trpx_filename : trpx_files) {
+        try {
+            auto file = std::make_unique<Virtual_file>(trpx_filename, input.option("-mrc").found());
+            if (input.option("-verbose").found())
+                std::cout << "Presenting " << trpx_filename << " as " << file->name() << " of " << file->size() << " bytes" << std::endl;
+            filesystem.paths.emplace("/" + file->name(), filesystem.files.size());
+            filesystem.files.push_back(std::move(file));
+        }
+        catch (std::exception const& e) {
+            std::cerr << "Error processing \"" << trpx_filename.string() << "\": " << e.what() << std::endl;
+        }
+    }
+
+    fuse_operations operations{};
+    operations.getattr = Getattr;
+    operations.readdir = Readdir;
+    operations.open = Open;
+    operations.read = Read;
+    operations.release = Release;
+    std::string const mount_options = "ro,fsname=trpxfs," + input.option("-o").param<std::string>()[0];
+    std::vector<char const*> fuse_argv{argv[0], params[1].c_str(), "-o", mount_options.c_str()};
+    if (input.option("-foreground").found())
+        fuse_argv.push_back("-f");
+    int const result = fuse_main(static_cast<int>(fuse_argv.size()), const_cast<char**>(fuse_argv.data()), &operations, &filesystem);
+    if (input.option("-verbose").found()) {
+        jpa::Frame_cache::Statistics const statistics = filesystem.cache.statistics();
+        std::cout << "Cache hits      : " << statistics.hits << "\n";
+        std::cout << "Cache misses    : " << statistics.misses << "\n";
+        std::cout << "Prefetched      : " << statistics.prefetches << " frames\n";
+        std::cout << "Evicted         : " << statistics.evictions << " frames\n";
+        std::cout << "Cached          : " << statistics.frames << " frames, " << statistics.bytes << " bytes" << std::endl;
+    }
+    return result;
+}
@@ -0,0 +1,66 @@
+#include "gtest/gtest.h"
+#include <thread>
+#include <vector>
+#include <memory>
+#include "Bounded_queue.hpp"
+
+using jpa::Bounded_queue;
+
+TEST(Bounded_queue, pops_in_push_order) {
+    Bounded_queue<int> queue(8);
+    for (int i = 0; i != 5; ++i)
+        EXPECT_TRUE(queue.push(i));
+    EXPECT_EQ(queue.size(), 5u);
+    for (int i = 0; i != 5; ++i)
+        EXPECT_EQ(queue.pop(), i);
+    EXPECT_EQ(queue.try_pop(), std::nullopt);
+}
+
+TEST(Bounded_queue, try_push_fails_when_full_and_keeps_the_value) {
+    Bounded_queue<std::unique_ptr<int>> queue(1);
+    EXPECT_TRUE(queue.try_push(std::make_unique<int>(1)));
+    auto value = std::make_unique<int>(2);
+    EXPECT_FALSE(queue.try_push(std::move(value)));
+    ASSERT_NE(value, nullptr);
+    EXPECT_EQ(*value, 2);
+}
+
+TEST(Bounded_queue, close_drains_and_rejects_pushes) {
+    Bounded_queue<int> queue(4);
+    queue.push(1);
+    queue.push(2);
+    queue.close();
+    EXPECT_FALSE(queue.push(3));
+    EXPECT_FALSE(queue.try_push(3));
+    EXPECT_EQ(queue.pop(), 1);
+    EXPECT_EQ(queue.pop(), 2);
+    EXPECT_EQ(queue.pop(), std::nullopt);
+}
+
+TEST(Bounded_queue, producers_block_at_the_depth) {
+    Bounded_queue<int> queue(2);
+    std::size_t max_size = 0;
+    std::thread producer([&] {
+        for (int i = 0; i != 1000; ++i)
+            queue.push(i);
+        queue.close();
+    });
+    int expected = 0;
+    while (auto i = queue.pop()) {
+        max_size = std::max(max_size, queue.size());
+        EXPECT_EQ(*i, expected++);
+    }
+    producer.join();
+    EXPECT_EQ(expected, 1000);
+    EXPECT_LE(max_size, 2u);
+}
+
+TEST(Bounded_queue, close_wakes_waiting_consumers) {
+    Bounded_queue<int> queue(1);
+    std::vector<std::thread> consumers;
+    for (int i = 0; i != 3; ++i)
+        consumers.emplace_back([&] { EXPECT_EQ(queue.pop(), std::nullopt); });
+    queue.close();
+    for (auto& consumer : consumers)
+        consumer.join();
+}
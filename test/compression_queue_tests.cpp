@@ -0,0 +1,178 @@
+#include "gtest/gtest.h"
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <future>
+#include <vector>
+#include <numeric>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <filesystem>
+#include <unistd.h>
+#include "Compression_queue.hpp"
+
+namespace fs = std::filesystem;
+using namespace std::chrono_literals;
+using Queue = jpa::Compression_queue<std::uint16_t>;
+
+namespace {
+
+std::vector<std::uint16_t> Frame(std::size_t const index) {
+    std::vector<std::uint16_t> pixels(64);
+    std::iota(pixels.begin(), pixels.end(), std::uint16_t(index * 10));
+    return pixels;
+}
+
+// Collects the frames that the queue writes. Writing frame 0 waits until release() is called, so that the worker that
+// writes it stalls and the queue fills up.
+class Gated_sink {
+public:
+    std::vector<std::size_t> indices;
+    std::vector<std::vector<std::uint16_t>> frames;
+    bool written_by_producer = false;
+
+    std::function<void(std::size_t, jpa::Terse&&)> sink(std::thread::id const producer) {
+        return [this, producer](std::size_t const index, jpa::Terse&& frame) {
+            if (index == 0) {
+                d_entered.set_value();
+                d_release.get_future().wait();
+            }
+            std::lock_guard lock(d_mutex);
+            written_by_producer |= std::this_thread::get_id() == producer;
+            indices.push_back(index);
+            frames.emplace_back(frame.size());
+            frame.prolix(frames.back());
+        };
+    }
+
+    void wait_until_stalled() { d_entered.get_future().wait(); }
+    void release() { d_release.set_value(); }
+
+private:
+    std::mutex d_mutex;
+    std::promise<void> d_entered;
+    std::promise<void> d_release;
+};
+
+void Wait_until_written(Queue const& queue, std::size_t const frames) {
+    for (int i = 0; i != 500 && queue.statistics().written != frames; ++i)
+        std::this_thread::sleep_for(10ms);
+}
+
+} // namespace
+
+TEST(Compression_queue, blocking_queue_writes_all_frames_in_order) {
+    std::stringstream out;
+    {
+        Queue queue(out, {.workers = 4, .queue_depth = 2});
+        for (std::size_t i = 0; i != 50; ++i)
+            EXPECT_TRUE(queue.submit(Frame(i), {8, 8}));
+        queue.close();
+        Queue::Statistics const statistics = queue.statistics();
+        EXPECT_EQ(statistics.submitted, 50u);
+        EXPECT_EQ(statistics.written, 50u);
+        EXPECT_EQ(statistics.spilled + statistics.dropped + statistics.missed_deadlines, 0u);
+        EXPECT_EQ(queue.waiting().count(), 50u);
+        EXPECT_EQ(queue.compressed().count(), 50u);
+        EXPECT_EQ(queue.written().count(), 50u);
+        EXPECT_NE(queue.report().find("50 frames submitted, 50 written"), std::string::npos);
+    }
+    for (std::size_t i = 0; i != 50; ++i) {
+        jpa::Terse const frame(out);
+        EXPECT_EQ(frame.dim(), (std::vector<std::size_t>{8, 8}));
+        std::vector<std::uint16_t> pixels(64);
+        frame.prolix(pixels);
+        EXPECT_EQ(pixels, Frame(i)) << "frame " << i;
+    }
+}
+
+// Frames that do not fit in the full queue are dropped and skipped, and the frames after them are still written
+TEST(Compression_queue, dropped_frames_are_skipped_in_the_output) {
+    Gated_sink gated;
+    Queue queue(gated.sink(std::this_thread::get_id()), {.workers = 1, .queue_depth = 2, .policy = Queue::Policy::drop});
+    EXPECT_TRUE(queue.submit(Frame(0)));
+    gated.wait_until_stalled();
+    EXPECT_TRUE(queue.submit(Frame(1)));
+    EXPECT_TRUE(queue.submit(Frame(2)));
+    EXPECT_FALSE(queue.submit(Frame(3)));
+    EXPECT_FALSE(queue.submit(Frame(4)));
+    gated.release();
+    Wait_until_written(queue, 3);
+    EXPECT_TRUE(queue.submit(Frame(5)));
+    EXPECT_TRUE(queue.submit(Frame(6)));
+    queue.close();
+    EXPECT_EQ(gated.indices, (std::vector<std::size_t>{0, 1, 2, 5, 6}));
+    for (std::size_t i = 0; i != gated.indices.size(); ++i)
+        EXPECT_EQ(gated.frames[i], Frame(gated.indices[i]));
+    EXPECT_FALSE(gated.written_by_producer);
+    Queue::Statistics const statistics = queue.statistics();
+    EXPECT_EQ(statistics.submitted, 7u);
+    EXPECT_EQ(statistics.written, 5u);
+    EXPECT_EQ(statistics.dropped, 2u);
+    EXPECT_EQ(statistics.spilled, 0u);
+}
+
+// Frames that do not fit in the full queue are written uncompressed to the spill file, and listed in its index
+TEST(Compression_queue, spilled_frames_are_written_to_the_spill_file) {
+    fs::path const spill = fs::temp_directory_path() / ("compression_queue_tests_" + std::to_string(::getpid()) + ".raw");
+    Gated_sink gated;
+    {
+        Queue queue(gated.sink(std::this_thread::get_id()),
+                    {.workers = 1, .queue_depth = 1, .policy = Queue::Policy::spill, .spill_path = spill});
+        EXPECT_TRUE(queue.submit(Frame(0)));
+        gated.wait_until_stalled();
+        EXPECT_TRUE(queue.submit(Frame(1)));
+        EXPECT_FALSE(queue.submit(Frame(2)));
+        EXPECT_FALSE(queue.submit(Frame(3)));
+        gated.release();
+        Wait_until_written(queue, 2);
+        EXPECT_TRUE(queue.submit(Frame(4)));
+        queue.close();
+        EXPECT_EQ(queue.statistics().spilled, 2u);
+        EXPECT_EQ(queue.statistics().dropped, 0u);
+    }
+    EXPECT_EQ(gated.indices, (std::vector<std::size_t>{0, 1, 4}));
+    EXPECT_FALSE(gated.written_by_producer);
+
+    std::ifstream raw(spill, std::ios::binary);
+    for (std::size_t const index : {2, 3}) {
+        std::vector<std::uint16_t> pixels(64);
+        raw.read(reinterpret_cast<char*>(pixels.data()), pixels.size() * sizeof(std::uint16_t));
+        EXPECT_EQ(pixels, Frame(index));
+    }
+    EXPECT_EQ(raw.peek(), std::char_traits<char>::eof());
+    std::ifstream index_file(spill.string() + ".frames");
+    EXPECT_EQ(std::string(std::istreambuf_iterator<char>(index_file), {}), "2\n3\n");
+    fs::remove(spill);
+    fs::remove(spill.string() + ".frames");
+}
+
+TEST(Compression_queue, frames_written_after_their_deadline_are_counted) {
+    Queue queue([](std::size_t, jpa::Terse&&) { std::this_thread::sleep_for(5ms); },
+                {.workers = 1, .queue_depth = 4, .deadline = 1ms});
+    for (std::size_t i = 0; i != 3; ++i)
+        queue.submit(Frame(i));
+    queue.close();
+    EXPECT_EQ(queue.statistics().written, 3u);
+    EXPECT_EQ(queue.statistics().missed_deadlines, 3u);
+    EXPECT_GE(queue.written().max(), 5ms);
+}
+
+// With the drop policy, a frame that has passed its deadline before a worker gets to it is dropped
+TEST(Compression_queue, late_frames_are_dropped_by_the_workers) {
+    Gated_sink gated;
+    Queue queue(gated.sink(std::this_thread::get_id()),
+                {.workers = 1, .queue_depth = 4, .policy = Queue::Policy::drop, .deadline = 5ms});
+    EXPECT_TRUE(queue.submit(Frame(0)));
+    gated.wait_until_stalled();
+    EXPECT_TRUE(queue.submit(Frame(1)));
+    std::this_thread::sleep_for(20ms);
+    gated.release();
+    queue.close();
+    EXPECT_EQ(gated.indices, (std::vector<std::size_t>{0}));
+    Queue::Statistics const statistics = queue.statistics();
+    EXPECT_EQ(statistics.written, 1u);
+    EXPECT_EQ(statistics.dropped, 1u);
+    EXPECT_EQ(statistics.missed_deadlines, 2u); // frame 0 is written late, frame 1 is dropped late
+}
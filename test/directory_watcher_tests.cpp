@@ -0,0 +1,97 @@
+#include "gtest/gtest.h"
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+#include <system_error>
+#include <unistd.h>
+#include "Directory_watcher.hpp"
+
+namespace fs = std::filesystem;
+using namespace std::chrono_literals;
+using jpa::Directory_watcher;
+
+namespace {
+
+class Directory_watcher_test : public ::testing::Test {
+protected:
+    fs::path const d_dir = fs::temp_directory_path() / ("directory_watcher_tests_" + std::to_string(::getpid()));
+    fs::path const d_outside = fs::temp_directory_path() / ("directory_watcher_outside_" + std::to_string(::getpid()));
+
+    void SetUp() override { fs::create_directories(d_dir); }
+    void TearDown() override { fs::remove_all(d_dir); fs::remove(d_outside); }
+
+    // Collects the completed files until none are reported for a while
+    static std::vector<fs::path> completed(Directory_watcher& watcher) {
+        std::vector<fs::path> files;
+        for (std::vector<fs::path> more; !(more = watcher.wait(200ms)).empty(); )
+            files.insert(files.end(), more.begin(), more.end());
+        std::sort(files.begin(), files.end());
+        return files;
+    }
+};
+
+} // namespace
+
+TEST_F(Directory_watcher_test, reports_files_when_they_are_closed) {
+    Directory_watcher watcher(d_dir);
+    EXPECT_TRUE(watcher.wait(10ms).empty());
+    {
+        std::ofstream file(d_dir / "a.tif");
+        file << "data";
+        file.flush();
+        EXPECT_TRUE(watcher.wait(50ms).empty()); // still open
+    }
+    EXPECT_EQ(completed(watcher), std::vector<fs::path>{d_dir / "a.tif"});
+}
+
+TEST_F(Directory_watcher_test, reports_files_moved_into_the_directory) {
+    Directory_watcher watcher(d_dir);
+    std::ofstream(d_outside) << "data";
+    fs::rename(d_outside, d_dir / "b.tif");
+    EXPECT_EQ(completed(watcher), std::vector<fs::path>{d_dir / "b.tif"});
+}
+
+TEST_F(Directory_watcher_test, scan_returns_regular_files_only) {
+    std::ofstream(d_dir / "a") << "a";
+    std::ofstream(d_dir / "b") << "b";
+    fs::create_directory(d_dir / "sub");
+    for (char const* name : {"a", "b"})
+        fs::last_write_time(d_dir / name, fs::file_time_type::clock::now() - 1h);
+    Directory_watcher watcher(d_dir);
+    auto files = watcher.scan();
+    std::sort(files.begin(), files.end());
+    EXPECT_EQ(files, (std::vector<fs::path>{d_dir / "a", d_dir / "b"}));
+}
+
+// Files that may still be written are held back by scan(), and reported by wait() once they have settled
+TEST_F(Directory_watcher_test, scan_holds_back_recently_modified_files) {
+    std::ofstream(d_dir / "old") << "old";
+    fs::last_write_time(d_dir / "old", fs::file_time_type::clock::now() - 1h);
+    std::ofstream(d_dir / "new") << "new";
+    Directory_watcher watcher(d_dir, 300ms);
+    EXPECT_EQ(watcher.scan(), std::vector<fs::path>{d_dir / "old"});
+    EXPECT_TRUE(watcher.wait(10ms).empty());
+    std::this_thread::sleep_for(300ms);
+    EXPECT_EQ(watcher.wait(10ms), std::vector<fs::path>{d_dir / "new"});
+    EXPECT_TRUE(watcher.wait(10ms).empty());
+}
+
+// A file that is being written during the scan is reported once, when it is closed
+TEST_F(Directory_watcher_test, scan_leaves_files_being_written_to_their_event) {
+    Directory_watcher watcher(d_dir, 300ms);
+    {
+        std::ofstream file(d_dir / "a.tif");
+        file << "data";
+        file.flush();
+        EXPECT_TRUE(watcher.scan().empty());
+    }
+    EXPECT_EQ(watcher.wait(200ms), std::vector<fs::path>{d_dir / "a.tif"});
+    std::this_thread::sleep_for(300ms);
+    EXPECT_TRUE(watcher.wait(10ms).empty());
+}
+
+TEST_F(Directory_watcher_test, throws_for_a_missing_directory) {
+    EXPECT_THROW(Directory_watcher(d_dir / "missing"), std::system_error);
+}
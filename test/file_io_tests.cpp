@@ -0,0 +1,112 @@
+#include "gtest/gtest.h"
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cerrno>
+#include <tuple>
+#include <filesystem>
+#include <unistd.h>
+#include "File_io.hpp"
+
+namespace fs = std::filesystem;
+using jpa::File_io;
+
+namespace {
+
+std::string Contents(std::size_t const size, int const seed) {
+    std::string contents(size, '\0');
+    for (std::size_t i = 0; i != size; ++i)
+        contents[i] = char((i * 131 + seed) % 251);
+    return contents;
+}
+
+std::string Read(fs::path const& path) {
+    std::ifstream file(path, std::ios::binary);
+    return {std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+}
+
+// Parameters: the backend, whether direct I/O is requested, and the directory (a tmpfs directory does not support
+// O_DIRECT, so direct I/O falls back to the page cache there).
+class File_io_test : public ::testing::TestWithParam<std::tuple<File_io::Backend, bool, fs::path>> {
+protected:
+    fs::path d_dir;
+
+    void SetUp() override {
+        fs::path const base = std::get<2>(GetParam());
+        if (!fs::is_directory(base))
+            GTEST_SKIP() << base << " does not exist";
+        d_dir = base / ("file_io_tests_" + std::to_string(::getpid()));
+        fs::create_directories(d_dir);
+    }
+    void TearDown() override {
+        if (!d_dir.empty())
+            fs::remove_all(d_dir);
+    }
+    File_io make_io() const { return File_io(std::get<0>(GetParam()), 4, std::get<1>(GetParam())); }
+};
+
+} // namespace
+
+// Sizes around the 4096 byte blocks of direct I/O, and more files than io_uring entries
+TEST_P(File_io_test, writes_and_reads_back_files) {
+    File_io io = make_io();
+    if (std::get<0>(GetParam()) == File_io::Backend::sync) {
+        EXPECT_EQ(io.backend(), File_io::Backend::sync);
+    }
+    std::vector<std::size_t> const sizes = {0, 1, 4095, 4096, 4097, 10000, 3 * 4096, 100000, 7, 8192};
+    std::vector<fs::path> paths;
+    std::vector<std::string> contents;
+    std::vector<std::span<std::byte const>> data;
+    for (std::size_t i = 0; i != sizes.size(); ++i) {
+        paths.push_back(d_dir / std::string("f").append(std::to_string(i)));
+        contents.push_back(Contents(sizes[i], int(i)));
+    }
+    for (auto const& c : contents)
+        data.push_back(std::as_bytes(std::span(c)));
+    for (int error : io.write(std::span<fs::path const>(paths), std::span<std::span<std::byte const> const>(data)))
+        EXPECT_EQ(error, 0);
+    for (std::size_t i = 0; i != paths.size(); ++i) {
+        EXPECT_EQ(fs::file_size(paths[i]), sizes[i]); // direct writes are truncated to the size of the data
+        EXPECT_EQ(Read(paths[i]), contents[i]);
+    }
+
+    std::vector<std::vector<std::byte>> buffers(paths.size());
+    for (int error : io.read(std::span<fs::path const>(paths), std::span(buffers)))
+        EXPECT_EQ(error, 0);
+    for (std::size_t i = 0; i != paths.size(); ++i)
+        EXPECT_TRUE(std::ranges::equal(buffers[i], std::as_bytes(std::span(contents[i]))));
+
+    for (int error : io.remove(std::span<fs::path const>(paths)))
+        EXPECT_EQ(error, 0);
+    for (auto const& path : paths)
+        EXPECT_FALSE(fs::exists(path));
+}
+
+TEST_P(File_io_test, overwrites_longer_files) {
+    File_io io = make_io();
+    fs::path const path = d_dir / "f";
+    std::ofstream(path, std::ios::binary) << Contents(20000, 1);
+    std::string const contents = Contents(5000, 2);
+    std::span<std::byte const> const data = std::as_bytes(std::span(contents));
+    EXPECT_EQ(io.write(std::span<fs::path const>(&path, 1), std::span<std::span<std::byte const> const>(&data, 1))[0], 0);
+    EXPECT_EQ(Read(path), contents);
+}
+
+TEST_P(File_io_test, reports_errors_per_file) {
+    File_io io = make_io();
+    std::ofstream(d_dir / "exists", std::ios::binary) << "abc";
+    std::vector<fs::path> const paths = {d_dir / "missing", d_dir / "exists"};
+    std::vector<std::string> buffers(2);
+    std::vector<int> const errors = io.read(std::span<fs::path const>(paths), std::span(buffers));
+    EXPECT_EQ(errors[0], ENOENT);
+    EXPECT_EQ(errors[1], 0);
+    EXPECT_EQ(buffers[1], "abc");
+    std::vector<int> const removed = io.remove(std::span<fs::path const>(paths));
+    EXPECT_EQ(removed[0], ENOENT);
+    EXPECT_EQ(removed[1], 0);
+}
+
+INSTANTIATE_TEST_SUITE_P(Backends, File_io_test,
+                         ::testing::Combine(::testing::Values(File_io::Backend::sync, File_io::Backend::io_uring),
+                                            ::testing::Bool(),
+                                            ::testing::Values(fs::temp_directory_path(), fs::path("/dev/shm"))));
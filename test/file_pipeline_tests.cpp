@@ -0,0 +1,119 @@
+#include "gtest/gtest.h"
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <filesystem>
+#include "File_pipeline.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// A job that reverses the contents of a file, and fails for files that start with '!'.
+class Reverse_job {
+public:
+    using Input = std::vector<std::byte>;
+
+    Reverse_job(fs::path input, fs::path output) : d_input(std::move(input)), d_output(std::move(output)) {}
+    fs::path input_path() const { return d_input; }
+    fs::path output_path() const { return d_output; }
+    std::size_t memory_size() const { return 2 * fs::file_size(d_input); }
+    void process(Input&& input) {
+        if (!input.empty() && input.front() == std::byte('!'))
+            throw std::runtime_error("refused");
+        d_data.assign(input.rbegin(), input.rend());
+    }
+    std::span<std::byte const> output() const { return d_data; }
+    void written() { d_data = {}; }
+    void fail(std::string const& message) { d_error = message; }
+    bool failed() const { return !d_error.empty(); }
+    std::string const& error() const { return d_error; }
+
+private:
+    fs::path d_input;
+    fs::path d_output;
+    std::vector<std::byte> d_data;
+    std::string d_error;
+};
+
+std::string Read(fs::path const& path) {
+    std::ifstream file(path, std::ios::binary);
+    return {std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+}
+
+class File_pipeline_test : public ::testing::TestWithParam<jpa::File_io::Backend> {
+protected:
+    fs::path const d_dir = fs::temp_directory_path() / ("file_pipeline_tests_" + std::to_string(::getpid()));
+
+    void SetUp() override { fs::create_directories(d_dir); }
+    void TearDown() override { fs::remove_all(d_dir); }
+
+    std::vector<Reverse_job> make_jobs(std::vector<std::string> const& contents) {
+        std::vector<Reverse_job> jobs;
+        for (std::size_t i = 0; i != contents.size(); ++i) {
+            fs::path const input = d_dir / ("in" + std::to_string(i));
+            std::ofstream(input, std::ios::binary) << contents[i];
+            jobs.emplace_back(input, d_dir / ("out" + std::to_string(i)));
+        }
+        return jobs;
+    }
+};
+
+} // namespace
+
+TEST_P(File_pipeline_test, processes_all_jobs_and_reports_in_order) {
+    std::vector<std::string> contents;
+    for (int i = 0; i != 50; ++i)
+        contents.push_back(std::string(1 + 997 * i % 5000, char('a' + i % 26)) + std::to_string(i));
+    auto jobs = make_jobs(contents);
+    using Pipeline = jpa::File_pipeline<Reverse_job>;
+    Pipeline pipeline(Pipeline::Options{.readers = 2, .workers = 3, .writers = 2, .queue_depth = 2,
+                                        .memory_budget = 20000, .io = GetParam(), .batch = 4});
+    std::vector<std::size_t> reported;
+    pipeline.run(jobs, [&](std::size_t const i) { reported.push_back(i); });
+    ASSERT_EQ(reported.size(), jobs.size());
+    for (std::size_t i = 0; i != jobs.size(); ++i) {
+        EXPECT_EQ(reported[i], i);
+        EXPECT_FALSE(jobs[i].failed()) << jobs[i].error();
+        EXPECT_EQ(Read(jobs[i].output_path()), std::string(contents[i].rbegin(), contents[i].rend()));
+        EXPECT_FALSE(fs::exists(jobs[i].input_path()));
+    }
+}
+
+TEST_P(File_pipeline_test, failed_jobs_keep_their_input) {
+    auto jobs = make_jobs({"abc", "!bad", "def"});
+    using Pipeline = jpa::File_pipeline<Reverse_job>;
+    Pipeline pipeline(Pipeline::Options{.io = GetParam()});
+    std::size_t reports = 0;
+    pipeline.run(jobs, [&](std::size_t) { ++reports; });
+    EXPECT_EQ(reports, 3u);
+    EXPECT_FALSE(jobs[0].failed());
+    EXPECT_TRUE(jobs[1].failed());
+    EXPECT_NE(jobs[1].error().find("refused"), std::string::npos);
+    EXPECT_TRUE(fs::exists(jobs[1].input_path()));
+    EXPECT_FALSE(fs::exists(jobs[1].output_path()));
+    EXPECT_EQ(Read(jobs[2].output_path()), "fed");
+}
+
+TEST_P(File_pipeline_test, keeps_inputs_if_asked) {
+    auto jobs = make_jobs({"abc", "xyz"});
+    using Pipeline = jpa::File_pipeline<Reverse_job>;
+    Pipeline pipeline(Pipeline::Options{.io = GetParam(), .remove_input = false});
+    pipeline.run(jobs, [](std::size_t) {});
+    EXPECT_EQ(Read(jobs[0].input_path()), "abc");
+    EXPECT_EQ(Read(jobs[1].output_path()), "zyx");
+}
+
+TEST(Memory_budget, grants_an_oversized_request_when_idle) {
+    jpa::Memory_budget budget(10);
+    budget.acquire(100);
+    budget.release(100);
+    budget.acquire(6);
+    budget.acquire(4);
+    budget.release(10);
+}
+
+INSTANTIATE_TEST_SUITE_P(Backends, File_pipeline_test,
+                         ::testing::Values(jpa::File_io::Backend::sync, jpa::File_io::Backend::automatic));
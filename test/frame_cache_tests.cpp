@@ -0,0 +1,132 @@
+#include "gtest/gtest.h"
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+#include "Frame_cache.hpp"
+#include "Thread_pool.hpp"
+
+using jpa::Frame_cache;
+
+// Expands frames of 100 bytes that hold their index, and counts the expansions
+struct Counting_expand {
+    std::atomic<int> expanded = 0;
+    std::chrono::milliseconds delay{0};
+
+    Frame_cache::Expand operator()() {
+        return [this](std::size_t const frame) {
+            ++expanded;
+            std::this_thread::sleep_for(delay);
+            return std::make_shared<std::vector<std::byte> const>(100, std::byte(frame));
+        };
+    }
+};
+
+TEST(Frame_cache, expands_a_frame_once) {
+    Counting_expand counting;
+    Frame_cache cache(1 << 20);
+    auto const first = cache.get(0, 3, 10, counting());
+    auto const second = cache.get(0, 3, 10, counting());
+    EXPECT_EQ(counting.expanded, 1);
+    EXPECT_EQ(first, second);
+    EXPECT_EQ(first->at(0), std::byte(3));
+    cache.get(1, 3, 10, counting()); // the same frame of another source
+    EXPECT_EQ(counting.expanded, 2);
+    Frame_cache::Statistics const statistics = cache.statistics();
+    EXPECT_EQ(statistics.hits, 1u);
+    EXPECT_EQ(statistics.misses, 2u);
+    EXPECT_EQ(statistics.frames, 2u);
+    EXPECT_EQ(statistics.bytes, 200u);
+}
+
+TEST(Frame_cache, concurrent_requests_expand_a_frame_once) {
+    Counting_expand counting;
+    counting.delay = std::chrono::milliseconds(20);
+    Frame_cache cache(1 << 20);
+    auto const expand = counting();
+    std::vector<Frame_cache::Frame> frames(8);
+    {
+        std::vector<std::jthread> threads;
+        for (auto& frame : frames)
+            threads.emplace_back([&] { frame = cache.get(0, 5, 10, expand); });
+    }
+    EXPECT_EQ(counting.expanded, 1);
+    for (auto const& frame : frames)
+        EXPECT_EQ(frame, frames[0]);
+    EXPECT_EQ(cache.statistics().hits + cache.statistics().misses, 8u);
+}
+
+TEST(Frame_cache, evicts_frames_beyond_the_budget) {
+    Counting_expand counting;
+    Frame_cache cache(300);
+    auto const first = cache.get(0, 0, 10, counting());
+    for (std::size_t frame = 1; frame != 10; ++frame)
+        cache.get(0, frame, 10, counting());
+    Frame_cache::Statistics const statistics = cache.statistics();
+    EXPECT_LE(statistics.bytes, 300u);
+    EXPECT_EQ(statistics.evictions, 10u - statistics.frames);
+    EXPECT_EQ(first->size(), 100u); // an evicted frame stays valid for its users
+    EXPECT_EQ(first->at(99), std::byte(0));
+}
+
+TEST(Frame_cache, referenced_frames_get_a_second_chance) {
+    Counting_expand counting;
+    Frame_cache cache(200);
+    cache.get(0, 0, 10, counting());
+    cache.get(0, 1, 10, counting());
+    cache.get(0, 0, 10, counting()); // frame 0 is referenced, so frame 1 is evicted for frame 2
+    cache.get(0, 2, 10, counting());
+    EXPECT_EQ(counting.expanded, 3);
+    cache.get(0, 0, 10, counting());
+    EXPECT_EQ(counting.expanded, 3);
+    cache.get(0, 1, 10, counting());
+    EXPECT_EQ(counting.expanded, 4);
+}
+
+TEST(Frame_cache, exceptions_are_passed_on_and_not_cached) {
+    Frame_cache cache(1 << 20);
+    int calls = 0;
+    auto const expand = [&calls](std::size_t const frame) -> Frame_cache::Frame {
+        if (calls++ == 0)
+            throw std::runtime_error("expansion failed");
+        return std::make_shared<std::vector<std::byte> const>(10, std::byte(frame));
+    };
+    EXPECT_THROW(cache.get(0, 1, 10, expand), std::runtime_error);
+    EXPECT_EQ(cache.statistics().frames, 0u);
+    EXPECT_EQ(cache.get(0, 1, 10, expand)->at(0), std::byte(1));
+    EXPECT_EQ(calls, 2);
+    EXPECT_EQ(cache.statistics().frames, 1u);
+}
+
+TEST(Frame_cache, prefetches_the_following_frames_of_the_source) {
+    Counting_expand counting;
+    jpa::Thread_pool pool(2);
+    Frame_cache cache(1 << 20, pool, 8);
+    cache.get(0, 0, 4, counting()); // only 3 frames follow frame 0
+    pool.wait();
+    Frame_cache::Statistics statistics = cache.statistics();
+    EXPECT_EQ(statistics.prefetches, 3u);
+    EXPECT_EQ(statistics.frames, 4u);
+    for (std::size_t frame = 1; frame != 4; ++frame)
+        EXPECT_EQ(cache.get(0, frame, 4, counting())->at(0), std::byte(frame));
+    EXPECT_EQ(counting.expanded, 4);
+    statistics = cache.statistics();
+    EXPECT_EQ(statistics.hits, 3u);
+    EXPECT_EQ(statistics.misses, 1u);
+}
+
+TEST(Frame_cache, clear_evicts_all_frames) {
+    Counting_expand counting;
+    Frame_cache cache(1 << 20);
+    for (std::size_t frame = 0; frame != 3; ++frame)
+        cache.get(0, frame, 3, counting());
+    cache.clear();
+    Frame_cache::Statistics const statistics = cache.statistics();
+    EXPECT_EQ(statistics.frames, 0u);
+    EXPECT_EQ(statistics.bytes, 0u);
+    EXPECT_EQ(statistics.evictions, 3u);
+    cache.get(0, 0, 3, counting());
+    EXPECT_EQ(counting.expanded, 4);
+}
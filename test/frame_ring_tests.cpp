@@ -0,0 +1,96 @@
+#include "gtest/gtest.h"
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <numeric>
+#include <stop_token>
+#include <unistd.h>
+#include "Frame_ring.hpp"
+
+using jpa::Frame_ring;
+using namespace std::chrono_literals;
+
+namespace {
+
+std::string Ring_name(char const* test) {
+    return "/frame_ring_tests_" + std::to_string(::getpid()) + "_" + test;
+}
+
+std::vector<std::uint16_t> Frame(std::uint64_t const number) {
+    std::vector<std::uint16_t> pixels(64);
+    std::iota(pixels.begin(), pixels.end(), std::uint16_t(number));
+    return pixels;
+}
+
+} // namespace
+
+TEST(Frame_ring, hands_frames_to_consumers_in_order) {
+    std::string const name = Ring_name("order");
+    auto producer = Frame_ring::create(name, 4, 64 * sizeof(std::uint16_t), 2, false);
+    auto consumer = Frame_ring::open(name);
+    EXPECT_EQ(consumer.slots(), 4u);
+    EXPECT_EQ(consumer.pixel_size(), 2u);
+    EXPECT_FALSE(consumer.is_signed());
+    std::thread writer([&] {
+        for (std::uint64_t number = 100; number != 120; ++number)
+            EXPECT_TRUE(producer.push(std::span<std::uint16_t const>(Frame(number)), {8, 8}, number, Frame_ring::Policy::block));
+        producer.close();
+    });
+    std::uint64_t expected = 0;
+    while (auto frame = consumer.pop()) {
+        EXPECT_EQ(frame->index(), expected);
+        EXPECT_EQ(frame->number(), 100 + expected);
+        EXPECT_EQ(frame->dim(), (std::array<std::uint64_t,2>{8, 8}));
+        auto const pixels = Frame(100 + expected);
+        EXPECT_TRUE(std::ranges::equal(frame->data(), std::as_bytes(std::span(pixels))));
+        ++expected;
+    }
+    writer.join();
+    EXPECT_EQ(expected, 20u);
+    auto const counters = consumer.counters();
+    EXPECT_EQ(counters.written, 20u);
+    EXPECT_EQ(counters.consumed, 20u);
+    EXPECT_EQ(counters.dropped, 0u);
+    EXPECT_LE(counters.max_lag, 4u);
+    Frame_ring::remove(name);
+}
+
+TEST(Frame_ring, drops_frames_when_full) {
+    std::string const name = Ring_name("drop");
+    auto ring = Frame_ring::create(name, 2, 64 * sizeof(std::uint16_t), 2, false);
+    for (std::uint64_t number = 0; number != 5; ++number)
+        EXPECT_EQ(ring.push(std::span<std::uint16_t const>(Frame(number)), {8, 8}, number, Frame_ring::Policy::drop), number < 2);
+    ring.close();
+    EXPECT_EQ(ring.counters().dropped, 3u);
+    std::vector<std::uint64_t> numbers;
+    while (auto frame = ring.pop())
+        numbers.push_back(frame->number());
+    EXPECT_EQ(numbers, (std::vector<std::uint64_t>{0, 1}));
+    Frame_ring::remove(name);
+}
+
+TEST(Frame_ring, rejects_frames_larger_than_a_slot) {
+    std::string const name = Ring_name("large");
+    auto ring = Frame_ring::create(name, 2, 16, 2, false);
+    EXPECT_THROW(ring.push(std::span<std::uint16_t const>(Frame(0)), {8, 8}, 0, Frame_ring::Policy::block), std::length_error);
+    Frame_ring::remove(name);
+}
+
+TEST(Frame_ring, open_throws_for_a_missing_ring) {
+    EXPECT_THROW(Frame_ring::open(Ring_name("missing")), std::system_error);
+}
+
+// A consumer that waits for a frame that never comes returns once a stop is requested
+TEST(Frame_ring, pop_returns_when_a_stop_is_requested) {
+    std::string const name = Ring_name("stop");
+    auto ring = Frame_ring::create(name, 2, 64 * sizeof(std::uint16_t), 2, false);
+    std::stop_source stopping;
+    std::thread consumer([&] { EXPECT_EQ(ring.pop(stopping.get_token()), std::nullopt); });
+    std::this_thread::sleep_for(20ms);
+    stopping.request_stop();
+    consumer.join();
+    ring.push(std::span<std::uint16_t const>(Frame(0)), {8, 8}, 0, Frame_ring::Policy::block);
+    EXPECT_EQ(ring.pop(stopping.get_token()), std::nullopt); // also when frames are available
+    EXPECT_NE(ring.pop(), std::nullopt);
+    Frame_ring::remove(name);
+}
@@ -0,0 +1,261 @@
+#include "gtest/gtest.h"
+#include <vector>
+#include <numeric>
+#include <sstream>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include "Grey_tif.hpp"
+#include "Grey_tif_map.hpp"
+#include "Grey_tif_writer.hpp"
+
+using jpa::Grey_tif;
+using jpa::Grey_tif_map;
+using jpa::Grey_tif_writer;
+
+namespace {
+
+std::vector<std::uint16_t> Image_u16(std::size_t const size, std::uint16_t const first) {
+    std::vector<std::uint16_t> pixels(size);
+    std::iota(pixels.begin(), pixels.end(), first);
+    return pixels;
+}
+
+std::vector<std::int32_t> Image_i32(std::size_t const size, std::int32_t const first) {
+    std::vector<std::int32_t> pixels(size);
+    std::iota(pixels.begin(), pixels.end(), first);
+    return pixels;
+}
+
+// Appends an image as prolix does: first the image, then its pixels
+void Push_back(Grey_tif<std::uint16_t>& tif, std::vector<std::uint16_t> const& pixels, std::array<long,2> const& dim) {
+    tif.push_back<std::uint16_t>(dim);
+    std::ranges::copy(pixels, tif.image(int(tif.image_stack_size()) - 1).begin());
+}
+
+// A TIFF file of one 16-bit image of width x height pixels, which are stored in tiles of 'tile' pixels, or if 'tile' is
+// {0, 0}, in strips of 'rows_per_strip' rows. The strips or tiles are stored in reverse order. The file is little-endian,
+// or big-endian (Motorola order) if 'big_endian'.
+std::string Tiled_tif(std::vector<std::uint16_t> const& pixels, long const width, long const height,
+                      long const rows_per_strip, std::array<long,2> const tile = {0, 0}, bool const big_endian = false) {
+    bool const tiled = tile[0] != 0;
+    long const across = tiled ? (width + tile[0] - 1) / tile[0] : 1;
+    long const down = tiled ? (height + tile[1] - 1) / tile[1] : (height + rows_per_strip - 1) / rows_per_strip;
+    long const piece_width = tiled ? tile[0] : width;
+    long const piece_height = tiled ? tile[1] : rows_per_strip;
+    std::string file(big_endian ? std::string("MM\0\x2a\0\0\0\0", 8) : std::string("II\x2a\0\0\0\0\0", 8));
+    auto const put = [&file, big_endian](std::uint64_t const value, std::size_t const bytes) {
+        for (std::size_t i = 0; i != bytes; ++i)
+            file += char(value >> (8 * (big_endian ? bytes - 1 - i : i)));
+    };
+    std::vector<std::uint32_t> offsets(std::size_t(across * down));
+    for (long piece = across * down; piece-- != 0; ) {
+        offsets[std::size_t(piece)] = std::uint32_t(file.size());
+        long const x0 = (piece % across) * piece_width;
+        long const y0 = (piece / across) * piece_height;
+        for (long y = y0; y != y0 + piece_height && (tiled || y != height); ++y)
+            for (long x = x0; x != x0 + piece_width; ++x)
+                put(x < width && y < height ? pixels[std::size_t(y * width + x)] : 0xdead, 2);
+    }
+    std::uint32_t const offsets_at = std::uint32_t(file.size());
+    for (auto const offset : offsets)
+        put(offset, 4);
+    std::uint32_t const ifd = std::uint32_t(file.size());
+    for (std::size_t i = 0; i != 4; ++i)
+        file[4 + i] = char(ifd >> (8 * (big_endian ? 3 - i : i)));
+    std::vector<std::array<std::uint32_t,4>> tags = {{0x0100, 4, 1, std::uint32_t(width)}, {0x0101, 4, 1, std::uint32_t(height)},
+        {0x0102, 3, 1, 16}, {0x0103, 3, 1, 1}, {0x0106, 3, 1, 1}, {0x0115, 3, 1, 1}};
+    std::uint32_t const count = std::uint32_t(offsets.size());
+    std::uint32_t const offsets_value = count == 1 ? offsets[0] : offsets_at;
+    if (tiled) {
+        tags.push_back({0x0142, 4, 1, std::uint32_t(tile[0])});
+        tags.push_back({0x0143, 4, 1, std::uint32_t(tile[1])});
+        tags.push_back({0x0144, 4, count, offsets_value});
+    }
+    else {
+        tags.push_back({0x0111, 4, count, offsets_value});
+        tags.push_back({0x0116, 4, 1, std::uint32_t(rows_per_strip)});
+    }
+    std::ranges::sort(tags);
+    put(tags.size(), 2);
+    for (auto const& [tag, type, n, value] : tags) {
+        put(tag, 2);
+        put(type, 2);
+        put(n, 4);
+        if (type == 3) { // a SHORT value is stored in the first two bytes of the value field
+            put(value, 2);
+            put(0, 2);
+        }
+        else
+            put(value, 4);
+    }
+    put(0, 4);
+    return file;
+}
+
+std::filesystem::path Temp_file(char const* name) {
+    return std::filesystem::temp_directory_path() / ("grey_tif_tests_" + std::to_string(::getpid()) + "_" + name);
+}
+
+} // namespace
+
+TEST(Grey_tif, reads_back_a_written_stack) {
+    Grey_tif<std::uint16_t> tif;
+    for (std::uint16_t i = 0; i != 5; ++i)
+        Push_back(tif, Image_u16(7 * 3, i * 100), {7, 3}); // odd-sized images are padded
+    EXPECT_EQ(tif.image_stack_size(), 5u);
+    EXPECT_FALSE(tif.is_big());
+    EXPECT_EQ(tif.raw_data_size(), Grey_tif<std::uint16_t>::raw_data_size(5, {7, 3}));
+    std::stringstream stream;
+    tif.write(stream);
+    Grey_tif<std::uint16_t> const from_file(stream);
+    ASSERT_EQ(from_file.image_stack_size(), 5u);
+    for (std::uint16_t i = 0; i != 5; ++i) {
+        EXPECT_EQ(from_file.image(i).dim(), (std::array<long,2>{7, 3}));
+        EXPECT_TRUE(std::ranges::equal(from_file.image(i), Image_u16(7 * 3, i * 100))) << "image " << i;
+    }
+}
+
+// Grey_tif_writer writes the same file as Grey_tif, without holding the stack
+TEST(Grey_tif_writer, writes_the_file_that_grey_tif_writes) {
+    Grey_tif<std::uint16_t> tif;
+    std::ostringstream streamed;
+    {
+        Grey_tif_writer writer(streamed);
+        for (std::uint16_t i = 0; i != 4; ++i) {
+            Push_back(tif, Image_u16(6 * 5, i), {6, 5});
+            writer.write(Image_u16(6 * 5, i), {6, 5});
+        }
+        EXPECT_EQ(writer.image_stack_size(), 4u);
+    }
+    std::ostringstream written;
+    tif.write(written);
+    EXPECT_EQ(streamed.str(), written.str());
+}
+
+// A writer that expects more than 4 GB writes BigTIFF, which is read as any TIFF file
+TEST(Grey_tif, reads_bigtiff_stacks_of_mixed_pixel_types) {
+    std::stringstream stream;
+    {
+        Grey_tif_writer writer(stream, std::uint64_t(5) << 30);
+        EXPECT_TRUE(writer.is_big());
+        writer.write(Image_u16(6 * 4, 1000), {6, 4});
+        writer.write(Image_i32(3 * 3, -4), {3, 3});
+        EXPECT_EQ(writer.size(), stream.str().size());
+    }
+    std::string const file = stream.str();
+    EXPECT_EQ(file[2], 43); // the BigTIFF magic number, in little-endian byte order
+    Grey_tif<std::byte> const raw(stream);
+    EXPECT_TRUE(raw.is_big());
+    EXPECT_EQ(raw.image_stack_size(), 2u);
+    stream.seekg(0);
+    Grey_tif<std::int32_t> const tif(stream); // converts the pixels of the first image to std::int32_t
+    ASSERT_EQ(tif.image_stack_size(), 2u);
+    EXPECT_EQ(tif.image(0).dim(), (std::array<long,2>{6, 4}));
+    EXPECT_TRUE(std::ranges::equal(tif.image(0), Image_i32(6 * 4, 1000)));
+    EXPECT_EQ(tif.image(1).dim(), (std::array<long,2>{3, 3}));
+    EXPECT_TRUE(std::ranges::equal(tif.image(1), Image_i32(3 * 3, -4)));
+
+    auto const path = Temp_file("big.tif");
+    std::ofstream(path, std::ios::binary).write(file.data(), std::streamsize(file.size()));
+    {
+        Grey_tif_map const map(path);
+        ASSERT_EQ(map.image_stack_size(), 2u);
+        EXPECT_TRUE(std::ranges::equal(map.image<std::uint16_t>(0), Image_u16(6 * 4, 1000)));
+        EXPECT_TRUE(std::ranges::equal(map.image<std::int32_t>(1), Image_i32(3 * 3, -4)));
+        EXPECT_THROW(map.image(2), std::out_of_range);
+    }
+    std::filesystem::remove(path);
+}
+
+TEST(Grey_tif_map, maps_the_images_of_a_classic_tiff_file) {
+    Grey_tif<std::uint16_t> tif;
+    for (std::uint16_t i = 0; i != 3; ++i)
+        Push_back(tif, Image_u16(8 * 2, i * 10), {8, 2});
+    auto const path = Temp_file("classic.tif");
+    {
+        std::ofstream file(path, std::ios::binary);
+        tif.write(file);
+    }
+    {
+        Grey_tif_map const map(path);
+        EXPECT_TRUE(map.native());
+        EXPECT_EQ(map.raw_data_size(), tif.raw_data_size());
+        EXPECT_TRUE(std::ranges::equal(map.image<std::uint16_t>(2), Image_u16(8 * 2, 20))); // parses only up to image 2
+        EXPECT_EQ(map.image_stack_size(), 3u);
+        EXPECT_EQ(map.image(1).dim(), (std::array<long,2>{8, 2}));
+    }
+    std::filesystem::remove(path);
+}
+
+TEST(Grey_tif_map, rejects_files_that_are_not_tiff_files) {
+    auto const path = Temp_file("not.tif");
+    std::ofstream(path) << "not a tiff file";
+    EXPECT_THROW(Grey_tif_map{path}, std::runtime_error);
+    std::filesystem::remove(path);
+}
+
+class Grey_tif_layout : public ::testing::TestWithParam<std::array<long,5>> {}; // width, height, rows per strip, tile
+
+// Images in strips in any order, or in tiles that extend beyond the image, are assembled on reading
+TEST_P(Grey_tif_layout, assembles_strips_and_tiles) {
+    auto const [width, height, rows_per_strip, tile_width, tile_height] = GetParam();
+    auto const pixels = Image_u16(std::size_t(width * height), 7);
+    std::string const file = Tiled_tif(pixels, width, height, rows_per_strip, {tile_width, tile_height});
+    std::istringstream stream(file);
+    Grey_tif<std::uint16_t> const tif(stream);
+    ASSERT_EQ(tif.image_stack_size(), 1u);
+    EXPECT_EQ(tif.image(0).dim(), (std::array<long,2>{width, height}));
+    EXPECT_TRUE(std::ranges::equal(tif.image(0), pixels));
+
+    auto const path = Temp_file("layout.tif");
+    std::ofstream(path, std::ios::binary).write(file.data(), std::streamsize(file.size()));
+    {
+        Grey_tif_map const map(path);
+        EXPECT_TRUE(std::ranges::equal(map.image<std::uint16_t>(0), pixels));
+        std::vector<std::byte> buffer;
+        EXPECT_TRUE(std::ranges::equal(static_cast<jpa::Grey_tif_image<std::uint16_t const>>(map.image(0, buffer)), pixels));
+    }
+    std::filesystem::remove(path);
+}
+
+// Pixels of Motorola-order files are byte-swapped on reading, by Grey_tif and by Grey_tif_map
+TEST(Grey_tif, reads_big_endian_files) {
+    auto const pixels = Image_u16(std::size_t(33 * 9), 0x1234); // more pixels than fit in a vector register
+    for (long const rows_per_strip : {9, 4}) {
+        std::string const file = Tiled_tif(pixels, 33, 9, rows_per_strip, {0, 0}, true);
+        std::istringstream stream(file);
+        Grey_tif<std::uint16_t> const tif(stream);
+        ASSERT_EQ(tif.image_stack_size(), 1u);
+        EXPECT_EQ(tif.image(0).dim(), (std::array<long,2>{33, 9}));
+        EXPECT_TRUE(std::ranges::equal(tif.image(0), pixels));
+
+        auto const path = Temp_file("motorola.tif");
+        std::ofstream(path, std::ios::binary).write(file.data(), std::streamsize(file.size()));
+        {
+            Grey_tif_map const map(path);
+            EXPECT_TRUE(std::ranges::equal(map.image<std::uint16_t>(0), pixels));
+        }
+        std::filesystem::remove(path);
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(Grey_tif, Grey_tif_layout, ::testing::Values(
+    std::array<long,5>{5, 7, 7, 0, 0},      // one strip
+    std::array<long,5>{5, 7, 3, 0, 0},      // three strips, the last one shorter
+    std::array<long,5>{5, 7, 1, 0, 0},      // a strip per row
+    std::array<long,5>{32, 32, 0, 16, 16},  // tiles that fit the image
+    std::array<long,5>{20, 18, 0, 16, 16}   // tiles that extend beyond the image
+));
+
+TEST(Grey_tif, rejects_strips_outside_the_file) {
+    std::string file = Tiled_tif(Image_u16(5 * 7, 0), 5, 7, 7);
+    std::uint32_t ifd;
+    std::memcpy(&ifd, &file[4], 4);
+    std::uint32_t const offset = std::uint32_t(file.size() - 10); // the strip would extend beyond the file
+    std::memcpy(&file[ifd + 2 + 5 * 12 + 8], &offset, 4);    // the value of tag 0x0111, StripOffsets, the 6th tag
+    std::istringstream stream(file);
+    EXPECT_THROW(Grey_tif<std::uint16_t>{stream}, std::runtime_error);
+}
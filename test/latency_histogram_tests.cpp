@@ -0,0 +1,63 @@
+#include "gtest/gtest.h"
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include "Latency_histogram.hpp"
+
+using jpa::Latency_histogram;
+using std::chrono::nanoseconds;
+
+TEST(Latency_histogram, empty_histogram_reports_zero) {
+    Latency_histogram const histogram;
+    EXPECT_EQ(histogram.count(), 0u);
+    EXPECT_EQ(histogram.percentile(0.5), nanoseconds(0));
+    EXPECT_EQ(histogram.mean(), nanoseconds(0));
+    EXPECT_EQ(histogram.max(), nanoseconds(0));
+}
+
+// A percentile is the upper bound of its bucket, which is at most 1/128 above the durations in it
+TEST(Latency_histogram, buckets_bound_the_relative_error) {
+    for (std::uint64_t const ns : {0ull, 1ull, 255ull, 256ull, 257ull, 511ull, 512ull, 1000ull, 123456789ull, 1ull << 40,
+                                   (1ull << 62) + 12345}) {
+        Latency_histogram histogram;
+        histogram.record(nanoseconds(ns));
+        histogram.record(nanoseconds::max()); // a larger maximum, so that the bucket bound is not capped
+        std::uint64_t const bound = static_cast<std::uint64_t>(histogram.percentile(0.5).count());
+        EXPECT_GE(bound, ns);
+        EXPECT_LE(bound - ns, ns / 128) << ns;
+        if (ns < 256)
+            EXPECT_EQ(bound, ns);
+    }
+}
+
+TEST(Latency_histogram, percentiles_of_a_distribution) {
+    Latency_histogram histogram;
+    for (std::int64_t us = 1; us <= 1000; ++us)
+        histogram.record(std::chrono::microseconds(us));
+    histogram.record(nanoseconds(-5)); // recorded as 0
+    EXPECT_EQ(histogram.count(), 1001u);
+    EXPECT_EQ(histogram.percentile(0), nanoseconds(0));
+    EXPECT_NEAR(histogram.percentile(0.5).count(), 500000, 500000 / 128);
+    EXPECT_NEAR(histogram.percentile(0.99).count(), 990000, 990000 / 128);
+    EXPECT_EQ(histogram.percentile(1), std::chrono::microseconds(1000)); // capped at the maximum
+    EXPECT_EQ(histogram.max(), std::chrono::microseconds(1000));
+    EXPECT_NEAR(histogram.mean().count(), 500500000 / 1001, 1);
+    histogram.reset();
+    EXPECT_EQ(histogram.count(), 0u);
+    EXPECT_EQ(histogram.max(), nanoseconds(0));
+}
+
+TEST(Latency_histogram, concurrent_records_are_all_counted) {
+    Latency_histogram histogram;
+    {
+        std::vector<std::jthread> threads;
+        for (int t = 0; t != 4; ++t)
+            threads.emplace_back([&histogram, t] {
+                for (int i = 0; i != 10000; ++i)
+                    histogram.record(nanoseconds(i * 4 + t));
+            });
+    }
+    EXPECT_EQ(histogram.count(), 40000u);
+    EXPECT_EQ(histogram.max(), nanoseconds(39999));
+}
@@ -0,0 +1,187 @@
+#include "gtest/gtest.h"
+#include <vector>
+#include <cstring>
+#include <numeric>
+#include <fstream>
+#include <sstream>
+#include <streambuf>
+#include <filesystem>
+#include <unistd.h>
+#include "Mrc_map.hpp"
+#include "Mrc_writer.hpp"
+
+using jpa::Mrc_map;
+using jpa::Mrc_writer;
+
+namespace {
+
+std::filesystem::path Temp_file(char const* name) {
+    return std::filesystem::temp_directory_path() / ("mrc_tests_" + std::to_string(::getpid()) + "_" + name);
+}
+
+void Write_file(std::filesystem::path const& path, std::string const& data) {
+    std::ofstream(path, std::ios::binary).write(data.data(), std::streamsize(data.size()));
+}
+
+template <typename T>
+std::vector<T> Image(std::size_t const size, int const first) {
+    std::vector<T> pixels(size);
+    for (std::size_t i = 0; i != size; ++i)
+        pixels[i] = T(first + int(i));
+    return pixels;
+}
+
+// The value of word 'number' (counting from 1, as MRC2014 does) of the header of an MRC file
+template <typename T>
+T Word(std::string const& file, std::size_t const number) {
+    T value;
+    std::memcpy(&value, &file[4 * (number - 1)], sizeof(T));
+    return value;
+}
+
+// A stream that cannot seek, like a pipe
+class Unseekable : public std::streambuf {
+public:
+    std::string data;
+private:
+    int overflow(int const c) override { data += char(c); return c; }
+};
+
+} // namespace
+
+template <typename T>
+class Mrc_types : public ::testing::Test {};
+using Pixel_types = ::testing::Types<std::int8_t, std::uint8_t, std::int16_t, std::uint16_t, float>;
+TYPED_TEST_SUITE(Mrc_types, Pixel_types);
+
+TYPED_TEST(Mrc_types, read_back_written_stacks) {
+    using T = TypeParam;
+    std::stringstream stream;
+    {
+        Mrc_writer writer(stream);
+        for (int i = 0; i != 3; ++i)
+            writer.write(Image<T>(6 * 4, -10 * i), {6, 4});
+        EXPECT_EQ(writer.image_stack_size(), 3u);
+    }
+    std::string const file = stream.str();
+    EXPECT_EQ(Word<std::int32_t>(file, 1), 6);
+    EXPECT_EQ(Word<std::int32_t>(file, 2), 4);
+    EXPECT_EQ(Word<std::int32_t>(file, 3), 3);
+    EXPECT_EQ(file.substr(52 * 4, 4), "MAP ");
+    auto const path = Temp_file("types.mrc");
+    Write_file(path, file);
+    {
+        Mrc_map const map(path);
+        EXPECT_TRUE(map.native());
+        EXPECT_EQ(map.raw_data_size(), file.size());
+        ASSERT_EQ(map.image_stack_size(), 3u);
+        for (int i = 0; i != 3; ++i) {
+            EXPECT_EQ(map.image(i).dim(), (std::array<long,2>{6, 4}));
+            EXPECT_TRUE(std::ranges::equal(map.image<T>(i), Image<T>(6 * 4, -10 * i))) << "image " << i;
+        }
+        EXPECT_THROW(map.image(3), std::out_of_range);
+    }
+    std::filesystem::remove(path);
+}
+
+TEST(Mrc_writer, writes_the_modes_and_statistics_of_the_pixels) {
+    std::ostringstream stream;
+    {
+        Mrc_writer writer(stream);
+        writer.write(std::vector<std::int16_t>{-3, 1, 1, 5}, {2, 2});
+        writer.write(std::vector<std::int16_t>{0, 0, 0, 0}, {2, 2});
+    }
+    std::string const file = stream.str();
+    EXPECT_EQ(Word<std::int32_t>(file, 4), 1); // mode 1: 16-bit signed integers
+    EXPECT_EQ(Word<float>(file, 20), -3.0f);   // minimum
+    EXPECT_EQ(Word<float>(file, 21), 5.0f);    // maximum
+    EXPECT_EQ(Word<float>(file, 22), 0.5f);    // mean
+    EXPECT_FLOAT_EQ(Word<float>(file, 55), std::sqrt(36.0f / 8 - 0.25f)); // RMS deviation
+    EXPECT_EQ(file.size(), 1024u + 2 * 4 * sizeof(std::int16_t));
+}
+
+TEST(Mrc_writer, rejects_images_of_another_size_or_type) {
+    std::ostringstream stream;
+    Mrc_writer writer(stream);
+    writer.write(Image<std::int16_t>(4, 0), {2, 2});
+    EXPECT_THROW(writer.write(Image<std::int16_t>(6, 0), {3, 2}), std::invalid_argument);
+    EXPECT_THROW(writer.write(Image<std::uint16_t>(4, 0), {2, 2}), std::invalid_argument);
+    auto const wide = Image<std::int32_t>(4, 0);
+    EXPECT_THROW(writer.write(std::as_bytes(std::span(wide)), jpa::POD_type_traits{.size = 4, .is_signed = true, .is_integral = true}, {2, 2}),
+                 std::invalid_argument);
+}
+
+// On a stream that cannot seek, the header holds the expected number of images, and no statistics
+TEST(Mrc_writer, writes_the_expected_number_of_images_to_streams_that_cannot_seek) {
+    Unseekable pipe;
+    std::ostream stream(&pipe);
+    {
+        Mrc_writer writer(stream, 2);
+        writer.write(Image<std::uint16_t>(4, 0), {2, 2});
+        writer.write(Image<std::uint16_t>(4, 0), {2, 2});
+        writer.close();
+    }
+    EXPECT_EQ(Word<std::int32_t>(pipe.data, 3), 2);
+    EXPECT_EQ(Word<std::int32_t>(pipe.data, 4), 6);
+    EXPECT_LT(Word<float>(pipe.data, 55), 0.0f); // not determined
+    Unseekable short_pipe;
+    std::ostream short_stream(&short_pipe);
+    Mrc_writer writer(short_stream, 3);
+    writer.write(Image<std::uint16_t>(4, 0), {2, 2});
+    EXPECT_THROW(writer.close(), std::length_error);
+}
+
+TEST(Mrc_map, converts_half_floats_to_floats) {
+    std::stringstream stream;
+    std::vector<std::uint16_t> const half = {0x3c00, 0xc000, 0x3800, 0x0000, 0x7bff, 0x8000}; // 1, -2, 0.5, 0, 65504, -0
+    {
+        Mrc_writer writer(stream);
+        writer.write(std::as_bytes(std::span(half)), 12, {3, 2});
+    }
+    auto const path = Temp_file("half.mrc");
+    Write_file(path, stream.str());
+    {
+        Mrc_map const map(path);
+        EXPECT_EQ(map.mode(), 12);
+        EXPECT_FALSE(map.native());
+        EXPECT_TRUE(std::ranges::equal(map.image<float>(0), std::vector<float>{1.0f, -2.0f, 0.5f, 0.0f, 65504.0f, -0.0f}));
+    }
+    std::filesystem::remove(path);
+}
+
+TEST(Mrc_map, skips_the_extended_header) {
+    std::ostringstream stream;
+    {
+        Mrc_writer writer(stream);
+        writer.write(Image<std::int16_t>(4, 7), {2, 2});
+    }
+    std::string file = stream.str();
+    std::int32_t const extended = 96;
+    std::memcpy(&file[4 * 23], &extended, 4); // NSYMBT, word 24
+    file.insert(1024, std::string(extended, 'x'));
+    auto const path = Temp_file("extended.mrc");
+    Write_file(path, file);
+    {
+        Mrc_map const map(path);
+        EXPECT_EQ(map.extended_header().size(), 96u);
+        EXPECT_TRUE(std::ranges::equal(map.image<std::int16_t>(0), Image<std::int16_t>(4, 7)));
+    }
+    std::filesystem::remove(path);
+}
+
+TEST(Mrc_map, rejects_unsupported_modes) {
+    std::ostringstream stream;
+    {
+        Mrc_writer writer(stream);
+        writer.write(Image<std::int16_t>(4, 0), {2, 2});
+    }
+    std::string file = stream.str();
+    std::int32_t const complex_mode = 4;
+    std::memcpy(&file[4 * 3], &complex_mode, 4);
+    auto const path = Temp_file("complex.mrc");
+    Write_file(path, file);
+    EXPECT_THROW(Mrc_map{path}, std::runtime_error);
+    Write_file(path, "not an MRC file");
+    EXPECT_THROW(Mrc_map{path}, std::runtime_error);
+    std::filesystem::remove(path);
+}
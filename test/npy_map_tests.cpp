@@ -0,0 +1,115 @@
+#include "gtest/gtest.h"
+#include <vector>
+#include <numeric>
+#include <fstream>
+#include <filesystem>
+#include <unistd.h>
+#include "Npy_map.hpp"
+
+using jpa::Npy_map;
+
+namespace {
+
+std::filesystem::path Temp_file(char const* name) {
+    return std::filesystem::temp_directory_path() / ("npy_map_tests_" + std::to_string(::getpid()) + "_" + name);
+}
+
+// Writes a file, which is removed when the test ends
+class Temp_npy {
+public:
+    Temp_npy(char const* name, std::string const& data) : d_path(Temp_file(name)) {
+        std::ofstream(d_path, std::ios::binary).write(data.data(), std::streamsize(data.size()));
+    }
+    ~Temp_npy() { std::filesystem::remove(d_path); }
+    std::filesystem::path const& path() const { return d_path; }
+private:
+    std::filesystem::path d_path;
+};
+
+// A .npy header (version 1.0) with the dictionary 'dict', as other programs than NumPy may write it
+std::string Header(std::string const& dict) {
+    std::string header = "\x93NUMPY\x01";
+    header += '\0';
+    std::size_t const size = (10 + dict.size() + 1 + 15) / 16 * 16;
+    std::string padded = dict + std::string(size - 10 - dict.size() - 1, ' ') + '\n';
+    header += char(padded.size() & 0xff);
+    header += char(padded.size() >> 8);
+    return header + padded;
+}
+
+template <typename T>
+std::string Bytes(std::vector<T> const& values) {
+    return std::string(reinterpret_cast<char const*>(values.data()), values.size() * sizeof(T));
+}
+
+} // namespace
+
+TEST(Npy_map, reads_the_frames_of_a_stack) {
+    std::vector<std::uint16_t> pixels(3 * 4 * 5);
+    std::iota(pixels.begin(), pixels.end(), 1000);
+    std::string const header = Npy_map::header({.size = 2, .is_signed = false, .is_integral = true}, {3, 4, 5});
+    EXPECT_EQ(header.size() % 64, 0u);
+    Temp_npy const file("stack.npy", header + Bytes(pixels));
+    Npy_map const npy(file.path());
+    EXPECT_TRUE(npy.native());
+    EXPECT_EQ(npy.shape(), (std::vector<std::size_t>{3, 4, 5}));
+    ASSERT_EQ(npy.image_stack_size(), 3u);
+    for (std::size_t i = 0; i != 3; ++i) {
+        EXPECT_EQ(npy.image(i).dim(), (std::array<long,2>{5, 4}));
+        EXPECT_TRUE(std::ranges::equal(npy.image<std::uint16_t>(i), std::span(pixels).subspan(i * 20, 20))) << "frame " << i;
+    }
+    EXPECT_THROW(npy.image(3), std::out_of_range);
+}
+
+TEST(Npy_map, reads_a_single_frame) {
+    std::vector<std::int32_t> const pixels = {-1, 2, -3, 4, -5, 6};
+    Temp_npy const file("frame.npy", Header("{'descr': '<i4', 'fortran_order': False, 'shape': (2, 3), }") + Bytes(pixels));
+    Npy_map const npy(file.path());
+    ASSERT_EQ(npy.image_stack_size(), 1u);
+    EXPECT_EQ(npy.image(0).dim(), (std::array<long,2>{3, 2}));
+    EXPECT_TRUE(std::ranges::equal(npy.image<std::int32_t>(0), pixels));
+}
+
+TEST(Npy_map, swaps_the_bytes_of_big_endian_arrays) {
+    std::vector<std::int16_t> const pixels = {-2, 1, 300, -32768, 32767, 0};
+    std::vector<std::int16_t> swapped(pixels.size());
+    std::ranges::transform(pixels, swapped.begin(), [](std::int16_t const p) { auto const u = std::uint16_t(p); return std::int16_t((u << 8) | (u >> 8)); });
+    Temp_npy const file("big.npy", Header("{'descr': '>i2', 'fortran_order': False, 'shape': (2, 1, 3), }") + Bytes(swapped));
+    Npy_map const npy(file.path());
+    EXPECT_FALSE(npy.native());
+    ASSERT_EQ(npy.image_stack_size(), 2u);
+    EXPECT_TRUE(std::ranges::equal(npy.image<std::int16_t>(1), std::span(pixels).subspan(3)));
+    std::vector<std::byte> buffer;
+    auto const first = npy.image(0, buffer);
+    EXPECT_TRUE(std::ranges::equal(static_cast<jpa::Grey_tif_image<std::int16_t const>>(first), std::span(pixels).first(3)));
+}
+
+TEST(Npy_map, converts_half_floats_to_floats) {
+    std::vector<std::uint16_t> const half = {0x3c00, 0xc000, 0x3800, 0x0000};
+    Temp_npy const file("half.npy", Header("{'descr': '<f2', 'fortran_order': False, 'shape': (2, 2), }") + Bytes(half));
+    Npy_map const npy(file.path());
+    EXPECT_TRUE(std::ranges::equal(npy.image<float>(0), std::vector<float>{1.0f, -2.0f, 0.5f, 0.0f}));
+}
+
+TEST(Npy_map, maps_raw_files) {
+    std::vector<std::uint8_t> pixels(2 * 3 * 4);
+    std::iota(pixels.begin(), pixels.end(), 0);
+    jpa::POD_type_traits const type{.size = 1, .is_signed = false, .is_integral = true};
+    Temp_npy const file("frames.raw", Bytes(pixels));
+    Npy_map const raw(file.path(), type, {4, 3});
+    EXPECT_EQ(raw.shape(), (std::vector<std::size_t>{2, 3, 4}));
+    ASSERT_EQ(raw.image_stack_size(), 2u);
+    EXPECT_TRUE(std::ranges::equal(raw.image<std::uint8_t>(1), std::span(pixels).subspan(12)));
+    EXPECT_THROW((Npy_map{file.path(), type, {5, 3}}), std::runtime_error); // 24 bytes are not a whole number of frames
+}
+
+TEST(Npy_map, rejects_unsupported_arrays) {
+    Temp_npy const fortran("fortran.npy", Header("{'descr': '<u2', 'fortran_order': True, 'shape': (2, 2), }") + std::string(8, '\0'));
+    EXPECT_THROW(Npy_map{fortran.path()}, std::runtime_error);
+    Temp_npy const wide("wide.npy", Header("{'descr': '<i8', 'fortran_order': False, 'shape': (2, 2), }") + std::string(32, '\0'));
+    EXPECT_THROW(Npy_map{wide.path()}, std::runtime_error);
+    Temp_npy const short_file("short.npy", Header("{'descr': '<u2', 'fortran_order': False, 'shape': (4, 4), }") + std::string(8, '\0'));
+    EXPECT_THROW(Npy_map{short_file.path()}, std::runtime_error);
+    Temp_npy const other("other.npy", "not a NumPy file");
+    EXPECT_THROW(Npy_map{other.path()}, std::runtime_error);
+}
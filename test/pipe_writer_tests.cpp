@@ -0,0 +1,89 @@
+#include "gtest/gtest.h"
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <csignal>
+#include <unistd.h>
+#include "Pipe_writer.hpp"
+
+using jpa::Page_buffer;
+using jpa::Pipe_writer;
+
+namespace {
+
+// Reads everything from a file descriptor until end of file.
+std::string Read_all(int const fd) {
+    std::string data;
+    char buffer[65536];
+    for (ssize_t r; (r = ::read(fd, buffer, sizeof(buffer))) > 0; )
+        data.append(buffer, static_cast<std::size_t>(r));
+    return data;
+}
+
+Page_buffer Filled(std::size_t const size, char const seed) {
+    Page_buffer buffer(size);
+    for (std::size_t i = 0; i != size; ++i)
+        buffer.data()[i] = std::byte(seed + i % 97);
+    return buffer;
+}
+
+} // namespace
+
+TEST(Page_buffer, is_zero_initialised) {
+    Page_buffer const buffer(10000);
+    EXPECT_EQ(buffer.size(), 10000u);
+    for (std::size_t i = 0; i != buffer.size(); ++i)
+        ASSERT_EQ(buffer.data()[i], std::byte(0));
+}
+
+// Buffers that are not a multiple of the page size, larger than the pipe buffer, mixed with copied data
+TEST(Pipe_writer, writes_buffers_and_spans_into_a_pipe_in_order) {
+    int fds[2];
+    ASSERT_EQ(::pipe(fds), 0);
+    std::string expected;
+    std::string received;
+    std::thread reader([&] { received = Read_all(fds[0]); });
+    {
+        Pipe_writer out(fds[1]);
+        for (std::size_t size : {1ul, 4096ul, 5000ul, 300000ul, 0ul, 123457ul}) {
+            Page_buffer buffer = Filled(size, char(size % 13));
+            expected.append(reinterpret_cast<char const*>(buffer.data()), size);
+            out.write(std::move(buffer));
+            std::string const text = "frame " + std::to_string(size) + "\n";
+            expected += text;
+            out.write(std::as_bytes(std::span(text)));
+        }
+        ::close(fds[1]);
+    }
+    reader.join();
+    ::close(fds[0]);
+    EXPECT_EQ(received.size(), expected.size());
+    EXPECT_TRUE(received == expected);
+}
+
+TEST(Pipe_writer, writes_into_a_file) {
+    std::FILE* const file = std::tmpfile();
+    ASSERT_NE(file, nullptr);
+    int const fd = ::fileno(file);
+    Pipe_writer out(fd);
+    EXPECT_FALSE(out.is_pipe());
+    Page_buffer buffer = Filled(10000, 'a');
+    std::string const expected(reinterpret_cast<char const*>(buffer.data()), buffer.size());
+    out.write(std::move(buffer));
+    ::lseek(fd, 0, SEEK_SET);
+    EXPECT_TRUE(Read_all(fd) == expected);
+    std::fclose(file);
+}
+
+TEST(Pipe_writer, throws_if_writing_fails) {
+    int fds[2];
+    ASSERT_EQ(::pipe(fds), 0);
+    ::close(fds[0]);
+    std::signal(SIGPIPE, SIG_IGN);
+    Pipe_writer out(fds[1]);
+    std::string const text = "lost";
+    EXPECT_THROW(out.write(std::as_bytes(std::span(text))), std::system_error);
+    EXPECT_THROW(out.write(Filled(8192, 'x')), std::system_error);
+    ::close(fds[1]);
+}
@@ -0,0 +1,165 @@
+#include "gtest/gtest.h"
+#include <bit>
+#include <cmath>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include "Pixel_kernels.hpp"
+
+namespace kernels = jpa::pixel_kernels;
+
+namespace {
+
+// Numbers of values around the vector widths, and around the blocks that are split over threads
+std::size_t const s_counts[] = {0, 1, 3, 7, 8, 9, 15, 16, 17, 31, 32, 33, 100, kernels::s_block - 1, kernels::s_block + 1,
+                                5 * kernels::s_block + 13};
+
+// Bytes that differ at every position, starting one byte into the buffer so that the values are not aligned
+std::vector<std::byte> Bytes(std::size_t const size) {
+    std::vector<std::byte> bytes(size + 1);
+    for (std::size_t i = 0; i != bytes.size(); ++i)
+        bytes[i] = std::byte(i * 37 + 11);
+    return bytes;
+}
+
+std::vector<std::byte> Swapped(std::vector<std::byte> const& bytes, std::size_t const values, std::size_t const size) {
+    std::vector<std::byte> swapped(bytes);
+    for (std::size_t v = 0; v != values; ++v)
+        std::reverse(swapped.begin() + 1 + std::ptrdiff_t(v * size), swapped.begin() + 1 + std::ptrdiff_t((v + 1) * size));
+    return swapped;
+}
+
+// The conversion of Pixel_kernels, one value at a time
+template <typename From, typename To>
+std::vector<To> Converted(std::vector<From> const& from) {
+    std::vector<To> to(from.size());
+    for (std::size_t i = 0; i != from.size(); ++i)
+        if constexpr (std::is_floating_point_v<From> && std::is_unsigned_v<To>)
+            to[i] = static_cast<To>(static_cast<std::make_signed_t<To>>(from[i]));
+        else
+            to[i] = static_cast<To>(from[i]);
+    return to;
+}
+
+template <typename From, typename To>
+void Expect_conversion(std::vector<From> const& from, std::size_t const threads) {
+    std::vector<To> to(from.size());
+    kernels::convert<From, To>(reinterpret_cast<std::byte const*>(from.data()), reinterpret_cast<std::byte*>(to.data()),
+                               from.size(), threads);
+    EXPECT_EQ(to, (Converted<From, To>(from))) << from.size() << " values, " << threads << " threads";
+    if constexpr (sizeof(From) == sizeof(To)) {
+        std::vector<From> in_place(from);
+        kernels::convert<From, To>(reinterpret_cast<std::byte const*>(in_place.data()), reinterpret_cast<std::byte*>(in_place.data()),
+                                   in_place.size(), threads);
+        std::vector<To> converted(in_place.size());
+        std::ranges::transform(in_place, converted.begin(), [](From const value) { return std::bit_cast<To>(value); });
+        EXPECT_EQ(converted, (Converted<From, To>(from))) << from.size() << " values in place, " << threads << " threads";
+    }
+}
+
+// IEEE 754 half precision values, computed from their parts
+float Half(std::uint16_t const half) {
+    int const exponent = (half >> 10) & 0x1f;
+    int const mantissa = half & 0x3ff;
+    float const magnitude = exponent == 0 ? std::ldexp(float(mantissa), -24)
+                          : exponent == 0x1f ? (mantissa == 0 ? INFINITY : NAN)
+                          : std::ldexp(float(mantissa + 0x400), exponent - 25);
+    return half & 0x8000 ? -magnitude : magnitude;
+}
+
+} // namespace
+
+TEST(Pixel_kernels, byte_swap_matches_reversing_every_value) {
+    for (std::size_t const size : {1, 2, 4, 8})
+        for (std::size_t const values : s_counts)
+            for (std::size_t const threads : {1, 4}) {
+                auto const bytes = Bytes(values * size);
+                auto const expected = Swapped(bytes, values, size);
+                std::vector<std::byte> to(bytes.size(), std::byte(0));
+                to[0] = bytes[0];
+                kernels::byte_swap(bytes.data() + 1, to.data() + 1, values, size, threads);
+                EXPECT_EQ(to, expected) << values << " values of " << size << " bytes, " << threads << " threads";
+                auto in_place = bytes;
+                kernels::byte_swap(in_place.data() + 1, in_place.data() + 1, values, size, threads);
+                EXPECT_EQ(in_place, expected) << values << " values of " << size << " bytes in place, " << threads << " threads";
+            }
+}
+
+TEST(Pixel_kernels, convert_matches_casting_every_value) {
+    for (std::size_t const values : s_counts)
+        for (std::size_t const threads : {1, 4}) {
+            std::vector<std::uint16_t> u16(values);
+            std::vector<std::int32_t> i32(values);
+            std::vector<float> f32(values);
+            std::vector<double> f64(values);
+            for (std::size_t i = 0; i != values; ++i) {
+                u16[i] = std::uint16_t(i * 7919);
+                i32[i] = std::int32_t(i * 104729) - 1000000;
+                f32[i] = float(i % 300) - 100.25f; // negative values wrap around in unsigned types
+                f64[i] = double(i) * 1.5 - 700;
+            }
+            Expect_conversion<std::uint16_t, float>(u16, threads);
+            Expect_conversion<std::uint16_t, std::int32_t>(u16, threads);
+            Expect_conversion<std::int32_t, float>(i32, threads);
+            Expect_conversion<std::int32_t, std::uint32_t>(i32, threads);
+            Expect_conversion<float, std::uint16_t>(f32, threads);
+            Expect_conversion<float, std::int32_t>(f32, threads);
+            Expect_conversion<double, std::int32_t>(f64, threads);
+        }
+}
+
+// All half precision values, including subnormals, infinities and NaNs
+TEST(Pixel_kernels, half_to_float_converts_every_half_precision_value) {
+    std::vector<std::uint16_t> halves(1 << 16);
+    for (std::size_t i = 0; i != halves.size(); ++i)
+        halves[i] = std::uint16_t(i);
+    for (std::size_t const threads : {1, 4}) {
+        std::vector<float> floats(halves.size());
+        kernels::half_to_float(reinterpret_cast<std::byte const*>(halves.data()), reinterpret_cast<std::byte*>(floats.data()),
+                               halves.size(), threads);
+        for (std::size_t i = 0; i != halves.size(); ++i) {
+            float const expected = Half(halves[i]);
+            if (std::isnan(expected)) {
+                EXPECT_TRUE(std::isnan(floats[i])) << std::hex << i;
+            }
+            else {
+                EXPECT_EQ(std::bit_cast<std::uint32_t>(floats[i]), std::bit_cast<std::uint32_t>(expected)) << std::hex << i;
+            }
+        }
+    }
+    for (std::size_t const values : s_counts) { // the vector loop and the loop over the remaining values
+        std::vector<float> floats(values + 1, -1.0f);
+        kernels::half_to_float(reinterpret_cast<std::byte const*>(halves.data() + 0x3c00), reinterpret_cast<std::byte*>(floats.data()),
+                               values, 1);
+        for (std::size_t i = 0; i != values; ++i)
+            EXPECT_EQ(floats[i], Half(std::uint16_t(0x3c00 + i))) << values << " values";
+        EXPECT_EQ(floats[values], -1.0f); // nothing is written beyond the values
+    }
+}
+
+// The kernels that the dispatch selects give the same results as the baseline loops
+TEST(Pixel_kernels, dispatched_kernels_match_the_baseline_loops) {
+    std::size_t const values = 3 * kernels::s_block + 5;
+    auto const bytes = Bytes(values * 8);
+    std::vector<std::byte> dispatched(values * 8), baseline(values * 8);
+    kernels::f_swap_kernel<2>()(bytes.data() + 1, dispatched.data(), values);
+    kernels::f_swap<2>(bytes.data() + 1, baseline.data(), values);
+    EXPECT_EQ(dispatched, baseline);
+    kernels::f_swap_kernel<4>()(bytes.data() + 1, dispatched.data(), values);
+    kernels::f_swap<4>(bytes.data() + 1, baseline.data(), values);
+    EXPECT_EQ(dispatched, baseline);
+    kernels::f_swap_kernel<8>()(bytes.data() + 1, dispatched.data(), values);
+    kernels::f_swap<8>(bytes.data() + 1, baseline.data(), values);
+    EXPECT_EQ(dispatched, baseline);
+    kernels::f_half_kernel()(bytes.data() + 1, dispatched.data(), values);
+    kernels::f_half(bytes.data() + 1, baseline.data(), values);
+    for (std::size_t i = 0; i != values; ++i) {
+        float a, b;
+        std::memcpy(&a, dispatched.data() + 4 * i, 4);
+        std::memcpy(&b, baseline.data() + 4 * i, 4);
+        if (!std::isnan(b)) { // F16C quiets signalling NaNs
+            EXPECT_EQ(std::bit_cast<std::uint32_t>(a), std::bit_cast<std::uint32_t>(b)) << i;
+        }
+    }
+}
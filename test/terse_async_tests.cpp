@@ -0,0 +1,122 @@
+#include "gtest/gtest.h"
+#include <thread>
+#include <vector>
+#include <numeric>
+#include <stdexcept>
+#include <filesystem>
+#include <unistd.h>
+#include "Terse_async.hpp"
+#include "Thread_pool.hpp"
+
+namespace fs = std::filesystem;
+using jpa::Task;
+using jpa::Executor;
+namespace terse_async = jpa::terse_async;
+
+namespace {
+
+std::vector<std::int32_t> Frame(std::size_t const index) {
+    std::vector<std::int32_t> pixels(1000);
+    std::iota(pixels.begin(), pixels.end(), std::int32_t(index * 100) - 500);
+    return pixels;
+}
+
+// Compresses and decompresses frames on the codec executor, and counts the frames that survive the round trip
+Task<std::size_t> Round_trips(Executor codec, std::size_t const frames, std::thread::id const caller, bool& on_caller) {
+    std::size_t equal = 0;
+    for (std::size_t i = 0; i != frames; ++i) {
+        auto const frame = Frame(i);
+        jpa::Terse const terse = co_await terse_async::compress(codec, frame);
+        on_caller |= std::this_thread::get_id() == caller;
+        equal += co_await terse_async::prolix<std::int32_t>(codec, terse) == frame;
+    }
+    co_return equal;
+}
+
+Task<int> Fail(Executor executor) {
+    co_return co_await terse_async::run(executor, []() -> int { throw std::runtime_error("run failed"); });
+}
+
+Task<std::string> Catch(Executor executor) {
+    try {
+        co_await Fail(executor);
+    }
+    catch (std::runtime_error const& e) {
+        co_return e.what();
+    }
+    co_return "";
+}
+
+Task<std::size_t> Ready(std::size_t const i) {
+    co_return i;
+}
+
+// Awaits many tasks that finish without suspending, which overflows the stack unless completions transfer symmetrically
+Task<std::size_t> Sum(std::size_t const tasks) {
+    std::size_t sum = 0;
+    for (std::size_t i = 0; i != tasks; ++i)
+        sum += co_await Ready(i);
+    co_return sum;
+}
+
+Task<std::thread::id> Thread_after_run(Executor executor) {
+    co_await terse_async::run(executor, [] {});
+    co_return std::this_thread::get_id();
+}
+
+Task<> Write_frames(fs::path const path, Executor io, std::size_t const frames) {
+    jpa::Async_trpx_writer writer(path, io);
+    for (std::size_t i = 0; i != frames; ++i)
+        co_await writer.write(jpa::Terse(Frame(i)));
+}
+
+Task<std::vector<std::vector<std::int32_t>>> Read_frames(fs::path const path, Executor io, Executor codec) {
+    jpa::Async_trpx_reader reader(path, io);
+    std::vector<std::vector<std::int32_t>> frames;
+    while (auto terse = co_await reader.next_frame())
+        frames.push_back(co_await terse_async::prolix<std::int32_t>(codec, *terse));
+    co_return frames;
+}
+
+} // namespace
+
+TEST(Terse_async, round_trips_on_a_thread_pool) {
+    jpa::Thread_pool pool(2);
+    bool on_caller = false;
+    EXPECT_EQ(terse_async::sync_wait(Round_trips(pool, 20, std::this_thread::get_id(), on_caller)), 20u);
+    EXPECT_FALSE(on_caller); // the coroutine is resumed on the threads of the pool
+}
+
+TEST(Terse_async, exceptions_thrown_in_run_are_rethrown) {
+    jpa::Thread_pool pool(2);
+    EXPECT_THROW(terse_async::sync_wait(Fail(pool)), std::runtime_error);
+    EXPECT_EQ(terse_async::sync_wait(Catch(pool)), "run failed");
+    EXPECT_THROW(terse_async::sync_wait(Fail(Executor::inline_executor())), std::runtime_error);
+}
+
+TEST(Terse_async, inline_executor_resumes_on_the_calling_thread) {
+    EXPECT_EQ(terse_async::sync_wait(Thread_after_run(Executor::inline_executor())), std::this_thread::get_id());
+    jpa::Thread_pool pool(1);
+    EXPECT_NE(terse_async::sync_wait(Thread_after_run(pool)), std::this_thread::get_id());
+}
+
+// Symmetric transfer is a tail call, which g++ only makes in optimised builds
+TEST(Terse_async, awaiting_many_ready_tasks_does_not_grow_the_stack) {
+#ifndef __OPTIMIZE__
+    GTEST_SKIP() << "symmetric transfer needs an optimised build";
+#endif
+    std::size_t const tasks = 1000000;
+    EXPECT_EQ(terse_async::sync_wait(Sum(tasks)), tasks * (tasks - 1) / 2);
+}
+
+TEST(Terse_async, reader_reads_the_terse_objects_that_the_writer_wrote) {
+    fs::path const path = fs::temp_directory_path() / ("terse_async_tests_" + std::to_string(::getpid()) + ".trpx");
+    jpa::Thread_pool io(1), codec(2);
+    terse_async::sync_wait(Write_frames(path, io, 5));
+    auto const frames = terse_async::sync_wait(Read_frames(path, io, codec));
+    ASSERT_EQ(frames.size(), 5u);
+    for (std::size_t i = 0; i != frames.size(); ++i)
+        EXPECT_EQ(frames[i], Frame(i)) << "frame " << i;
+    EXPECT_THROW(jpa::Async_trpx_reader(path / "missing", io), std::runtime_error);
+    fs::remove(path);
+}
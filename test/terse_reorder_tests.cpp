@@ -0,0 +1,112 @@
+#include "gtest/gtest.h"
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <numeric>
+#include <sstream>
+#include "Terse_reorder.hpp"
+
+using jpa::Terse;
+using jpa::Terse_reorder;
+using namespace std::chrono_literals;
+
+namespace {
+
+std::vector<std::int16_t> Frame(std::size_t const index) {
+    std::vector<std::int16_t> pixels(100);
+    std::iota(pixels.begin(), pixels.end(), std::int16_t(index) - 50);
+    return pixels;
+}
+
+} // namespace
+
+TEST(Terse_reorder, emits_frames_inserted_by_several_threads_in_order) {
+    Terse stack;
+    {
+        Terse_reorder reorder(stack, 8);
+        std::vector<std::thread> readout;
+        for (std::size_t t = 0; t != 4; ++t)
+            readout.emplace_back([&, t] {
+                for (std::size_t i = t; i < 200; i += 4)
+                    reorder.insert(i, Frame(i));
+            });
+        for (auto& thread : readout)
+            thread.join();
+        EXPECT_EQ(reorder.next(), 200u);
+        EXPECT_EQ(reorder.pending(), 0u);
+    }
+    ASSERT_EQ(stack.number_of_frames(), 200u);
+    std::vector<std::int16_t> frame(100);
+    for (std::size_t i = 0; i != 200; ++i) {
+        stack.prolix(frame, i);
+        EXPECT_EQ(frame, Frame(i)) << "frame " << i;
+    }
+}
+
+TEST(Terse_reorder, skipped_frames_do_not_hold_up_later_frames) {
+    std::vector<std::size_t> emitted;
+    Terse_reorder reorder([&](std::size_t const index, Terse&&) { emitted.push_back(index); });
+    reorder.insert(2, Frame(2));
+    reorder.insert(0, Frame(0));
+    EXPECT_EQ(reorder.pending(), 1u);
+    reorder.skip(1);
+    EXPECT_EQ(emitted, (std::vector<std::size_t>{0, 2}));
+    EXPECT_EQ(reorder.next(), 3u);
+}
+
+TEST(Terse_reorder, inserting_an_index_twice_throws) {
+    Terse_reorder reorder([](std::size_t, Terse&&) {});
+    reorder.insert(0, Frame(0));
+    reorder.insert(2, Frame(2));
+    EXPECT_THROW(reorder.insert(0, Frame(0)), std::invalid_argument);
+    EXPECT_THROW(reorder.insert(2, Frame(2)), std::invalid_argument);
+    EXPECT_THROW(reorder.skip(0), std::invalid_argument);
+}
+
+TEST(Terse_reorder, the_window_holds_up_frames_that_are_too_far_ahead) {
+    Terse_reorder reorder([](std::size_t, Terse&&) {}, 2);
+    std::atomic<bool> inserted = false;
+    std::thread ahead([&] { reorder.insert(3, Frame(3)); inserted = true; });
+    std::this_thread::sleep_for(20ms);
+    EXPECT_FALSE(inserted);
+    reorder.insert(0, Frame(0));
+    reorder.insert(1, Frame(1));
+    ahead.join();
+    EXPECT_TRUE(inserted);
+    EXPECT_EQ(reorder.pending(), 1u);
+}
+
+TEST(Terse_reorder, a_failing_emit_throws_and_fails_the_later_inserts) {
+    std::vector<std::size_t> emitted;
+    Terse_reorder reorder([&](std::size_t const index, Terse&&) {
+        if (index == 1)
+            throw std::runtime_error("disk full");
+        emitted.push_back(index);
+    });
+    reorder.insert(2, Frame(2));
+    reorder.insert(0, Frame(0));
+    EXPECT_THROW(reorder.insert(1, Frame(1)), std::runtime_error);
+    EXPECT_EQ(emitted, (std::vector<std::size_t>{0}));
+    EXPECT_EQ(reorder.next(), 2u);
+    EXPECT_EQ(reorder.pending(), 0u);
+    EXPECT_THROW(reorder.insert(3, Frame(3)), std::runtime_error);
+    EXPECT_THROW(reorder.skip(4), std::runtime_error);
+}
+
+// Threads that wait for the window to move on must not wait forever for frames that will never be emitted
+TEST(Terse_reorder, a_failing_emit_wakes_the_threads_that_wait_for_the_window) {
+    Terse_reorder reorder([](std::size_t, Terse&&) { throw std::runtime_error("disk full"); }, 1);
+    std::atomic<int> failed = 0;
+    std::vector<std::thread> ahead;
+    for (std::size_t i = 1; i != 4; ++i)
+        ahead.emplace_back([&, i] {
+            try { reorder.insert(i, Frame(i)); }
+            catch (std::runtime_error const&) { ++failed; }
+        });
+    std::this_thread::sleep_for(20ms);
+    EXPECT_THROW(reorder.insert(0, Frame(0)), std::runtime_error);
+    for (auto& thread : ahead)
+        thread.join();
+    EXPECT_EQ(failed, 3);
+}
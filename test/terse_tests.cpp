@@ -1,9 +1,15 @@
-
 #include "gtest/gtest.h"
 #include <fstream>
 #include <filesystem>
 #include "Terse.hpp"
 #include <numeric>
+#include <sstream>
+#include <vector>
+#include <limits>
+#include <thread>
+#include <memory_resource>
+
+using jpa::Terse;
 
 class TerseTests: public ::testing::Test {
 public:
@@ -18,8 +24,10 @@ TEST_F(TerseTests, testname1){
     auto compressed = Terse(numbers);                      // Compress the data to less than 30% of memory
     std::cout << "compression rate " << float(compressed.terse_size()) / (numbers.size() * sizeof(unsigned))
               << std::endl;
-    std::ofstream outfile("junk.terse");
-    outfile << compressed;                          // Write Terse data to disk
+    {
+        std::ofstream outfile("junk.terse");
+        compressed.write(outfile);                  // Write Terse data to disk
+    }
     std::ifstream infile("junk.terse");
     Terse from_file(infile);                        // Read it back in again
     std::vector<int> uncompressed(1000);
@@ -28,13 +36,238 @@ TEST_F(TerseTests, testname1){
     std::cout << uncompressed[i] << std::endl;
     for (int i=995; i != 1000; ++i)
     std::cout << uncompressed[i] << std::endl;
+    EXPECT_EQ(uncompressed, numbers);
+}
 
 
+// Frames of different ranges of values, so that their compressed sizes differ
+static std::vector<std::vector<std::uint16_t>> Test_frames(std::size_t const frames, std::size_t const size) {
+    std::vector<std::vector<std::uint16_t>> result(frames, std::vector<std::uint16_t>(size));
+    for (std::size_t f = 0; f != frames; ++f)
+        for (std::size_t i = 0; i != size; ++i)
+            result[f][i] = std::uint16_t((i * 2654435761u >> (f % 7)) & ((1u << (4 + f % 12)) - 1));
+    return result;
 }
 
+TEST_F(TerseTests, aligned_frames_start_at_multiples_of_the_alignment){
+    auto const frames = Test_frames(5, 3000);
+    Terse compressed;
+    compressed.alignment(4096);
+    for (auto const& frame : frames)
+        compressed.push_back(frame);
+    std::stringstream stream;
+    compressed.write(stream);
+    std::string const file = stream.str();
+    std::size_t const header = file.find("/>") + 2;
+    EXPECT_EQ(header % 4096, 0u);
+    EXPECT_EQ(file.size() % 4096, 0u);
+    EXPECT_NE(file.find("memory_size=\"" + std::to_string(file.size() - header) + "\""), std::string::npos);
+    EXPECT_GT(file.size() - header, compressed.terse_size()); // the last frame is padded in the file only
+    Terse const from_file(stream);
+    EXPECT_EQ(from_file.alignment(), 4096u);
+    std::vector<std::uint16_t> uncompressed(3000);
+    for (std::size_t f = frames.size(); f-- != 0; ) { // the offsets are found in any order
+        from_file.prolix(uncompressed, f);
+        EXPECT_EQ(uncompressed, frames[f]) << "frame " << f;
+    }
+}
 
+TEST_F(TerseTests, appended_aligned_frames_match_pushed_frames){
+    auto const frames = Test_frames(4, 1000);
+    Terse pushed, appended;
+    pushed.alignment(512);
+    appended.alignment(512);
+    for (auto const& frame : frames) {
+        pushed.push_back(frame);
+        Terse single(frame);
+        single.alignment(512);
+        appended.append(single);
+    }
+    std::ostringstream a, b;
+    pushed.write(a);
+    appended.write(b);
+    EXPECT_EQ(a.str(), b.str());
+}
 
+// Frames of which every block holds the lowest and highest values of T, which take the most bits to store
+template <typename T>
+static std::vector<T> Extreme_frame(std::size_t const size) {
+    T const values[] = {std::numeric_limits<T>::min(), std::numeric_limits<T>::max(), T(0), T(1), T(-1),
+                        T(std::numeric_limits<T>::min() / 2), T(std::numeric_limits<T>::max() / 2 + 1)};
+    std::vector<T> frame(size);
+    for (std::size_t i = 0; i != size; ++i)
+        frame[i] = values[(i * 5 + size) % std::size(values)];
+    return frame;
+}
 
+template <typename T>
+static void Expect_round_trip(std::vector<T> const& frame) {
+    Terse const compressed(frame);
+    std::stringstream stream;
+    compressed.write(stream);
+    Terse const from_file(stream);
+    std::vector<T> uncompressed(frame.size());
+    from_file.prolix(uncompressed);
+    EXPECT_EQ(uncompressed, frame) << frame.size() << " values of " << sizeof(T) << " bytes";
+}
+
+TEST_F(TerseTests, extreme_values_round_trip){
+    for (std::size_t size : {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 24, 25, 100}) {
+        Expect_round_trip(Extreme_frame<std::int8_t>(size));
+        Expect_round_trip(Extreme_frame<std::uint8_t>(size));
+        Expect_round_trip(Extreme_frame<std::int16_t>(size));
+        Expect_round_trip(Extreme_frame<std::uint16_t>(size));
+        Expect_round_trip(Extreme_frame<std::int32_t>(size));
+        Expect_round_trip(Extreme_frame<std::uint32_t>(size));
+        Expect_round_trip(Extreme_frame<std::int64_t>(size));
+        Expect_round_trip(Extreme_frame<std::uint64_t>(size));
+    }
+}
+
+// Signed values that fill their type, like -128 or -64 in an int8_t, take one bit more than their type, which frames of
+// fewer values than a block have least room for
+TEST_F(TerseTests, lowest_signed_values_round_trip){
+    for (std::size_t size : {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 30}) {
+        Expect_round_trip(std::vector<std::int8_t>(size, -128));
+        Expect_round_trip(std::vector<std::int8_t>(size, -64));
+        Expect_round_trip(std::vector<std::int16_t>(size, -32768));
+        Expect_round_trip(std::vector<std::int16_t>(size, -16384));
+        Expect_round_trip(std::vector<std::int64_t>(size, std::numeric_limits<std::int64_t>::min()));
+    }
+}
+
+// Values of more than 32 bits are unpacked without shifting by the width of their type
+TEST_F(TerseTests, wide_values_round_trip){
+    std::vector<std::int64_t> frame(40);
+    for (std::size_t i = 0; i != frame.size(); ++i)
+        frame[i] = (i % 2 ? -1 : 1) * (std::int64_t(1) << (20 + i % 40)) + std::int64_t(i);
+    Expect_round_trip(frame);
+    std::vector<std::uint64_t> positive(frame.size());
+    for (std::size_t i = 0; i != frame.size(); ++i)
+        positive[i] = (std::uint64_t(1) << (i % 63)) | i;
+    Expect_round_trip(positive);
+}
+
+// Threads unpack the frames of one const Terse object, read from a stream so that the offsets of its frames are unknown,
+// each in a different order
+TEST_F(TerseTests, concurrent_prolix_of_a_const_stack){
+    auto const frames = Test_frames(40, 2000);
+    Terse compressed;
+    for (auto const& frame : frames)
+        compressed.push_back(frame);
+    std::stringstream stream;
+    compressed.write(stream);
+    Terse const from_file(stream);
+    std::vector<int> failures(8);
+    {
+        std::vector<std::jthread> threads;
+        for (std::size_t t = 0; t != failures.size(); ++t)
+            threads.emplace_back([&, t] {
+                std::vector<std::uint16_t> uncompressed(2000);
+                for (std::size_t i = 0; i != frames.size(); ++i) {
+                    std::size_t const f = t % 2 ? frames.size() - 1 - (i * 7 + t) % frames.size() : (i * 7 + t) % frames.size();
+                    from_file.prolix(uncompressed, f);
+                    failures[t] += uncompressed != frames[f];
+                }
+            });
+    }
+    EXPECT_EQ(failures, std::vector<int>(8));
+    Terse appended; // the offsets that were found are kept by append
+    appended.append(from_file);
+    std::vector<std::uint16_t> uncompressed(2000);
+    appended.prolix(uncompressed, frames.size() - 1);
+    EXPECT_EQ(uncompressed, frames.back());
+}
+
+TEST_F(TerseTests, cleared_object_compresses_like_a_new_one){
+    Terse reused(Test_frames(1, 3000)[0]);
+    reused.push_back(Test_frames(2, 3000)[1]);
+    reused.clear();
+    EXPECT_EQ(reused.number_of_frames(), 0u);
+    std::vector<std::int32_t> frame(500);
+    std::iota(frame.begin(), frame.end(), -250);
+    reused.push_back(frame);
+    std::ostringstream a, b;
+    reused.write(a);
+    Terse(frame).write(b);
+    EXPECT_EQ(a.str(), b.str());
+    EXPECT_TRUE(reused.is_signed());
+    std::vector<std::int32_t> uncompressed(500);
+    reused.prolix(uncompressed);
+    EXPECT_EQ(uncompressed, frame);
+}
+
+// Counts the allocations of a memory resource
+class Counting_resource : public std::pmr::memory_resource {
+public:
+    std::size_t allocations = 0;
+private:
+    void* do_allocate(std::size_t const bytes, std::size_t const alignment) override {
+        ++allocations;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+    void do_deallocate(void* const p, std::size_t const bytes, std::size_t const alignment) override {
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+    bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override {return this == &other;}
+};
+
+TEST_F(TerseTests, cleared_object_reuses_the_memory_of_its_resource){
+    auto const frames = Test_frames(3, 2000);
+    Counting_resource resource;
+    Terse reused(&resource);
+    for (auto const& frame : frames)
+        reused.push_back(frame);
+    EXPECT_GT(resource.allocations, 0u);
+    Terse moved(std::move(reused)); // keeps allocating from the resource
+    moved.clear();
+    std::size_t const allocations = resource.allocations;
+    for (auto const& frame : frames)
+        moved.push_back(frame);
+    EXPECT_EQ(resource.allocations, allocations);
+    Terse copy;
+    copy = moved; // copies allocate from the default resource
+    EXPECT_EQ(resource.allocations, allocations);
+    std::vector<std::uint16_t> uncompressed(2000);
+    for (std::size_t f = 0; f != frames.size(); ++f) {
+        copy.prolix(uncompressed, f);
+        EXPECT_EQ(uncompressed, frames[f]) << "frame " << f;
+    }
+}
+
+// Move assignment keeps the resource of the object that is assigned to, like the assignment of pmr containers
+TEST_F(TerseTests, move_assigned_object_keeps_its_resource){
+    auto const frames = Test_frames(3, 2000);
+    Counting_resource resource;
+    Terse reused(&resource);
+    reused = Terse(frames[0]);
+    std::size_t const allocations = resource.allocations;
+    EXPECT_GT(allocations, 0u); // the frame is moved into memory of the resource
+    std::vector<std::uint16_t> uncompressed(2000);
+    reused.prolix(uncompressed);
+    EXPECT_EQ(uncompressed, frames[0]);
+    for (int i = 0; i != 2; ++i) {
+        reused.clear();
+        for (auto const& frame : frames)
+            reused.push_back(frame);
+    }
+    std::size_t const filled = resource.allocations;
+    reused.clear();
+    for (auto const& frame : frames)
+        reused.push_back(frame);
+    EXPECT_EQ(resource.allocations, filled);
+
+    Terse assigned;
+    assigned = std::move(reused); // allocates from the default resource
+    assigned.clear();
+    for (auto const& frame : frames)
+        assigned.push_back(frame);
+    EXPECT_EQ(resource.allocations, filled);
+    for (std::size_t f = 0; f != frames.size(); ++f) {
+        assigned.prolix(uncompressed, f);
+        EXPECT_EQ(uncompressed, frames[f]) << "frame " << f;
+    }
+}
 
 int main(int argc, char** argv) {
     testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,96 @@
+#include "gtest/gtest.h"
+#include <vector>
+#include <sstream>
+#include <streambuf>
+#include "Terse_writer.hpp"
+
+using jpa::Terse;
+using jpa::Terse_writer;
+
+namespace {
+
+// Frames of different ranges of values, so that their compressed sizes and bits per value differ
+std::vector<std::vector<std::uint16_t>> Frames(std::size_t const frames, std::size_t const size) {
+    std::vector<std::vector<std::uint16_t>> result(frames, std::vector<std::uint16_t>(size));
+    for (std::size_t f = 0; f != frames; ++f)
+        for (std::size_t i = 0; i != size; ++i)
+            result[f][i] = std::uint16_t((i * 2654435761u >> (f % 5)) & ((1u << (3 + f * 3 % 14)) - 1));
+    return result;
+}
+
+std::string Payload(std::string const& file) {
+    return file.substr(file.find("/>") + 2);
+}
+
+// A stream that cannot seek, like a pipe
+class Unseekable : public std::streambuf {
+    int overflow(int const c) override { return c; }
+};
+
+} // namespace
+
+TEST(Terse_writer, writes_the_frames_that_terse_writes) {
+    auto const frames = Frames(6, 12 * 10);
+    Terse stack;
+    std::stringstream stream;
+    {
+        Terse_writer writer(stream);
+        for (auto const& frame : frames) {
+            Terse single(frame);
+            single.dim({12, 10});
+            stack.append(single);
+            writer.write(single);
+        }
+        EXPECT_EQ(writer.number_of_frames(), 6u);
+        EXPECT_EQ(writer.terse_size(), stack.terse_size());
+        EXPECT_EQ(writer.dim(), (std::vector<std::size_t>{12, 10}));
+    } // the destructor rewrites the header
+    std::ostringstream expected;
+    stack.write(expected);
+    EXPECT_EQ(Payload(stream.str()), Payload(expected.str())); // only the padding of the header differs
+    Terse const from_file(stream);
+    EXPECT_EQ(from_file.number_of_frames(), 6u);
+    EXPECT_EQ(from_file.bits_per_val(), stack.bits_per_val()); // the largest of all frames
+    EXPECT_EQ(from_file.dim(), (std::vector<std::size_t>{12, 10}));
+    std::vector<std::uint16_t> frame(12 * 10);
+    for (std::size_t f = 0; f != frames.size(); ++f) {
+        from_file.prolix(frame, f);
+        EXPECT_EQ(frame, frames[f]) << "frame " << f;
+    }
+}
+
+TEST(Terse_writer, writes_aligned_frames_after_other_data) {
+    auto const frames = Frames(3, 1000);
+    std::stringstream stream;
+    stream << "prefix";
+    {
+        Terse_writer writer(stream, 512);
+        for (auto const& frame : frames)
+            writer.write(Terse(frame));
+        writer.close();
+        EXPECT_THROW(writer.write(Terse(frames[0])), std::logic_error);
+    }
+    std::string const file = stream.str();
+    EXPECT_EQ(file.substr(0, 6), "prefix");
+    EXPECT_EQ((file.size() - 6) % 512, 0u);
+    stream.seekg(6);
+    Terse const from_file(stream);
+    EXPECT_EQ(from_file.alignment(), 512u);
+    std::vector<std::uint16_t> frame(1000);
+    for (std::size_t f = frames.size(); f-- != 0; ) {
+        from_file.prolix(frame, f);
+        EXPECT_EQ(frame, frames[f]) << "frame " << f;
+    }
+}
+
+TEST(Terse_writer, writes_nothing_without_frames) {
+    std::ostringstream stream;
+    Terse_writer(stream).close();
+    EXPECT_TRUE(stream.str().empty());
+}
+
+TEST(Terse_writer, requires_a_stream_that_can_seek) {
+    Unseekable pipe;
+    std::ostream stream(&pipe);
+    EXPECT_THROW(Terse_writer{stream}, std::invalid_argument);
+}
@@ -0,0 +1,56 @@
+#include "gtest/gtest.h"
+#include <atomic>
+#include <numeric>
+#include <stdexcept>
+#include "Thread_pool.hpp"
+
+using jpa::Thread_pool;
+
+TEST(Thread_pool, runs_every_task) {
+    Thread_pool pool(4);
+    EXPECT_EQ(pool.size(), 4u);
+    std::vector<int> squares(1000);
+    for (int i = 0; i != 1000; ++i)
+        pool.submit([&squares, i] { squares[i] = i * i; });
+    pool.wait();
+    for (int i = 0; i != 1000; ++i)
+        EXPECT_EQ(squares[i], i * i);
+}
+
+TEST(Thread_pool, zero_threads_starts_one_per_core) {
+    Thread_pool pool(0);
+    EXPECT_GE(pool.size(), 1u);
+}
+
+TEST(Thread_pool, tasks_submitted_by_tasks_are_waited_for) {
+    Thread_pool pool(3);
+    std::atomic<int> done = 0;
+    for (int i = 0; i != 10; ++i)
+        pool.submit([&] {
+            for (int j = 0; j != 10; ++j)
+                pool.submit([&] { ++done; });
+        });
+    pool.wait();
+    EXPECT_EQ(done, 100);
+}
+
+TEST(Thread_pool, wait_rethrows_the_first_exception_once) {
+    Thread_pool pool(2);
+    std::atomic<int> done = 0;
+    pool.submit([] { throw std::runtime_error("failed"); });
+    for (int i = 0; i != 10; ++i)
+        pool.submit([&] { ++done; });
+    EXPECT_THROW(pool.wait(), std::runtime_error);
+    EXPECT_EQ(done, 10); // the other tasks still run
+    EXPECT_NO_THROW(pool.wait());
+}
+
+TEST(Thread_pool, destructor_finishes_pending_tasks) {
+    std::atomic<int> done = 0;
+    {
+        Thread_pool pool(2);
+        for (int i = 0; i != 100; ++i)
+            pool.submit([&] { ++done; });
+    }
+    EXPECT_EQ(done, 100);
+}
@@ -0,0 +1,92 @@
+#include "gtest/gtest.h"
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <unistd.h>
+#include "Terse.hpp"
+#include "Trpx_index.hpp"
+
+using jpa::Terse;
+using jpa::Trpx_index;
+
+namespace {
+
+std::vector<std::int16_t> Frame(std::size_t const index, std::size_t const size) {
+    std::vector<std::int16_t> pixels(size);
+    for (std::size_t i = 0; i != size; ++i)
+        pixels[i] = std::int16_t((i * 37 + index * 1000) % (16 << index)) - std::int16_t(index);
+    return pixels;
+}
+
+class Trpx_index_tests : public ::testing::Test {
+protected:
+    std::filesystem::path const d_path = std::filesystem::temp_directory_path() /
+                                         ("trpx_index_tests_" + std::to_string(::getpid()) + ".trpx");
+    ~Trpx_index_tests() override { std::filesystem::remove(d_path); }
+};
+
+} // namespace
+
+// A file of a stack of three frames, followed by two single frames, as terse -stdout or trpxd append them
+TEST_F(Trpx_index_tests, indexes_consecutive_terse_objects) {
+    {
+        std::ofstream file(d_path, std::ios::binary);
+        Terse stack;
+        for (std::size_t f = 0; f != 3; ++f)
+            stack.push_back(Frame(f, 6 * 5));
+        stack.dim({6, 5});
+        stack.write(file);
+        for (std::size_t f = 3; f != 5; ++f)
+            Terse(Frame(f, 6 * 5)).write(file);
+    }
+    Trpx_index const index(d_path);
+    EXPECT_EQ(index.number_of_frames(), 5u);
+    auto const& objects = index.objects();
+    ASSERT_EQ(objects.size(), 3u);
+    EXPECT_EQ(objects[0].offset, 0u);
+    EXPECT_EQ(objects[0].frames, 3u);
+    EXPECT_EQ(objects[0].dim, (std::vector<std::size_t>{6, 5}));
+    EXPECT_EQ(objects[1].first_frame, 3u);
+    EXPECT_EQ(objects[2].first_frame, 4u);
+    for (auto const& object : objects) {
+        EXPECT_EQ(object.values, 30u);
+        EXPECT_TRUE(object.is_signed);
+    }
+
+    std::ifstream file(d_path, std::ios::binary);
+    for (std::size_t f = 0; f != 5; ++f) {
+        auto const [object, frame] = index.locate(f);
+        EXPECT_EQ(object, f < 3 ? 0u : f - 2);
+        EXPECT_EQ(frame, f < 3 ? f : 0u);
+        file.seekg(std::streamoff(objects[object].offset));
+        Terse const trpx(file);
+        EXPECT_EQ(trpx.bits_per_val(), objects[object].bits);
+        std::vector<std::int16_t> image(trpx.size());
+        trpx.prolix(image, frame);
+        EXPECT_EQ(image, Frame(f, 6 * 5)) << "frame " << f;
+    }
+    EXPECT_THROW(index.locate(5), std::out_of_range);
+}
+
+TEST_F(Trpx_index_tests, rejects_invalid_and_missing_files) {
+    {
+        std::ofstream file(d_path, std::ios::binary);
+        Terse(Frame(0, 10)).write(file);
+        file << "<Terse garbage";
+    }
+    EXPECT_THROW(Trpx_index{d_path}, std::runtime_error);
+    std::filesystem::remove(d_path);
+    EXPECT_THROW(Trpx_index{d_path}, std::runtime_error);
+}
+
+// A file that ends halfway the data of a Terse object, as left by a writer that was interrupted
+TEST_F(Trpx_index_tests, rejects_truncated_files) {
+    {
+        std::ofstream file(d_path, std::ios::binary);
+        Terse(Frame(0, 100)).write(file);
+        Terse(Frame(1, 100)).write(file);
+    }
+    EXPECT_EQ(Trpx_index(d_path).number_of_frames(), 2u);
+    std::filesystem::resize_file(d_path, std::filesystem::file_size(d_path) - 1);
+    EXPECT_THROW(Trpx_index{d_path}, std::runtime_error);
+}
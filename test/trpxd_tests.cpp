@@ -0,0 +1,106 @@
+#include "gtest/gtest.h"
+#include <regex>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <fstream>
+#include <filesystem>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "Trpx_client.hpp"
+
+namespace fs = std::filesystem;
+using namespace std::chrono_literals;
+
+// Runs the trpxd service (TRPXD is the path of the executable) on a private socket.
+class Trpxd_test : public ::testing::Test {
+protected:
+    fs::path const d_dir = fs::temp_directory_path() / ("trpxd_tests_" + std::to_string(::getpid()));
+    fs::path const d_socket = d_dir / "trpxd.sock";
+    pid_t d_pid = -1;
+
+    void SetUp() override {
+        fs::create_directories(d_dir);
+        d_pid = ::fork();
+        if (d_pid == 0) {
+            ::execl(TRPXD, TRPXD, "-socket", d_socket.c_str(), "-j", "2", static_cast<char*>(nullptr));
+            ::_exit(127);
+        }
+        for (int i = 0; i != 500 && !fs::exists(d_socket); ++i)
+            std::this_thread::sleep_for(10ms);
+        ASSERT_TRUE(fs::exists(d_socket));
+    }
+
+    void TearDown() override {
+        if (d_pid > 0) {
+            ::kill(d_pid, SIGTERM);
+            ::waitpid(d_pid, nullptr, 0);
+        }
+        fs::remove_all(d_dir);
+    }
+
+    static std::vector<std::uint16_t> frame(int const seed) {
+        std::vector<std::uint16_t> pixels(64 * 64);
+        for (std::size_t i = 0; i != pixels.size(); ++i)
+            pixels[i] = std::uint16_t((i * 7 + seed) % 13);
+        return pixels;
+    }
+
+    // The compression rate in the stats line of the client
+    static double compression_rate(std::string const& stats) {
+        std::smatch match;
+        if (!std::regex_search(stats, match, std::regex("compression rate ([0-9.]+)")))
+            return -1;
+        return std::stod(match[1]);
+    }
+};
+
+TEST_F(Trpxd_test, compresses_frames) {
+    jpa::Trpx_client client(d_socket);
+    auto const pixels = frame(1);
+    jpa::Terse const compressed = client.compress(std::span<std::uint16_t const>(pixels), {64, 64});
+    std::vector<std::uint16_t> expanded(pixels.size());
+    compressed.prolix(expanded);
+    EXPECT_EQ(expanded, pixels);
+    EXPECT_GT(compression_rate(client.stats()), 1);
+}
+
+// A client that leaves halfway a frame, or sends a frame that is too large, is dropped, and other clients are served
+TEST_F(Trpxd_test, failed_clients_do_not_stop_the_service) {
+    jpa::Trpx_client client(d_socket);
+    auto const pixels = frame(2);
+    for (std::uint64_t const data_size : {std::uint64_t(pixels.size() * sizeof(std::uint16_t)), std::uint64_t(1) << 41}) {
+        auto failing = jpa::Trpx_socket::connect(d_socket);
+        jpa::Trpx_request const request{jpa::Trpx_socket::s_magic, jpa::Trpx_command::compress, jpa::Trpx_pixel::uint16,
+                                        0, {64, 64}, data_size, 0};
+        auto const half = std::as_bytes(std::span(pixels)).first(pixels.size());
+        failing.send({std::as_bytes(std::span(&request, 1)), half});
+    } // the failing clients disconnect
+    std::this_thread::sleep_for(100ms);
+    jpa::Terse const compressed = client.compress(std::span<std::uint16_t const>(pixels), {64, 64});
+    std::vector<std::uint16_t> expanded(pixels.size());
+    compressed.prolix(expanded);
+    EXPECT_EQ(expanded, pixels);
+    EXPECT_EQ(::waitpid(d_pid, nullptr, WNOHANG), 0); // trpxd is still running
+}
+
+// Appended frames are counted in the bytes out of the stats, like returned frames
+TEST_F(Trpxd_test, stats_count_appended_frames) {
+    jpa::Trpx_client client(d_socket);
+    fs::path const trpx = d_dir / "run.trpx";
+    for (int i = 0; i != 3; ++i)
+        client.append(trpx, std::span<std::uint16_t const>(frame(i)), {64, 64});
+    std::string const stats = client.stats();
+    EXPECT_NE(stats.find("3 frames (0 failed)"), std::string::npos) << stats;
+    EXPECT_NEAR(compression_rate(stats), 3.0 * sizeof(std::uint16_t) * 64 * 64 / fs::file_size(trpx), 0.01) << stats;
+
+    std::ifstream file(trpx, std::ios::binary);
+    for (int i = 0; i != 3; ++i) {
+        jpa::Terse const compressed(file);
+        std::vector<std::uint16_t> expanded(64 * 64);
+        compressed.prolix(expanded);
+        EXPECT_EQ(expanded, frame(i));
+    }
+}